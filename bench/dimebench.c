@@ -0,0 +1,1523 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <jansson.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "route.h"
+#include "trace.h"
+
+/* DiME v2 flag asking the server not to acknowledge a send, as in socket.h */
+#define BENCH_FLAG_NOACK 0x04
+
+#define BENCH_GROUP "bench"
+
+/* Binary data beyond the timestamp is sent from this many zero bytes */
+#define BENCH_POOL_LEN (1 << 20)
+
+/* Bytes of messages in flight per sender, unless a window is given */
+#define BENCH_WINDOW_BYTES (64 << 20)
+
+#define BENCH_READ_LEN (1 << 16)
+
+/* Longest JSON portion a benchmark client accepts */
+#define BENCH_JSON_MAXLEN (1 << 20)
+
+enum {
+    BENCH_UNIX,
+    BENCH_TCP,
+    BENCH_WS
+};
+
+enum {
+    BENCH_SEND,      /* Messages to a group, pushed to its subscribed members */
+    BENCH_BROADCAST, /* Messages to every client, pushed to subscribed ones */
+    BENCH_SYNC       /* Messages to a group, pulled by its members with sync */
+};
+
+static const char *const TRANSPORTS[] = {"unix", "tcp", "ws"};
+static const char *const PATTERNS[] = {"send", "broadcast", "sync"};
+
+/* What a receiver in the sync pattern is waiting on */
+enum {
+    BENCH_IDLE,
+    BENCH_SYNCING,
+    BENCH_WAITING
+};
+
+typedef struct {
+    int fd;
+    SSL *ssl;
+    int ws;
+
+    /* WebSocket frame being unwrapped */
+    uint8_t ws_hdr[14];
+    size_t ws_hdr_len;
+    uint64_t ws_left;
+    int ws_control;
+
+    /* DiME message being parsed */
+    uint8_t hdr[24];
+    size_t hdr_len;
+    char *json;
+    size_t json_cap;
+    size_t json_len;
+    size_t json_need;
+    uint8_t stamp[8];
+    uint64_t bin_len;
+    uint64_t bin_got;
+    uint32_t rseq;
+
+    uint32_t seq;
+
+    /* Replies, which the handler of each role fills in */
+    int replied;
+    json_int_t status;
+    json_int_t group;
+    int tls;
+
+    /* Receivers in the sync pattern */
+    int pending;
+    uint64_t synced;
+} bench_conn_t;
+
+typedef int (*bench_handler_t)(bench_conn_t *conn, void *arg);
+
+typedef struct {
+    int type;
+    char host[256];
+    char port[8];
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int tls;
+} bench_addr_t;
+
+typedef struct {
+    bench_addr_t addr;
+    SSL_CTX *tlsctx;
+
+    int pattern;
+    uint64_t size;
+    size_t fanout;
+    size_t senders;
+    size_t rthreads;
+    size_t window;
+    uint64_t count;
+    double duration;
+
+    pthread_barrier_t barrier;
+    uint64_t start;
+    uint64_t end;
+
+    /* Shared between threads, and only accessed atomically */
+    uint64_t sent;
+    uint64_t delivered;
+    int stop;
+    int failed;
+} bench_t;
+
+typedef struct {
+    bench_t *bench;
+    pthread_t thread;
+
+    bench_conn_t *conns;
+    size_t conns_len;
+
+    dime_hist_t latency;
+    uint64_t delivered;
+} bench_receiver_t;
+
+typedef struct {
+    bench_t *bench;
+    pthread_t thread;
+
+    bench_conn_t conn;
+    uint64_t sent;
+} bench_sender_t;
+
+static uint8_t pool[BENCH_POOL_LEN];
+
+static void bench_fail(bench_t *bench, const char *fmt, ...) {
+    va_list args;
+
+    /* Only the first failure is reported, the rest usually follow from it */
+    if (__atomic_exchange_n(&bench->failed, 1, __ATOMIC_RELAXED) == 0) {
+        fputs("dimebench: ", stderr);
+
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+
+        fputc('\n', stderr);
+    }
+
+    __atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+}
+
+static void bench_put_u32(uint8_t *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static uint32_t bench_get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void bench_put_u64(uint8_t *p, uint64_t x) {
+    bench_put_u32(p, x >> 32);
+    bench_put_u32(p + 4, x);
+}
+
+static uint64_t bench_get_u64(const uint8_t *p) {
+    return ((uint64_t)bench_get_u32(p) << 32) | bench_get_u32(p + 4);
+}
+
+static int bench_parse_addr(bench_addr_t *addr, const char *s) {
+    char buf[512];
+    char *type, *rest, *colon;
+
+    if (strlen(s) >= sizeof(buf)) {
+        return -1;
+    }
+
+    strcpy(buf, s);
+
+    type = buf;
+    rest = strchr(buf, ':');
+    if (rest == NULL) {
+        return -1;
+    }
+
+    *rest++ = '\0';
+
+    if (strcmp(type, "unix") == 0 || strcmp(type, "ipc") == 0) {
+        if (strlen(rest) == 0 || strlen(rest) >= sizeof(addr->path)) {
+            return -1;
+        }
+
+        addr->type = BENCH_UNIX;
+        strcpy(addr->path, rest);
+
+        return 0;
+    }
+
+    if (strcmp(type, "tcp") == 0) {
+        addr->type = BENCH_TCP;
+    } else if (strcmp(type, "ws") == 0) {
+        addr->type = BENCH_WS;
+    } else {
+        return -1;
+    }
+
+    /* Either a port on the local machine, as the server takes them, or host:port */
+    colon = strrchr(rest, ':');
+
+    if (colon == NULL) {
+        strcpy(addr->host, "localhost");
+    } else {
+        *colon = '\0';
+
+        if (strlen(rest) == 0 || strlen(rest) >= sizeof(addr->host)) {
+            return -1;
+        }
+
+        strcpy(addr->host, rest);
+        rest = colon + 1;
+    }
+
+    if (strlen(rest) == 0 || strlen(rest) >= sizeof(addr->port) || strtoul(rest, NULL, 10) == 0) {
+        return -1;
+    }
+
+    strcpy(addr->port, rest);
+
+    return 0;
+}
+
+static int bench_parse_size(const char *s, uint64_t *size) {
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        n <<= 10;
+        end++;
+        break;
+
+    case 'm':
+    case 'M':
+        n <<= 20;
+        end++;
+        break;
+
+    case 'g':
+    case 'G':
+        n <<= 30;
+        end++;
+        break;
+    }
+
+    if (end == s || *end != '\0') {
+        return -1;
+    }
+
+    *size = n;
+
+    return 0;
+}
+
+static ssize_t bench_conn_read(bench_conn_t *conn, void *buf, size_t len) {
+    if (conn->ssl != NULL) {
+        int n = SSL_read(conn->ssl, buf, len > INT_MAX ? INT_MAX : len);
+
+        if (n > 0) {
+            return n;
+        }
+
+        switch (SSL_get_error(conn->ssl, n)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+
+        default:
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    ssize_t n;
+
+    do {
+        n = recv(conn->fd, buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+/* Writes all of the given buffers, waiting on the socket if it is nonblocking */
+static int bench_conn_writev(bench_conn_t *conn, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n;
+
+        if (conn->ssl != NULL) {
+            int m = SSL_write(conn->ssl, iov[0].iov_base, iov[0].iov_len > INT_MAX ? INT_MAX : iov[0].iov_len);
+
+            if (m > 0) {
+                n = m;
+            } else {
+                int sslerr = SSL_get_error(conn->ssl, m);
+
+                errno = (sslerr == SSL_ERROR_WANT_READ || sslerr == SSL_ERROR_WANT_WRITE) ? EAGAIN : EIO;
+                n = -1;
+            }
+        } else {
+            struct msghdr msg;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        }
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {conn->fd, POLLIN | POLLOUT, 0};
+
+                poll(&pfd, 1, 100);
+
+                continue;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov[0].iov_base = (uint8_t *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sends a DiME message whose binary data is an 8-byte big-endian timestamp
+ * followed by zeros, streamed from a fixed pool so that messages may be
+ * far larger than memory allows. The handshake goes out in v1 framing,
+ * everything after it in v2.
+ */
+static int bench_conn_send(bench_conn_t *conn, int opcode, int flags, uint32_t group, const char *json, uint64_t bin_len, uint64_t stamp) {
+    uint8_t head[14 + 24 + 8];
+    size_t head_len = 0, hdr_len = (opcode == DIME_OP_HANDSHAKE) ? 12 : 24;
+    size_t json_len = strlen(json);
+    uint64_t payload_len = hdr_len + json_len + bin_len;
+
+    if (conn->ws) {
+        head[0] = 0x82;
+
+        /* Messages from clients must be masked, and a zero mask keeps the bytes as they are */
+        if (payload_len < 126) {
+            head[1] = 0x80 | payload_len;
+            head_len = 2;
+        } else if (payload_len < (1 << 16)) {
+            head[1] = 0x80 | 126;
+            head[2] = payload_len >> 8;
+            head[3] = payload_len;
+            head_len = 4;
+        } else {
+            head[1] = 0x80 | 127;
+            bench_put_u64(head + 2, payload_len);
+            head_len = 10;
+        }
+
+        memset(head + head_len, 0, 4);
+        head_len += 4;
+    }
+
+    uint8_t *hdr = head + head_len;
+
+    if (opcode == DIME_OP_HANDSHAKE) {
+        memcpy(hdr, "DiME", 4);
+        bench_put_u32(hdr + 4, json_len);
+        bench_put_u32(hdr + 8, bin_len);
+    } else {
+        /* Sequence number 0 is left for messages the server sends unprompted */
+        conn->seq = conn->seq % 0xFFFFFFFF + 1;
+
+        memcpy(hdr, "DiM2", 4);
+        hdr[4] = opcode;
+        hdr[5] = flags;
+        hdr[6] = hdr[7] = 0;
+        bench_put_u32(hdr + 8, group);
+        bench_put_u32(hdr + 12, conn->seq);
+        bench_put_u32(hdr + 16, json_len);
+        bench_put_u32(hdr + 20, bin_len);
+    }
+
+    head_len += hdr_len;
+
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    iov[iovcnt].iov_base = head;
+    iov[iovcnt].iov_len = head_len;
+    iovcnt++;
+
+    iov[iovcnt].iov_base = (void *)json;
+    iov[iovcnt].iov_len = json_len;
+    iovcnt++;
+
+    uint8_t stampbuf[8];
+
+    if (bin_len >= 8) {
+        bench_put_u64(stampbuf, stamp);
+
+        iov[iovcnt].iov_base = stampbuf;
+        iov[iovcnt].iov_len = 8;
+        iovcnt++;
+
+        bin_len -= 8;
+    }
+
+    if (bench_conn_writev(conn, iov, iovcnt) < 0) {
+        return -1;
+    }
+
+    while (bin_len > 0) {
+        iov[0].iov_base = pool;
+        iov[0].iov_len = (bin_len < BENCH_POOL_LEN) ? bin_len : BENCH_POOL_LEN;
+
+        bin_len -= iov[0].iov_len;
+
+        if (bench_conn_writev(conn, iov, 1) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Consumes DiME bytes, calling the handler with every complete message */
+static int bench_conn_parse(bench_conn_t *conn, const uint8_t *p, size_t n, bench_handler_t handler, void *arg) {
+    while (n > 0) {
+        size_t m;
+
+        /* Header, 12 bytes for v1 messages and 24 for v2 */
+        if (conn->json_need == 0) {
+            size_t hdr_need = (conn->hdr_len >= 4 && memcmp(conn->hdr, "DiM2", 4) == 0) ? 24 : 12;
+
+            m = hdr_need - conn->hdr_len;
+            m = (m < n) ? m : n;
+
+            memcpy(conn->hdr + conn->hdr_len, p, m);
+            conn->hdr_len += m;
+            p += m;
+            n -= m;
+
+            if (conn->hdr_len == 12 && memcmp(conn->hdr, "DiM2", 4) == 0) {
+                continue;
+            }
+
+            if (conn->hdr_len < 12) {
+                continue;
+            }
+
+            const uint8_t *lens;
+
+            if (memcmp(conn->hdr, "DiM2", 4) == 0) {
+                if (conn->hdr[5] != 0) {
+                    errno = EPROTO;
+                    return -1;
+                }
+
+                conn->rseq = bench_get_u32(conn->hdr + 12);
+                lens = conn->hdr + 16;
+            } else if (memcmp(conn->hdr, "DiME", 4) == 0) {
+                conn->rseq = 0;
+                lens = conn->hdr + 4;
+            } else {
+                errno = EPROTO;
+                return -1;
+            }
+
+            conn->json_need = bench_get_u32(lens);
+            conn->bin_len = bench_get_u32(lens + 4);
+            conn->json_len = 0;
+            conn->bin_got = 0;
+
+            if (conn->json_need == 0 || conn->json_need > BENCH_JSON_MAXLEN) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            if (conn->json_need + 1 > conn->json_cap) {
+                char *json = realloc(conn->json, conn->json_need + 1);
+                if (json == NULL) {
+                    return -1;
+                }
+
+                conn->json = json;
+                conn->json_cap = conn->json_need + 1;
+            }
+
+            continue;
+        }
+
+        if (conn->json_len < conn->json_need) {
+            m = conn->json_need - conn->json_len;
+            m = (m < n) ? m : n;
+
+            memcpy(conn->json + conn->json_len, p, m);
+            conn->json_len += m;
+            p += m;
+            n -= m;
+        }
+
+        /* Only the timestamp of the binary data is kept */
+        if (conn->bin_got < conn->bin_len) {
+            m = (conn->bin_len - conn->bin_got < n) ? conn->bin_len - conn->bin_got : n;
+
+            if (conn->bin_got < 8) {
+                size_t k = (8 - conn->bin_got < m) ? 8 - conn->bin_got : m;
+
+                memcpy(conn->stamp + conn->bin_got, p, k);
+            }
+
+            conn->bin_got += m;
+            p += m;
+            n -= m;
+        }
+
+        if (conn->json_len == conn->json_need && conn->bin_got == conn->bin_len) {
+            conn->json[conn->json_len] = '\0';
+            conn->json_need = 0;
+            conn->hdr_len = 0;
+
+            if (handler(conn, arg) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Unwraps WebSocket frames, if any, and parses what is inside them */
+static int bench_conn_input(bench_conn_t *conn, const uint8_t *p, size_t n, bench_handler_t handler, void *arg) {
+    if (!conn->ws) {
+        return bench_conn_parse(conn, p, n, handler, arg);
+    }
+
+    while (n > 0) {
+        if (conn->ws_left == 0) {
+            size_t need = 2;
+
+            if (conn->ws_hdr_len >= 2) {
+                switch (conn->ws_hdr[1] & 0x7F) {
+                case 126:
+                    need += 2;
+                    break;
+
+                case 127:
+                    need += 8;
+                    break;
+                }
+
+                if (conn->ws_hdr[1] & 0x80) {
+                    need += 4;
+                }
+            }
+
+            if (conn->ws_hdr_len < need) {
+                conn->ws_hdr[conn->ws_hdr_len++] = *p++;
+                n--;
+
+                continue;
+            }
+
+            int opcode = conn->ws_hdr[0] & 0x0F;
+
+            if (opcode == 0x8) {
+                errno = ECONNRESET;
+                return -1;
+            }
+
+            switch (conn->ws_hdr[1] & 0x7F) {
+            case 126:
+                conn->ws_left = ((uint64_t)conn->ws_hdr[2] << 8) | conn->ws_hdr[3];
+                break;
+
+            case 127:
+                conn->ws_left = bench_get_u64(conn->ws_hdr + 2);
+                break;
+
+            default:
+                conn->ws_left = conn->ws_hdr[1] & 0x7F;
+                break;
+            }
+
+            conn->ws_control = (opcode >= 0x8);
+            conn->ws_hdr_len = 0;
+
+            continue;
+        }
+
+        size_t m = (conn->ws_left < n) ? conn->ws_left : n;
+
+        if (!conn->ws_control && bench_conn_parse(conn, p, m, handler, arg) < 0) {
+            return -1;
+        }
+
+        conn->ws_left -= m;
+        p += m;
+        n -= m;
+    }
+
+    return 0;
+}
+
+/* Reads from a blocking socket until the handler sets replied */
+static int bench_conn_await(bench_conn_t *conn, bench_handler_t handler, void *arg) {
+    uint8_t buf[BENCH_READ_LEN];
+
+    conn->replied = 0;
+
+    while (!conn->replied) {
+        ssize_t n = bench_conn_read(conn, buf, sizeof(buf));
+
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {conn->fd, POLLIN, 0};
+
+                poll(&pfd, 1, 100);
+
+                continue;
+            }
+
+            return -1;
+        }
+
+        if (bench_conn_input(conn, buf, n, handler, arg) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Handles replies to commands, skipping meta messages and anything relayed */
+static int bench_reply(bench_conn_t *conn, void *arg) {
+    json_t *jsondata = json_loads(conn->json, 0, NULL);
+    json_int_t status = 0, group = 0;
+    int tls = 0, meta = 0;
+
+    if (jsondata == NULL) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (json_unpack(jsondata, "{sI}", "status", &status) < 0) {
+        json_decref(jsondata);
+
+        return 0;
+    }
+
+    json_unpack(jsondata, "{s?Is?bs?b}", "group", &group, "tls", &tls, "meta", &meta);
+
+    if (!meta) {
+        if (status < 0) {
+            const char *error = "unknown error";
+
+            json_unpack(jsondata, "{s?s}", "error", &error);
+            fprintf(stderr, "dimebench: server error: %s\n", error);
+        }
+
+        /* Errors are sticky, the last reply of a batch may succeed */
+        if (conn->status >= 0) {
+            conn->status = status;
+        }
+
+        if (group > 0) {
+            conn->group = group;
+        }
+
+        conn->tls = tls;
+
+        uint32_t *awaited = arg;
+
+        if (awaited == NULL || conn->rseq == *awaited) {
+            conn->replied = 1;
+        }
+    }
+
+    json_decref(jsondata);
+
+    return 0;
+}
+
+/* Sends a command and waits for its reply */
+static int bench_conn_command(bench_conn_t *conn, int opcode, const char *json) {
+    conn->status = 0;
+
+    if (bench_conn_send(conn, opcode, 0, 0, json, 0, 0) < 0) {
+        return -1;
+    }
+
+    uint32_t seq = conn->seq;
+
+    if (bench_conn_await(conn, bench_reply, (opcode == DIME_OP_HANDSHAKE) ? NULL : &seq) < 0) {
+        return -1;
+    }
+
+    if (conn->status < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bench_ws_upgrade(bench_conn_t *conn, const bench_addr_t *addr) {
+    char req[512];
+
+    snprintf(req, sizeof(req),
+             "GET / HTTP/1.1\r\n"
+             "Host: %s:%s\r\n"
+             "Connection: Upgrade\r\n"
+             "Upgrade: websocket\r\n"
+             "Sec-WebSocket-Key: ZGltZWJlbmNoIG5vbmNlIQ==\r\n"
+             "Sec-WebSocket-Version: 13\r\n"
+             "\r\n",
+             addr->host, addr->port);
+
+    struct iovec iov = {req, strlen(req)};
+
+    if (bench_conn_writev(conn, &iov, 1) < 0) {
+        return -1;
+    }
+
+    /* Read byte by byte, so that nothing after the response is consumed */
+    char resp[4096];
+    size_t len = 0;
+
+    while (len < 4 || memcmp(resp + len - 4, "\r\n\r\n", 4) != 0) {
+        if (len == sizeof(resp) - 1) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        ssize_t n = recv(conn->fd, resp + len, 1, 0);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            errno = (n == 0) ? ECONNRESET : errno;
+            return -1;
+        }
+
+        len++;
+    }
+
+    resp[len] = '\0';
+
+    if (strncmp(resp, "HTTP/1.1 101", 12) != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    conn->ws = 1;
+
+    return 0;
+}
+
+/* Connects, shakes hands and upgrades to TLS if asked to */
+static int bench_conn_open(bench_t *bench, bench_conn_t *conn, int sender) {
+    const bench_addr_t *addr = &bench->addr;
+
+    memset(conn, 0, sizeof(bench_conn_t));
+    conn->fd = -1;
+
+    if (addr->type == BENCH_UNIX) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, addr->path);
+
+        conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (conn->fd < 0) {
+            return -1;
+        }
+
+        if (connect(conn->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            return -1;
+        }
+    } else {
+        struct addrinfo hints, *res, *ai;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int err = getaddrinfo(addr->host, addr->port, &hints, &res);
+        if (err != 0) {
+            fprintf(stderr, "dimebench: %s: %s\n", addr->host, gai_strerror(err));
+
+            errno = EHOSTUNREACH;
+            return -1;
+        }
+
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            conn->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (conn->fd < 0) {
+                continue;
+            }
+
+            if (connect(conn->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+
+            close(conn->fd);
+            conn->fd = -1;
+        }
+
+        freeaddrinfo(res);
+
+        if (conn->fd < 0) {
+            return -1;
+        }
+
+        int one = 1;
+
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (addr->type == BENCH_WS && bench_ws_upgrade(conn, addr) < 0) {
+            return -1;
+        }
+    }
+
+    /* Senders never read relayed messages, so their queue only keeps the latest */
+    char json[256];
+
+    snprintf(json, sizeof(json), "{\"command\":\"handshake\",\"serialization\":\"dimeb\",\"tls\":%s,\"version\":2%s}",
+             addr->tls ? "true" : "false",
+             sender ? ",\"queue_max_len\":1,\"queue_policy\":\"drop_oldest\"" : "");
+
+    if (bench_conn_command(conn, DIME_OP_HANDSHAKE, json) < 0) {
+        return -1;
+    }
+
+    if (addr->tls) {
+        if (!conn->tls) {
+            fputs("dimebench: the server did not enable TLS\n", stderr);
+
+            errno = EPROTONOSUPPORT;
+            return -1;
+        }
+
+        conn->ssl = SSL_new(bench->tlsctx);
+        if (conn->ssl == NULL || SSL_set_fd(conn->ssl, conn->fd) <= 0 || SSL_connect(conn->ssl) <= 0) {
+            fprintf(stderr, "dimebench: TLS handshake failed: %s\n", ERR_reason_error_string(ERR_get_error()));
+
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_conn_close(bench_conn_t *conn) {
+    if (conn->ssl != NULL) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+
+    free(conn->json);
+}
+
+/* Waits until no more than the window of messages is in flight */
+static void bench_throttle(bench_t *bench) {
+    uint64_t window = bench->window * bench->senders;
+
+    while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        uint64_t sent = __atomic_load_n(&bench->sent, __ATOMIC_RELAXED);
+        uint64_t delivered = __atomic_load_n(&bench->delivered, __ATOMIC_RELAXED);
+
+        if (sent - delivered / bench->fanout < window) {
+            return;
+        }
+
+        struct timespec ts = {0, 10000};
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void *bench_sender_main(void *arg) {
+    bench_sender_t *sender = arg;
+    bench_t *bench = sender->bench;
+    bench_conn_t *conn = &sender->conn;
+
+    pthread_barrier_wait(&bench->barrier);
+
+    int opcode = (bench->pattern == BENCH_BROADCAST) ? DIME_OP_BROADCAST : DIME_OP_SEND;
+    uint64_t deadline = bench->start + (uint64_t)(bench->duration * 1e9);
+
+    while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        /* Only the last message of each window is acknowledged, and the first on its own to learn the group handle */
+        size_t window = (opcode == DIME_OP_SEND && conn->group == 0) ? 1 : bench->window;
+        size_t i;
+
+        for (i = 0; i < window; i++) {
+            if (bench->count > 0 ? sender->sent >= bench->count : dime_trace_now() >= deadline) {
+                break;
+            }
+
+            bench_throttle(bench);
+
+            char json[128];
+            int flags = (i + 1 < window) ? BENCH_FLAG_NOACK : 0;
+
+            if (opcode == DIME_OP_SEND && conn->group == 0) {
+                strcpy(json, "{\"name\":\"" BENCH_GROUP "\",\"varname\":\"x\",\"serialization\":\"dimeb\"}");
+            } else {
+                strcpy(json, "{\"varname\":\"x\",\"serialization\":\"dimeb\"}");
+            }
+
+            if (bench_conn_send(conn, opcode, flags, conn->group, json, bench->size, dime_trace_now()) < 0) {
+                bench_fail(bench, "send failed: %s", strerror(errno));
+
+                return NULL;
+            }
+
+            sender->sent++;
+            __atomic_fetch_add(&bench->sent, 1, __ATOMIC_RELAXED);
+        }
+
+        if (i == 0) {
+            break;
+        }
+
+        /* A window cut short ends in an unacknowledged message, so ask for the ack on its own */
+        if (i < window && bench_conn_send(conn, DIME_OP_DEVICES, 0, 0, "{}", 0, 0) < 0) {
+            bench_fail(bench, "send failed: %s", strerror(errno));
+
+            return NULL;
+        }
+
+        uint32_t seq = conn->seq;
+
+        if (bench_conn_await(conn, bench_reply, &seq) < 0) {
+            bench_fail(bench, "receive failed: %s", strerror(errno));
+
+            return NULL;
+        }
+
+        if (conn->status < 0) {
+            bench_fail(bench, "the server rejected a message");
+
+            return NULL;
+        }
+
+        if (i < window) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Handles what arrives at receivers: relayed messages, and replies to sync and wait */
+static int bench_receive(bench_conn_t *conn, void *arg) {
+    bench_receiver_t *receiver = arg;
+    bench_t *bench = receiver->bench;
+
+    if (strstr(conn->json, "\"status\"") == NULL) {
+        uint64_t now = dime_trace_now();
+        uint64_t stamp = bench_get_u64(conn->stamp);
+
+        dime_hist_record(&receiver->latency, (now > stamp) ? now - stamp : 0);
+        receiver->delivered++;
+        conn->synced++;
+
+        /* Arrivals after the last send are part of the run */
+        __atomic_store_n(&bench->end, now, __ATOMIC_RELAXED);
+
+        return 0;
+    }
+
+    /* Only one command is outstanding, and a woken wait is answered with sequence number 0 */
+    conn->status = 0;
+    conn->replied = 0;
+
+    if (bench_reply(conn, NULL) < 0) {
+        return -1;
+    }
+
+    if (conn->status < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (!conn->replied || conn->pending == BENCH_IDLE) {
+        return 0;
+    }
+
+    /* Pull whatever is queued, or block on the server until something is */
+    if (conn->pending == BENCH_SYNCING && conn->synced == 0) {
+        conn->pending = BENCH_WAITING;
+
+        return bench_conn_send(conn, DIME_OP_WAIT, 0, 0, "{}", 0, 0);
+    }
+
+    conn->pending = BENCH_SYNCING;
+    conn->synced = 0;
+
+    return bench_conn_send(conn, DIME_OP_SYNC, 0, 0, "{\"n\":-1}", 0, 0);
+}
+
+static void *bench_receiver_main(void *arg) {
+    bench_receiver_t *receiver = arg;
+    bench_t *bench = receiver->bench;
+    struct pollfd *pfds = calloc(receiver->conns_len, sizeof(struct pollfd));
+    uint8_t *buf = malloc(BENCH_READ_LEN);
+
+    if (pfds == NULL || buf == NULL) {
+        bench_fail(bench, "%s", strerror(ENOMEM));
+        pthread_barrier_wait(&bench->barrier);
+
+        free(pfds);
+        free(buf);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < receiver->conns_len; i++) {
+        pfds[i].fd = receiver->conns[i].fd;
+        pfds[i].events = POLLIN;
+    }
+
+    pthread_barrier_wait(&bench->barrier);
+
+    if (bench->pattern == BENCH_SYNC) {
+        for (size_t i = 0; i < receiver->conns_len; i++) {
+            receiver->conns[i].pending = BENCH_SYNCING;
+
+            if (bench_conn_send(&receiver->conns[i], DIME_OP_SYNC, 0, 0, "{\"n\":-1}", 0, 0) < 0) {
+                bench_fail(bench, "send failed: %s", strerror(errno));
+            }
+        }
+    }
+
+    while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        uint64_t delivered = receiver->delivered;
+
+        if (poll(pfds, receiver->conns_len, 50) < 0 && errno != EINTR) {
+            bench_fail(bench, "poll failed: %s", strerror(errno));
+
+            break;
+        }
+
+        for (size_t i = 0; i < receiver->conns_len; i++) {
+            bench_conn_t *conn = &receiver->conns[i];
+
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+
+            /* A bounded number of reads, so that one busy socket does not starve the others */
+            for (int j = 0; j < 16; j++) {
+                ssize_t n = bench_conn_read(conn, buf, BENCH_READ_LEN);
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+
+                if (n <= 0) {
+                    bench_fail(bench, "receive failed: %s", (n == 0) ? "connection closed" : strerror(errno));
+                    pfds[i].fd = -1;
+
+                    break;
+                }
+
+                if (bench_conn_input(conn, buf, n, bench_receive, receiver) < 0) {
+                    bench_fail(bench, "receive failed: %s", strerror(errno));
+                    pfds[i].fd = -1;
+
+                    break;
+                }
+            }
+        }
+
+        if (receiver->delivered > delivered) {
+            __atomic_fetch_add(&bench->delivered, receiver->delivered - delivered, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(pfds);
+    free(buf);
+
+    return NULL;
+}
+
+static void bench_hist_merge(dime_hist_t *dst, const dime_hist_t *src) {
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->max = (src->max > dst->max) ? src->max : dst->max;
+
+    for (size_t i = 0; i < DIME_HIST_LEN; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+static void bench_usage(FILE *f, const char *argv0) {
+    fprintf(f, "Usage: %s [options] [<protocol>:<info>]\n"
+               "\n"
+               "Connects clients to a running DiME server, relays messages between them\n"
+               "for a while and prints one line of JSON with the throughput and the\n"
+               "latency percentiles of the run. The address is given as to the server's\n"
+               "-l option, with an optional host before the port of tcp and ws, and\n"
+               "defaults to unix:/tmp/dime.sock.\n"
+               "\n"
+               "Options:\n"
+               "-c <senders>           Number of sending clients. Defaults to 1.\n"
+               "-f <fanout>            Number of receiving clients. Defaults to 1.\n"
+               "-h                     Displays this help message.\n"
+               "-n <count>             Messages each sender sends, instead of sending\n"
+               "                       for the duration given by -t.\n"
+               "-p <pattern>           send (to a group whose members subscribe),\n"
+               "                       broadcast (to every client) or sync (to a group\n"
+               "                       whose members poll with sync and wait).\n"
+               "                       Defaults to send.\n"
+               "-r <threads>           Number of threads the receivers are spread over.\n"
+               "                       Defaults to the smaller of the fanout and 4.\n"
+               "-s <size>              Size of the binary data of every message, with an\n"
+               "                       optional K, M or G suffix. At least 8 bytes, which\n"
+               "                       carry the send time. Defaults to 100.\n"
+               "-t <seconds>           Duration of sending. Defaults to 5.\n"
+               "-T                     Asks the server for TLS after the handshake.\n"
+               "-w <messages>          Messages each sender may have in flight. Defaults\n"
+               "                       to as many as fit in 64 MiB, between 1 and 64.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    static bench_t bench;
+    int opt;
+
+    memset(&bench, 0, sizeof(bench));
+
+    bench.pattern = BENCH_SEND;
+    bench.size = 100;
+    bench.fanout = 1;
+    bench.senders = 1;
+    bench.duration = 5;
+
+    while ((opt = getopt(argc, argv, "c:f:hn:p:r:s:t:Tw:")) != -1) {
+        switch (opt) {
+        case 'c':
+            bench.senders = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'f':
+            bench.fanout = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'h':
+            bench_usage(stdout, argv[0]);
+            return 0;
+
+        case 'n':
+            bench.count = strtoull(optarg, NULL, 0);
+            if (bench.count == 0) {
+                goto usage_err;
+            }
+
+            break;
+
+        case 'p':
+            for (bench.pattern = 0; bench.pattern < 3; bench.pattern++) {
+                if (strcmp(optarg, PATTERNS[bench.pattern]) == 0) {
+                    break;
+                }
+            }
+
+            break;
+
+        case 'r':
+            bench.rthreads = strtoul(optarg, NULL, 0);
+            if (bench.rthreads == 0) {
+                goto usage_err;
+            }
+
+            break;
+
+        case 's':
+            if (bench_parse_size(optarg, &bench.size) < 0) {
+                goto usage_err;
+            }
+
+            break;
+
+        case 't':
+            bench.duration = strtod(optarg, NULL);
+            break;
+
+        case 'T':
+            bench.addr.tls = 1;
+            break;
+
+        case 'w':
+            bench.window = strtoul(optarg, NULL, 0);
+            if (bench.window == 0) {
+                goto usage_err;
+            }
+
+            break;
+
+        default:
+            goto usage_err;
+        }
+    }
+
+    if (bench_parse_addr(&bench.addr, (optind < argc) ? argv[optind] : "unix:/tmp/dime.sock") < 0 || optind + 1 < argc) {
+        goto usage_err;
+    }
+
+    if (bench.senders == 0 || bench.fanout == 0 || bench.pattern == 3 || bench.duration <= 0 ||
+        bench.size < 8 || bench.size > UINT32_MAX) {
+        goto usage_err;
+    }
+
+    if (bench.addr.tls && bench.addr.type == BENCH_WS) {
+        fputs("dimebench: TLS is only offered over unix and tcp\n", stderr);
+
+        return 1;
+    }
+
+    if (bench.window == 0) {
+        bench.window = BENCH_WINDOW_BYTES / bench.size;
+        bench.window = (bench.window < 1) ? 1 : (bench.window > 64) ? 64 : bench.window;
+    }
+
+    if (bench.rthreads == 0) {
+        bench.rthreads = (bench.fanout < 4) ? bench.fanout : 4;
+    }
+
+    bench.rthreads = (bench.rthreads > bench.fanout) ? bench.fanout : bench.rthreads;
+
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    /* A thousand receivers need more descriptors than the usual soft limit */
+    struct rlimit rlim;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+
+    if (bench.addr.tls) {
+        SSL_library_init();
+        SSL_load_error_strings();
+
+        bench.tlsctx = SSL_CTX_new(TLS_client_method());
+        if (bench.tlsctx == NULL) {
+            fprintf(stderr, "dimebench: failed to initialize TLS: %s\n", ERR_reason_error_string(ERR_get_error()));
+
+            return 1;
+        }
+    }
+
+    bench_conn_t *rconns = calloc(bench.fanout, sizeof(bench_conn_t));
+    bench_receiver_t *receivers = calloc(bench.rthreads, sizeof(bench_receiver_t));
+    bench_sender_t *senders = calloc(bench.senders, sizeof(bench_sender_t));
+
+    if (rconns == NULL || receivers == NULL || senders == NULL) {
+        fprintf(stderr, "dimebench: %s\n", strerror(ENOMEM));
+
+        return 1;
+    }
+
+    int ret = 1;
+    size_t rconns_len = 0, senders_len = 0, rthreads_len = 0;
+
+    /* Receivers are all in place before anything is sent */
+    for (; rconns_len < bench.fanout; rconns_len++) {
+        bench_conn_t *conn = &rconns[rconns_len];
+
+        if (bench_conn_open(&bench, conn, 0) < 0) {
+            fprintf(stderr, "dimebench: failed to connect receiver %zu: %s\n", rconns_len, strerror(errno));
+
+            rconns_len++;
+            goto cleanup;
+        }
+
+        if (bench.pattern != BENCH_BROADCAST &&
+            bench_conn_command(conn, DIME_OP_JOIN, "{\"name\":[\"" BENCH_GROUP "\"]}") < 0) {
+            fprintf(stderr, "dimebench: failed to join: %s\n", strerror(errno));
+
+            rconns_len++;
+            goto cleanup;
+        }
+
+        if (bench.pattern != BENCH_SYNC &&
+            bench_conn_command(conn, DIME_OP_SUBSCRIBE, "{\"credits\":4611686018427387904}") < 0) {
+            fprintf(stderr, "dimebench: failed to subscribe: %s\n", strerror(errno));
+
+            rconns_len++;
+            goto cleanup;
+        }
+
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    for (; senders_len < bench.senders; senders_len++) {
+        senders[senders_len].bench = &bench;
+
+        if (bench_conn_open(&bench, &senders[senders_len].conn, 1) < 0) {
+            fprintf(stderr, "dimebench: failed to connect sender %zu: %s\n", senders_len, strerror(errno));
+
+            senders_len++;
+            goto cleanup;
+        }
+    }
+
+    pthread_barrier_init(&bench.barrier, NULL, bench.senders + bench.rthreads + 1);
+
+    for (size_t i = 0; i < bench.rthreads; i++) {
+        bench_receiver_t *receiver = &receivers[i];
+        size_t lo = bench.fanout * i / bench.rthreads, hi = bench.fanout * (i + 1) / bench.rthreads;
+
+        receiver->bench = &bench;
+        receiver->conns = rconns + lo;
+        receiver->conns_len = hi - lo;
+    }
+
+    bench.start = dime_trace_now();
+
+    for (; rthreads_len < bench.rthreads; rthreads_len++) {
+        pthread_create(&receivers[rthreads_len].thread, NULL, bench_receiver_main, &receivers[rthreads_len]);
+    }
+
+    for (size_t i = 0; i < bench.senders; i++) {
+        pthread_create(&senders[i].thread, NULL, bench_sender_main, &senders[i]);
+    }
+
+    pthread_barrier_wait(&bench.barrier);
+
+    for (size_t i = 0; i < bench.senders; i++) {
+        pthread_join(senders[i].thread, NULL);
+    }
+
+    uint64_t sent_end = dime_trace_now();
+
+    /* Let the last messages arrive, giving up once nothing has arrived for a while */
+    uint64_t expected = __atomic_load_n(&bench.sent, __ATOMIC_RELAXED) * bench.fanout;
+    uint64_t last = __atomic_load_n(&bench.delivered, __ATOMIC_RELAXED), idle = dime_trace_now();
+
+    while (!__atomic_load_n(&bench.stop, __ATOMIC_RELAXED)) {
+        uint64_t delivered = __atomic_load_n(&bench.delivered, __ATOMIC_RELAXED);
+
+        if (delivered >= expected) {
+            break;
+        }
+
+        if (delivered != last) {
+            last = delivered;
+            idle = dime_trace_now();
+        } else if (dime_trace_now() - idle > 5000000000ull) {
+            fprintf(stderr, "dimebench: %llu of %llu messages were not delivered\n",
+                    (unsigned long long)(expected - delivered), (unsigned long long)expected);
+
+            break;
+        }
+
+        struct timespec ts = {0, 1000000};
+
+        nanosleep(&ts, NULL);
+    }
+
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+
+    for (; rthreads_len > 0; rthreads_len--) {
+        pthread_join(receivers[rthreads_len - 1].thread, NULL);
+    }
+
+    if (__atomic_load_n(&bench.failed, __ATOMIC_RELAXED)) {
+        goto cleanup;
+    }
+
+    dime_hist_t *latency = calloc(1, sizeof(dime_hist_t));
+    uint64_t delivered = 0;
+
+    if (latency == NULL) {
+        fprintf(stderr, "dimebench: %s\n", strerror(ENOMEM));
+
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < bench.rthreads; i++) {
+        bench_hist_merge(latency, &receivers[i].latency);
+        delivered += receivers[i].delivered;
+    }
+
+    uint64_t end = (bench.end > sent_end) ? bench.end : sent_end;
+    double elapsed = (end - bench.start) / 1e9;
+
+    json_t *result = json_pack("{sssbsssIsIsIsIsfsIsIsfsfsfso}",
+                               "transport", TRANSPORTS[bench.addr.type],
+                               "tls", bench.addr.tls,
+                               "pattern", PATTERNS[bench.pattern],
+                               "size", (json_int_t)bench.size,
+                               "fanout", (json_int_t)bench.fanout,
+                               "senders", (json_int_t)bench.senders,
+                               "window", (json_int_t)bench.window,
+                               "elapsed", elapsed,
+                               "sent", (json_int_t)__atomic_load_n(&bench.sent, __ATOMIC_RELAXED),
+                               "delivered", (json_int_t)delivered,
+                               "sent_per_sec", __atomic_load_n(&bench.sent, __ATOMIC_RELAXED) / elapsed,
+                               "delivered_per_sec", delivered / elapsed,
+                               "bytes_per_sec", delivered * (double)bench.size / elapsed,
+                               "latency", dime_hist_json(latency));
+
+    free(latency);
+
+    if (result == NULL) {
+        fprintf(stderr, "dimebench: %s\n", strerror(ENOMEM));
+
+        goto cleanup;
+    }
+
+    char *result_str = json_dumps(result, JSON_COMPACT);
+
+    json_decref(result);
+
+    if (result_str == NULL) {
+        fprintf(stderr, "dimebench: %s\n", strerror(ENOMEM));
+
+        goto cleanup;
+    }
+
+    puts(result_str);
+    fflush(stdout);
+
+    free(result_str);
+
+    ret = (delivered >= expected) ? 0 : 1;
+
+cleanup:
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < senders_len; i++) {
+        bench_conn_close(&senders[i].conn);
+    }
+
+    for (size_t i = 0; i < rconns_len; i++) {
+        bench_conn_close(&rconns[i]);
+    }
+
+    free(rconns);
+    free(receivers);
+    free(senders);
+
+    if (bench.tlsctx != NULL) {
+        SSL_CTX_free(bench.tlsctx);
+    }
+
+    return ret;
+
+usage_err:
+    bench_usage(stderr, argv[0]);
+
+    return 1;
+}
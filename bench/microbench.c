@@ -0,0 +1,473 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "deque.h"
+#include "ringbuffer.h"
+#include "table.h"
+
+/* Each benchmark is run with twice the iterations until it takes this long */
+#define MICRO_MINTIME 200000000ull
+
+/* Sinks for results, so that the compiler cannot drop the work */
+static volatile uintptr_t sink;
+
+typedef struct {
+    const char *name;
+    size_t param;       /* Chunk length, queue depth or table size */
+    size_t bytes_per_op;
+
+    /* Runs n operations; returns a negative value on failure */
+    int (*run)(void *state, size_t param, uint64_t n);
+    void *(*setup)(size_t param);
+    void (*teardown)(void *state);
+} micro_t;
+
+static uint64_t micro_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* A cheap generator, so that random keys cost little next to the operations */
+static uint64_t micro_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+
+    return *x;
+}
+
+/*
+ * Ring buffer benchmarks
+ */
+
+typedef struct {
+    dime_ringbuffer_t ring;
+    unsigned char *buf;
+} micro_ring_t;
+
+static void *micro_ring_setup(size_t chunk) {
+    micro_ring_t *st = malloc(sizeof(micro_ring_t));
+    if (st == NULL) {
+        return NULL;
+    }
+
+    st->buf = calloc(1, chunk);
+
+    if (st->buf == NULL || dime_ringbuffer_init(&st->ring) < 0) {
+        free(st->buf);
+        free(st);
+
+        return NULL;
+    }
+
+    return st;
+}
+
+static void micro_ring_teardown(void *p) {
+    micro_ring_t *st = p;
+
+    dime_ringbuffer_destroy(&st->ring);
+    free(st->buf);
+    free(st);
+}
+
+/*
+ * Writes and consumes one chunk at a time, behind a backlog whose length
+ * is not a multiple of the chunk, so that the readable bytes keep
+ * wrapping around the end of the array at different offsets
+ */
+static int micro_ring_wrap(void *p, size_t chunk, uint64_t n) {
+    micro_ring_t *st = p;
+
+    if (dime_ringbuffer_len(&st->ring) == 0) {
+        for (size_t i = 0; i < 3; i++) {
+            if (dime_ringbuffer_write(&st->ring, st->buf, chunk) < 0) {
+                return -1;
+            }
+        }
+
+        dime_ringbuffer_discard(&st->ring, chunk / 2 + 7);
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        if (dime_ringbuffer_write(&st->ring, st->buf, chunk) < 0) {
+            return -1;
+        }
+
+        sink += dime_ringbuffer_peek(&st->ring, st->buf, chunk);
+        sink += dime_ringbuffer_discard(&st->ring, chunk);
+    }
+
+    return 0;
+}
+
+/* Fills an empty ring buffer until it has grown to hold 64 chunks, then empties it */
+static int micro_ring_grow(void *p, size_t chunk, uint64_t n) {
+    micro_ring_t *st = p;
+
+    for (uint64_t i = 0; i < n; i++) {
+        dime_ringbuffer_t ring;
+
+        if (dime_ringbuffer_init(&ring) < 0) {
+            return -1;
+        }
+
+        for (size_t j = 0; j < 64; j++) {
+            if (dime_ringbuffer_write(&ring, st->buf, chunk) < 0) {
+                dime_ringbuffer_destroy(&ring);
+
+                return -1;
+            }
+        }
+
+        while (dime_ringbuffer_len(&ring) > 0) {
+            sink += dime_ringbuffer_read(&ring, st->buf, chunk);
+        }
+
+        dime_ringbuffer_destroy(&ring);
+    }
+
+    return 0;
+}
+
+/*
+ * Deque benchmarks
+ */
+
+static void *micro_deque_setup(size_t depth) {
+    dime_deque_t *deck = malloc(sizeof(dime_deque_t));
+
+    if (deck == NULL || dime_deque_init(deck) < 0) {
+        free(deck);
+
+        return NULL;
+    }
+
+    /* Queues of clients hold messages, which are only compared as pointers here */
+    for (size_t i = 0; i < depth; i++) {
+        if (dime_deque_pushr(deck, (void *)(uintptr_t)(i + 1)) < 0) {
+            dime_deque_destroy(deck);
+            free(deck);
+
+            return NULL;
+        }
+    }
+
+    return deck;
+}
+
+static void micro_deque_teardown(void *p) {
+    dime_deque_destroy(p);
+    free(p);
+}
+
+/* Pushes onto the tail and pops off the head behind a standing backlog, as client queues do */
+static int micro_deque_fifo(void *p, size_t depth, uint64_t n) {
+    dime_deque_t *deck = p;
+
+    for (uint64_t i = 0; i < n; i++) {
+        if (dime_deque_pushr(deck, (void *)(uintptr_t)(i + 1)) < 0) {
+            return -1;
+        }
+
+        sink += (uintptr_t)dime_deque_popl(deck);
+    }
+
+    return 0;
+}
+
+/* Pushes and pops at the same end, as message pools do */
+static int micro_deque_lifo(void *p, size_t depth, uint64_t n) {
+    dime_deque_t *deck = p;
+
+    for (uint64_t i = 0; i < n; i++) {
+        if (dime_deque_pushl(deck, (void *)(uintptr_t)(i + 1)) < 0) {
+            return -1;
+        }
+
+        sink += (uintptr_t)dime_deque_popl(deck);
+    }
+
+    return 0;
+}
+
+/* Fills an empty deque to the given depth, growing it, then drains it */
+static int micro_deque_grow(void *p, size_t depth, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        dime_deque_t deck;
+
+        if (dime_deque_init(&deck) < 0) {
+            return -1;
+        }
+
+        for (size_t j = 0; j < depth; j++) {
+            if (dime_deque_pushr(&deck, (void *)(uintptr_t)(j + 1)) < 0) {
+                dime_deque_destroy(&deck);
+
+                return -1;
+            }
+        }
+
+        while (dime_deque_len(&deck) > 0) {
+            sink += (uintptr_t)dime_deque_popl(&deck);
+        }
+
+        dime_deque_destroy(&deck);
+    }
+
+    return 0;
+}
+
+/*
+ * Hash table benchmarks, with the key functions of server.c
+ */
+
+static int cmp_fd(const void *a, const void *b) {
+    return (*(const int *)b) - (*(const int *)a);
+}
+
+static uint64_t hash_fd(const void *a) {
+    return (*(const int *)a) * 0x9E3779B97F4A7BB9;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+static uint64_t hash_name(const void *a) {
+    uint64_t y = 0xCBF29CE484222325;
+
+    for (const char *s = a; *s != '\0'; s++) {
+        y = (y ^ *s) * 1099511628211;
+    }
+
+    return y;
+}
+
+#define MICRO_NAME_LEN 48
+
+typedef struct {
+    dime_table_t tbl;
+    size_t len;
+
+    /* Keys, which must outlive their entries; twice as many as are ever in the table */
+    int *fds;
+    char (*names)[MICRO_NAME_LEN];
+    unsigned char *present;
+
+    uint64_t rng;
+} micro_table_t;
+
+static void micro_table_teardown(void *p) {
+    micro_table_t *st = p;
+
+    dime_table_destroy(&st->tbl);
+    free(st->fds);
+    free(st->names);
+    free(st->present);
+    free(st);
+}
+
+static const void *micro_table_key(const micro_table_t *st, size_t i) {
+    return (st->fds != NULL) ? (const void *)&st->fds[i] : (const void *)st->names[i];
+}
+
+static micro_table_t *micro_table_new(size_t len, int names) {
+    micro_table_t *st = calloc(1, sizeof(micro_table_t));
+    if (st == NULL) {
+        return NULL;
+    }
+
+    st->len = len;
+    st->rng = 0x2545F4914F6CDD1D;
+    st->present = calloc(2 * len, 1);
+
+    if (names) {
+        st->names = malloc(2 * len * sizeof(*st->names));
+    } else {
+        st->fds = malloc(2 * len * sizeof(int));
+    }
+
+    if (st->present == NULL || (st->names == NULL && st->fds == NULL) ||
+        dime_table_init(&st->tbl, names ? cmp_name : cmp_fd, names ? hash_name : hash_fd) < 0) {
+        free(st->present);
+        free(st->names);
+        free(st->fds);
+        free(st);
+
+        return NULL;
+    }
+
+    /*
+     * Descriptors are small, dense integers, and group names share long
+     * prefixes that differ in their last few characters
+     */
+    for (size_t i = 0; i < 2 * len; i++) {
+        if (names) {
+            snprintf(st->names[i], MICRO_NAME_LEN, "ltb.area%zu.pmu%zu", i % 17, i);
+        } else {
+            st->fds[i] = (int)i + 5;
+        }
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (dime_table_insert(&st->tbl, micro_table_key(st, i), st) < 0) {
+            micro_table_teardown(st);
+
+            return NULL;
+        }
+
+        st->present[i] = 1;
+    }
+
+    return st;
+}
+
+static void *micro_table_fd_setup(size_t len) {
+    return micro_table_new(len, 0);
+}
+
+static void *micro_table_name_setup(size_t len) {
+    return micro_table_new(len, 1);
+}
+
+/* Looks up keys at random, half of them absent */
+static int micro_table_search(void *p, size_t len, uint64_t n) {
+    micro_table_t *st = p;
+
+    for (uint64_t i = 0; i < n; i++) {
+        size_t k = micro_rand(&st->rng) % (2 * len);
+
+        sink += (uintptr_t)dime_table_search(&st->tbl, micro_table_key(st, k));
+    }
+
+    return 0;
+}
+
+/*
+ * Removes a random present key and inserts a random absent one, keeping
+ * the table at the same size while tombstones come and go, as
+ * connections and groups do
+ */
+static int micro_table_churn(void *p, size_t len, uint64_t n) {
+    micro_table_t *st = p;
+
+    for (uint64_t i = 0; i < n; i++) {
+        size_t out, in;
+
+        do {
+            out = micro_rand(&st->rng) % (2 * len);
+        } while (!st->present[out]);
+
+        do {
+            in = micro_rand(&st->rng) % (2 * len);
+        } while (st->present[in]);
+
+        sink += (uintptr_t)dime_table_remove(&st->tbl, micro_table_key(st, out));
+        st->present[out] = 0;
+
+        if (dime_table_insert(&st->tbl, micro_table_key(st, in), st) < 0) {
+            return -1;
+        }
+
+        st->present[in] = 1;
+    }
+
+    return 0;
+}
+
+static const micro_t MICROS[] = {
+    {"ringbuffer_wrap", 64, 64, micro_ring_wrap, micro_ring_setup, micro_ring_teardown},
+    {"ringbuffer_wrap", 1500, 1500, micro_ring_wrap, micro_ring_setup, micro_ring_teardown},
+    {"ringbuffer_wrap", 65536, 65536, micro_ring_wrap, micro_ring_setup, micro_ring_teardown},
+    {"ringbuffer_grow", 1500, 64 * 1500, micro_ring_grow, micro_ring_setup, micro_ring_teardown},
+    {"ringbuffer_grow", 65536, 64 * 65536, micro_ring_grow, micro_ring_setup, micro_ring_teardown},
+
+    {"deque_fifo", 0, 0, micro_deque_fifo, micro_deque_setup, micro_deque_teardown},
+    {"deque_fifo", 4096, 0, micro_deque_fifo, micro_deque_setup, micro_deque_teardown},
+    {"deque_lifo", 0, 0, micro_deque_lifo, micro_deque_setup, micro_deque_teardown},
+    {"deque_grow", 4096, 0, micro_deque_grow, micro_deque_setup, micro_deque_teardown},
+
+    {"table_fd_search", 64, 0, micro_table_search, micro_table_fd_setup, micro_table_teardown},
+    {"table_fd_search", 4096, 0, micro_table_search, micro_table_fd_setup, micro_table_teardown},
+    {"table_fd_churn", 64, 0, micro_table_churn, micro_table_fd_setup, micro_table_teardown},
+    {"table_fd_churn", 4096, 0, micro_table_churn, micro_table_fd_setup, micro_table_teardown},
+    {"table_name_search", 64, 0, micro_table_search, micro_table_name_setup, micro_table_teardown},
+    {"table_name_search", 4096, 0, micro_table_search, micro_table_name_setup, micro_table_teardown},
+    {"table_name_churn", 64, 0, micro_table_churn, micro_table_name_setup, micro_table_teardown},
+    {"table_name_churn", 4096, 0, micro_table_churn, micro_table_name_setup, micro_table_teardown}
+};
+
+/*
+ * Runs the microbenchmarks of the server's data structures, all of them or
+ * those whose names start with one of the arguments, and prints one line
+ * of JSON for each
+ */
+int main(int argc, char **argv) {
+    int ret = 0;
+
+    for (size_t i = 0; i < sizeof(MICROS) / sizeof(MICROS[0]); i++) {
+        const micro_t *micro = &MICROS[i];
+        int selected = (argc < 2);
+
+        for (int j = 1; j < argc; j++) {
+            if (strncmp(micro->name, argv[j], strlen(argv[j])) == 0) {
+                selected = 1;
+            }
+        }
+
+        if (!selected) {
+            continue;
+        }
+
+        void *state = micro->setup(micro->param);
+        if (state == NULL) {
+            fprintf(stderr, "%s: setup failed\n", micro->name);
+
+            ret = 1;
+            continue;
+        }
+
+        /* Warms up caches and the allocator, then doubles until the run is long enough */
+        uint64_t n = 1, elapsed = 0;
+        int failed = (micro->run(state, micro->param, 1) < 0);
+
+        while (!failed && elapsed < MICRO_MINTIME) {
+            n *= 2;
+
+            uint64_t start = micro_now();
+
+            failed = (micro->run(state, micro->param, n) < 0);
+            elapsed = micro_now() - start;
+        }
+
+        micro->teardown(state);
+
+        if (failed) {
+            fprintf(stderr, "%s: run failed\n", micro->name);
+
+            ret = 1;
+            continue;
+        }
+
+        double ns = (double)elapsed / n;
+
+        printf("{\"name\":\"%s\",\"param\":%zu,\"iterations\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f",
+               micro->name, micro->param, (unsigned long long)n, ns, 1e9 / ns);
+
+        if (micro->bytes_per_op > 0) {
+            printf(",\"bytes_per_sec\":%.0f", micro->bytes_per_op * 1e9 / ns);
+        }
+
+        printf("}\n");
+        fflush(stdout);
+    }
+
+    return ret;
+}
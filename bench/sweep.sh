@@ -0,0 +1,114 @@
+#!/bin/sh -e
+
+# Runs dimebench over every combination of transport, pattern, message
+# size and fan-out, against a fresh server for each transport, and prints
+# one line of JSON per run. Each list below can be narrowed from the
+# environment, e.g. TRANSPORTS="unix" SIZES="100 1M" sh sweep.sh
+#
+# The tls transport needs a server with TLS enabled, through DIME_CERT
+# and DIME_KEY; it is skipped otherwise.
+
+TRANSPORTS="${TRANSPORTS:-unix tcp ws tls}"
+PATTERNS="${PATTERNS:-send broadcast sync}"
+SIZES="${SIZES:-100 10K 1M 100M 1G}"
+FANOUTS="${FANOUTS:-1 10 100 1000}"
+DURATION="${DURATION:-2}"
+
+# Messages of more than 1 MiB are counted rather than timed, so that a
+# run delivers about BUDGET bytes, and runs that would deliver more than
+# LIMIT bytes with a single message are skipped
+BUDGET="${BUDGET:-4294967296}"
+LIMIT="${LIMIT:-17179869184}"
+
+DIME="${DIME:-../server/dime}"
+DIMEBENCH="${DIMEBENCH:-./dimebench}"
+
+DIME_PORT=`python3 <<HEREDOC
+import random
+import socket
+
+while True:
+    port = random.randrange(1 << 10, 1 << 15)
+
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as srv:
+            srv.bind(("", port))
+    except OSError:
+        pass
+    else:
+        break
+
+print(port)
+HEREDOC`
+
+DIME_SOCKET="`mktemp -u`"
+
+# A thousand receivers need as many descriptors on the server
+ulimit -n "`ulimit -H -n`" 2>/dev/null || true
+
+bytes() {
+    case "$1" in
+    *K) echo $((${1%K} << 10)) ;;
+    *M) echo $((${1%M} << 20)) ;;
+    *G) echo $((${1%G} << 30)) ;;
+    *) echo "$1" ;;
+    esac
+}
+
+for transport in $TRANSPORTS; do
+    case "$transport" in
+    unix)
+        listen="unix:$DIME_SOCKET"
+        address="unix:$DIME_SOCKET"
+        tls=""
+        ;;
+    tcp|ws)
+        listen="$transport:$DIME_PORT"
+        address="$transport:$DIME_PORT"
+        tls=""
+        ;;
+    tls)
+        if [ -z "$DIME_CERT" ] || [ -z "$DIME_KEY" ]; then
+            echo "Skipping tls, DIME_CERT and DIME_KEY are not set" >&2
+            continue
+        fi
+
+        listen="tcp:$DIME_PORT -c $DIME_CERT -k $DIME_KEY"
+        address="tcp:$DIME_PORT"
+        tls="-T"
+        ;;
+    *)
+        echo "Unknown transport: $transport" >&2
+        exit 1
+        ;;
+    esac
+
+    $DIME -l $listen $DIME_ARGS &
+    DIME_PID=$!
+    sleep 0.5
+
+    for pattern in $PATTERNS; do
+        for size in $SIZES; do
+            for fanout in $FANOUTS; do
+                n=`bytes $size`
+
+                if [ $((n * fanout)) -gt "$LIMIT" ]; then
+                    continue
+                fi
+
+                if [ "$n" -gt 1048576 ]; then
+                    count=$((BUDGET / (n * fanout)))
+                    length="-n $((count > 0 ? count : 1))"
+                else
+                    length="-t $DURATION"
+                fi
+
+                $DIMEBENCH $tls -p "$pattern" -s "$size" -f "$fanout" $length "$address" || \
+                    echo "Failed: $transport $pattern $size $fanout" >&2
+            done
+        done
+    done
+
+    kill $DIME_PID
+    wait $DIME_PID 2>/dev/null || true
+done
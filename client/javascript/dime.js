@@ -198,7 +198,7 @@ class NDArray {
 }
 
 function jsonloads(obj) {
-    return JSON.parse(new TextDecoder().decode(new Uint8Array(obj)), function(key, value) {
+    return JSON.parse(new TextDecoder().decode(obj), function(key, value) {
         if (value && value.__dime_type !== undefined) {
             if (value.__dime_type === "complex") {
                 return new Complex(value.real, value.imag);
@@ -324,44 +324,86 @@ const TYPE_STRING     = 0x20;
 const TYPE_ARRAY      = 0x21;
 const TYPE_ASSOCARRAY = 0x22;
 
-function __loadsmat(bytes, dtype, complex) {
-    let [constructor, method, itemsize] = dtype;
+// Whether TypedArrays need byteswapping from the big-endian dimeb data
+const LITTLE_ENDIAN = new Uint8Array(new Uint16Array([1]).buffer)[0] === 1;
 
-    let dview = new DataView(bytes, 1);
-    let rank = dview.getUint8(0);
+const DECODER = new TextDecoder();
 
-    dview = new DataView(bytes, 2);
+// Swaps nelems items of itemsize bytes each in place, at an aligned offset
+function __byteswap(buffer, offset, nelems, itemsize) {
+    if (itemsize === 2) {
+        let array = new Uint16Array(buffer, offset, nelems);
+
+        for (let i = 0; i < nelems; i++) {
+            let x = array[i];
+            array[i] = (x << 8) | (x >>> 8);
+        }
+    } else if (itemsize === 4 || itemsize === 8) {
+        let array = new Uint32Array(buffer, offset, nelems * itemsize / 4);
+
+        for (let i = 0; i < array.length; i++) {
+            let x = array[i];
+            array[i] = (x << 24) | ((x & 0xFF00) << 8) | ((x >>> 8) & 0xFF00) | (x >>> 24);
+        }
+
+        // The halves of each 64-bit item also trade places
+        if (itemsize === 8) {
+            for (let i = 0; i < array.length; i += 2) {
+                let x = array[i];
+                array[i] = array[i + 1];
+                array[i + 1] = x;
+            }
+        }
+    }
+}
+
+/*
+ * Matrices are TypedArray views over the buffer being decoded, which is
+ * byteswapped in place. Data that is not aligned for its TypedArray is
+ * copied out first.
+ */
+function __loadsmat(dview, off, dtype, complex) {
+    let [constructor, itemsize] = dtype;
+
+    let rank = dview.getUint8(off + 1);
     let shape = [];
 
     for (let i = 0; i < rank; i++) {
-        shape.push(dview.getUint32(i * 4));
+        shape.push(dview.getUint32(off + 2 + i * 4));
     }
 
     if (shape.length === 1) {
         shape = [1, shape[0]];
     }
 
-    let nelems = shape.reduce((a, b) => a * b) * (complex ? 2 : 1);
+    let nelems = shape.reduce((a, b) => a * b, 1) * (complex ? 2 : 1);
+    let nread = 2 + 4 * rank + nelems * itemsize;
 
-    dview = new DataView(bytes, 2 + 4 * rank);
-    let array = new constructor(nelems);
+    let buffer = dview.buffer;
+    let start = dview.byteOffset + off + 2 + 4 * rank;
 
-    for (let i = 0; i < nelems; i++) {
-        array[i] = dview[method](i * itemsize);
+    if (start + nelems * itemsize > dview.byteOffset + dview.byteLength) {
+        throw "Invalid dimeb data";
     }
 
-    let obj = new dime.NDArray("F", shape, array, complex);
-    let nread = 2 + 4 * rank + nelems * itemsize;
+    if (start % itemsize !== 0) {
+        buffer = buffer.slice(start, start + nelems * itemsize);
+        start = 0;
+    }
+
+    if (LITTLE_ENDIAN) {
+        __byteswap(buffer, start, nelems, itemsize);
+    }
+
+    let obj = new NDArray("F", shape, new constructor(buffer, start, nelems), complex);
 
     return [obj, nread];
 }
 
-function __loads(bytes) {
+function __loads(dview, off) {
     let obj, nread;
 
-    let dview = new DataView(bytes, 1);
-
-    switch (new DataView(bytes).getUint8(0)) {
+    switch (dview.getUint8(off)) {
     case TYPE_NULL:
         obj = null;
         nread = 1;
@@ -381,25 +423,25 @@ function __loads(bytes) {
         break;
 
     case TYPE_I8:
-        obj = dview.getInt8(0);
+        obj = dview.getInt8(off + 1);
         nread = 2;
 
         break;
 
     case TYPE_I16:
-        obj = dview.getInt16(0);
+        obj = dview.getInt16(off + 1);
         nread = 3;
 
         break;
 
     case TYPE_I32:
-        obj = dview.getInt32(0);
+        obj = dview.getInt32(off + 1);
         nread = 5;
 
         break;
 
     case TYPE_I64:
-        obj = dview.getBigInt64(0);
+        obj = dview.getBigInt64(off + 1);
         if (BigInt(-Number.MAX_SAFE_INTEGER) <= obj && obj <= BigInt(Number.MAX_SAFE_INTEGER)) {
             obj = Number(obj);
         }
@@ -409,25 +451,25 @@ function __loads(bytes) {
         break;
 
     case TYPE_U8:
-        obj = dview.getUint8(0);
+        obj = dview.getUint8(off + 1);
         nread = 2;
 
         break;
 
     case TYPE_U16:
-        obj = dview.getUint16(0);
+        obj = dview.getUint16(off + 1);
         nread = 3;
 
         break;
 
     case TYPE_U32:
-        obj = dview.getUint32(0);
+        obj = dview.getUint32(off + 1);
         nread = 5;
 
         break;
 
     case TYPE_U64:
-        obj = dview.getBigUint64(0);
+        obj = dview.getBigUint64(off + 1);
         if (obj <= BigInt(Number.MAX_SAFE_INTEGER)) {
             obj = Number(obj);
         }
@@ -437,21 +479,21 @@ function __loads(bytes) {
         break;
 
     case TYPE_SINGLE:
-        obj = dview.getFloat32(0);
+        obj = dview.getFloat32(off + 1);
         nread = 5;
 
         break;
 
     case TYPE_DOUBLE:
-        obj = dview.getFloat64(0);
+        obj = dview.getFloat64(off + 1);
         nread = 9;
 
         break;
 
     case TYPE_COMPLEX_SINGLE:
         {
-            let realpart = dview.getFloat32(0);
-            let imagpart = dview.getFloat32(4);
+            let realpart = dview.getFloat32(off + 1);
+            let imagpart = dview.getFloat32(off + 5);
 
             obj = new Complex(realpart, imagpart);
         }
@@ -461,8 +503,8 @@ function __loads(bytes) {
 
     case TYPE_COMPLEX_DOUBLE:
         {
-            let realpart = dview.getFloat64(0);
-            let imagpart = dview.getFloat64(8);
+            let realpart = dview.getFloat64(off + 1);
+            let imagpart = dview.getFloat64(off + 9);
 
             obj = new Complex(realpart, imagpart);
         }
@@ -471,70 +513,70 @@ function __loads(bytes) {
         break;
 
     case TYPE_MAT_I8:
-        [obj, nread] = __loadsmat(bytes, [Int8Array, "getInt8", 1], false);
+        [obj, nread] = __loadsmat(dview, off, [Int8Array, 1], false);
         break;
 
     case TYPE_MAT_I16:
-        [obj, nread] = __loadsmat(bytes, [Int16Array, "getInt16", 2], false);
+        [obj, nread] = __loadsmat(dview, off, [Int16Array, 2], false);
         break;
 
     case TYPE_MAT_I32:
-        [obj, nread] = __loadsmat(bytes, [Int32Array, "getInt32", 4], false);
+        [obj, nread] = __loadsmat(dview, off, [Int32Array, 4], false);
         break;
 
     case TYPE_MAT_I64:
-        [obj, nread] = __loadsmat(bytes, [BigInt64Array, "getBigInt64", 8], false);
+        [obj, nread] = __loadsmat(dview, off, [BigInt64Array, 8], false);
 
         if (obj.array.every((i) => BigInt(-Number.MAX_SAFE_INTEGER) <= i && i <= BigInt(Number.MAX_SAFE_INTEGER))) {
-            let array = new Float64Array(Array.from(obj.array).map(Number));
+            let array = Float64Array.from(obj.array, Number);
             obj = new NDArray(obj.order, obj.shape, array, obj.complex);
         }
 
         break;
 
     case TYPE_MAT_U8:
-        [obj, nread] = __loadsmat(bytes, [Uint8Array, "getUint8", 1], false);
+        [obj, nread] = __loadsmat(dview, off, [Uint8Array, 1], false);
         break;
 
     case TYPE_MAT_U16:
-        [obj, nread] = __loadsmat(bytes, [Uint16Array, "getUint16", 2], false);
+        [obj, nread] = __loadsmat(dview, off, [Uint16Array, 2], false);
         break;
 
     case TYPE_MAT_U32:
-        [obj, nread] = __loadsmat(bytes, [Uint32Array, "getUint32", 4], false);
+        [obj, nread] = __loadsmat(dview, off, [Uint32Array, 4], false);
         break;
 
     case TYPE_MAT_U64:
-        [obj, nread] = __loadsmat(bytes, [BigUint64Array, "getBigUint64", 8], false);
+        [obj, nread] = __loadsmat(dview, off, [BigUint64Array, 8], false);
 
         if (obj.array.every((i) => i <= BigInt(Number.MAX_SAFE_INTEGER))) {
-            let array = new Float64Array.from(Array.from(obj.array).map(Number));
+            let array = Float64Array.from(obj.array, Number);
             obj = new NDArray(obj.order, obj.shape, array, obj.complex);
         }
 
         break;
 
     case TYPE_MAT_SINGLE:
-        [obj, nread] = __loadsmat(bytes, [Float32Array, "getFloat32", 4], false);
+        [obj, nread] = __loadsmat(dview, off, [Float32Array, 4], false);
         break;
 
     case TYPE_MAT_DOUBLE:
-        [obj, nread] = __loadsmat(bytes, [Float64Array, "getFloat64", 8], false);
+        [obj, nread] = __loadsmat(dview, off, [Float64Array, 8], false);
         break;
 
     case TYPE_MAT_COMPLEX_SINGLE:
-        [obj, nread] = __loadsmat(bytes, [Float32Array, "getFloat32", 4], true);
+        [obj, nread] = __loadsmat(dview, off, [Float32Array, 4], true);
         break;
 
     case TYPE_MAT_COMPLEX_DOUBLE:
-        [obj, nread] = __loadsmat(bytes, [Float64Array, "getFloat64", 8], true);
+        [obj, nread] = __loadsmat(dview, off, [Float64Array, 8], true);
         break;
 
     case TYPE_STRING:
         {
-            let len = dview.getUint32(0);
+            let len = dview.getUint32(off + 1);
 
-            obj = new TextDecoder().decode(bytes.slice(5, len + 5));
+            obj = DECODER.decode(new Uint8Array(dview.buffer, dview.byteOffset + off + 5, len));
             nread = len + 5;
         }
 
@@ -542,13 +584,13 @@ function __loads(bytes) {
 
     case TYPE_ARRAY:
         {
-            let len = dview.getUint32(0);
+            let len = dview.getUint32(off + 1);
 
             obj = [];
             nread = 5;
 
             for (let i = 0; i < len; i++) {
-                let [elem, elem_siz] = __loads(bytes.slice(nread));
+                let [elem, elem_siz] = __loads(dview, off + nread);
 
                 obj.push(elem);
                 nread += elem_siz;
@@ -559,16 +601,16 @@ function __loads(bytes) {
 
     case TYPE_ASSOCARRAY:
         {
-            let len = dview.getUint32(0);
+            let len = dview.getUint32(off + 1);
 
             obj = {};
             nread = 5;
 
             for (let i = 0; i < len; i++) {
-                let [key, key_siz] = __loads(bytes.slice(nread));
+                let [key, key_siz] = __loads(dview, off + nread);
                 nread += key_siz;
 
-                let [val, val_siz] = __loads(bytes.slice(nread));
+                let [val, val_siz] = __loads(dview, off + nread);
                 nread += val_siz;
 
                 obj[key] = val;
@@ -584,8 +626,10 @@ function __loads(bytes) {
     return [obj, nread];
 }
 
+// Takes an ArrayBuffer or a view of one, which is decoded in place
 function dimebloads(bytes) {
-    let [obj, nread] = __loads(bytes);
+    let dview = ArrayBuffer.isView(bytes) ? new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength) : new DataView(bytes);
+    let [obj, nread] = __loads(dview, 0);
 
     return obj;
 }
@@ -734,15 +778,125 @@ function dimebdumps(obj) {
     return bytes;
 }
 
+// Opcodes of the commands in the DiME v2 header
+const OPCODES = {
+    handshake: 1,
+    join: 2,
+    leave: 3,
+    send: 4,
+    broadcast: 5,
+    sync: 6,
+    wait: 7,
+    devices: 8
+};
+
+// The URL of this script, for starting Workers from it
+const SCRIPT = (typeof document !== "undefined" && document.currentScript) ? document.currentScript.src : null;
+
+// Makes NDArrays and Complexes survive being posted to or from a Worker
+function __pack(obj, transfer = null) {
+    if (obj instanceof NDArray) {
+        if (transfer) {
+            transfer.add(obj.array.buffer);
+        }
+
+        return {
+            __dime_type: "matrix",
+            order: obj.order,
+            shape: obj.shape,
+            array: obj.array,
+            complex: obj.complex
+        };
+    } else if (obj instanceof Complex) {
+        return {
+            __dime_type: "complex",
+            real: obj.real,
+            imag: obj.imag
+        };
+    } else if (Array.isArray(obj)) {
+        return obj.map((x) => __pack(x, transfer));
+    } else if (obj && typeof obj === "object" && !ArrayBuffer.isView(obj)) {
+        let ret = {};
+
+        for (let [key, value] of Object.entries(obj)) {
+            ret[key] = __pack(value, transfer);
+        }
+
+        return ret;
+    }
+
+    return obj;
+}
+
+function __unpack(obj) {
+    if (Array.isArray(obj)) {
+        return obj.map(__unpack);
+    } else if (obj && typeof obj === "object" && !ArrayBuffer.isView(obj)) {
+        if (obj.__dime_type === "matrix") {
+            return new NDArray(obj.order, obj.shape, obj.array, obj.complex);
+        } else if (obj.__dime_type === "complex") {
+            return new Complex(obj.real, obj.imag);
+        }
+
+        let ret = {};
+
+        for (let [key, value] of Object.entries(obj)) {
+            ret[key] = __unpack(value);
+        }
+
+        return ret;
+    }
+
+    return obj;
+}
+
 class DimeClient {
-    constructor(hostname, port) {
+    constructor(hostname, port, options = {}) {
         const self = this;
 
+        // The socket and decoding move to a Worker running this script
+        if (options.worker) {
+            this.worker = new Worker((options.worker === true) ? SCRIPT : options.worker);
+            this.workspace = {};
+            this.calls = new Map();
+            this.callid = 0;
+
+            this.worker.onmessage = function(event) {
+                let {id, result, error} = event.data;
+                let [resolve, reject] = self.calls.get(id);
+
+                self.calls.delete(id);
+
+                if (error !== undefined) {
+                    reject(error);
+                } else {
+                    resolve(__unpack(result));
+                }
+            };
+
+            this.worker.onerror = function(event) {
+                for (let [resolve, reject] of self.calls.values()) {
+                    reject(event.message);
+                }
+
+                self.calls.clear();
+            };
+
+            this.connected = this.__call("connect", [hostname, port]);
+
+            return;
+        }
+
+        this.worker = null;
         this.ws = null;
         this.workspace = {};
         this.serialization = "json";
         this.recvbuffer = new ArrayBuffer(0);
+        this.recvoffset = 0;
         this.recvcallback = null;
+        this.version = 1;
+        this.seq = 0;
+        this.groups = new Map();
 
         this.loads = function() {};
         this.dumps = function() {};
@@ -752,17 +906,22 @@ class DimeClient {
             self.ws.binaryType = "arraybuffer";
 
             self.ws.onmessage = function(event) {
-                if (self.recvbuffer.byteLength > 0) {
-                    let tmp = new Uint8Array(self.recvbuffer.byteLength + event.data.byteLength);
+                let remaining = self.recvbuffer.byteLength - self.recvoffset;
+
+                // Messages already received keep views into the old buffer
+                if (remaining > 0) {
+                    let tmp = new Uint8Array(remaining + event.data.byteLength);
 
-                    tmp.set(new Uint8Array(self.recvbuffer));
-                    tmp.set(new Uint8Array(event.data), self.recvbuffer.byteLength);
+                    tmp.set(new Uint8Array(self.recvbuffer, self.recvoffset));
+                    tmp.set(new Uint8Array(event.data), remaining);
 
                     self.recvbuffer = tmp.buffer;
                 } else {
                     self.recvbuffer = event.data;
                 }
 
+                self.recvoffset = 0;
+
                 if (self.recvcallback) {
                     self.recvcallback();
                 }
@@ -772,7 +931,8 @@ class DimeClient {
                 self.__send({
                     command: "handshake",
                     serialization: self.serialization,
-                    tls: false
+                    tls: false,
+                    version: 2
                 });
 
                 self.__recv().then(function([jsondata, bindata]) {
@@ -781,6 +941,7 @@ class DimeClient {
                     }
 
                     self.serialization = jsondata.serialization;
+                    self.version = jsondata.version || 1;
 
                     // No serialization methods other than dimeb are supported (for now)
                     if (jsondata.serialization === "dimeb") {
@@ -800,7 +961,9 @@ class DimeClient {
     }
 
     close() {
-        if (this.ws) {
+        if (this.worker) {
+            this.__call("close", []).finally(() => this.worker.terminate());
+        } else if (this.ws) {
             this.ws.close();
         }
     }
@@ -811,6 +974,10 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("join", names);
+        }
+
         this.__send({
             command: "join",
             name: names
@@ -821,6 +988,10 @@ class DimeClient {
         if (jsondata.status < 0) {
             throw status.error;
         }
+
+        for (let i = 0; jsondata.handles && i < names.length; i++) {
+            this.groups.set(names[i], jsondata.handles[i]);
+        }
     }
 
     async leave(...names) {
@@ -829,6 +1000,10 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("leave", names);
+        }
+
         this.__send({
             command: "leave",
             name: names
@@ -857,22 +1032,36 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("send_r", [name, kvpairs]);
+        }
+
         for (let [varname, value] of Object.entries(kvpairs)) {
             let jsondata = {
                 command: "send",
-                name: name,
                 varname: varname,
                 serialization: this.serialization
             };
 
+            // Groups with a known handle are addressed by it in DiME v2
+            let group = (this.version >= 2 && this.groups.get(name)) || 0;
+
+            if (group === 0) {
+                jsondata.name = name;
+            }
+
             let bindata = this.dumps(value);
 
-            this.__send(jsondata, bindata);
+            this.__send(jsondata, bindata, group);
             [jsondata, bindata] = await this.__recv();
 
             if (jsondata.status < 0) {
                 throw jsondata.error;
             }
+
+            if (jsondata.group) {
+                this.groups.set(name, jsondata.group);
+            }
         }
     }
 
@@ -892,6 +1081,10 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("broadcast_r", [kvpairs]);
+        }
+
         for (let [varname, value] of Object.entries(kvpairs)) {
             let jsondata = {
                 command: "broadcast",
@@ -920,6 +1113,10 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("sync_r", [n]);
+        }
+
         this.__send({
             command: "sync",
             n: n
@@ -939,17 +1136,32 @@ class DimeClient {
                 break;
             }
 
+            let loads;
+
             if (jsondata.serialization === "dimeb") {
-                ret[jsondata.varname] = dimebloads(bindata);
+                loads = dimebloads;
             } else if (jsondata.serialization === "json") {
-                ret[jsondata.varname] = jsonloads(bindata);
+                loads = jsonloads;
             } else {
                 m--;
+                continue;
+            }
+
+            // Batches carry several variables, their binary data concatenated
+            if ("varnames" in jsondata) {
+                let off = 0;
+
+                for (let i = 0; i < jsondata.varnames.length; i++) {
+                    ret[jsondata.varnames[i]] = loads(bindata.subarray(off, off + jsondata.lengths[i]));
+                    off += jsondata.lengths[i];
+                }
+            } else {
+                ret[jsondata.varname] = loads(bindata);
             }
         }
 
         if (n > 0 && m < n) {
-            Object.assign(ret, await self.sync_r(n - m));
+            Object.assign(ret, await this.sync_r(n - m));
         }
 
         return ret;
@@ -961,6 +1173,10 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("wait", []);
+        }
+
         this.__send({command: "wait"})
 
         let [jsondata, bindata] = await this.__recv();
@@ -978,6 +1194,10 @@ class DimeClient {
             this.connected = null;
         }
 
+        if (this.worker) {
+            return this.__call("devices", []);
+        }
+
         this.__send({command: "devices"})
 
         let [jsondata, bindata] = await this.__recv();
@@ -989,21 +1209,77 @@ class DimeClient {
         return jsondata.devices;
     }
 
-    __send(jsondata, bindata = new ArrayBuffer(0)) {
+    async stats() {
+        if (this.connected) {
+            await this.connected;
+            this.connected = null;
+        }
+
+        if (this.worker) {
+            return this.__call("stats", []);
+        }
+
+        this.__send({command: "stats"})
+
+        let [jsondata, bindata] = await this.__recv();
+
+        if (jsondata.status < 0) {
+            throw jsondata.error;
+        }
+
+        delete jsondata.status;
+
+        return jsondata;
+    }
+
+    __call(method, args) {
+        const self = this;
+        const id = ++this.callid;
+
+        return new Promise(function(resolve, reject) {
+            self.calls.set(id, [resolve, reject]);
+            self.worker.postMessage({id, method, args: __pack(args)});
+        });
+    }
+
+    __send(jsondata, bindata = new ArrayBuffer(0), group = 0) {
         //console.log("-> " + JSON.stringify(jsondata));
 
+        let opcode = 0;
+
+        // The command moves into the header in DiME v2
+        if (this.version >= 2) {
+            let command;
+
+            ({command, ...jsondata} = jsondata);
+            opcode = OPCODES[command];
+        }
+
         jsondata = new TextEncoder().encode(JSON.stringify(jsondata));
         bindata = new Uint8Array(bindata);
 
-        let msg = new Uint8Array(12 + jsondata.length + bindata.length);
+        let header_len = (opcode > 0) ? 24 : 12;
+        let msg = new Uint8Array(header_len + jsondata.length + bindata.length);
         let dview = new DataView(msg.buffer);
 
-        dview.setUint32(0, 0x44694D45); // ASCII for "DiME"
-        dview.setUint32(4, jsondata.length);
-        dview.setUint32(8, bindata.length);
+        if (opcode > 0) {
+            // Sequence number 0 is left for messages the server sends unprompted
+            this.seq = this.seq % 0xFFFFFFFF + 1;
 
-        msg.set(jsondata, 12);
-        msg.set(bindata, 12 + jsondata.length);
+            dview.setUint32(0, 0x44694D32); // ASCII for "DiM2"
+            dview.setUint8(4, opcode);
+            dview.setUint32(8, group);
+            dview.setUint32(12, this.seq);
+            dview.setUint32(16, jsondata.length);
+            dview.setUint32(20, bindata.length);
+        } else {
+            dview.setUint32(0, 0x44694D45); // ASCII for "DiME"
+            dview.setUint32(4, jsondata.length);
+            dview.setUint32(8, bindata.length);
+        }
+
+        msg.set(jsondata, header_len);
+        msg.set(bindata, header_len + jsondata.length);
 
         this.ws.send(msg.buffer);
     }
@@ -1013,27 +1289,49 @@ class DimeClient {
 
         return new Promise(function(resolve, reject) {
             let callback = function() {
-                if (self.recvbuffer.byteLength >= 12) {
-                    let dview = new DataView(self.recvbuffer);
+                let avail = self.recvbuffer.byteLength - self.recvoffset;
+
+                if (avail >= 12) {
+                    let dview = new DataView(self.recvbuffer, self.recvoffset);
 
                     let magic = dview.getUint32(0);
-                    let jsondata_len = dview.getUint32(4);
-                    let bindata_len = dview.getUint32(8);
+                    let header_len = 12;
 
-                    if (magic != 0x44694D45) { // ASCII for "DiME"
+                    if (magic == 0x44694D32 && self.version >= 2) { // ASCII for "DiM2"
+                        if (avail < 24) {
+                            return;
+                        }
+
+                        // No flags apply to WebSocket clients
+                        if (dview.getUint8(5) != 0) {
+                            self.recvcallback = null;
+                            reject("Bad header flags");
+
+                            return;
+                        }
+
+                        header_len = 24;
+                    } else if (magic != 0x44694D45) { // ASCII for "DiME"
                         self.recvcallback = null;
                         reject("Bad magic value");
+
+                        return;
                     }
 
-                    if (self.recvbuffer.byteLength >= 12 + jsondata_len + bindata_len) {
-                        let jsondata = self.recvbuffer.slice(12, 12 + jsondata_len);
-                        let bindata = self.recvbuffer.slice(12 + jsondata_len, 12 + jsondata_len + bindata_len);
+                    let jsondata_len = dview.getUint32(header_len - 8);
+                    let bindata_len = dview.getUint32(header_len - 4);
+                    let msg_len = header_len + jsondata_len + bindata_len;
+
+                    if (avail >= msg_len) {
+                        let pos = self.recvoffset + header_len;
+                        let jsondata = new Uint8Array(self.recvbuffer, pos, jsondata_len);
+                        let bindata = new Uint8Array(self.recvbuffer, pos + jsondata_len, bindata_len);
 
-                        //console.log("<- " + new TextDecoder().decode(jsondata));
+                        //console.log("<- " + DECODER.decode(jsondata));
 
-                        jsondata = JSON.parse(new TextDecoder().decode(jsondata));
+                        jsondata = JSON.parse(DECODER.decode(jsondata));
 
-                        self.recvbuffer = self.recvbuffer.slice(12 + jsondata_len + bindata_len);
+                        self.recvoffset += msg_len;
                         self.recvcallback = null;
 
                         resolve([jsondata, bindata]);
@@ -1047,6 +1345,39 @@ class DimeClient {
     }
 }
 
+// Serves a DimeClient on the page when this script runs as its Worker
+if (typeof WorkerGlobalScope !== "undefined" && globalThis instanceof WorkerGlobalScope) {
+    let client = null;
+
+    globalThis.onmessage = async function(event) {
+        let {id, method, args} = event.data;
+
+        try {
+            let result;
+            let transfer = new Set();
+
+            if (method === "connect") {
+                client = new DimeClient(...args);
+
+                await client.connected;
+                client.connected = null;
+            } else {
+                result = __pack(await client[method](...__unpack(args)), transfer);
+            }
+
+            // Transferring the receive buffer would take unread data with it
+            if (client && transfer.has(client.recvbuffer)) {
+                client.recvbuffer = client.recvbuffer.slice(client.recvoffset);
+                client.recvoffset = 0;
+            }
+
+            globalThis.postMessage({id, result}, Array.from(transfer));
+        } catch (error) {
+            globalThis.postMessage({id, error: String(error)});
+        }
+    };
+}
+
 return {
     dimebloads,
     dimebdumps,
@@ -28,6 +28,16 @@ classdef dime < handle
         send_ll       % Low-level send function
         recv_ll       % Low-level receive function
         close_ll      % Low-level close function
+        sendshm_ll    % Low-level send function passing binary data in shared memory
+        recvshm_ll    % Low-level receive function accepting file descriptors
+        shm           % Whether binary data may be passed in shared memory
+        fds           % Received file descriptors not yet claimed by a message
+        version       % DiME protocol version granted by the server
+        seq           % Sequence number of the last message sent in DiME v2
+        groups        % Handles of the groups known to the server, by name
+        delta         % Whether variables are sent as deltas against their previous value
+        sent          % Binary data last sent of each variable, by group and variable name
+        received      % Binary data last received of each variable, by name
     end
 
     methods
@@ -44,6 +54,14 @@ classdef dime < handle
             %   additional arguments: the hostname and port of the TCP socket
             %   to connect to, in that order.
             %
+            % Either may be followed by the name-value pair 'shm', true to
+            % pass large variables in shared memory instead of over the
+            % socket. This is only possible over 'ipc' on Linux, and
+            % silently falls back to the socket otherwise. The name-value
+            % pair 'delta', true sends variables that were sent to the same
+            % group before as deltas against their previous value, where that
+            % is smaller.
+            %
             % Parameters
             % ----------
             % proto : {'ipc', 'tcp'}
@@ -62,6 +80,30 @@ classdef dime < handle
                 varargin = {'/tmp/dime.sock'};
             end
 
+            shm = false;
+            delta = false;
+
+            while numel(varargin) >= 2 && ischar(varargin{end - 1}) && any(strcmp(varargin{end - 1}, {'shm', 'delta'}))
+                switch varargin{end - 1}
+                case 'shm'
+                    shm = varargin{end};
+
+                case 'delta'
+                    delta = varargin{end};
+                end
+
+                varargin = varargin(1:(end - 2));
+            end
+
+            obj.shm = false;
+            obj.fds = int64.empty;
+            obj.version = 1;
+            obj.seq = uint32(0);
+            obj.groups = containers.Map('KeyType', 'char', 'ValueType', 'double');
+            obj.delta = delta;
+            obj.sent = containers.Map('KeyType', 'char', 'ValueType', 'any');
+            obj.received = containers.Map('KeyType', 'char', 'ValueType', 'any');
+
             switch (proto)
             case {'ipc', 'unix'}
                 conn = sunconnect(varargin{:});
@@ -69,6 +111,8 @@ classdef dime < handle
                 obj.send_ll = @(msg) sunsend(conn, msg);
                 obj.recv_ll = @(n) sunrecv(conn, n);
                 obj.close_ll = @() sunclose(conn);
+                obj.sendshm_ll = @(msg, bindata) sunsendshm(conn, msg, bindata);
+                obj.recvshm_ll = @(n) sunrecvshm(conn, n);
 
             case 'tcp'
                 conn = tcpclient(varargin{:});
@@ -88,6 +132,8 @@ classdef dime < handle
                         obj.send_ll = @(msg) sunsend(conn, msg);
                         obj.recv_ll = @(n) sunrecv(conn, n);
                         obj.close_ll = @() sunclose(conn);
+                        obj.sendshm_ll = @(msg, bindata) sunsendshm(conn, msg, bindata);
+                        obj.recvshm_ll = @(n) sunrecvshm(conn, n);
 
                     case 'tcp'
                         conn = tcpclient(match.hostname, str2num(match.port(2:length(match.port))));
@@ -104,6 +150,11 @@ classdef dime < handle
             jsondata.command = 'handshake';
             jsondata.serialization = 'matlab';
             jsondata.tls = false;
+            jsondata.version = 2;
+
+            if shm && isunix() && ~ismac() && ~isempty(obj.recvshm_ll)
+                jsondata.shm = true;
+            end
 
             sendmsg(obj, jsondata, uint8.empty);
             [jsondata, ~] = recvmsg(obj);
@@ -112,6 +163,12 @@ classdef dime < handle
                 error(jsondata.error);
             end
 
+            obj.shm = isfield(jsondata, 'shm') && jsondata.shm;
+
+            if isfield(jsondata, 'version')
+                obj.version = jsondata.version;
+            end
+
             obj.serialization = jsondata.serialization;
         end
 
@@ -154,6 +211,12 @@ classdef dime < handle
             if jsondata.status < 0
                 error(jsondata.error);
             end
+
+            if isfield(jsondata, 'handles')
+                for i = 1:length(varargin)
+                    obj.groups(varargin{i}) = jsondata.handles(i);
+                end
+            end
         end
 
         function [] = leave(obj, varargin)
@@ -254,10 +317,18 @@ classdef dime < handle
                 for j = i:min(i + 16, length(k))
                     jsondata = struct();
                     jsondata.command = 'send';
-                    jsondata.name = name;
                     jsondata.varname = k{j};
                     jsondata.serialization = obj.serialization;
 
+                    % Groups with a known handle are addressed by it in DiME v2
+                    group = 0;
+
+                    if obj.version >= 2 && isKey(obj.groups, name)
+                        group = obj.groups(name);
+                    else
+                        jsondata.name = name;
+                    end
+
                     switch obj.serialization
                     case 'matlab'
                         bindata = getByteStreamFromArray(v.(k{j}));
@@ -266,7 +337,11 @@ classdef dime < handle
                         bindata = dimebdumps(v.(k{j}));
                     end
 
-                    sendmsg(obj, jsondata, bindata);
+                    if obj.delta
+                        [jsondata.delta, bindata] = senddelta(obj, name, k{j}, bindata);
+                    end
+
+                    sendmsg(obj, jsondata, bindata, group);
 
                     n = n + 1;
                 end
@@ -275,8 +350,21 @@ classdef dime < handle
                     [jsondata, bindata] = recvmsg(obj);
 
                     if jsondata.status < 0
+                        % The server may not have the values to apply later deltas to
+                        for l = i:min(i + 16, length(k))
+                            key = [name newline k{l}];
+
+                            if isKey(obj.sent, key)
+                                remove(obj.sent, key);
+                            end
+                        end
+
                         error(jsondata.error);
                     end
+
+                    if isfield(jsondata, 'group')
+                        obj.groups(name) = jsondata.group;
+                    end
                 end
 
 
@@ -441,23 +529,41 @@ classdef dime < handle
             while true
                 [jsondata, bindata] = recvmsg(obj);
 
-                if ~isfield(jsondata, 'varname')
+                if isfield(jsondata, 'varnames')
+                    % Batches carry several variables, their binary data concatenated
+                    varnames = cellstr(jsondata.varnames);
+                    ends = cumsum(jsondata.lengths);
+                    datas = cell(size(varnames));
+
+                    for i = 1:length(varnames)
+                        datas{i} = bindata((ends(i) - jsondata.lengths(i) + 1):ends(i));
+                    end
+                elseif isfield(jsondata, 'varname')
+                    varnames = {jsondata.varname};
+                    datas = {bindata};
+
+                    if isfield(jsondata, 'delta')
+                        datas = {recvdelta(obj, jsondata.varname, jsondata.delta, bindata)};
+                    end
+                else
                     break;
                 end
 
                 switch jsondata.serialization
                 case 'matlab'
-                    x = getArrayFromByteStream(bindata);
+                    loads = @getArrayFromByteStream;
 
                 case 'dimeb'
-                    x = dimebloads(bindata);
+                    loads = @dimebloads;
 
                 otherwise
                     m = m - 1;
                     continue
                 end
 
-                v.(jsondata.varname) = x;
+                for i = 1:length(varnames)
+                    v.(varnames{i}) = loads(datas{i});
+                end
             end
 
             if n > 0 && m < n
@@ -536,7 +642,38 @@ classdef dime < handle
             end
         end
 
-        function [] = sendmsg(obj, json, bindata)
+        function [counters] = stats(obj)
+            % send Send a "stats" command to the server
+            %
+            % Tell the server to send this client its counters, for the
+            % server as a whole, for each connected client and for each
+            % nonempty group.
+            %
+            % Parameters
+            % ----------
+            % obj : dime
+            %     The dime instance.
+            %
+            % Returns
+            % -------
+            % struct
+            %     The counters, in the fields server, clients and groups.
+
+            jsondata = struct();
+            jsondata.command = 'stats';
+
+            sendmsg(obj, jsondata, uint8.empty);
+
+            [jsondata, ~] = recvmsg(obj);
+
+            if jsondata.status < 0
+                error(jsondata.error);
+            else
+                counters = rmfield(jsondata, 'status');
+            end
+        end
+
+        function [] = sendmsg(obj, json, bindata, group)
             % Send a raw DiME message over the socket
             %
             % Parameters
@@ -549,9 +686,26 @@ classdef dime < handle
             %
             % bindata : uint8
             %     Binary portion of the message to send
+            %
+            % group : double, optional
+            %     Handle of the recipient group, for the DiME v2 header
 
             [~, ~, endianness] = computer;
 
+            if nargin < 4
+                group = 0;
+            end
+
+            group = uint32(group);
+
+            % The command moves into the header in DiME v2
+            opcode = uint8(0);
+
+            if obj.version >= 2 && isstruct(json) && isfield(json, 'command')
+                opcode = uint8(find(strcmp(json.command, {'handshake', 'join', 'leave', 'send', 'broadcast', 'sync', 'wait', 'devices'})));
+                json = rmfield(json, 'command');
+            end
+
             json = uint8(jsonencode(json));
 
             json_len = uint32(length(json));
@@ -563,9 +717,31 @@ classdef dime < handle
                 bindata_len = swapbytes(bindata_len);
             end
 
-            header = [uint8('DiME') typecast(json_len, 'uint8') typecast(bindata_len, 'uint8')];
+            % Large binary data goes in shared memory, if enabled
+            shm = obj.shm && length(bindata) >= 65536;
+
+            if opcode > 0
+                % Sequence number 0 is left for messages the server sends unprompted
+                obj.seq = mod(obj.seq, intmax('uint32')) + 1;
+                seq = obj.seq;
 
-            obj.send_ll([header json bindata]);
+                if endianness == 'L'
+                    seq = swapbytes(seq);
+                    group = swapbytes(group);
+                end
+
+                header = [uint8('DiM2') opcode uint8(shm) uint8([0 0]) typecast(group, 'uint8') typecast(seq, 'uint8') typecast(json_len, 'uint8') typecast(bindata_len, 'uint8')];
+            elseif shm
+                header = [uint8('DiMS') typecast(json_len, 'uint8') typecast(bindata_len, 'uint8')];
+            else
+                header = [uint8('DiME') typecast(json_len, 'uint8') typecast(bindata_len, 'uint8')];
+            end
+
+            if shm
+                obj.sendshm_ll([header json], bindata);
+            else
+                obj.send_ll([header json bindata]);
+            end
 
             %disp(['-> ' char(json)]);
         end
@@ -588,10 +764,24 @@ classdef dime < handle
 
             [~, ~, endianness] = computer;
 
-            header = obj.recv_ll(12);
+            header = recvraw(obj, 12);
 
-            if header(1:4) ~= uint8('DiME')
-                error('Invalid DiME message');
+            if obj.version >= 2 && all(header(1:4) == uint8('DiM2'))
+                header = [header recvraw(obj, 12)];
+
+                % Only the shared memory flag may be set, if enabled
+                if header(6) > 1 || (header(6) == 1 && ~obj.shm)
+                    error('Invalid DiME message');
+                end
+
+                shm = (header(6) == 1);
+                header = [header(1:4) header(17:24)];
+            else
+                shm = obj.shm && all(header(1:4) == uint8('DiMS'));
+
+                if ~shm && any(header(1:4) ~= uint8('DiME'))
+                    error('Invalid DiME message');
+                end
             end
 
             json_len = typecast(header(5:8), 'uint32');
@@ -603,11 +793,22 @@ classdef dime < handle
                 bindata_len = swapbytes(bindata_len);
             end
 
-            % Faster to get both in one syscall
-            msg = obj.recv_ll(json_len + bindata_len);
+            if shm
+                msg = recvraw(obj, json_len);
+
+                if isempty(obj.fds)
+                    error('Missing file descriptor for shared memory');
+                end
+
+                bindata = shmread(obj.fds(1), bindata_len);
+                obj.fds = obj.fds(2:end);
+            else
+                % Faster to get both in one syscall
+                msg = recvraw(obj, json_len + bindata_len);
+                bindata = msg((json_len + 1):end);
+            end
 
             json = jsondecode(char(msg(1:json_len)));
-            bindata = msg((json_len + 1):end);
 
             if isfield(json, 'status') && json.status > 0 && isfield(json, 'meta') && json.meta
                 metamsg(obj, json);
@@ -617,6 +818,51 @@ classdef dime < handle
             %disp(['<- ' char(msg(1:json_len))]);
         end
 
+        function [delta, bindata] = senddelta(obj, name, varname, bindata)
+            % Encode binary data as a delta against that last sent, where smaller
+            key = [name newline varname];
+            prev = [];
+
+            if isKey(obj.sent, key)
+                prev = obj.sent(key);
+            end
+
+            obj.sent(key) = bindata;
+            delta = false;
+
+            if ~isempty(prev) && length(prev) == length(bindata)
+                d = dimebdelta(prev, bindata);
+
+                if length(d) < length(bindata)
+                    delta = true;
+                    bindata = d;
+                end
+            end
+        end
+
+        function [bindata] = recvdelta(obj, varname, delta, bindata)
+            % Apply a received delta to the binary data last received
+            if delta
+                if ~isKey(obj.received, varname)
+                    error('Received a delta of %s without its previous value', varname);
+                end
+
+                bindata = dimebpatch(obj.received(varname), bindata);
+            end
+
+            obj.received(varname) = bindata;
+        end
+
+        function [data] = recvraw(obj, n)
+            % Receive bytes, keeping any file descriptors passed with them
+            if obj.shm
+                [data, fds] = obj.recvshm_ll(n);
+                obj.fds = [obj.fds fds];
+            else
+                data = obj.recv_ll(n);
+            end
+        end
+
         function [] = metamsg(obj, json)
             if isfield(json, 'serialization')
                 obj.serialization = json.serialization;
@@ -0,0 +1,164 @@
+#ifndef DIMEB_H
+#define DIMEB_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mex.h"
+
+/* Boolean sentinels */
+#define TYPE_NULL  0x00
+#define TYPE_TRUE  0x01
+#define TYPE_FALSE 0x02
+
+/* Scalar types */
+#define TYPE_I8  0x03
+#define TYPE_I16 0x04
+#define TYPE_I32 0x05
+#define TYPE_I64 0x06
+#define TYPE_U8  0x07
+#define TYPE_U16 0x08
+#define TYPE_U32 0x09
+#define TYPE_U64 0x0A
+
+#define TYPE_SINGLE         0x0B
+#define TYPE_DOUBLE         0x0C
+#define TYPE_COMPLEX_SINGLE 0x0D
+#define TYPE_COMPLEX_DOUBLE 0x0E
+
+/* Matrix types are 0x10 | the scalar type */
+#define TYPE_MAT 0x10
+
+/* Other types */
+#define TYPE_STRING     0x20
+#define TYPE_ARRAY      0x21
+#define TYPE_ASSOCARRAY 0x22
+
+/* Nesting limit, to stay well clear of the end of the stack */
+#define DIMEB_MAXDEPTH 2048
+
+/* Returns the real scalar type of a numeric class, or -1 */
+static inline int dimeb_type(mxClassID id) {
+    switch (id) {
+    case mxINT8_CLASS:
+        return TYPE_I8;
+
+    case mxINT16_CLASS:
+        return TYPE_I16;
+
+    case mxINT32_CLASS:
+        return TYPE_I32;
+
+    case mxINT64_CLASS:
+        return TYPE_I64;
+
+    case mxUINT8_CLASS:
+        return TYPE_U8;
+
+    case mxUINT16_CLASS:
+        return TYPE_U16;
+
+    case mxUINT32_CLASS:
+        return TYPE_U32;
+
+    case mxUINT64_CLASS:
+        return TYPE_U64;
+
+    case mxSINGLE_CLASS:
+        return TYPE_SINGLE;
+
+    case mxDOUBLE_CLASS:
+        return TYPE_DOUBLE;
+
+    default:
+        return -1;
+    }
+}
+
+/* Inverse of dimeb_type */
+static inline mxClassID dimeb_class(int type) {
+    static const mxClassID CLASSES[] = {
+        mxINT8_CLASS, mxINT16_CLASS, mxINT32_CLASS, mxINT64_CLASS,
+        mxUINT8_CLASS, mxUINT16_CLASS, mxUINT32_CLASS, mxUINT64_CLASS,
+        mxSINGLE_CLASS, mxDOUBLE_CLASS
+    };
+
+    return CLASSES[type - TYPE_I8];
+}
+
+/* Size of a real scalar type */
+static inline size_t dimeb_itemsize(int type) {
+    static const size_t SIZES[] = {1, 2, 4, 8, 1, 2, 4, 8, 4, 8};
+
+    return SIZES[type - TYPE_I8];
+}
+
+static inline void dimeb_put_u32(unsigned char *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static inline uint32_t dimeb_get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * Copies n items of the given size, converting between host and big-endian
+ * byte order. Works in either direction.
+ */
+static inline void dimeb_copy_be(void *dst, const void *src, size_t n, size_t itemsize) {
+    const uint16_t one = 1;
+    unsigned char *p = dst;
+
+    if (n == 0) {
+        return;
+    }
+
+    memcpy(dst, src, n * itemsize);
+
+    if (*(const unsigned char *)&one == 0) {
+        return;
+    }
+
+    /* Fixed-size loops, which compilers turn into vector byte shuffles */
+    switch (itemsize) {
+    case 2:
+        for (size_t i = 0; i < n; i++) {
+            uint16_t x;
+
+            memcpy(&x, p + 2 * i, 2);
+            x = (uint16_t)((x >> 8) | (x << 8));
+            memcpy(p + 2 * i, &x, 2);
+        }
+
+        break;
+
+    case 4:
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x;
+
+            memcpy(&x, p + 4 * i, 4);
+            x = (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+            memcpy(p + 4 * i, &x, 4);
+        }
+
+        break;
+
+    case 8:
+        for (size_t i = 0; i < n; i++) {
+            uint64_t x;
+
+            memcpy(&x, p + 8 * i, 8);
+            x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+            x = ((x & 0x0000FFFF0000FFFFULL) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+            x = (x << 32) | (x >> 32);
+            memcpy(p + 8 * i, &x, 8);
+        }
+
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,49 @@
+function [bytes] = dimebdelta(old, new)
+    % Encode a value as the changes from another of the same length
+    %
+    % The result is the length of the value, followed by runs of changed
+    % bytes, each an offset, a length and the bytes themselves, all
+    % integers being unsigned, 32-bit and big-endian.
+
+    % Unchanged bytes shorter than a run header are sent as part of a run
+    GAP = 8;
+
+    if length(old) ~= length(new)
+        error('Deltas need values of the same length');
+    end
+
+    old = reshape(uint8(old), 1, []);
+    new = reshape(uint8(new), 1, []);
+
+    changed = find(old ~= new);
+
+    if isempty(changed)
+        bytes = u32(length(new));
+        return;
+    end
+
+    breaks = find(diff(changed) > GAP);
+    starts = [changed(1) changed(breaks + 1)];
+    ends = [changed(breaks) changed(end)];
+
+    parts = cell(1, length(starts) + 1);
+    parts{1} = u32(length(new));
+
+    for i = 1:length(starts)
+        parts{i + 1} = [u32(starts(i) - 1) u32(ends(i) - starts(i) + 1) new(starts(i):ends(i))];
+    end
+
+    bytes = [parts{:}];
+end
+
+function [bytes] = u32(n)
+    [~, ~, ENDIANNESS] = computer;
+
+    n = uint32(n);
+
+    if ENDIANNESS == 'L'
+        n = swapbytes(n);
+    end
+
+    bytes = typecast(n, 'uint8');
+end
@@ -0,0 +1,278 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "mex.h"
+
+#include "dimeb.h"
+
+/*
+ * Compiled version of dimebdumps.m, which MATLAB prefers over it when both
+ * are on the path
+ */
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+} dimeb_writer_t;
+
+static void dimeb_dump(dimeb_writer_t *w, const mxArray *obj, unsigned int depth);
+
+/* Reserves n bytes of output, returning where to write them */
+static unsigned char *dimeb_reserve(dimeb_writer_t *w, size_t n) {
+    unsigned char *p;
+
+    if (w->len + n > w->cap) {
+        size_t cap = w->cap;
+
+        while (w->len + n > cap) {
+            cap = (cap * 3) / 2;
+        }
+
+        p = mxRealloc(w->buf, cap);
+        if (p == NULL) {
+            mexErrMsgTxt("Out of memory");
+        }
+
+        w->buf = p;
+        w->cap = cap;
+    }
+
+    p = w->buf + w->len;
+    w->len += n;
+
+    return p;
+}
+
+/* Writes a type byte followed by a 32-bit size */
+static void dimeb_dump_header(dimeb_writer_t *w, int type, size_t n) {
+    unsigned char *p;
+
+    if (n > UINT32_MAX) {
+        mexErrMsgTxt("Too large for dimeb");
+    }
+
+    p = dimeb_reserve(w, 5);
+    p[0] = type;
+    dimeb_put_u32(p + 1, n);
+}
+
+/* Calls a MATLAB function of one argument */
+static mxArray *dimeb_call(const char *fn, const mxArray *obj) {
+    mxArray *in = (mxArray *)obj, *out;
+
+    mexCallMATLAB(1, &out, 1, &in, fn);
+
+    return out;
+}
+
+static void dimeb_dump_num(dimeb_writer_t *w, const mxArray *obj) {
+    int type = dimeb_type(mxGetClassID(obj));
+    size_t itemsize = dimeb_itemsize(type);
+    size_t n = mxGetNumberOfElements(obj);
+    int complex = mxIsComplex(obj);
+    size_t nbytes = n * itemsize * (complex ? 2 : 1);
+    unsigned char *p;
+
+    if (complex) {
+        type += TYPE_COMPLEX_SINGLE - TYPE_SINGLE;
+    }
+
+    if (n == 1) {
+        p = dimeb_reserve(w, 1 + nbytes);
+        *p++ = type;
+    } else {
+        mwSize rank = mxGetNumberOfDimensions(obj);
+        const mwSize *shape = mxGetDimensions(obj);
+
+        if (rank > 255) {
+            mexErrMsgTxt("Too many dimensions for dimeb");
+        }
+
+        p = dimeb_reserve(w, 2 + 4 * rank + nbytes);
+        *p++ = TYPE_MAT | type;
+        *p++ = rank;
+
+        for (mwSize i = 0; i < rank; i++) {
+            if (shape[i] > UINT32_MAX) {
+                mexErrMsgTxt("Too large for dimeb");
+            }
+
+            dimeb_put_u32(p, shape[i]);
+            p += 4;
+        }
+    }
+
+    if (!complex) {
+        dimeb_copy_be(p, mxGetData(obj), n, itemsize);
+    } else {
+#if MX_HAS_INTERLEAVED_COMPLEX
+        dimeb_copy_be(p, mxGetData(obj), 2 * n, itemsize);
+#else
+        const unsigned char *re = mxGetData(obj), *im = mxGetImagData(obj);
+
+        /* dimeb interleaves the real and imaginary parts */
+        for (size_t i = 0; i < n; i++) {
+            dimeb_copy_be(p + 2 * i * itemsize, re + i * itemsize, 1, itemsize);
+            dimeb_copy_be(p + (2 * i + 1) * itemsize, im + i * itemsize, 1, itemsize);
+        }
+#endif
+    }
+}
+
+/* Characters past 0xFF saturate, as in uint8(obj) */
+static void dimeb_dump_string(dimeb_writer_t *w, const mxArray *obj) {
+    size_t n = mxGetNumberOfElements(obj);
+    const mxChar *chars = mxGetChars(obj);
+    unsigned char *p;
+
+    dimeb_dump_header(w, TYPE_STRING, n);
+    p = dimeb_reserve(w, n);
+
+    for (size_t i = 0; i < n; i++) {
+        p[i] = (chars[i] > 0xFF) ? 0xFF : chars[i];
+    }
+}
+
+static void dimeb_dump_cell(dimeb_writer_t *w, const mxArray *obj, unsigned int depth) {
+    size_t n = mxGetNumberOfElements(obj);
+
+    dimeb_dump_header(w, TYPE_ARRAY, n);
+
+    for (size_t i = 0; i < n; i++) {
+        dimeb_dump(w, mxGetCell(obj, i), depth + 1);
+    }
+}
+
+/* Only the first element of a struct array is encoded, as in dimebdumps.m */
+static void dimeb_dump_struct(dimeb_writer_t *w, const mxArray *obj, unsigned int depth) {
+    int n = mxGetNumberOfFields(obj);
+
+    dimeb_dump_header(w, TYPE_ASSOCARRAY, n);
+
+    for (int i = 0; i < n; i++) {
+        const char *key = mxGetFieldNameByNumber(obj, i);
+        size_t len = strlen(key);
+
+        dimeb_dump_header(w, TYPE_STRING, len);
+        memcpy(dimeb_reserve(w, len), key, len);
+
+        dimeb_dump(w, mxGetFieldByNumber(obj, 0, i), depth + 1);
+    }
+}
+
+static void dimeb_dump_map(dimeb_writer_t *w, const mxArray *obj, unsigned int depth) {
+    mxArray *k = dimeb_call("keys", obj);
+    mxArray *v = dimeb_call("values", obj);
+    size_t n = mxGetNumberOfElements(k);
+
+    if (n == 0) {
+        *dimeb_reserve(w, 1) = TYPE_NULL;
+    } else {
+        dimeb_dump_header(w, TYPE_ASSOCARRAY, n);
+
+        for (size_t i = 0; i < n; i++) {
+            dimeb_dump(w, mxGetCell(k, i), depth + 1);
+            dimeb_dump(w, mxGetCell(v, i), depth + 1);
+        }
+    }
+
+    mxDestroyArray(v);
+    mxDestroyArray(k);
+}
+
+/* Follows the same order of checks as dimebdumps.m */
+static void dimeb_dump(dimeb_writer_t *w, const mxArray *obj, unsigned int depth) {
+    mxArray *tmp;
+
+    if (depth >= DIMEB_MAXDEPTH) {
+        mexErrMsgTxt("Too deeply nested for dimeb");
+    }
+
+    /* Unset cells and fields read as [] */
+    if (obj == NULL) {
+        *dimeb_reserve(w, 1) = TYPE_NULL;
+        return;
+    }
+
+    /* Opaque to the MEX API, so they are converted through MATLAB */
+    if (mxIsClass(obj, "string")) {
+        tmp = dimeb_call("isempty", obj);
+
+        if (mxIsLogicalScalarTrue(tmp)) {
+            *dimeb_reserve(w, 1) = TYPE_NULL;
+        } else {
+            mxDestroyArray(tmp);
+            tmp = dimeb_call("char", obj);
+            dimeb_dump_string(w, tmp);
+        }
+
+        mxDestroyArray(tmp);
+        return;
+    }
+
+    if (mxIsClass(obj, "containers.Map")) {
+        dimeb_dump_map(w, obj, depth);
+        return;
+    }
+
+    if (mxIsEmpty(obj) && !mxIsCell(obj)) {
+        *dimeb_reserve(w, 1) = TYPE_NULL;
+    } else if (mxIsLogical(obj) && mxGetNumberOfElements(obj) == 1) {
+        *dimeb_reserve(w, 1) = mxIsLogicalScalarTrue(obj) ? TYPE_TRUE : TYPE_FALSE;
+    } else if (mxIsNumeric(obj)) {
+        tmp = NULL;
+
+        if (mxIsSparse(obj)) {
+            obj = tmp = dimeb_call("full", obj);
+        }
+
+        /* Only single and double have complex dimeb types */
+        if (mxIsComplex(obj) && !mxIsSingle(obj) && !mxIsDouble(obj)) {
+            mxArray *dbl = dimeb_call("double", obj);
+
+            if (tmp != NULL) {
+                mxDestroyArray(tmp);
+            }
+
+            obj = tmp = dbl;
+        }
+
+        dimeb_dump_num(w, obj);
+
+        if (tmp != NULL) {
+            mxDestroyArray(tmp);
+        }
+    } else if (mxIsChar(obj)) {
+        dimeb_dump_string(w, obj);
+    } else if (mxIsCell(obj)) {
+        dimeb_dump_cell(w, obj, depth);
+    } else if (mxIsStruct(obj)) {
+        dimeb_dump_struct(w, obj, depth);
+    } else {
+        mexErrMsgTxt("Unsupported type for dimeb");
+    }
+}
+
+void mexFunction(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
+    dimeb_writer_t w;
+    mxArray *bytes;
+
+    if (nrhs != 1) {
+        mexErrMsgTxt("Wrong number of arguments");
+    }
+
+    w.len = 0;
+    w.cap = 64;
+    w.buf = mxMalloc(w.cap);
+
+    dimeb_dump(&w, prhs[0], 0);
+
+    /* Hands the output buffer over without copying it */
+    bytes = mxCreateNumericMatrix(0, 0, mxUINT8_CLASS, mxREAL);
+    mxSetData(bytes, w.buf);
+    mxSetM(bytes, 1);
+    mxSetN(bytes, w.len);
+
+    plhs[0] = bytes;
+}
@@ -0,0 +1,288 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "mex.h"
+
+#include "dimeb.h"
+
+/*
+ * Compiled version of dimebloads.m, which MATLAB prefers over it when both
+ * are on the path
+ */
+
+typedef struct {
+    const unsigned char *p;
+    size_t len;
+    size_t off;
+} dimeb_reader_t;
+
+static mxArray *dimeb_load(dimeb_reader_t *r, unsigned int depth);
+
+/* Ensures n more bytes are left to read */
+static void dimeb_need(const dimeb_reader_t *r, size_t n) {
+    if (r->len - r->off < n) {
+        mexErrMsgTxt("Truncated dimeb data");
+    }
+}
+
+/* Loads a scalar, or a matrix if shaped, of a real or complex type */
+static mxArray *dimeb_load_num(dimeb_reader_t *r, int type, int shaped) {
+    int complex = (type == TYPE_COMPLEX_SINGLE || type == TYPE_COMPLEX_DOUBLE);
+    int base = complex ? type - (TYPE_COMPLEX_SINGLE - TYPE_SINGLE) : type;
+    size_t itemsize = dimeb_itemsize(base) * (complex ? 2 : 1);
+    mwSize shape[255];
+    mwSize rank = 2;
+    size_t n = 1, max;
+    mxArray *obj;
+
+    shape[0] = shape[1] = 1;
+
+    if (shaped) {
+        dimeb_need(r, 2);
+        rank = r->p[r->off + 1];
+
+        dimeb_need(r, 2 + 4 * rank);
+
+        for (mwSize i = 0; i < rank; i++) {
+            shape[i] = dimeb_get_u32(r->p + r->off + 2 + 4 * i);
+        }
+
+        r->off += 2 + 4 * rank;
+
+        /* MATLAB arrays have at least two dimensions */
+        if (rank < 2) {
+            shape[1] = 1;
+
+            if (rank == 0) {
+                shape[0] = 1;
+            }
+
+            rank = 2;
+        }
+    } else {
+        r->off += 1;
+    }
+
+    max = (r->len - r->off) / itemsize;
+
+    for (mwSize i = 0; i < rank; i++) {
+        /* Also keeps the count from overflowing */
+        if (shape[i] > 0 && n > max / shape[i]) {
+            mexErrMsgTxt("Truncated dimeb data");
+        }
+
+        n *= shape[i];
+    }
+
+    obj = mxCreateNumericArray(rank, shape, dimeb_class(base), complex ? mxCOMPLEX : mxREAL);
+
+    if (!complex) {
+        dimeb_copy_be(mxGetData(obj), r->p + r->off, n, itemsize);
+    } else {
+#if MX_HAS_INTERLEAVED_COMPLEX
+        dimeb_copy_be(mxGetData(obj), r->p + r->off, 2 * n, itemsize / 2);
+#else
+        unsigned char *re = mxGetData(obj), *im = mxGetImagData(obj);
+        size_t half = itemsize / 2;
+
+        for (size_t i = 0; i < n; i++) {
+            dimeb_copy_be(re + i * half, r->p + r->off + i * itemsize, 1, half);
+            dimeb_copy_be(im + i * half, r->p + r->off + i * itemsize + half, 1, half);
+        }
+#endif
+    }
+
+    r->off += n * itemsize;
+
+    return obj;
+}
+
+/* Bytes map to characters one to one, as in char(bytes) */
+static mxArray *dimeb_load_string(dimeb_reader_t *r) {
+    mwSize shape[2];
+    mxArray *obj;
+    mxChar *chars;
+
+    dimeb_need(r, 5);
+    shape[0] = 1;
+    shape[1] = dimeb_get_u32(r->p + r->off + 1);
+    r->off += 5;
+
+    dimeb_need(r, shape[1]);
+
+    obj = mxCreateCharArray(2, shape);
+    chars = mxGetChars(obj);
+
+    for (mwSize i = 0; i < shape[1]; i++) {
+        chars[i] = r->p[r->off + i];
+    }
+
+    r->off += shape[1];
+
+    return obj;
+}
+
+static mxArray *dimeb_load_array(dimeb_reader_t *r, unsigned int depth) {
+    size_t n;
+    mxArray *obj;
+
+    dimeb_need(r, 5);
+    n = dimeb_get_u32(r->p + r->off + 1);
+    r->off += 5;
+
+    /* Every element takes at least one byte */
+    dimeb_need(r, n);
+
+    obj = (n > 0) ? mxCreateCellMatrix(1, n) : mxCreateCellMatrix(0, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        mxSetCell(obj, i, dimeb_load(r, depth + 1));
+    }
+
+    return obj;
+}
+
+/* Whether a key can be a struct field, like isvarname */
+static int dimeb_fieldname(const mxArray *key) {
+    size_t n = mxGetNumberOfElements(key);
+    const mxChar *chars;
+
+    if (!mxIsChar(key) || mxGetM(key) != 1 || n == 0 || n > 63) {
+        return 0;
+    }
+
+    chars = mxGetChars(key);
+
+    for (size_t i = 0; i < n; i++) {
+        mxChar c = chars[i];
+        int alpha = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+
+        if (!alpha && (i == 0 || !((c >= '0' && c <= '9') || c == '_'))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Decodes to a struct, or to a containers.Map if any key can't be a field */
+static mxArray *dimeb_load_assocarray(dimeb_reader_t *r, unsigned int depth) {
+    size_t n;
+    int fields = 1;
+    mxArray *k, *v, *obj;
+
+    dimeb_need(r, 5);
+    n = dimeb_get_u32(r->p + r->off + 1);
+    r->off += 5;
+
+    /* Every pair takes at least two bytes */
+    dimeb_need(r, 2 * n);
+
+    k = mxCreateCellMatrix(1, n);
+    v = mxCreateCellMatrix(1, n);
+
+    for (size_t i = 0; i < n; i++) {
+        mxSetCell(k, i, dimeb_load(r, depth + 1));
+        mxSetCell(v, i, dimeb_load(r, depth + 1));
+
+        fields = fields && dimeb_fieldname(mxGetCell(k, i));
+    }
+
+    if (fields) {
+        obj = mxCreateStructMatrix(1, 1, 0, NULL);
+
+        for (size_t i = 0; i < n; i++) {
+            char *name = mxArrayToString(mxGetCell(k, i));
+            int field = mxGetFieldNumber(obj, name);
+
+            /* Later duplicates override earlier values */
+            if (field < 0) {
+                field = mxAddField(obj, name);
+            } else {
+                mxDestroyArray(mxGetFieldByNumber(obj, 0, field));
+            }
+
+            mxSetFieldByNumber(obj, 0, field, mxGetCell(v, i));
+            mxSetCell(v, i, NULL);
+            mxFree(name);
+        }
+    } else {
+        mxArray *args[4];
+
+        args[0] = k;
+        args[1] = v;
+        args[2] = mxCreateString("UniformValues");
+        args[3] = mxCreateLogicalScalar(0);
+
+        mexCallMATLAB(1, &obj, 4, args, "containers.Map");
+
+        mxDestroyArray(args[3]);
+        mxDestroyArray(args[2]);
+    }
+
+    mxDestroyArray(v);
+    mxDestroyArray(k);
+
+    return obj;
+}
+
+static mxArray *dimeb_load(dimeb_reader_t *r, unsigned int depth) {
+    int type;
+
+    if (depth >= DIMEB_MAXDEPTH) {
+        mexErrMsgTxt("Too deeply nested for dimeb");
+    }
+
+    dimeb_need(r, 1);
+    type = r->p[r->off];
+
+    switch (type) {
+    case TYPE_NULL:
+        r->off++;
+        return mxCreateDoubleMatrix(0, 0, mxREAL);
+
+    case TYPE_TRUE:
+    case TYPE_FALSE:
+        r->off++;
+        return mxCreateLogicalScalar(type == TYPE_TRUE);
+
+    case TYPE_STRING:
+        return dimeb_load_string(r);
+
+    case TYPE_ARRAY:
+        return dimeb_load_array(r, depth);
+
+    case TYPE_ASSOCARRAY:
+        return dimeb_load_assocarray(r, depth);
+
+    default:
+        if (type >= TYPE_I8 && type <= TYPE_COMPLEX_DOUBLE) {
+            return dimeb_load_num(r, type, 0);
+        }
+
+        if ((type & ~TYPE_MAT) >= TYPE_I8 && (type & ~TYPE_MAT) <= TYPE_COMPLEX_DOUBLE && (type & TYPE_MAT)) {
+            return dimeb_load_num(r, type & ~TYPE_MAT, 1);
+        }
+
+        mexErrMsgTxt("Unknown dimeb type");
+        return NULL;
+    }
+}
+
+void mexFunction(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
+    dimeb_reader_t r;
+
+    if (nrhs != 1) {
+        mexErrMsgTxt("Wrong number of arguments");
+    }
+
+    if (mxGetClassID(prhs[0]) != mxUINT8_CLASS || mxIsComplex(prhs[0])) {
+        mexErrMsgTxt("Invalid argument");
+    }
+
+    r.p = mxGetData(prhs[0]);
+    r.len = mxGetNumberOfElements(prhs[0]);
+    r.off = 0;
+
+    plhs[0] = dimeb_load(&r, 0);
+}
@@ -0,0 +1,33 @@
+function [bytes] = dimebpatch(old, delta)
+    % Apply the changes encoded by dimebdelta to a value
+
+    old = reshape(uint8(old), 1, []);
+    delta = reshape(uint8(delta), 1, []);
+
+    if u32(delta(1:4)) ~= length(old)
+        error('Delta does not match the length of the previous value');
+    end
+
+    bytes = old;
+    i = 5;
+
+    while i <= length(delta)
+        start = u32(delta(i:(i + 3)));
+        n = u32(delta((i + 4):(i + 7)));
+
+        bytes((start + 1):(start + n)) = delta((i + 8):(i + 7 + n));
+        i = i + 8 + n;
+    end
+end
+
+function [n] = u32(bytes)
+    [~, ~, ENDIANNESS] = computer;
+
+    n = typecast(bytes, 'uint32');
+
+    if ENDIANNESS == 'L'
+        n = swapbytes(n);
+    end
+
+    n = double(n);
+end
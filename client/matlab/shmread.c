@@ -0,0 +1,44 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mex.h"
+
+/* Copies the contents of a shared memory segment and closes it */
+void mexFunction(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
+    int fd;
+    size_t n;
+    void *addr;
+    mxArray *buf;
+
+    if (nrhs != 2) {
+        mexErrMsgTxt("Wrong number of arguments");
+    }
+
+    if (mxGetClassID(prhs[0]) != mxINT64_CLASS ||
+        mxGetM(prhs[0]) != 1 ||
+        mxGetN(prhs[0]) != 1) {
+        mexErrMsgTxt("Invalid argument");
+    }
+
+    fd = ((mxInt64 *)mxGetData(prhs[0]))[0];
+    n = (size_t)mxGetScalar(prhs[1]);
+
+    buf = mxCreateNumericMatrix(1, n, mxUINT8_CLASS, 0);
+
+    if (n > 0) {
+        addr = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            mexErrMsgTxt(strerror(errno));
+        }
+
+        memcpy(mxGetData(buf), addr, n);
+        munmap(addr, n);
+    }
+
+    close(fd);
+
+    plhs[0] = buf;
+}
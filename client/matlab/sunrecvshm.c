@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "mex.h"
+
+/* Maximum number of file descriptors accepted per receive */
+#define MAXFDS 16
+
+/* Receives data along with any file descriptors passed with it */
+void mexFunction(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
+    int fd;
+    size_t n, off, nfds;
+    ssize_t m;
+    mxArray *buf, *fds;
+    int received[MAXFDS * 4];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(MAXFDS * sizeof(int))];
+    } ctl;
+
+    if (nrhs != 2) {
+        mexErrMsgTxt("Wrong number of arguments");
+    }
+
+    if (mxGetClassID(prhs[0]) != mxINT64_CLASS ||
+        mxGetM(prhs[0]) != 1 ||
+        mxGetN(prhs[0]) != 1) {
+        mexErrMsgTxt("Invalid argument");
+    }
+
+    fd = ((mxInt64 *)mxGetData(prhs[0]))[0];
+    n = (size_t)mxGetScalar(prhs[1]);
+
+    buf = mxCreateNumericMatrix(1, n, mxUINT8_CLASS, 0);
+    off = 0;
+    nfds = 0;
+
+    while (off < n) {
+        iov.iov_base = (unsigned char *)mxGetData(buf) + off;
+        iov.iov_len = n - off;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        m = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (m < 0) {
+            mexErrMsgTxt(strerror(errno));
+        } else if (m == 0) {
+            mexErrMsgTxt(strerror(EPIPE));
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+                if (nfds + k > sizeof(received) / sizeof(int)) {
+                    mexErrMsgTxt("Too many file descriptors received");
+                }
+
+                memcpy(received + nfds, CMSG_DATA(cmsg), k * sizeof(int));
+                nfds += k;
+            }
+        }
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+            mexErrMsgTxt("Too many file descriptors received");
+        }
+
+        off += m;
+    }
+
+    fds = mxCreateNumericMatrix(1, nfds, mxINT64_CLASS, 0);
+
+    for (size_t i = 0; i < nfds; i++) {
+        ((mxInt64 *)mxGetData(fds))[i] = received[i];
+    }
+
+    plhs[0] = buf;
+
+    if (nlhs > 1) {
+        plhs[1] = fds;
+    }
+}
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mex.h"
+
+/* Sends a message header, passing its binary data in a sealed memfd */
+void mexFunction(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
+    int fd, shmfd;
+    size_t n, bindata_len;
+    ssize_t m;
+    unsigned char *data, *bindata;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    void (*handler)(int);
+
+    if (nrhs != 3) {
+        mexErrMsgTxt("Wrong number of arguments");
+    }
+
+    if (mxGetClassID(prhs[0]) != mxINT64_CLASS ||
+        mxGetM(prhs[0]) != 1 ||
+        mxGetN(prhs[0]) != 1) {
+        mexErrMsgTxt("Invalid argument");
+    }
+
+    fd = ((mxInt64 *)mxGetData(prhs[0]))[0];
+    n = mxGetM(prhs[1]) * mxGetN(prhs[1]) * mxGetElementSize(prhs[1]);
+    data = mxGetData(prhs[1]);
+    bindata_len = mxGetM(prhs[2]) * mxGetN(prhs[2]) * mxGetElementSize(prhs[2]);
+    bindata = mxGetData(prhs[2]);
+
+    shmfd = memfd_create("dime", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shmfd < 0) {
+        mexErrMsgTxt(strerror(errno));
+    }
+
+    while (bindata_len > 0) {
+        m = write(shmfd, bindata, bindata_len);
+
+        if (m < 0) {
+            close(shmfd);
+            mexErrMsgTxt(strerror(errno));
+        }
+
+        bindata += m;
+        bindata_len -= m;
+    }
+
+    /* The server refuses segments that could shrink under it */
+    if (fcntl(shmfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) < 0) {
+        close(shmfd);
+        mexErrMsgTxt(strerror(errno));
+    }
+
+    iov.iov_base = data;
+    iov.iov_len = n;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shmfd, sizeof(int));
+
+    handler = signal(SIGPIPE, SIG_IGN);
+
+    /* The file descriptor goes along with the first byte of the header */
+    m = sendmsg(fd, &msg, 0);
+    close(shmfd);
+
+    if (m < 0) {
+        signal(SIGPIPE, handler);
+        mexErrMsgTxt(strerror(errno));
+    }
+
+    data += m;
+    n -= m;
+
+    while (n > 0) {
+        m = send(fd, data, n, 0);
+
+        if (m < 0) {
+            signal(SIGPIPE, handler);
+            mexErrMsgTxt(strerror(errno));
+        }
+
+        data += m;
+        n -= m;
+    }
+
+    signal(SIGPIPE, handler);
+}
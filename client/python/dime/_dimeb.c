@@ -0,0 +1,829 @@
+/*
+ * Compiled implementation of dime.dimeb, with the same loads and dumps.
+ * Matrices decode to read-only numpy arrays over the original buffer, in
+ * the big-endian byte order of the format, so no element is touched.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/* Boolean sentinels */
+#define TYPE_NULL  0x00
+#define TYPE_TRUE  0x01
+#define TYPE_FALSE 0x02
+
+/* Scalar types */
+#define TYPE_I8  0x03
+#define TYPE_I16 0x04
+#define TYPE_I32 0x05
+#define TYPE_I64 0x06
+#define TYPE_U8  0x07
+#define TYPE_U16 0x08
+#define TYPE_U32 0x09
+#define TYPE_U64 0x0A
+
+#define TYPE_SINGLE         0x0B
+#define TYPE_DOUBLE         0x0C
+#define TYPE_COMPLEX_SINGLE 0x0D
+#define TYPE_COMPLEX_DOUBLE 0x0E
+
+/* Matrix types are 0x10 | the scalar type */
+#define TYPE_MAT 0x10
+
+/* Other types */
+#define TYPE_STRING     0x20
+#define TYPE_ARRAY      0x21
+#define TYPE_ASSOCARRAY 0x22
+
+/* Big-endian numpy dtypes of the matrix element types */
+static const char *const DTYPES[] = {
+    [TYPE_I8] = ">i1",
+    [TYPE_I16] = ">i2",
+    [TYPE_I32] = ">i4",
+    [TYPE_I64] = ">i8",
+    [TYPE_U8] = ">u1",
+    [TYPE_U16] = ">u2",
+    [TYPE_U32] = ">u4",
+    [TYPE_U64] = ">u8",
+    [TYPE_SINGLE] = ">f4",
+    [TYPE_DOUBLE] = ">f8",
+    [TYPE_COMPLEX_SINGLE] = ">c8",
+    [TYPE_COMPLEX_DOUBLE] = ">c16"
+};
+
+#define NDTYPES (sizeof(DTYPES) / sizeof(DTYPES[0]))
+
+/* Imported on first use, so that numpy is only needed for matrices */
+static PyObject *numpy;
+static PyObject *ndarray;
+static PyObject *dtypes[NDTYPES];
+
+static PyObject *sequence_abc;
+static PyObject *mapping_abc;
+
+typedef struct {
+    PyObject *obj;          /* Object being decoded */
+    const unsigned char *p; /* Its contents */
+    Py_ssize_t len;         /* Length of its contents */
+    Py_ssize_t off;         /* Offset of the next value */
+    int view;               /* Whether matrices are left as read-only views of obj */
+} dimeb_reader_t;
+
+typedef struct {
+    PyObject *bytes; /* Output, overallocated */
+    Py_ssize_t len;  /* Bytes written so far */
+} dimeb_writer_t;
+
+static int dimeb_numpy(void) {
+    if (numpy != NULL) {
+        return 0;
+    }
+
+    PyObject *mod = PyImport_ImportModule("numpy");
+    if (mod == NULL) {
+        return -1;
+    }
+
+    ndarray = PyObject_GetAttrString(mod, "ndarray");
+    if (ndarray == NULL) {
+        Py_DECREF(mod);
+        return -1;
+    }
+
+    for (size_t i = 0; i < NDTYPES; i++) {
+        if (DTYPES[i] != NULL) {
+            dtypes[i] = PyObject_CallMethod(mod, "dtype", "s", DTYPES[i]);
+
+            if (dtypes[i] == NULL) {
+                for (size_t j = 0; j < i; j++) {
+                    Py_CLEAR(dtypes[j]);
+                }
+
+                Py_CLEAR(ndarray);
+                Py_DECREF(mod);
+
+                return -1;
+            }
+        }
+    }
+
+    numpy = mod;
+
+    return 0;
+}
+
+static Py_ssize_t dimeb_itemsize(int type) {
+    return strtol(DTYPES[type] + 2, NULL, 10);
+}
+
+static uint64_t dimeb_be(const unsigned char *p, size_t n) {
+    uint64_t x = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        x = (x << 8) | p[i];
+    }
+
+    return x;
+}
+
+/* Ensures n more bytes are left to read, past the type byte */
+static int dimeb_need(const dimeb_reader_t *r, Py_ssize_t n) {
+    if (r->len - r->off - 1 < n) {
+        PyErr_SetString(PyExc_ValueError, "Truncated dimeb data");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *dimeb_load(dimeb_reader_t *r);
+
+static PyObject *dimeb_load_mat(dimeb_reader_t *r, int type) {
+    const unsigned char *p = r->p + r->off;
+
+    if (dimeb_need(r, 1) < 0) {
+        return NULL;
+    }
+
+    unsigned int rank = p[1];
+    Py_ssize_t offset = 2 + 4 * rank;
+
+    if (dimeb_need(r, offset - 1) < 0) {
+        return NULL;
+    }
+
+    PyObject *shape = PyTuple_New(rank);
+    if (shape == NULL) {
+        return NULL;
+    }
+
+    Py_ssize_t count = 1;
+    Py_ssize_t itemsize = dimeb_itemsize(type);
+    Py_ssize_t max = (r->len - r->off - offset) / itemsize;
+
+    for (unsigned int i = 0; i < rank; i++) {
+        uint32_t dim = (uint32_t)dimeb_be(p + 2 + 4 * i, 4);
+
+        /* Also keeps the count from overflowing */
+        if (dim > 0 && count > max / dim) {
+            Py_DECREF(shape);
+            PyErr_SetString(PyExc_ValueError, "Truncated dimeb data");
+
+            return NULL;
+        }
+
+        count *= dim;
+
+        PyObject *v = PyLong_FromUnsignedLong(dim);
+        if (v == NULL) {
+            Py_DECREF(shape);
+            return NULL;
+        }
+
+        PyTuple_SET_ITEM(shape, i, v);
+    }
+
+    /* Row and column vectors decode to one dimension */
+    if (rank == 2 && (dimeb_be(p + 2, 4) == 1 || dimeb_be(p + 6, 4) == 1)) {
+        PyObject *v = PyTuple_Pack(1, PyTuple_GET_ITEM(shape, (dimeb_be(p + 2, 4) == 1) ? 1 : 0));
+
+        Py_DECREF(shape);
+
+        if (v == NULL) {
+            return NULL;
+        }
+
+        shape = v;
+    }
+
+    PyObject *arr = PyObject_CallMethod(numpy, "frombuffer", "OOnn", r->obj, dtypes[type], count, r->off + offset);
+    if (arr == NULL) {
+        Py_DECREF(shape);
+        return NULL;
+    }
+
+    PyObject *reshape = PyObject_GetAttrString(arr, "reshape");
+    PyObject *args = PyTuple_Pack(1, shape);
+    PyObject *kwargs = Py_BuildValue("{ss}", "order", "F");
+    PyObject *ret = NULL;
+
+    if (reshape != NULL && args != NULL && kwargs != NULL) {
+        ret = PyObject_Call(reshape, args, kwargs);
+    }
+
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    Py_XDECREF(reshape);
+    Py_DECREF(arr);
+    Py_DECREF(shape);
+
+    /* Otherwise a writable copy in native byte order, same dtype without the ">" */
+    if (ret != NULL && !r->view) {
+        PyObject *copy = PyObject_CallMethod(ret, "astype", "s", DTYPES[type] + 1);
+
+        Py_DECREF(ret);
+        ret = copy;
+    }
+
+    if (ret != NULL) {
+        r->off += offset + count * itemsize;
+    }
+
+    return ret;
+}
+
+static PyObject *dimeb_load_array(dimeb_reader_t *r) {
+    if (dimeb_need(r, 4) < 0) {
+        return NULL;
+    }
+
+    uint32_t siz = (uint32_t)dimeb_be(r->p + r->off + 1, 4);
+
+    /* Every element takes at least one byte */
+    if (dimeb_need(r, 4 + (Py_ssize_t)siz) < 0) {
+        return NULL;
+    }
+
+    PyObject *ret = PyList_New(siz);
+    if (ret == NULL) {
+        return NULL;
+    }
+
+    r->off += 5;
+
+    for (uint32_t i = 0; i < siz; i++) {
+        PyObject *element = dimeb_load(r);
+
+        if (element == NULL) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+
+        PyList_SET_ITEM(ret, i, element);
+    }
+
+    return ret;
+}
+
+static PyObject *dimeb_load_assocarray(dimeb_reader_t *r) {
+    if (dimeb_need(r, 4) < 0) {
+        return NULL;
+    }
+
+    uint32_t siz = (uint32_t)dimeb_be(r->p + r->off + 1, 4);
+
+    PyObject *ret = PyDict_New();
+    if (ret == NULL) {
+        return NULL;
+    }
+
+    r->off += 5;
+
+    for (uint32_t i = 0; i < siz; i++) {
+        PyObject *key = dimeb_load(r);
+        if (key == NULL) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+
+        PyObject *val = dimeb_load(r);
+        if (val == NULL || PyDict_SetItem(ret, key, val) < 0) {
+            Py_XDECREF(val);
+            Py_DECREF(key);
+            Py_DECREF(ret);
+
+            return NULL;
+        }
+
+        Py_DECREF(val);
+        Py_DECREF(key);
+    }
+
+    return ret;
+}
+
+static PyObject *dimeb_load_scalar(dimeb_reader_t *r, int type) {
+    static const Py_ssize_t SIZES[] = {
+        [TYPE_I8] = 1, [TYPE_I16] = 2, [TYPE_I32] = 4, [TYPE_I64] = 8,
+        [TYPE_U8] = 1, [TYPE_U16] = 2, [TYPE_U32] = 4, [TYPE_U64] = 8,
+        [TYPE_SINGLE] = 4, [TYPE_DOUBLE] = 8,
+        [TYPE_COMPLEX_SINGLE] = 8, [TYPE_COMPLEX_DOUBLE] = 16
+    };
+
+    Py_ssize_t n = SIZES[type];
+    const unsigned char *p = r->p + r->off + 1;
+
+    if (dimeb_need(r, n) < 0) {
+        return NULL;
+    }
+
+    r->off += 1 + n;
+
+    uint64_t x = dimeb_be(p, (n > 8) ? 8 : n);
+    float f, g;
+    double d, e;
+    uint32_t y;
+
+    switch (type) {
+    case TYPE_I8:
+        return PyLong_FromLong((int8_t)x);
+
+    case TYPE_I16:
+        return PyLong_FromLong((int16_t)x);
+
+    case TYPE_I32:
+        return PyLong_FromLong((int32_t)x);
+
+    case TYPE_I64:
+        return PyLong_FromLongLong((int64_t)x);
+
+    case TYPE_SINGLE:
+        y = (uint32_t)x;
+        memcpy(&f, &y, 4);
+
+        return PyFloat_FromDouble(f);
+
+    case TYPE_DOUBLE:
+        memcpy(&d, &x, 8);
+
+        return PyFloat_FromDouble(d);
+
+    case TYPE_COMPLEX_SINGLE:
+        y = (uint32_t)(x >> 32);
+        memcpy(&f, &y, 4);
+        y = (uint32_t)x;
+        memcpy(&g, &y, 4);
+
+        return PyComplex_FromDoubles(f, g);
+
+    case TYPE_COMPLEX_DOUBLE:
+        memcpy(&d, &x, 8);
+        x = dimeb_be(p + 8, 8);
+        memcpy(&e, &x, 8);
+
+        return PyComplex_FromDoubles(d, e);
+
+    default:
+        return PyLong_FromUnsignedLongLong(x);
+    }
+}
+
+static PyObject *dimeb_load(dimeb_reader_t *r) {
+    if (r->off >= r->len) {
+        PyErr_SetString(PyExc_ValueError, "Truncated dimeb data");
+        return NULL;
+    }
+
+    int type = r->p[r->off];
+    Py_ssize_t siz;
+    PyObject *ret;
+
+    switch (type) {
+    case TYPE_NULL:
+        r->off++;
+        Py_RETURN_NONE;
+
+    case TYPE_TRUE:
+        r->off++;
+        Py_RETURN_TRUE;
+
+    case TYPE_FALSE:
+        r->off++;
+        Py_RETURN_FALSE;
+
+    case TYPE_STRING:
+        if (dimeb_need(r, 4) < 0) {
+            return NULL;
+        }
+
+        siz = (Py_ssize_t)dimeb_be(r->p + r->off + 1, 4);
+
+        if (dimeb_need(r, 4 + siz) < 0) {
+            return NULL;
+        }
+
+        ret = PyUnicode_DecodeUTF8((const char *)r->p + r->off + 5, siz, NULL);
+        r->off += 5 + siz;
+
+        return ret;
+
+    case TYPE_ARRAY:
+    case TYPE_ASSOCARRAY:
+        if (Py_EnterRecursiveCall(" while decoding dimeb data")) {
+            return NULL;
+        }
+
+        ret = (type == TYPE_ARRAY) ? dimeb_load_array(r) : dimeb_load_assocarray(r);
+
+        Py_LeaveRecursiveCall();
+
+        return ret;
+
+    default:
+        if (type >= TYPE_I8 && type <= TYPE_COMPLEX_DOUBLE) {
+            return dimeb_load_scalar(r, type);
+        }
+
+        if ((type & TYPE_MAT) && (type & ~TYPE_MAT) >= TYPE_I8 && (type & ~TYPE_MAT) <= TYPE_COMPLEX_DOUBLE) {
+            if (dimeb_numpy() < 0) {
+                return NULL;
+            }
+
+            return dimeb_load_mat(r, type & ~TYPE_MAT);
+        }
+
+        PyErr_Format(PyExc_ValueError, "Unknown dimeb type 0x%02X", type);
+
+        return NULL;
+    }
+}
+
+static PyObject *dimeb_loads(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"x", "view", NULL};
+    PyObject *obj;
+    int asview = 0;
+    Py_buffer view;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist, &obj, &asview)) {
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    dimeb_reader_t r = {obj, view.buf, view.len, 0, asview};
+    PyObject *ret = dimeb_load(&r);
+
+    PyBuffer_Release(&view);
+
+    return ret;
+}
+
+/* Reserves n bytes of output, returning where to write them */
+static unsigned char *dimeb_reserve(dimeb_writer_t *w, Py_ssize_t n) {
+    Py_ssize_t cap = PyBytes_GET_SIZE(w->bytes);
+
+    if (w->len + n > cap) {
+        while (w->len + n > cap) {
+            cap = (cap * 3) / 2;
+        }
+
+        if (_PyBytes_Resize(&w->bytes, cap) < 0) {
+            return NULL;
+        }
+    }
+
+    unsigned char *p = (unsigned char *)PyBytes_AS_STRING(w->bytes) + w->len;
+
+    w->len += n;
+
+    return p;
+}
+
+static void dimeb_put_be(unsigned char *p, uint64_t x, size_t n) {
+    for (size_t i = n; i > 0; i--) {
+        p[i - 1] = x & 0xFF;
+        x >>= 8;
+    }
+}
+
+/* Writes a type byte followed by a 32-bit size */
+static int dimeb_dump_header(dimeb_writer_t *w, int type, Py_ssize_t siz) {
+    if ((size_t)siz > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "Too large for dimeb");
+        return -1;
+    }
+
+    unsigned char *p = dimeb_reserve(w, 5);
+    if (p == NULL) {
+        return -1;
+    }
+
+    p[0] = type;
+    dimeb_put_be(p + 1, siz, 4);
+
+    return 0;
+}
+
+static int dimeb_dump(dimeb_writer_t *w, PyObject *x);
+
+static int dimeb_dump_mat(dimeb_writer_t *w, PyObject *x) {
+    PyObject *dtype = PyObject_GetAttrString(x, "dtype");
+    if (dtype == NULL) {
+        return -1;
+    }
+
+    PyObject *kind = PyObject_GetAttrString(dtype, "kind");
+    PyObject *itemsize = PyObject_GetAttrString(dtype, "itemsize");
+
+    Py_DECREF(dtype);
+
+    if (kind == NULL || itemsize == NULL) {
+        Py_XDECREF(kind);
+        Py_XDECREF(itemsize);
+
+        return -1;
+    }
+
+    const char *k = PyUnicode_AsUTF8(kind);
+    long n = PyLong_AsLong(itemsize);
+    int type = -1;
+
+    if (k != NULL && k[0] != '\0' && k[1] == '\0') {
+        for (size_t i = 0; i < NDTYPES; i++) {
+            if (DTYPES[i] != NULL && DTYPES[i][1] == k[0] && dimeb_itemsize(i) == n) {
+                type = i;
+                break;
+            }
+        }
+    }
+
+    Py_DECREF(kind);
+    Py_DECREF(itemsize);
+
+    if (type < 0) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "Unsupported array type for dimeb");
+        }
+
+        return -1;
+    }
+
+    /* A no-op for arrays already in the format's byte and element order */
+    PyObject *astype = PyObject_GetAttrString(x, "astype");
+    PyObject *args = PyTuple_Pack(1, dtypes[type]);
+    PyObject *kwargs = Py_BuildValue("{sssO}", "order", "F", "copy", Py_False);
+    PyObject *arr = NULL;
+
+    if (astype != NULL && args != NULL && kwargs != NULL) {
+        arr = PyObject_Call(astype, args, kwargs);
+    }
+
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    Py_XDECREF(astype);
+
+    if (arr == NULL) {
+        return -1;
+    }
+
+    PyObject *shape = PyObject_GetAttrString(arr, "shape");
+    Py_buffer view;
+
+    if (shape == NULL || PyObject_GetBuffer(arr, &view, PyBUF_F_CONTIGUOUS) < 0) {
+        Py_XDECREF(shape);
+        Py_DECREF(arr);
+
+        return -1;
+    }
+
+    Py_ssize_t rank = PyTuple_GET_SIZE(shape);
+    unsigned char *p = NULL;
+
+    if (rank <= 255) {
+        p = dimeb_reserve(w, 2 + 4 * rank + view.len);
+    } else {
+        PyErr_SetString(PyExc_OverflowError, "Too many dimensions for dimeb");
+    }
+
+    if (p != NULL) {
+        p[0] = TYPE_MAT | type;
+        p[1] = rank;
+
+        for (Py_ssize_t i = 0; i < rank; i++) {
+            size_t dim = PyLong_AsSize_t(PyTuple_GET_ITEM(shape, i));
+
+            if (dim > UINT32_MAX) {
+                PyErr_SetString(PyExc_OverflowError, "Too large for dimeb");
+                p = NULL;
+
+                break;
+            }
+
+            dimeb_put_be(p + 2 + 4 * i, dim, 4);
+        }
+
+        if (p != NULL) {
+            memcpy(p + 2 + 4 * rank, view.buf, view.len);
+        }
+    }
+
+    PyBuffer_Release(&view);
+    Py_DECREF(shape);
+    Py_DECREF(arr);
+
+    return (p != NULL) ? 0 : -1;
+}
+
+static int dimeb_dump_seq(dimeb_writer_t *w, PyObject *x) {
+    PyObject *seq = PySequence_Fast(x, "Expected a sequence");
+    if (seq == NULL) {
+        return -1;
+    }
+
+    Py_ssize_t siz = PySequence_Fast_GET_SIZE(seq);
+    int ret = dimeb_dump_header(w, TYPE_ARRAY, siz);
+
+    for (Py_ssize_t i = 0; ret == 0 && i < siz; i++) {
+        ret = dimeb_dump(w, PySequence_Fast_GET_ITEM(seq, i));
+    }
+
+    Py_DECREF(seq);
+
+    return ret;
+}
+
+static int dimeb_dump_map(dimeb_writer_t *w, PyObject *x) {
+    PyObject *items = PyMapping_Items(x);
+    if (items == NULL) {
+        return -1;
+    }
+
+    Py_ssize_t siz = PyList_GET_SIZE(items);
+    int ret = dimeb_dump_header(w, TYPE_ASSOCARRAY, siz);
+
+    for (Py_ssize_t i = 0; ret == 0 && i < siz; i++) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+
+        ret = dimeb_dump(w, PyTuple_GET_ITEM(item, 0));
+
+        if (ret == 0) {
+            ret = dimeb_dump(w, PyTuple_GET_ITEM(item, 1));
+        }
+    }
+
+    Py_DECREF(items);
+
+    return ret;
+}
+
+/* Like isinstance, where a failed check counts as a mismatch */
+static int dimeb_isinstance(PyObject *x, PyObject *cls) {
+    int ret = (cls != NULL) ? PyObject_IsInstance(x, cls) : 0;
+
+    if (ret < 0) {
+        PyErr_Clear();
+        ret = 0;
+    }
+
+    return ret;
+}
+
+static int dimeb_dump(dimeb_writer_t *w, PyObject *x) {
+    unsigned char *p;
+
+    if (x == Py_None || x == Py_True || x == Py_False) {
+        p = dimeb_reserve(w, 1);
+        if (p == NULL) {
+            return -1;
+        }
+
+        p[0] = (x == Py_None) ? TYPE_NULL : (x == Py_True) ? TYPE_TRUE : TYPE_FALSE;
+
+        return 0;
+    }
+
+    if (PyLong_Check(x)) {
+        long long v = PyLong_AsLongLong(x);
+
+        if (v == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+
+        p = dimeb_reserve(w, 9);
+        if (p == NULL) {
+            return -1;
+        }
+
+        p[0] = TYPE_I64;
+        dimeb_put_be(p + 1, (uint64_t)v, 8);
+
+        return 0;
+    }
+
+    if (PyFloat_Check(x) || PyComplex_Check(x)) {
+        int complex = PyComplex_Check(x);
+        double v[2];
+
+        if (complex) {
+            v[0] = PyComplex_RealAsDouble(x);
+            v[1] = PyComplex_ImagAsDouble(x);
+        } else {
+            v[0] = PyFloat_AS_DOUBLE(x);
+        }
+
+        p = dimeb_reserve(w, complex ? 17 : 9);
+        if (p == NULL) {
+            return -1;
+        }
+
+        p[0] = complex ? TYPE_COMPLEX_DOUBLE : TYPE_DOUBLE;
+
+        for (int i = 0; i <= complex; i++) {
+            uint64_t bits;
+
+            memcpy(&bits, &v[i], 8);
+            dimeb_put_be(p + 1 + 8 * i, bits, 8);
+        }
+
+        return 0;
+    }
+
+    if (PyUnicode_Check(x)) {
+        Py_ssize_t siz;
+        const char *s = PyUnicode_AsUTF8AndSize(x, &siz);
+
+        if (s == NULL || dimeb_dump_header(w, TYPE_STRING, siz) < 0) {
+            return -1;
+        }
+
+        p = dimeb_reserve(w, siz);
+        if (p == NULL) {
+            return -1;
+        }
+
+        memcpy(p, s, siz);
+
+        return 0;
+    }
+
+    int ret;
+
+    if (Py_EnterRecursiveCall(" while encoding dimeb data")) {
+        return -1;
+    }
+
+    /* Checked in the same order as the pure-Python version */
+    if (ndarray == NULL && !PyList_Check(x) && !PyTuple_Check(x) && !PyDict_Check(x) && dimeb_numpy() < 0) {
+        PyErr_Clear();
+    }
+
+    if (dimeb_isinstance(x, ndarray)) {
+        ret = dimeb_dump_mat(w, x);
+    } else if (PyList_Check(x) || PyTuple_Check(x) || dimeb_isinstance(x, sequence_abc)) {
+        ret = dimeb_dump_seq(w, x);
+    } else if (PyDict_Check(x) || dimeb_isinstance(x, mapping_abc)) {
+        ret = dimeb_dump_map(w, x);
+    } else {
+        PyErr_Format(PyExc_TypeError, "Cannot encode %s in dimeb", Py_TYPE(x)->tp_name);
+        ret = -1;
+    }
+
+    Py_LeaveRecursiveCall();
+
+    return ret;
+}
+
+static PyObject *dimeb_dumps(PyObject *self, PyObject *x) {
+    dimeb_writer_t w = {PyBytes_FromStringAndSize(NULL, 64), 0};
+
+    if (w.bytes == NULL) {
+        return NULL;
+    }
+
+    if (dimeb_dump(&w, x) < 0 || _PyBytes_Resize(&w.bytes, w.len) < 0) {
+        Py_XDECREF(w.bytes);
+        return NULL;
+    }
+
+    return w.bytes;
+}
+
+static PyMethodDef METHODS[] = {
+    {"loads", (PyCFunction)(void (*)(void))dimeb_loads, METH_VARARGS | METH_KEYWORDS, "Decode a dimeb-encoded object, its matrices as read-only views if view is true"},
+    {"dumps", dimeb_dumps, METH_O, "Encode an object as dimeb"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef MODULE = {
+    PyModuleDef_HEAD_INIT,
+    "dime._dimeb",
+    "Compiled dimeb codec",
+    -1,
+    METHODS
+};
+
+PyMODINIT_FUNC PyInit__dimeb(void) {
+    PyObject *abc = PyImport_ImportModule("collections.abc");
+    if (abc == NULL) {
+        return NULL;
+    }
+
+    sequence_abc = PyObject_GetAttrString(abc, "Sequence");
+    mapping_abc = PyObject_GetAttrString(abc, "Mapping");
+
+    Py_DECREF(abc);
+
+    if (sequence_abc == NULL || mapping_abc == NULL) {
+        Py_CLEAR(sequence_abc);
+        Py_CLEAR(mapping_abc);
+
+        return NULL;
+    }
+
+    return PyModule_Create(&MODULE);
+}
@@ -1,11 +1,22 @@
+import array
 import base64
+import collections
 import collections.abc
 import itertools
 import json
+import mmap
+import os
 import pickle
 import re
+import select
 import socket
 import struct
+import zlib
+
+try:
+    import fcntl
+except ImportError: # Windows
+    fcntl = None
 
 from dime import dimeb
 from dime import json as dimejson
@@ -14,6 +25,35 @@ __all__ = ["DimeClient"]
 
 ADDRESS_REGEX = re.compile(r"(?P<proto>[a-z]+)://(?P<hostname>([^:]|((?<=\\)(?:\\\\)*:))+)(:(?P<port>[0-9]+))?")
 
+# Binary data of at least this size is passed in shared memory, if enabled
+SHM_THRESHOLD = 65536
+
+# Maximum number of file descriptors accepted per receive
+SHM_MAXFDS = 16
+
+# Largest message the server is asked to coalesce queued messages into on sync
+SYNC_COALESCE = 1 << 20
+
+# Opcodes of the commands in the DiME v2 header
+OPCODES = {
+    "handshake": 1,
+    "join": 2,
+    "leave": 3,
+    "send": 4,
+    "broadcast": 5,
+    "sync": 6,
+    "wait": 7,
+    "devices": 8,
+    "batch": 9,
+    "subscribe": 10,
+    "stats": 11
+}
+
+# Flags of the DiME v2 header
+FLAG_SHM = 0x01
+FLAG_ZLIB = 0x02
+FLAG_NOACK = 0x04
+
 class DimeClient(collections.abc.MutableMapping):
     """DiME client
 
@@ -23,7 +63,7 @@ class DimeClient(collections.abc.MutableMapping):
     variables in the workspace.
     """
 
-    def __init__(self, proto = "ipc", *args):
+    def __init__(self, proto = "ipc", *args, queue_max_bytes = None, queue_max_len = None, queue_policy = None, shm = False, zlib = False, delta = False, views = False):
         """Construct a dime instance
 
         Create a dime client via the specified protocol. The exact arguments
@@ -42,11 +82,86 @@ class DimeClient(collections.abc.MutableMapping):
 
         args : tuple
             Additional arguments, as described above.
+
+        queue_max_bytes : int, optional
+            Limit on the total size of messages the server queues for this
+            client before they are synchronized.
+
+        queue_max_len : int, optional
+            Limit on the number of messages the server queues for this
+            client.
+
+        queue_policy : {'reject', 'drop_oldest', 'conflate'}, optional
+            What the server does with messages past either limit: refuse
+            them (the sender gets an error), discard the oldest queued
+            messages, or replace a queued message for the same variable
+            name (refusing the message if there is none, so that no other
+            variable's value is lost). Defaults to 'reject'.
+
+        shm : bool, optional
+            Pass large variables to and from the server in shared memory
+            instead of over the socket. Only possible over 'ipc' on Linux;
+            silently falls back to the socket otherwise.
+
+        zlib : bool, optional
+            Compress large variables sent to and from the server, if the
+            server was started with compression enabled. Silently falls
+            back to uncompressed data otherwise.
+
+        delta : bool, optional
+            Send variables to groups as deltas against the value last sent
+            to the same group under the same name, where that is smaller.
+            The server passes on the delta to clients that received that
+            value, and the full value to all others. Only pays off for
+            variables that keep the same shape and change in small parts,
+            which in practice means the 'dimeb' serialization.
+            Sending fails if another client sent the same variable to the
+            group since, in which case the next send carries the full value.
+
+        views : bool, optional
+            Receive matrices in the 'dimeb' serialization as read-only numpy
+            arrays in big-endian byte order that share memory with the
+            received message, instead of as writable copies in native byte
+            order. Saves a copy of large matrices, but they must be copied
+            before being modified.
         """
 
         self.proto = proto
         self.args = args
 
+        self.queue_opts = {}
+
+        if queue_max_bytes is not None:
+            self.queue_opts["queue_max_bytes"] = queue_max_bytes
+
+        if queue_max_len is not None:
+            self.queue_opts["queue_max_len"] = queue_max_len
+
+        if queue_policy is not None:
+            self.queue_opts["queue_policy"] = queue_policy
+
+        self.shm_requested = shm
+        self.shm = False
+        self.fds = collections.deque()
+
+        self.zlib_requested = zlib
+        self.zlib = False
+        self.zlib_threshold = 0
+
+        self.delta = delta
+        self.views = views
+        self.sent = {}
+        self.received = {}
+
+        self.version = 1
+        self.seq = 0
+        self.rseq = 0
+        self.groups = {}
+
+        self.subscribed = False
+        self.pushed = collections.deque()
+        self.acks = 0
+
         self.workspace = {}
 
         self.open()
@@ -83,12 +198,34 @@ class DimeClient(collections.abc.MutableMapping):
             self.open(proto, *args)
             return
 
-        self.__send({"command": "handshake", "serialization": "json" if use_json else "pickle", "tls": False})
+        handshake = {"command": "handshake", "serialization": "json" if use_json else "pickle", "tls": False, "version": 2, **self.queue_opts}
+
+        if self.shm_requested and self.conn.family == socket.AF_UNIX and hasattr(os, "memfd_create") and fcntl is not None:
+            handshake["shm"] = True
+
+        if self.zlib_requested:
+            handshake["zlib"] = True
+
+        self.shm = False
+        self.zlib = False
+        self.version = 1
+        self.__send(handshake)
 
         jsondata, _ = self.__recv()
 
         if jsondata["status"] < 0:
-            raise RuntimeError(status["error"])
+            raise RuntimeError(jsondata["error"])
+
+        self.shm = jsondata.get("shm", False)
+        self.zlib = jsondata.get("zlib", False)
+        self.zlib_threshold = jsondata.get("zlib_threshold", 0)
+        self.version = jsondata.get("version", 1)
+        self.seq = 0
+        self.groups = {}
+
+        # The server knows nothing of what this connection sent or received before
+        self.sent = {}
+        self.received = {}
 
         self.serialization = jsondata["serialization"]
 
@@ -125,7 +262,9 @@ class DimeClient(collections.abc.MutableMapping):
         jsondata, _ = self.__recv()
 
         if jsondata["status"] < 0:
-            raise RuntimeError(status["error"])
+            raise RuntimeError(jsondata["error"])
+
+        self.groups.update(zip(names, jsondata.get("handles", [])))
 
     def leave(self, *names):
         """Send a "leave" command to the server
@@ -147,7 +286,7 @@ class DimeClient(collections.abc.MutableMapping):
         jsondata, _ = self.__recv()
 
         if jsondata["status"] < 0:
-            raise RuntimeError(status["error"])
+            raise RuntimeError(jsondata["error"])
 
     def send(self, name, *varnames):
         """Send a "send" command to the server
@@ -170,39 +309,7 @@ class DimeClient(collections.abc.MutableMapping):
         self.send_r(name, **{varname: self.workspace[varname] for varname in varnames})
 
     def send_r(self, name, **kvpairs):
-        kviter = iter(kvpairs.items())
-        serialization = self.serialization
-
-        for _ in range(0, len(kvpairs), 16):
-            n = 0
-
-            for i in range(16):
-                try:
-                    varname, var = next(kviter)
-                except StopIteration:
-                    break
-
-                jsondata = {
-                    "command": "send",
-                    "name": name,
-                    "varname": varname,
-                    "serialization": self.serialization
-                }
-                bindata = self.dumps(var)
-
-                self.__send(jsondata, bindata)
-
-                n += 1
-
-            for _ in range(n):
-                jsondata, _ = self.__recv()
-
-                if jsondata["status"] < 0:
-                    raise RuntimeError(status["error"])
-
-            if serialization != self.serialization:
-                self.send_r(name, **kvpairs)
-                return
+        self.__relay("send", name, kvpairs)
 
     def broadcast(self, *varnames):
         """Send a "broadcast" command to the server
@@ -222,38 +329,59 @@ class DimeClient(collections.abc.MutableMapping):
         self.broadcast_r(**{varname: self.workspace[varname] for varname in varnames})
 
     def broadcast_r(self, **kvpairs):
-        kviter = iter(kvpairs.items())
-        serialization = self.serialization
+        self.__relay("broadcast", None, kvpairs)
 
-        for _ in range(0, len(kvpairs), 16):
-            n = 0
+    def batch(self, names, *varnames):
+        """Send a "batch" command to the server
 
-            for i in range(16):
-                try:
-                    varname, var = next(kviter)
-                except StopIteration:
-                    break
+        Sends one or more variables from the mapping of this instance to all
+        clients in one or more groups, in a single message. Clients in more
+        than one of the groups receive the variables once.
 
-                jsondata = {
-                    "command": "broadcast",
-                    "varname": varname,
-                    "serialization": self.serialization
-                }
-                bindata = self.dumps(var)
+        Parameters
+        ----------
+        self : DimeClient
+            The dime instance.
 
-                self.__send(jsondata, bindata)
+        names : str or list of str
+           The group name(s).
 
-                n += 1
+        varnames : tuple of str
+           The variable name(s) in the mapping.
+        """
 
-            for _ in range(n):
-                jsondata, _ = self.__recv()
+        self.batch_r(names, **{varname: self.workspace[varname] for varname in varnames})
 
-                if jsondata["status"] < 0:
-                    raise RuntimeError(status["error"])
+    def batch_r(self, names, **kvpairs):
+        if isinstance(names, str):
+            names = [names]
 
-            if serialization != self.serialization:
-                self.send_r(name, **kvpairs)
-                return
+        serialization = self.serialization
+        bindata = [self.dumps(var) for var in kvpairs.values()]
+
+        # Groups with a known handle are addressed by it in DiME v2
+        if self.version >= 2:
+            groups = [self.groups.get(name, name) for name in names]
+        else:
+            groups = list(names)
+
+        self.__send({
+            "command": "batch",
+            "name": groups,
+            "serialization": self.serialization,
+            "varnames": list(kvpairs.keys()),
+            "lengths": [len(data) for data in bindata]
+        }, b"".join(bindata))
+
+        jsondata, _ = self.__recv()
+
+        if jsondata["status"] < 0:
+            raise RuntimeError(jsondata["error"])
+
+        self.groups.update(zip(names, jsondata.get("handles", [])))
+
+        if serialization != self.serialization:
+            self.batch_r(names, **kvpairs)
 
     def sync(self, n = -1):
         """Send a "sync" command to the server
@@ -277,9 +405,31 @@ class DimeClient(collections.abc.MutableMapping):
         return set(updates.keys())
 
     def sync_r(self, n = -1):
-        self.__send({"command": "sync", "n": n})
+        # Messages pushed to a subscription are already here
+        if self.subscribed:
+            while select.select([self.conn], [], [], 0)[0]:
+                self.__recvpushed()
 
         ret = {}
+        k = 0
+
+        while len(self.pushed) > 0 and (n < 0 or k < n):
+            self.__unpack(*self.pushed.popleft(), ret)
+            k += 1
+
+        if self.subscribed:
+            self.__grant(k)
+
+            return ret
+
+        if n >= 0:
+            n -= k
+
+            if n == 0:
+                return ret
+
+        self.__send({"command": "sync", "n": n, "coalesce": SYNC_COALESCE})
+
         m = n
 
         while True:
@@ -287,21 +437,13 @@ class DimeClient(collections.abc.MutableMapping):
 
             if "status" in jsondata:
                 if jsondata["status"] < 0:
-                    raise RuntimeError(status["error"])
+                    raise RuntimeError(jsondata["error"])
 
                 break
 
-            if jsondata["serialization"] == "pickle":
-                var = pickle.loads(bindata)
-            elif jsondata["serialization"] == "dimeb":
-                var = dimeb.loads(bindata)
-            elif jsondata["serialization"] == "json":
-                var = dimejson.loads(bindata)
-            else:
-                m -= 1
-                continue
-
-            ret[jsondata["varname"]] = var
+            for jsondata, bindata in self.__messages(jsondata, bindata):
+                if not self.__unpack(jsondata, bindata, ret):
+                    m -= 1
 
         if n > 0 and m < n:
             ret.update(self.sync_r(n - m))
@@ -321,15 +463,68 @@ class DimeClient(collections.abc.MutableMapping):
             The dime instance.
         """
 
+        if self.subscribed:
+            while len(self.pushed) == 0 or select.select([self.conn], [], [], 0)[0]:
+                self.__recvpushed()
+
+            return len(self.pushed)
+
         self.__send({"command": "wait"})
 
         jsondata, _ = self.__recv()
 
         if jsondata["status"] < 0:
-            raise RuntimeError(status["error"])
+            raise RuntimeError(jsondata["error"])
 
         return jsondata["n"]
 
+    def subscribe(self, credits = 64):
+        """Send a "subscribe" command to the server
+
+        Tell the server to push variables sent to this client as soon as they
+        arrive, instead of waiting to be asked. Up to a number of variables
+        may be in flight at once; sync grants the server room for as many
+        more as it returns. While subscribed, wait and sync do not need to
+        ask the server for anything.
+
+        Parameters
+        ----------
+        self : DimeClient
+            The dime instance.
+
+        credits : int
+           The number of variables that may be in flight at once.
+        """
+
+        self.__send({"command": "subscribe", "credits": credits, "coalesce": SYNC_COALESCE})
+        self.subscribed = True
+
+        jsondata, _ = self.__recv()
+
+        if jsondata["status"] < 0:
+            self.subscribed = False
+            raise RuntimeError(jsondata["error"])
+
+    def unsubscribe(self):
+        """Undo subscribe
+
+        Variables pushed before the server stopped pushing them are returned
+        by the next sync.
+
+        Parameters
+        ----------
+        self : DimeClient
+            The dime instance.
+        """
+
+        self.__send({"command": "subscribe", "credits": -1})
+
+        jsondata, _ = self.__recv()
+        self.subscribed = False
+
+        if jsondata["status"] < 0:
+            raise RuntimeError(jsondata["error"])
+
     def devices(self):
         """send Send a "devices" command to the server
 
@@ -351,42 +546,355 @@ class DimeClient(collections.abc.MutableMapping):
         jsondata, _ = self.__recv()
 
         if jsondata["status"] < 0:
-            raise RuntimeError(status["error"])
+            raise RuntimeError(jsondata["error"])
 
         return jsondata["devices"]
 
-    def __send(self, jsondata, bindata = b""):
+    def stats(self):
+        """Send a "stats" command to the server
+
+        Tell the server to send this client its counters, for the server
+        as a whole, for each connected client and for each nonempty
+        group. The server's "rate" is the number of commands handled per
+        second since the previous "stats" command from any client.
+
+        Parameters
+        ----------
+        self : DimeClient
+            The dime instance.
+
+        Returns
+        -------
+        dict
+            The counters, with the keys "server", "clients" and "groups".
+        """
+
+        self.__send({"command": "stats"})
+        jsondata, _ = self.__recv()
+
+        if jsondata["status"] < 0:
+            raise RuntimeError(jsondata["error"])
+
+        del jsondata["status"]
+
+        return jsondata
+
+    def __relay(self, command, name, kvpairs):
+        items = list(kvpairs.items())
+        serialization = self.serialization
+
+        # DiME v2 acknowledges only the last message of a batch, so the whole
+        # batch goes out before waiting. Otherwise up to 16 acks are pending.
+        batch = max(len(items), 1) if self.version >= 2 else 16
+        error = None
+
+        for start in range(0, len(items), batch):
+            chunk = items[start:start + batch]
+
+            for i, (varname, var) in enumerate(chunk):
+                jsondata = {
+                    "command": command,
+                    "varname": varname,
+                    "serialization": self.serialization
+                }
+                bindata = self.dumps(var)
+
+                if self.delta and command == "send":
+                    jsondata["delta"], bindata = self.__delta(name, varname, bindata)
+
+                # Groups with a known handle are addressed by it in DiME v2
+                group = self.groups.get(name, 0) if self.version >= 2 else 0
+
+                if name is not None and group == 0:
+                    jsondata["name"] = name
+
+                self.__send(jsondata, bindata, group, noack = self.version >= 2 and i < len(chunk) - 1)
+
+            replies = 0
+
+            # In DiME v2, errors from the rest of the batch precede the last reply
+            while True:
+                jsondata, _ = self.__recv()
+                replies += 1
+
+                if jsondata["status"] < 0:
+                    error = error or jsondata["error"]
+                elif "group" in jsondata:
+                    self.groups[name] = jsondata["group"]
+
+                if (self.rseq == self.seq) if self.version >= 2 else (replies == len(chunk)):
+                    break
+
+            if error is not None:
+                # The server may not have the values to apply later deltas to
+                for varname, _ in chunk:
+                    self.sent.pop((name, varname), None)
+
+                raise RuntimeError(error)
+
+            if serialization != self.serialization:
+                self.__relay(command, name, kvpairs)
+                return
+
+    def __grant(self, credits):
+        if credits == 0:
+            return
+
+        # Acks to these are only sent before DiME v2, and skipped when they arrive
+        self.__send({"command": "subscribe", "credits": credits}, noack = self.version >= 2)
+
+        if self.version < 2:
+            self.acks += 1
+
+    def __messages(self, jsondata, bindata):
+        # Coalesced messages arrive as one, their binary data concatenated
+        if "messages" in jsondata:
+            return list(zip(jsondata["messages"], self.__split(bindata, jsondata["lengths"])))
+
+        return [(jsondata, bindata)]
+
+    def __unpack(self, jsondata, bindata, ret):
+        if jsondata["serialization"] == "pickle":
+            loads = pickle.loads
+        elif jsondata["serialization"] == "dimeb":
+            loads = lambda data: dimeb.loads(data, view = self.views)
+        elif jsondata["serialization"] == "json":
+            loads = dimejson.loads
+        else:
+            return False
+
+        # Batches carry several variables, their binary data concatenated
+        if "varnames" in jsondata:
+            for varname, data in zip(jsondata["varnames"], self.__split(bindata, jsondata["lengths"])):
+                ret[varname] = loads(data)
+        else:
+            if "delta" in jsondata:
+                bindata = self.__patch(jsondata["varname"], jsondata["delta"], bindata)
+
+            ret[jsondata["varname"]] = loads(bindata)
+
+        return True
+
+    def __delta(self, name, varname, bindata):
+        prev = self.sent.get((name, varname))
+        self.sent[(name, varname)] = bindata
+
+        if prev is not None and len(prev) == len(bindata):
+            delta = dimeb.delta(prev, bindata)
+
+            if len(delta) < len(bindata):
+                return True, delta
+
+        return False, bindata
+
+    def __patch(self, varname, delta, bindata):
+        if delta:
+            if varname not in self.received:
+                raise RuntimeError("Received a delta of {} without its previous value".format(varname))
+
+            bindata = dimeb.patch(self.received[varname], bindata)
+        else:
+            bindata = bytes(bindata)
+
+        self.received[varname] = bindata
+
+        return bindata
+
+    def __split(self, bindata, lengths):
+        view = memoryview(bindata)
+
+        return [view[end - n:end] for n, end in zip(lengths, itertools.accumulate(lengths))]
+
+    def __send(self, jsondata, bindata = b"", group = 0, noack = False):
         #print("->", jsondata)
 
+        opcode = None
+        flags = FLAG_NOACK if noack else 0
+
+        # The command moves into the header in DiME v2
+        if self.version >= 2:
+            jsondata = dict(jsondata)
+            opcode = OPCODES[jsondata.pop("command")]
+
         jsondata = json.dumps(jsondata).encode("utf-8")
 
-        data = b"DiME" + \
-               struct.pack("!II", len(jsondata), len(bindata)) + \
+        if self.shm and len(bindata) >= SHM_THRESHOLD:
+            fd = self.__shm_create(bindata)
+
+            data = self.__header(b"DiMS", flags | FLAG_SHM, opcode, group, len(jsondata), len(bindata)) + \
+                   jsondata
+
+            try:
+                n = self.conn.sendmsg([data], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, array.array("i", [fd]))])
+                self.conn.sendall(data[n:])
+            finally:
+                os.close(fd)
+
+            return
+
+        if self.zlib and len(bindata) >= self.zlib_threshold:
+            compressed = zlib.compress(bindata)
+
+            if len(compressed) + 4 < len(bindata):
+                data = self.__header(b"DiMZ", flags | FLAG_ZLIB, opcode, group, len(jsondata), len(compressed) + 4) + \
+                       jsondata + \
+                       struct.pack("!I", len(bindata)) + \
+                       compressed
+
+                self.conn.sendall(data)
+                return
+
+        data = self.__header(b"DiME", flags, opcode, group, len(jsondata), len(bindata)) + \
                jsondata + \
                bindata
 
         self.conn.sendall(data)
 
+    def __header(self, magic, flags, opcode, group, jsondata_len, bindata_len):
+        if opcode is None:
+            return magic + struct.pack("!II", jsondata_len, bindata_len)
+
+        # Sequence number 0 is left for messages the server sends unprompted
+        self.seq = self.seq % 0xFFFFFFFF + 1
+
+        return b"DiM2" + struct.pack("!BBHIIII", opcode, flags, 0, group, self.seq, jsondata_len, bindata_len)
+
     def __recv(self):
-        header = self.conn.recv(12, socket.MSG_WAITALL)
+        while True:
+            msg = self.__recvone()
+
+            if msg is not None:
+                return msg
+
+    def __recvpushed(self):
+        msg = self.__recvone()
+
+        # Nothing else should arrive unprompted, but errors
+        if msg is not None and msg[0].get("status", 0) < 0:
+            raise RuntimeError(msg[0]["error"])
+
+    def __recvone(self):
+        jsondata, bindata = self.__recvmsg()
 
-        if header[:4] != b"DiME":
+        # Messages pushed to a subscription wait for sync
+        if self.subscribed and "status" not in jsondata:
+            self.pushed.extend(self.__messages(jsondata, bindata))
+            return None
+
+        # So do acks to the credits granted to it
+        if self.acks > 0 and "status" in jsondata:
+            self.acks -= 1
+
+            if jsondata["status"] < 0:
+                raise RuntimeError(jsondata["error"])
+
+            return None
+
+        return jsondata, bindata
+
+    def __recvmsg(self):
+        header = self.__recvall(12)
+        magic = header[:4]
+        self.rseq = 0
+
+        if magic == b"DiM2" and self.version >= 2:
+            header += self.__recvall(12)
+            _, flags, _, _, self.rseq, jsondata_len, bindata_len = struct.unpack("!BBHIIII", header[4:])
+
+            if flags == FLAG_SHM:
+                magic = b"DiMS"
+            elif flags == FLAG_ZLIB:
+                magic = b"DiMZ"
+            elif flags == 0:
+                magic = b"DiME"
+        else:
+            jsondata_len, bindata_len = struct.unpack("!II", header[4:])
+
+        if magic != b"DiME" and not (self.shm and magic == b"DiMS") and not (self.zlib and magic == b"DiMZ"):
             raise RuntimeError("Invalid DiME message")
 
-        jsondata_len, bindata_len = struct.unpack("!II", header[4:])
+        if magic == b"DiMS":
+            data = self.__recvall(jsondata_len)
+            bindata = self.__shm_map(bindata_len)
+        else:
+            data = self.__recvall(jsondata_len + bindata_len)
+            bindata = data[jsondata_len:]
+
+            if magic == b"DiMZ":
+                bindata = zlib.decompress(bindata[4:])
+
+                if len(bindata) != struct.unpack("!I", data[jsondata_len:jsondata_len + 4])[0]:
+                    raise RuntimeError("Invalid DiME message")
 
-        data = self.conn.recv(jsondata_len + bindata_len, socket.MSG_WAITALL)
         jsondata = json.loads(data[:jsondata_len].decode("utf-8"))
-        bindata = data[jsondata_len:]
 
         if "status" in jsondata and jsondata["status"] > 0 and "meta" in jsondata and jsondata["meta"]:
             self.__meta(jsondata)
-            return self.__recv()
+            return self.__recvmsg()
 
         #print("<-", jsondata)
 
         return jsondata, bindata
 
+    def __recvall(self, n):
+        if not self.shm:
+            return self.conn.recv(n, socket.MSG_WAITALL)
+
+        # File descriptors arrive along with the first byte of their header
+        data = bytearray(n)
+        view = memoryview(data)
+        ancbufsize = socket.CMSG_SPACE(SHM_MAXFDS * array.array("i").itemsize)
+        i = 0
+
+        while i < n:
+            m, ancdata, flags, _ = self.conn.recvmsg_into([view[i:]], ancbufsize)
+
+            for level, kind, fddata in ancdata:
+                if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                    fds = array.array("i")
+                    fds.frombytes(fddata[:len(fddata) - (len(fddata) % fds.itemsize)])
+                    self.fds.extend(fds)
+
+            if m == 0:
+                raise ConnectionError("Connection closed by the server")
+
+            i += m
+
+        return data
+
+    def __shm_create(self, bindata):
+        fd = os.memfd_create("dime", os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+
+        try:
+            view = memoryview(bindata).cast("B")
+
+            while len(view) > 0:
+                view = view[os.write(fd, view):]
+
+            # The server refuses segments that could shrink under it
+            fcntl.fcntl(fd, fcntl.F_ADD_SEALS, fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW | fcntl.F_SEAL_WRITE)
+        except:
+            os.close(fd)
+            raise
+
+        return fd
+
+    def __shm_map(self, n):
+        if len(self.fds) == 0:
+            raise RuntimeError("Missing file descriptor for shared memory")
+
+        fd = self.fds.popleft()
+
+        try:
+            if n == 0:
+                return b""
+
+            # Deserializers read straight from the mapping, which stays
+            # mapped for as long as anything refers to it
+            return memoryview(mmap.mmap(fd, n, prot = mmap.PROT_READ))
+        finally:
+            os.close(fd)
+
     def __meta(self, jsondata):
         if jsondata["command"] == "reregister":
             self.serialization = jsondata["serialization"]
@@ -5,7 +5,7 @@ import sys
 
 import numpy as np
 
-__all__ = ["loads", "dumps"]
+__all__ = ["loads", "dumps", "delta", "patch"]
 
 # Boolean sentinels
 TYPE_NULL  = 0x00
@@ -94,7 +94,7 @@ def loads_complex_double(s):
     real, imag = struct.unpack("!dd", s[1:17])
     return complex(real, imag), 17
 
-def loads_mat(s, dtype):
+def loads_mat(s, dtype, view = False):
     rank = s[1]
     offset = 4 * rank + 2
     shape = struct.unpack("!" + "I" * rank, s[2:offset])
@@ -106,84 +106,85 @@ def loads_mat(s, dtype):
         elif shape[1] == 1:
             shape = (shape[0],)
 
-    arr = np.frombuffer(s, dtype, count, offset).reshape(shape, order = "F")
-    if sys.byteorder != "big":
-        arr = arr.byteswap()
+    # A read-only view in the wire byte order, unless a writable copy is wanted
+    arr = np.frombuffer(s, dtype.newbyteorder(">"), count, offset).reshape(shape, order = "F")
+    if not view:
+        arr = arr.astype(dtype.newbyteorder("="))
 
     return arr, count * dtype.itemsize + offset
 
-def loads_mat_i8(s):
-    return loads_mat(s, np.dtype(np.int8))
+def loads_mat_i8(s, view = False):
+    return loads_mat(s, np.dtype(np.int8), view)
 
-def loads_mat_i16(s):
-    return loads_mat(s, np.dtype(np.int16))
+def loads_mat_i16(s, view = False):
+    return loads_mat(s, np.dtype(np.int16), view)
 
-def loads_mat_i32(s):
-    return loads_mat(s, np.dtype(np.int32))
+def loads_mat_i32(s, view = False):
+    return loads_mat(s, np.dtype(np.int32), view)
 
-def loads_mat_i64(s):
-    return loads_mat(s, np.dtype(np.int64))
+def loads_mat_i64(s, view = False):
+    return loads_mat(s, np.dtype(np.int64), view)
 
-def loads_mat_u8(s):
-    return loads_mat(s, np.dtype(np.uint8))
+def loads_mat_u8(s, view = False):
+    return loads_mat(s, np.dtype(np.uint8), view)
 
-def loads_mat_u16(s):
-    return loads_mat(s, np.dtype(np.uint16))
+def loads_mat_u16(s, view = False):
+    return loads_mat(s, np.dtype(np.uint16), view)
 
-def loads_mat_u32(s):
-    return loads_mat(s, np.dtype(np.uint32))
+def loads_mat_u32(s, view = False):
+    return loads_mat(s, np.dtype(np.uint32), view)
 
-def loads_mat_u64(s):
-    return loads_mat(s, np.dtype(np.uint64))
+def loads_mat_u64(s, view = False):
+    return loads_mat(s, np.dtype(np.uint64), view)
 
-def loads_mat_single(s):
-    return loads_mat(s, np.dtype(np.float32))
+def loads_mat_single(s, view = False):
+    return loads_mat(s, np.dtype(np.float32), view)
 
-def loads_mat_double(s):
-    return loads_mat(s, np.dtype(np.float64))
+def loads_mat_double(s, view = False):
+    return loads_mat(s, np.dtype(np.float64), view)
 
-def loads_mat_complex_single(s):
-    return loads_mat(s, np.dtype(np.complex64))
+def loads_mat_complex_single(s, view = False):
+    return loads_mat(s, np.dtype(np.complex64), view)
 
-def loads_mat_complex_double(s):
-    return loads_mat(s, np.dtype(np.complex128))
+def loads_mat_complex_double(s, view = False):
+    return loads_mat(s, np.dtype(np.complex128), view)
 
 def loads_string(s):
     siz = struct.unpack("!I", s[1:5])[0]
-    return s[5:(siz + 5)].decode("utf-8"), siz + 5
+    return str(s[5:(siz + 5)], "utf-8"), siz + 5
 
-def loads_array(s):
+def loads_array(s, view = False):
     siz = struct.unpack("!I", s[1:5])[0]
 
     ret = []
     i = 5
 
     for _ in range(siz):
-        element, element_siz = _loads(s[i:])
+        element, element_siz = _loads(s[i:], view)
 
         ret.append(element)
         i += element_siz
 
     return ret, i
 
-def loads_assocarray(s):
+def loads_assocarray(s, view = False):
     siz = struct.unpack("!I", s[1:5])[0]
 
     ret = {}
     i = 5
 
     for _ in range(siz):
-        key, key_siz = _loads(s[i:])
+        key, key_siz = _loads(s[i:], view)
         i += key_siz
 
-        val, val_siz = _loads(s[i:])
+        val, val_siz = _loads(s[i:], view)
         i += val_siz
 
         ret[key] = val
 
     return ret, i
 
-def _loads(s):
+def _loads(s, view = False):
     tab = {
         TYPE_NULL:  loads_null,
         TYPE_TRUE:  loads_true,
@@ -222,10 +223,16 @@ def _loads(s):
         TYPE_ASSOCARRAY: loads_assocarray
     }
 
+    # Matrices, and containers that may hold them, are decoded as asked
+    if s[0] & 0x10 or s[0] in (TYPE_ARRAY, TYPE_ASSOCARRAY):
+        return tab[s[0]](s, view)
+
     return tab[s[0]](s)
 
-def loads(x):
-    return _loads(x)[0]
+# Matrices decode to writable arrays in native byte order, or, if view is
+# true, to read-only big-endian views of x that save copying them
+def loads(x, view = False):
+    return _loads(x, view)[0]
 
 def dumps(x):
     if x is None:
@@ -292,3 +299,62 @@ def dumps(x):
 
     else:
         raise TypeError
+
+# Unchanged bytes between two changes are sent along if a new run would cost more
+DELTA_GAP = 8
+
+def delta(old, new):
+    """Encode a value as the changes from another of the same length
+
+    The result is the length of the value, followed by runs of changed
+    bytes, each an offset, a length and the bytes themselves, all
+    integers being unsigned, 32-bit and big-endian.
+    """
+
+    if len(old) != len(new):
+        raise ValueError("Deltas need values of the same length")
+
+    a = np.frombuffer(old, dtype = np.uint8)
+    b = np.frombuffer(new, dtype = np.uint8)
+
+    changed = np.flatnonzero(a != b)
+    ret = bytearray(struct.pack("!I", len(new)))
+
+    if len(changed) == 0:
+        return bytes(ret)
+
+    breaks = np.flatnonzero(np.diff(changed) > DELTA_GAP)
+    starts = np.concatenate(([changed[0]], changed[breaks + 1]))
+    ends = np.concatenate((changed[breaks], [changed[-1]])) + 1
+
+    view = memoryview(new)
+
+    for start, end in zip(starts.tolist(), ends.tolist()):
+        ret += struct.pack("!II", start, end - start)
+        ret += view[start:end]
+
+    return bytes(ret)
+
+def patch(old, d):
+    """Apply the changes encoded by delta to a value"""
+
+    n, = struct.unpack_from("!I", d)
+
+    if n != len(old):
+        raise ValueError("Delta does not match the length of the previous value")
+
+    ret = bytearray(old)
+    i = 4
+
+    while i < len(d):
+        start, length = struct.unpack_from("!II", d, i)
+        ret[start:start + length] = d[i + 8:i + 8 + length]
+        i += 8 + length
+
+    return bytes(ret)
+
+# Prefer the compiled codec where it was built
+try:
+    from dime._dimeb import loads, dumps
+except ImportError:
+    pass
@@ -45,7 +45,7 @@ def dime_JSON_dechook(dct):
     return dct
 
 def loads(x):
-    return json.loads(x.decode("utf-8"), object_hook = dime_JSON_dechook)
+    return json.loads(str(x, "utf-8"), object_hook = dime_JSON_dechook)
 
 def dumps(x):
     return json.dumps(x, cls = DimeJSONEncoder).encode("utf-8")
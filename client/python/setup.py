@@ -1,7 +1,7 @@
 #!/usr/bin/env python3
 # See https://packaging.python.org/tutorials/packaging-projects/ for reference
 
-from setuptools import setup
+from setuptools import Extension, setup
 
 with open("README.md", "r") as file:
     long_description = file.read()
@@ -18,5 +18,8 @@ setup(
     author_email = "nwest13@vols.utk.edu",
 
     url = "https://github.com/TheHashTableSlasher/dime2",
-    packages = ["dime"]
+    packages = ["dime"],
+
+    # Falls back to the pure-Python dimeb codec if this fails to build
+    ext_modules = [Extension("dime._dimeb", ["dime/_dimeb.c"], optional = True)]
 )
@@ -11,427 +11,1930 @@
 #   include <arpa/inet.h>
 #   include <netinet/in.h>
 #   include <unistd.h>
+#   include <sys/mman.h>
 #   include <sys/socket.h>
 #   include <sys/un.h>
 #endif
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
 #include <jansson.h>
 #include "client.h"
 #include "deque.h"
 #include "log.h"
 #include "server.h"
 #include "socket.h"
+#include "stats.h"
 #include "table.h"
 
-int dime_client_init(dime_client_t *clnt, int fd, const struct sockaddr *addr) {
-    clnt->fd = fd;
-    clnt->waiting = 0;
-    clnt->err[0] = '\0';
+void dime_rcmessage_incref(dime_rcmessage_t *msg) {
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+}
 
-    switch (addr->sa_family) {
-    case AF_INET6:
-        {
-            clnt->addr = malloc(40);
-            if (clnt->addr == NULL) {
-                return -1;
-            }
+void dime_rcmessage_decref(dime_rcmessage_t *msg) {
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (msg->jsondata != msg->json_inline) {
+            free(msg->jsondata);
+        }
 
-            struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *)addr;
-            char tmp[34];
+        if (msg->varname != msg->varname_inline) {
+            free(msg->varname);
+        }
 
-            inet_ntop(AF_INET6, &inet6->sin6_addr, tmp, sizeof(tmp));
-            snprintf(clnt->addr, 40, "%s:%hu", tmp, (unsigned short)(inet6->sin6_port));
+        for (size_t i = 0; i < DIME_FRAMING_COUNT; i++) {
+            free(msg->comp[i].data);
         }
 
-        break;
+#ifndef _WIN32
+        if (msg->shmfd >= 0) {
+            if (msg->bindata_len > 0) {
+                munmap(msg->bindata, msg->bindata_len);
+            }
 
-    case AF_INET:
+            close(msg->shmfd);
+        } else
+#endif
         {
-            clnt->addr = malloc(22);
-            if (clnt->addr == NULL) {
-                return -1;
-            }
+            free(msg->bindata);
+        }
 
-            struct sockaddr_in *inet = (struct sockaddr_in *)addr;
-            char s[16];
+        dime_pool_free(msg->pool, msg);
+    }
+}
 
-            inet_ntop(AF_INET, &inet->sin_addr, s, sizeof(s));
-            snprintf(clnt->addr, 22, "%s:%hu", s, (unsigned short)(inet->sin_port));
+/* Allocate a message holding one reference, taking ownership of bindata on success */
+static dime_rcmessage_t *dime_rcmessage_new(dime_server_t *srv, const dime_route_t *route, void *bindata, size_t bindata_len) {
+    dime_rcmessage_t *msg = dime_pool_alloc(&srv->msgpool);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    size_t jsondata_len = route->jsondata_len;
+
+    msg->jsondata = msg->json_inline;
+
+    /* Too long to store inline */
+    if (jsondata_len > DIME_RCMESSAGE_INLINE) {
+        msg->jsondata = malloc(jsondata_len);
+
+        if (msg->jsondata == NULL) {
+            dime_pool_free(&srv->msgpool, msg);
+
+            return NULL;
         }
+    }
 
-        break;
+    memcpy(msg->jsondata, route->jsonstr, jsondata_len);
 
-#ifndef _WIN32
-    case AF_UNIX:
-#endif
-        /*
-        // Attempt to get PID of other process on Linux
-#ifdef __linux__
-        {
-            struct ucred cred;
-            socklen_t credlen = sizeof(struct ucred);
+    const char *varname = route->varname;
 
-            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) >= 0) {
-                clnt->addr = malloc(30);
-                if (clnt->addr == NULL) {
-                    return -1;
+    msg->varname = NULL;
+
+    /* Kept for conflating queued messages */
+    if (varname != NULL) {
+        size_t varname_len = strlen(varname);
+
+        if (varname_len < DIME_RCMESSAGE_VARNAME_INLINE) {
+            msg->varname = msg->varname_inline;
+        } else {
+            msg->varname = malloc(varname_len + 1);
+
+            if (msg->varname == NULL) {
+                if (msg->jsondata != msg->json_inline) {
+                    free(msg->jsondata);
                 }
 
-                snprintf(clnt->addr, 30, "PID %d, fd %d", (int)cred.pid, fd);
+                dime_pool_free(&srv->msgpool, msg);
 
-                break;
+                return NULL;
             }
         }
-#endif
-        */
 
-    default:
-        clnt->addr = malloc(14);
-        if (clnt->addr == NULL) {
-            return -1;
-        }
+        memcpy(msg->varname, varname, varname_len + 1);
+    }
 
-        snprintf(clnt->addr, 14, "fd %d", fd);
+    msg->refs = 1;
+    msg->pool = &srv->msgpool;
+    msg->jsondata_len = jsondata_len;
+    msg->bindata = bindata;
+    msg->bindata_len = bindata_len;
+    msg->shmfd = -1;
 
-        break;
+    for (size_t i = 0; i < DIME_FRAMING_COUNT; i++) {
+        msg->frames_len[i] = 0;
+        msg->comp[i].data = NULL;
+        msg->comp[i].len = 0;
+        msg->comp[i].failed = 0;
     }
 
-    clnt->groups_len = 0;
-    clnt->groups_cap = 4;
+#ifdef DIME_USE_TRACE
+    msg->arrived = dime_trace_now();
+    msg->trace = &srv->trace;
+#endif
 
-    clnt->groups = malloc(sizeof(dime_group_t *) * clnt->groups_cap);
-    if (clnt->groups == NULL) {
-        free(clnt->addr);
+    return msg;
+}
 
-        return -1;
+static void dime_rcmessage_release(void *p) {
+    dime_rcmessage_decref(p);
+}
+
+/* Whether a message's shared memory segment can be passed to a socket as is */
+static int dime_rcmessage_passable(const dime_rcmessage_t *msg, const dime_socket_t *sock) {
+    return msg->shmfd >= 0 && dime_socket_shm_enabled(sock);
+}
+
+/* Choose the framing of a message for a socket, compressing it if needed */
+static int dime_rcmessage_framing(dime_rcmessage_t *msg, const dime_socket_t *sock) {
+    if (dime_rcmessage_passable(msg, sock)) {
+        return DIME_FRAMING_SHM;
     }
 
-    if (dime_socket_init(&clnt->sock, fd) < 0) {
-        free(clnt->groups);
-        free(clnt->addr);
+    int framing = dime_socket_framing(sock, msg->bindata_len);
+    int fallback;
+    size_t orig_len;
 
-        return -1;
+    if (framing == DIME_FRAMING_ZLIB) {
+        fallback = DIME_FRAMING_RAW;
+        orig_len = msg->bindata_len;
+    } else if (framing == DIME_FRAMING_WS_DEFLATE) {
+        fallback = DIME_FRAMING_WS;
+        orig_len = 12 + msg->jsondata_len + msg->bindata_len;
+    } else {
+        return framing;
     }
 
-    if (dime_deque_init(&clnt->queue) < 0) {
-        dime_socket_destroy(&clnt->sock);
-        free(clnt->groups);
-        free(clnt->addr);
+    if (msg->comp[framing].data == NULL && !msg->comp[framing].failed) {
+        if (dime_socket_compress(framing, msg->jsondata, msg->jsondata_len, msg->bindata, msg->bindata_len, &msg->comp[framing].data, &msg->comp[framing].len) < 0) {
+            msg->comp[framing].data = NULL;
+            msg->comp[framing].failed = 1;
+        } else if (msg->comp[framing].len >= orig_len) {
+            /* Incompressible data goes out as is */
+            free(msg->comp[framing].data);
 
-        return -1;
+            msg->comp[framing].data = NULL;
+            msg->comp[framing].failed = 1;
+        }
     }
 
-    return 0;
+    return msg->comp[framing].failed ? fallback : framing;
 }
 
-void dime_client_destroy(dime_client_t *clnt) {
-    for (size_t i = 0; i < clnt->groups_len; i++) {
-        dime_group_t *group = clnt->groups[i];
+/* Get the framing header of a message in a framing, building it if needed */
+static const unsigned char *dime_rcmessage_frame(dime_rcmessage_t *msg, int framing, size_t *len) {
+    if (msg->frames_len[framing] == 0) {
+        switch (framing) {
+        case DIME_FRAMING_ZLIB:
+            msg->frames_len[framing] = dime_socket_frame(framing, msg->frames[framing], msg->jsondata_len, msg->comp[framing].len);
+            break;
 
-        for (size_t j = 0; j < group->clnts_len; j++) {
-            if (group->clnts[j] == clnt) {
-                group->clnts_len--;
-                group->clnts[j] = group->clnts[group->clnts_len];
+        case DIME_FRAMING_WS_DEFLATE:
+            msg->frames_len[framing] = dime_socket_frame(framing, msg->frames[framing], 0, msg->comp[framing].len);
+            break;
 
-                break;
-            }
+        default:
+            msg->frames_len[framing] = dime_socket_frame(framing, msg->frames[framing], msg->jsondata_len, msg->bindata_len);
+            break;
         }
     }
 
-    dime_deque_iter_t it;
+    *len = msg->frames_len[framing];
+
+    return msg->frames[framing];
+}
+
+static size_t dime_rcmessage_size(const dime_rcmessage_t *msg) {
+    return msg->jsondata_len + msg->bindata_len;
+}
+
+/* Whether a client's queue would be over its limits with extra more bytes in n more messages */
+static int dime_client_overfull(const dime_client_t *clnt, size_t n, size_t extra) {
+    return (clnt->queue_max_len > 0 && dime_deque_len(&clnt->queue) + n > clnt->queue_max_len) ||
+           (clnt->queue_max_bytes > 0 && clnt->queue_bytes + extra > clnt->queue_max_bytes);
+}
+
+/* Replace the newest queued message for the same variable; returns 1 if one was found */
+static int dime_client_conflate(dime_client_t *clnt, dime_rcmessage_t *msg) {
+    dime_deque_iter_t it, found;
+    int nfound = 0;
 
     dime_deque_iter_init(&it, &clnt->queue);
 
     while (dime_deque_iter_next(&it)) {
-        dime_rcmessage_t *msg = it.val;
-
-        msg->refs--;
+        dime_rcmessage_t *other = it.val;
 
-        if (msg->refs == 0) {
-            free(msg->jsondata);
-            free(msg->bindata);
-            free(msg);
+        if (other->varname != NULL && strcmp(other->varname, msg->varname) == 0) {
+            found = it;
+            nfound = 1;
         }
     }
 
-    free(clnt->addr);
-    free(clnt->groups);
-    dime_deque_destroy(&clnt->queue);
-    dime_socket_destroy(&clnt->sock);
-}
+    if (!nfound) {
+        return 0;
+    }
 
-int dime_client_handshake(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
-    const char *serialization;
-    int tls;
+    dime_rcmessage_t *old = found.val;
 
-    json_error_t err;
+    dime_rcmessage_incref(msg);
+    dime_deque_iter_set(&found, msg);
 
-    if (json_unpack_ex(jsondata, &err, 0, "{sssb}", "serialization", &serialization, "tls", &tls) < 0) {
-        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
-        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
+    clnt->queue_bytes += dime_rcmessage_size(msg);
+    clnt->queue_bytes -= dime_rcmessage_size(old);
 
-        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
-        }
+    dime_rcmessage_decref(old);
 
-        return -1;
-    }
+    return 1;
+}
 
-    int serialization_i;
+/*
+ * Queue a message for a client, subject to the client's queue limits.
+ * Returns 0 if the message was queued (or conflated), 1 if the client
+ * rejected it, or -1 on error.
+ */
+static int dime_client_enqueue(dime_client_t *clnt, dime_rcmessage_t *msg) {
+    int conflated = 0;
+
+    if (dime_client_overfull(clnt, 1, dime_rcmessage_size(msg))) {
+        if (clnt->queue_policy == DIME_QUEUE_CONFLATE && msg->varname != NULL) {
+            conflated = dime_client_conflate(clnt, msg);
+        }
 
-    if (strcmp(serialization, "matlab") == 0) {
-        serialization_i = DIME_MATLAB;
-    } else if (strcmp(serialization, "pickle") == 0) {
-        serialization_i = DIME_PICKLE;
-    } else if (strcmp(serialization, "dimeb") == 0) {
-        serialization_i = DIME_DIMEB;
-    } else if (strcmp(serialization, "json") == 0) {
-        serialization_i = DIME_JSON;
-    } else {
-        return -1;
-    }
+        /* Unless it replaced a message, conflation refuses rather than lose another variable's value */
+        if (clnt->queue_policy == DIME_QUEUE_REJECT || (clnt->queue_policy == DIME_QUEUE_CONFLATE && !conflated)) {
+            clnt->stats.msgs_dropped++;
+            clnt->srv->stats.dropped++;
 
-    if (srv->serialization == DIME_NO_SERIALIZATION) {
-        srv->serialization = serialization_i;
-    } else if (srv->serialization != serialization_i && srv->serialization != DIME_DIMEB && srv->serialization != DIME_JSON) {
-        json_t *meta = json_pack("{sisbssss}", "status", 1, "meta", 1, "command", "reregister", "serialization", "dimeb");
-        if (meta == NULL) {
-            return -1;
+            return 1;
         }
+    }
 
-        char *meta_str = json_dumps(meta, JSON_COMPACT);
-        if (meta_str == NULL) {
-            json_decref(meta);
-
+    if (conflated) {
+        /* A conflated message stands in for the one it replaced */
+        clnt->stats.msgs_dropped++;
+        clnt->srv->stats.dropped++;
+    } else {
+        if (dime_deque_pushr(&clnt->queue, msg) < 0) {
             return -1;
         }
 
-        json_decref(meta);
+        dime_rcmessage_incref(msg);
+        clnt->queue_bytes += dime_rcmessage_size(msg);
+    }
 
-        dime_table_iter_t it;
-        dime_table_iter_init(&it, &srv->fd2clnt);
+    clnt->stats.msgs_queued++;
+    clnt->srv->stats.relayed++;
 
-        while (dime_table_iter_next(&it)) {
-            dime_client_t *other = it.val;
+    /* Make room by dropping the oldest messages, but never the newest */
+    while (clnt->queue_policy == DIME_QUEUE_DROP_OLDEST && dime_deque_len(&clnt->queue) > 1 && dime_client_overfull(clnt, 0, 0)) {
+        dime_rcmessage_t *old = dime_deque_popl(&clnt->queue);
 
-            if (other != clnt && dime_socket_push_str(&other->sock, meta_str, NULL, 0) < 0) {
-                free(meta_str);
+        clnt->queue_bytes -= dime_rcmessage_size(old);
+        dime_rcmessage_decref(old);
 
-                return -1;
-            }
-        }
+        clnt->stats.msgs_dropped++;
+        clnt->srv->stats.dropped++;
+    }
 
-        free(meta_str);
-        srv->serialization = DIME_DIMEB;
+    if (dime_deque_len(&clnt->queue) > clnt->stats.queue_peak) {
+        clnt->stats.queue_peak = dime_deque_len(&clnt->queue);
     }
 
-    switch (srv->serialization) {
-    case DIME_MATLAB:
-        serialization = "matlab";
-        break;
+    return 0;
+}
 
-    case DIME_PICKLE:
-        serialization = "pickle";
-        break;
+/*
+ * Push the reply to a wait, {"status":0,"n":N}, formatted directly. If
+ * wakeup is nonzero, the wait is another client's that was blocked, so the
+ * reply is not framed as a response to that client's last message.
+ */
+static ssize_t dime_client_push_n(dime_socket_t *sock, size_t n, int wakeup) {
+    char jsonstr[48];
 
-    case DIME_DIMEB:
-        serialization = "dimeb";
-        break;
+    snprintf(jsonstr, sizeof(jsonstr), "{\"status\":0,\"n\":%zu}", n);
 
-    case DIME_JSON:
-        serialization = "json";
-        break;
+    if (wakeup) {
+        return dime_socket_notify_str(sock, jsonstr);
     }
 
-    tls = (tls && srv->tlsctx != NULL);
+    return dime_socket_push_str(sock, jsonstr, NULL, 0);
+}
 
-    json_t *response = json_pack("{sisssb}", "status", 0, "serialization", serialization, "tls", tls);
-    if (response == NULL) {
-        return -1;
+static int dime_client_stream(dime_client_t *clnt, size_t *npushed);
+
+/*
+ * Queue a message for another client, then push queued messages to it if
+ * it is subscribed, or the reply to its wait if it was blocked on messages
+ * that are still queued. Returns like dime_client_enqueue.
+ */
+static int dime_client_deliver(dime_client_t *other, dime_rcmessage_t *msg) {
+    int queued = dime_client_enqueue(other, msg);
+
+    if (queued != 0 || (!other->waiting && other->credits == 0)) {
+        return queued;
     }
 
-    if (dime_socket_push(&clnt->sock, response, NULL, 0) < 0) {
-        json_decref(response);
+    size_t streamed;
+
+    pthread_mutex_lock(&other->lock);
 
+    int ret = dime_client_stream(other, &streamed);
+    int woken = (ret >= 0 && other->waiting && dime_deque_len(&other->queue) > 0);
+
+    if (woken && dime_client_push_n(&other->sock, dime_deque_len(&other->queue), 1) < 0) {
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&other->lock);
+
+    if (ret < 0) {
         return -1;
     }
 
-    json_decref(response);
+    if (woken) {
+        other->waiting = 0;
+    }
 
-    if (tls) {
-        if (srv->verbosity >= 1) {
-            dime_warn("Temporarily pausing event loop to handle a TLS handshake");
-        }
+    if (woken || streamed > 0) {
+        dime_server_wake(other->worker);
+    }
 
-        if (dime_socket_init_tls(&clnt->sock, srv->tlsctx) < 0) {
-            return -1;
-        }
+    return 0;
+}
 
-        if (srv->verbosity >= 1) {
-            dime_warn("TLS handshake established with %s", clnt->addr);
+/* Whether a client is a member of a group */
+static int dime_client_ingroup(const dime_client_t *clnt, const dime_group_t *group) {
+    for (size_t i = 0; i < clnt->groups_len; i++) {
+        if (clnt->groups[i].group == group) {
+            return 1;
         }
     }
 
     return 0;
 }
 
-int dime_client_join(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
-    json_t *arr;
-    json_error_t err;
+/* Version of a variable sent as deltas last queued for a client */
+typedef struct {
+    char *varname;       /* Variable name, also the key in the client's table */
+    dime_delta_t *delta; /* Variable, or NULL if the client may be out of date */
+    uint64_t version;    /* Version of the variable last queued */
+} dime_client_delta_t;
+
+static dime_table_t *dime_deltas_new(void) {
+    dime_table_t *tbl = malloc(sizeof(dime_table_t));
+    if (tbl == NULL) {
+        return NULL;
+    }
 
-    if (json_unpack_ex(jsondata, &err, 0, "{so}", "name", &arr) < 0) {
-        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
-        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
+    if (dime_table_init(tbl, dime_table_cmp_str, dime_table_hash_str) < 0) {
+        free(tbl);
 
-        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
+        return NULL;
+    }
+
+    return tbl;
+}
+
+/* Find the variable sent to a group as deltas with a name, creating it if asked */
+static dime_delta_t *dime_group_delta(dime_group_t *group, const char *varname, int create) {
+    if (group->deltas == NULL) {
+        if (!create || (group->deltas = dime_deltas_new()) == NULL) {
+            return NULL;
         }
+    }
 
-        return -1;
+    dime_delta_t *delta = dime_table_search(group->deltas, varname);
+
+    if (delta != NULL || !create) {
+        return delta;
     }
 
-    size_t i;
-    json_t *v;
+    delta = malloc(sizeof(dime_delta_t));
+    if (delta == NULL) {
+        return NULL;
+    }
 
-    json_array_foreach(arr, i, v) {
-        const char *name = json_string_value(v);
-        if (name == NULL) {
-            strncpy(srv->err, "JSON parsing error: expected string", sizeof(srv->err));
-            srv->err[sizeof(srv->err) - 1] = '\0';
+    delta->varname = strdup(varname);
+    if (delta->varname == NULL) {
+        free(delta);
 
-            json_t *response = json_pack("{siss}", "status", -1, "error", "JSON parsing error: expected string");
-            if (response != NULL) {
-                dime_socket_push(&clnt->sock, response, NULL, 0);
-                json_decref(response);
-            }
+        return NULL;
+    }
 
-            return -1;
-        }
+    delta->value = NULL;
+    delta->value_len = 0;
+    delta->version = 0;
+    delta->sender = NULL;
 
-        for (size_t j = 0; j < clnt->groups_len; j++) {
-            if (strcmp(name, clnt->groups[j]->name) == 0) {
-                strncpy(srv->err, "Client is already in group: ", sizeof(srv->err));
-                strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+    if (dime_table_insert(group->deltas, delta->varname, delta) < 0) {
+        free(delta->varname);
+        free(delta);
 
-                json_t *response = json_pack("{siss+}", "status", -1, "error", "Client is already in group: ", name);
-                if (response != NULL) {
+        return NULL;
+    }
+
+    return delta;
+}
+
+static uint32_t dime_delta_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/*
+ * Apply a delta to the kept value of a variable. The delta is checked in
+ * full beforehand, so that the value is left alone if it is malformed.
+ */
+static int dime_delta_apply(dime_delta_t *delta, const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+
+    if (len < 4 || dime_delta_u32(p) != delta->value_len) {
+        return -1;
+    }
+
+    for (const unsigned char *run = p + 4; run < end; ) {
+        if ((size_t)(end - run) < 8) {
+            return -1;
+        }
+
+        size_t off = dime_delta_u32(run), n = dime_delta_u32(run + 4);
+
+        if (off > delta->value_len || n > delta->value_len - off || n > (size_t)(end - run) - 8) {
+            return -1;
+        }
+
+        run += 8 + n;
+    }
+
+    for (const unsigned char *run = p + 4; run < end; ) {
+        size_t off = dime_delta_u32(run), n = dime_delta_u32(run + 4);
+
+        memcpy(delta->value + off, run + 8, n);
+        run += 8 + n;
+    }
+
+    return 0;
+}
+
+/* Whether a client was queued the version of a variable before the latest */
+static int dime_client_current(dime_client_t *clnt, const dime_delta_t *delta) {
+    /* Queues that drop messages may have dropped that version */
+    if (clnt->deltas == NULL || clnt->queue_policy != DIME_QUEUE_REJECT) {
+        return 0;
+    }
+
+    const dime_client_delta_t *rec = dime_table_search(clnt->deltas, delta->varname);
+
+    return rec != NULL && rec->delta == delta && rec->version + 1 == delta->version;
+}
+
+/* Record whether a client was queued the latest version of a variable */
+static int dime_client_track(dime_client_t *clnt, dime_delta_t *delta, int queued) {
+    if (clnt->deltas == NULL && (clnt->deltas = dime_deltas_new()) == NULL) {
+        return -1;
+    }
+
+    dime_client_delta_t *rec = dime_table_search(clnt->deltas, delta->varname);
+
+    if (rec == NULL) {
+        rec = malloc(sizeof(dime_client_delta_t));
+        if (rec == NULL) {
+            return -1;
+        }
+
+        rec->varname = strdup(delta->varname);
+        if (rec->varname == NULL) {
+            free(rec);
+
+            return -1;
+        }
+
+        if (dime_table_insert(clnt->deltas, rec->varname, rec) < 0) {
+            free(rec->varname);
+            free(rec);
+
+            return -1;
+        }
+    }
+
+    rec->delta = queued ? delta : NULL;
+    rec->version = delta->version;
+
+    return 0;
+}
+
+/* Mark a client out of date for a variable, after it was sent from elsewhere */
+static void dime_client_forget(dime_client_t *clnt, const char *varname) {
+    if (clnt->deltas == NULL || varname == NULL) {
+        return;
+    }
+
+    dime_client_delta_t *rec = dime_table_search(clnt->deltas, varname);
+
+    if (rec != NULL) {
+        rec->delta = NULL;
+    }
+}
+
+/* Build a message carrying the full value of a variable, for clients that are out of date */
+static dime_rcmessage_t *dime_rcmessage_full(dime_server_t *srv, const dime_route_t *route, const dime_delta_t *delta) {
+    json_t *jsondata = json_loadb(route->jsonstr, route->jsondata_len, 0, NULL);
+    if (jsondata == NULL) {
+        return NULL;
+    }
+
+    if (json_object_set_new(jsondata, "delta", json_false()) < 0) {
+        json_decref(jsondata);
+
+        return NULL;
+    }
+
+    char *jsonstr = json_dumps(jsondata, JSON_COMPACT);
+
+    json_decref(jsondata);
+
+    if (jsonstr == NULL) {
+        return NULL;
+    }
+
+    void *value = malloc(delta->value_len);
+    if (value == NULL && delta->value_len > 0) {
+        free(jsonstr);
+
+        return NULL;
+    }
+
+    if (delta->value_len > 0) {
+        memcpy(value, delta->value, delta->value_len);
+    }
+
+    dime_route_t full = *route;
+
+    full.jsonstr = jsonstr;
+    full.jsondata_len = strlen(jsonstr);
+
+    dime_rcmessage_t *msg = dime_rcmessage_new(srv, &full, value, delta->value_len);
+
+    free(jsonstr);
+
+    if (msg == NULL) {
+        free(value);
+    }
+
+    return msg;
+}
+
+/* Push a command that answers nothing to a peered server */
+static int dime_client_notify_peer(dime_client_t *peer, const char *command, json_t *names) {
+    json_t *jsondata = json_pack("{sssO}", "command", command, "name", names);
+    if (jsondata == NULL) {
+        return -1;
+    }
+
+    char *jsonstr = json_dumps(jsondata, JSON_COMPACT);
+
+    json_decref(jsondata);
+
+    if (jsonstr == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&peer->lock);
+    ssize_t pushed = dime_socket_notify_str(&peer->sock, jsonstr);
+    pthread_mutex_unlock(&peer->lock);
+
+    free(jsonstr);
+
+    if (pushed < 0) {
+        return -1;
+    }
+
+    dime_server_wake(peer->worker);
+
+    return 0;
+}
+
+/*
+ * Tell every peered server that a group gained its first local member
+ * ("join") or lost its last one ("leave"). Nothing is sent once the
+ * server is shutting down, as the workers are gone by then.
+ */
+static void dime_client_advertise(dime_server_t *srv, const char *command, const char *name) {
+    if (srv->workers_len == 0) {
+        return;
+    }
+
+    json_t *names = json_pack("[s]", name);
+    if (names == NULL) {
+        dime_err("Failed to advertise group \"%s\" (%s)", name, strerror(errno));
+
+        return;
+    }
+
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_client_t *other = srv->clnts[i];
+
+        if (other->peer && dime_client_notify_peer(other, command, names) < 0) {
+            dime_err("Failed to advertise group \"%s\" to %s (%s)", name, other->addr, strerror(errno));
+        }
+    }
+
+    json_decref(names);
+}
+
+/* Envelope of a message forwarded to a peered server, freed once sent */
+typedef struct {
+    dime_rcmessage_t *msg;
+    unsigned char buf[]; /* Framing header, then the "forward" command */
+} dime_forward_t;
+
+static void dime_forward_release(void *p) {
+    dime_forward_t *fwd = p;
+
+    dime_rcmessage_decref(fwd->msg);
+    free(fwd);
+}
+
+/*
+ * Send a message to a peered server as a "forward" command, to be relayed
+ * to its clients in the groups in names, or to all of them if names is
+ * NULL. The binary and JSON portions of the message follow the command by
+ * reference, in that order, so that the peer can keep the binary portion
+ * where it was received.
+ */
+static int dime_client_forward_to(dime_client_t *peer, dime_rcmessage_t *msg, const char *const *names, size_t names_len) {
+    json_t *jsondata = json_pack("{sssI}", "command", "forward", "json", (json_int_t)msg->jsondata_len);
+    if (jsondata == NULL) {
+        return -1;
+    }
+
+    if (names != NULL) {
+        json_t *arr = json_array();
+
+        if (arr == NULL || json_object_set_new(jsondata, "name", arr) < 0) {
+            json_decref(jsondata);
+
+            return -1;
+        }
+
+        for (size_t i = 0; i < names_len; i++) {
+            if (json_array_append_new(arr, json_string(names[i])) < 0) {
+                json_decref(jsondata);
+
+                return -1;
+            }
+        }
+    }
+
+    char *jsonstr = json_dumps(jsondata, JSON_COMPACT);
+
+    json_decref(jsondata);
+
+    if (jsonstr == NULL) {
+        return -1;
+    }
+
+    size_t jsondata_len = strlen(jsonstr);
+
+    dime_forward_t *fwd = malloc(sizeof(dime_forward_t) + DIME_FRAME_MAXLEN + jsondata_len);
+    if (fwd == NULL) {
+        free(jsonstr);
+
+        return -1;
+    }
+
+    /* Peer links never negotiate anything but the raw framing */
+    size_t hdr_len = dime_socket_frame(DIME_FRAMING_RAW, fwd->buf, jsondata_len, msg->bindata_len + msg->jsondata_len);
+
+    memcpy(fwd->buf + hdr_len, jsonstr, jsondata_len);
+    free(jsonstr);
+
+    dime_rcmessage_incref(msg);
+    fwd->msg = msg;
+
+    pthread_mutex_lock(&peer->lock);
+    ssize_t pushed = dime_socket_push_ref(&peer->sock, fwd->buf, hdr_len + jsondata_len, msg->bindata, msg->bindata_len, msg->jsondata, msg->jsondata_len, dime_forward_release, fwd);
+    pthread_mutex_unlock(&peer->lock);
+
+    if (pushed < 0) {
+        dime_forward_release(fwd);
+
+        return -1;
+    }
+
+    peer->stats.msgs_out++;
+    peer->srv->stats.forwarded++;
+
+    dime_server_wake(peer->worker);
+
+    return 0;
+}
+
+int dime_client_init(dime_client_t *clnt, int fd, const struct sockaddr *addr) {
+    clnt->fd = fd;
+    clnt->waiting = 0;
+    clnt->peer = 0;
+    clnt->batch = 0;
+    clnt->credits = 0;
+    clnt->coalesce = 0;
+    clnt->queue_bytes = 0;
+    clnt->queue_max_bytes = 0;
+    clnt->queue_max_len = 0;
+    clnt->queue_policy = DIME_QUEUE_REJECT;
+    clnt->deltas = NULL;
+    memset(&clnt->stats, 0, sizeof(clnt->stats));
+    clnt->worker = NULL;
+    clnt->err[0] = '\0';
+
+    switch (addr->sa_family) {
+    case AF_INET6:
+        {
+            clnt->addr = malloc(40);
+            if (clnt->addr == NULL) {
+                return -1;
+            }
+
+            struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *)addr;
+            char tmp[34];
+
+            inet_ntop(AF_INET6, &inet6->sin6_addr, tmp, sizeof(tmp));
+            snprintf(clnt->addr, 40, "%s:%hu", tmp, (unsigned short)(inet6->sin6_port));
+        }
+
+        break;
+
+    case AF_INET:
+        {
+            clnt->addr = malloc(22);
+            if (clnt->addr == NULL) {
+                return -1;
+            }
+
+            struct sockaddr_in *inet = (struct sockaddr_in *)addr;
+            char s[16];
+
+            inet_ntop(AF_INET, &inet->sin_addr, s, sizeof(s));
+            snprintf(clnt->addr, 22, "%s:%hu", s, (unsigned short)(inet->sin_port));
+        }
+
+        break;
+
+#ifndef _WIN32
+    case AF_UNIX:
+#endif
+        /*
+        // Attempt to get PID of other process on Linux
+#ifdef __linux__
+        {
+            struct ucred cred;
+            socklen_t credlen = sizeof(struct ucred);
+
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) >= 0) {
+                clnt->addr = malloc(30);
+                if (clnt->addr == NULL) {
+                    return -1;
+                }
+
+                snprintf(clnt->addr, 30, "PID %d, fd %d", (int)cred.pid, fd);
+
+                break;
+            }
+        }
+#endif
+        */
+
+    default:
+        clnt->addr = malloc(14);
+        if (clnt->addr == NULL) {
+            return -1;
+        }
+
+        snprintf(clnt->addr, 14, "fd %d", fd);
+
+        break;
+    }
+
+    clnt->groups_len = 0;
+    clnt->groups_cap = 4;
+
+    clnt->groups = malloc(sizeof(*clnt->groups) * clnt->groups_cap);
+    if (clnt->groups == NULL) {
+        free(clnt->addr);
+
+        return -1;
+    }
+
+    if (dime_socket_init(&clnt->sock, fd) < 0) {
+        free(clnt->groups);
+        free(clnt->addr);
+
+        return -1;
+    }
+
+    if (dime_deque_init(&clnt->queue) < 0) {
+        dime_socket_destroy(&clnt->sock);
+        free(clnt->groups);
+        free(clnt->addr);
+
+        return -1;
+    }
+
+    if (pthread_mutex_init(&clnt->lock, NULL) != 0) {
+        dime_deque_destroy(&clnt->queue);
+        dime_socket_destroy(&clnt->sock);
+        free(clnt->groups);
+        free(clnt->addr);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Removes a client from the group at index i of its group array. Both
+ * arrays are swap-removed, fixing up the back-index of the moved entries.
+ */
+static void dime_client_ungroup(dime_client_t *clnt, size_t i) {
+    dime_group_t *group = clnt->groups[i].group;
+    size_t j = clnt->groups[i].index;
+
+    group->clnts_len--;
+
+    if (!clnt->peer && --group->locals == 0) {
+        dime_client_advertise(clnt->srv, "leave", group->name);
+    }
+
+    if (j < group->clnts_len) {
+        group->clnts[j] = group->clnts[group->clnts_len];
+        group->clnts[j].clnt->groups[group->clnts[j].index].index = j;
+    }
+
+    clnt->groups_len--;
+
+    if (i < clnt->groups_len) {
+        clnt->groups[i] = clnt->groups[clnt->groups_len];
+        clnt->groups[i].group->clnts[clnt->groups[i].index].index = i;
+    }
+}
+
+void dime_client_destroy(dime_client_t *clnt) {
+    while (clnt->groups_len > 0) {
+        dime_client_ungroup(clnt, clnt->groups_len - 1);
+    }
+
+    dime_deque_iter_t it;
+
+    dime_deque_iter_init(&it, &clnt->queue);
+
+    while (dime_deque_iter_next(&it)) {
+        dime_rcmessage_decref(it.val);
+    }
+
+    if (clnt->deltas != NULL) {
+        dime_table_iter_t it;
+
+        dime_table_iter_init(&it, clnt->deltas);
+
+        while (dime_table_iter_next(&it)) {
+            dime_client_delta_t *rec = it.val;
+
+            free(rec->varname);
+            free(rec);
+        }
+
+        dime_table_destroy(clnt->deltas);
+        free(clnt->deltas);
+    }
+
+    free(clnt->addr);
+    free(clnt->groups);
+    dime_deque_destroy(&clnt->queue);
+    dime_socket_destroy(&clnt->sock);
+    pthread_mutex_destroy(&clnt->lock);
+}
+
+int dime_client_register(dime_client_t *clnt, dime_server_t *srv) {
+    if (srv->clnts_len >= srv->clnts_cap) {
+        size_t ncap = (srv->clnts_cap * 3) / 2;
+
+        dime_client_t **nclnts = realloc(srv->clnts, sizeof(dime_client_t *) * ncap);
+        if (nclnts == NULL) {
+            return -1;
+        }
+
+        srv->clnts = nclnts;
+        srv->clnts_cap = ncap;
+    }
+
+    if (dime_table_insert(&srv->fd2clnt, &clnt->fd, clnt) < 0) {
+        return -1;
+    }
+
+    clnt->index = srv->clnts_len;
+    srv->clnts[srv->clnts_len] = clnt;
+    srv->clnts_len++;
+
+    srv->stats.connections++;
+
+    return 0;
+}
+
+void dime_client_unregister(dime_client_t *clnt, dime_server_t *srv) {
+    dime_table_remove(&srv->fd2clnt, &clnt->fd);
+
+    /* Keep the server's totals from going backwards */
+    srv->stats.bytes_in += dime_socket_bytes_in(&clnt->sock);
+    srv->stats.bytes_out += dime_socket_bytes_out(&clnt->sock);
+
+    srv->clnts_len--;
+
+    if (clnt->index < srv->clnts_len) {
+        srv->clnts[clnt->index] = srv->clnts[srv->clnts_len];
+        srv->clnts[clnt->index]->index = clnt->index;
+    }
+}
+
+int dime_client_handshake(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    const char *serialization;
+    int tls;
+
+    json_error_t err;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{sssb}", "serialization", &serialization, "tls", &tls) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    json_int_t queue_max_bytes = 0, queue_max_len = 0;
+    const char *queue_policy = "reject";
+    json_int_t version = 1;
+    int shm = 0, zlib = 0, peer = 0;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{s?Is?Is?ss?bs?bs?Is?b}", "queue_max_bytes", &queue_max_bytes, "queue_max_len", &queue_max_len, "queue_policy", &queue_policy, "shm", &shm, "zlib", &zlib, "version", &version, "peer", &peer) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (strcmp(queue_policy, "reject") == 0) {
+        clnt->queue_policy = DIME_QUEUE_REJECT;
+    } else if (strcmp(queue_policy, "drop_oldest") == 0) {
+        clnt->queue_policy = DIME_QUEUE_DROP_OLDEST;
+    } else if (strcmp(queue_policy, "conflate") == 0) {
+        clnt->queue_policy = DIME_QUEUE_CONFLATE;
+    } else {
+        strncpy(srv->err, "Unknown queue policy: ", sizeof(srv->err));
+        strncat(srv->err, queue_policy, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "Unknown queue policy: ", queue_policy);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    clnt->queue_max_bytes = (queue_max_bytes > 0) ? (size_t)queue_max_bytes : 0;
+    clnt->queue_max_len = (queue_max_len > 0) ? (size_t)queue_max_len : 0;
+
+    int serialization_i;
+
+    if (strcmp(serialization, "matlab") == 0) {
+        serialization_i = DIME_MATLAB;
+    } else if (strcmp(serialization, "pickle") == 0) {
+        serialization_i = DIME_PICKLE;
+    } else if (strcmp(serialization, "dimeb") == 0) {
+        serialization_i = DIME_DIMEB;
+    } else if (strcmp(serialization, "json") == 0) {
+        serialization_i = DIME_JSON;
+    } else {
+        return -1;
+    }
+
+    if (peer) {
+        /* Peered servers relay whatever their clients send */
+    } else if (srv->serialization == DIME_NO_SERIALIZATION) {
+        srv->serialization = serialization_i;
+    } else if (srv->serialization != serialization_i && srv->serialization != DIME_DIMEB && srv->serialization != DIME_JSON) {
+        json_t *meta = json_pack("{sisbssss}", "status", 1, "meta", 1, "command", "reregister", "serialization", "dimeb");
+        if (meta == NULL) {
+            return -1;
+        }
+
+        char *meta_str = json_dumps(meta, JSON_COMPACT);
+        if (meta_str == NULL) {
+            json_decref(meta);
+
+            return -1;
+        }
+
+        json_decref(meta);
+
+        for (size_t i = 0; i < srv->clnts_len; i++) {
+            dime_client_t *other = srv->clnts[i];
+
+            if (other != clnt) {
+                pthread_mutex_lock(&other->lock);
+                ssize_t pushed = dime_socket_notify_str(&other->sock, meta_str);
+                pthread_mutex_unlock(&other->lock);
+
+                if (pushed < 0) {
+                    free(meta_str);
+
+                    return -1;
+                }
+
+                dime_server_wake(other->worker);
+            }
+        }
+
+        free(meta_str);
+        srv->serialization = DIME_DIMEB;
+    }
+
+    switch (srv->serialization) {
+    case DIME_MATLAB:
+        serialization = "matlab";
+        break;
+
+    case DIME_PICKLE:
+        serialization = "pickle";
+        break;
+
+    case DIME_DIMEB:
+        serialization = "dimeb";
+        break;
+
+    case DIME_JSON:
+        serialization = "json";
+        break;
+    }
+
+    tls = (tls && srv->tlsctx != NULL);
+
+    /* Only granted to same-host clients that can receive file descriptors */
+    shm = (shm && !tls && dime_socket_init_shm(&clnt->sock) >= 0);
+
+    /* WebSocket clients negotiate compression in the HTTP upgrade instead */
+    zlib = (zlib && srv->zlib && dime_socket_init_zlib(&clnt->sock, srv->zlib_threshold) >= 0);
+
+    version = (version >= 2) ? 2 : 1;
+
+    json_t *response = json_pack("{sisssbsbsbsIsI}", "status", 0, "serialization", serialization, "tls", tls, "shm", shm, "zlib", zlib, "zlib_threshold", (json_int_t)(zlib ? srv->zlib_threshold : 0), "version", version);
+    if (response == NULL) {
+        return -1;
+    }
+
+    if (dime_socket_push(&clnt->sock, response, NULL, 0) < 0) {
+        json_decref(response);
+
+        return -1;
+    }
+
+    json_decref(response);
+
+    /* The response itself is still in v1 framing */
+    if (version == 2 && dime_socket_init_v2(&clnt->sock) < 0) {
+        return -1;
+    }
+
+    if (tls) {
+        if (srv->verbosity >= 1) {
+            dime_warn("Blocking the worker of %s for a TLS handshake", clnt->addr);
+        }
+
+        /* The response goes out in the clear, while nobody else can push after it */
+        if (dime_socket_flush(&clnt->sock) < 0) {
+            strncpy(srv->err, clnt->sock.err, sizeof(srv->err));
+
+            return -1;
+        }
+
+        /*
+         * The handshake waits on the client, so let the other workers carry
+         * on. Only this worker reads from or sends on the connection, and
+         * the handshake does not touch what they push to its outbuffer.
+         * The libev loop dispatches without the lock.
+         */
+#ifndef DIME_USE_LIBEV
+        pthread_mutex_unlock(&srv->lock);
+#endif
+
+        int ret = dime_socket_init_tls(&clnt->sock, srv->tlsctx);
+
+#ifndef DIME_USE_LIBEV
+        pthread_mutex_lock(&srv->lock);
+#endif
+
+        if (ret < 0) {
+            strncpy(srv->err, clnt->sock.err, sizeof(srv->err));
+
+            return -1;
+        }
+
+        if (srv->verbosity >= 1) {
+            dime_warn("TLS handshake established with %s%s", clnt->addr, clnt->sock.tls.ktls_send ? ", sending through kernel TLS" : "");
+        }
+    }
+
+    if (peer && dime_client_peer(clnt, srv) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Looks up a group by handle, returning NULL if there is no such group */
+static dime_group_t *dime_client_group(dime_server_t *srv, json_int_t handle) {
+    if (handle <= 0 || (uint64_t)handle > srv->groups_len) {
+        return NULL;
+    }
+
+    return srv->groups[handle - 1];
+}
+
+int dime_client_join(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_t *arr;
+    json_error_t err;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{so}", "name", &arr) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    size_t i;
+    json_t *v;
+
+    json_array_foreach(arr, i, v) {
+        const char *name = json_string_value(v);
+        if (name == NULL) {
+            strncpy(srv->err, "JSON parsing error: expected string", sizeof(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
+
+            json_t *response = json_pack("{siss}", "status", -1, "error", "JSON parsing error: expected string");
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
+            }
+
+            return -1;
+        }
+
+        dime_group_t *group = dime_table_search(&srv->name2clnt, name);
+
+        for (size_t j = 0; group != NULL && j < clnt->groups_len; j++) {
+            if (clnt->groups[j].group == group) {
+                strncpy(srv->err, "Client is already in group: ", sizeof(srv->err));
+                strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss+}", "status", -1, "error", "Client is already in group: ", name);
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+        }
+
+        if (group == NULL) {
+            group = malloc(sizeof(dime_group_t));
+            if (group == NULL) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+
+            group->name = strdup(name);
+            if (group->name == NULL) {
+                free(group);
+
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+
+            group->clnts_len = 0;
+            group->clnts_cap = 4;
+            group->locals = 0;
+            group->deltas = NULL;
+            memset(&group->stats, 0, sizeof(group->stats));
+
+#ifdef DIME_USE_TRACE
+            memset(&group->trace, 0, sizeof(group->trace));
+            group->trace.parent = &srv->trace;
+#endif
+
+            group->clnts = malloc(sizeof(*group->clnts) * group->clnts_cap);
+            if (group->clnts == NULL) {
+                free(group->name);
+                free(group);
+
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+
+            if (srv->groups_len >= srv->groups_cap) {
+                size_t ncap = (srv->groups_cap * 3) / 2;
+
+                dime_group_t **ngroups = realloc(srv->groups, sizeof(dime_group_t *) * ncap);
+                if (ngroups == NULL) {
+                    free(group->clnts);
+                    free(group->name);
+                    free(group);
+
+                    strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                    srv->err[sizeof(srv->err) - 1] = '\0';
+
+                    json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                    if (response != NULL) {
+                        dime_socket_push(&clnt->sock, response, NULL, 0);
+                        json_decref(response);
+                    }
+
+                    return -1;
+                }
+
+                srv->groups = ngroups;
+                srv->groups_cap = ncap;
+            }
+
+            if (dime_table_insert(&srv->name2clnt, group->name, group) < 0) {
+                free(group->clnts);
+                free(group->name);
+                free(group);
+
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+
+            srv->groups[srv->groups_len] = group;
+            srv->groups_len++;
+            group->handle = srv->groups_len;
+        }
+
+        if (clnt->groups_len >= clnt->groups_cap) {
+            size_t ncap = (clnt->groups_cap * 3) / 2;
+
+            void *ngroups = realloc(clnt->groups, sizeof(*clnt->groups) * ncap);
+            if (ngroups == NULL) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+
+            clnt->groups = ngroups;
+            clnt->groups_cap = ncap;
+        }
+
+        if (group->clnts_len >= group->clnts_cap) {
+            size_t ncap = (group->clnts_cap * 3) / 2;
+
+            void *nclnts = realloc(group->clnts, sizeof(*group->clnts) * ncap);
+            if (nclnts == NULL) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                if (response != NULL) {
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
+                    json_decref(response);
+                }
+
+                return -1;
+            }
+
+            group->clnts = nclnts;
+            group->clnts_cap = ncap;
+        }
+
+        clnt->groups[clnt->groups_len].group = group;
+        clnt->groups[clnt->groups_len].index = group->clnts_len;
+        group->clnts[group->clnts_len].clnt = clnt;
+        group->clnts[group->clnts_len].index = clnt->groups_len;
+
+        clnt->groups_len++;
+        group->clnts_len++;
+
+        if (!clnt->peer && group->locals++ == 0) {
+            dime_client_advertise(srv, "join", group->name);
+        }
+
+        if (srv->verbosity >= 2) {
+            dime_info("%s joined group \"%s\"", clnt->addr, group->name);
+        }
+    }
+
+    /* Each name joined one group, appended to the client's in order */
+    json_t *handles = json_array();
+    if (handles == NULL) {
+        return -1;
+    }
+
+    for (size_t j = clnt->groups_len - json_array_size(arr); j < clnt->groups_len; j++) {
+        if (json_array_append_new(handles, json_integer(clnt->groups[j].group->handle)) < 0) {
+            json_decref(handles);
+
+            return -1;
+        }
+    }
+
+    json_t *response = json_pack("{siso}", "status", 0, "handles", handles);
+    if (response == NULL) {
+        return -1;
+    }
+
+    if (dime_socket_push(&clnt->sock, response, NULL, 0) < 0) {
+        json_decref(response);
+
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    json_decref(response);
+
+    return 0;
+}
+
+int dime_client_leave(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_t *arr;
+    json_error_t err;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{so}", "name", &arr) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    size_t i;
+    json_t *v;
+
+    json_array_foreach(arr, i, v) {
+        dime_group_t *group;
+        const char *name;
+        char buf[24];
+
+        if (json_is_integer(v)) {
+            group = dime_client_group(srv, json_integer_value(v));
+
+            snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT, json_integer_value(v));
+            name = buf;
+        } else {
+            name = json_string_value(v);
+            if (name == NULL) {
+                strncpy(srv->err, "JSON parsing error: expected string", sizeof(srv->err));
+                srv->err[sizeof(srv->err) - 1] = '\0';
+
+                json_t *response = json_pack("{siss}", "status", -1, "error", "JSON parsing error: expected string");
+                if (response != NULL) {
                     dime_socket_push(&clnt->sock, response, NULL, 0);
                     json_decref(response);
                 }
 
-                return -1;
+                return -1;
+            }
+
+            group = dime_table_search(&srv->name2clnt, name);
+        }
+
+        for (size_t i = 0; group != NULL && i < clnt->groups_len; i++) {
+            if (clnt->groups[i].group == group) {
+                dime_client_ungroup(clnt, i);
+
+                if (srv->verbosity >= 2) {
+                    dime_info("%s left group \"%s\"", clnt->addr, group->name);
+                }
+
+                goto next;
+            }
+        }
+
+        strncpy(srv->err, "Client is not in group: ", sizeof(srv->err));
+        strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "Client is not in group: ", name);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+
+    next:
+        ;
+    }
+
+    if (dime_socket_push_str(&clnt->sock, "{\"status\":0}", NULL, 0) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reply to a message that full queues refused: status -1 if no recipient
+ * queued it, or -2 if some did, so that the sender knows resending it
+ * would duplicate it for those
+ */
+static int dime_client_rejected(dime_client_t *clnt, dime_server_t *srv, size_t delivered, size_t rejected) {
+    snprintf(srv->err, sizeof(srv->err), "Message rejected by %zu of %zu client queues", rejected, delivered + rejected);
+
+    json_t *response = json_pack("{sisssIsI}", "status", (delivered > 0) ? -2 : -1, "error", srv->err,
+                                 "delivered", (json_int_t)delivered, "rejected", (json_int_t)rejected);
+    if (response != NULL) {
+        dime_socket_push(&clnt->sock, response, NULL, 0);
+        json_decref(response);
+    }
+
+    return -1;
+}
+
+/* Fill in the routing information of a parsed message, serializing it into a new buffer */
+static int dime_client_route(dime_route_t *route, json_t *jsondata) {
+    char *jsonstr = json_dumps(jsondata, JSON_COMPACT);
+    if (jsonstr == NULL) {
+        return -1;
+    }
+
+    route->jsonstr = jsonstr;
+    route->jsondata_len = strlen(jsonstr);
+
+    if (json_unpack(jsondata, "{ss}", "command", &route->command) < 0) {
+        route->command = NULL;
+    }
+
+    if (json_unpack(jsondata, "{ss}", "name", &route->name) < 0) {
+        route->name = NULL;
+    }
+
+    if (json_unpack(jsondata, "{ss}", "varname", &route->varname) < 0) {
+        route->varname = NULL;
+    }
+
+    json_t *delta = json_object_get(jsondata, "delta");
+
+    route->delta = json_is_boolean(delta) ? json_is_true(delta) : -1;
+    route->group = 0;
+
+    return 0;
+}
+
+int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    const char *name = NULL;
+    json_int_t handle = 0;
+    int delta = 0;
+    json_error_t err;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{s?ss?Is?b}", "name", &name, "group", &handle, "delta", &delta) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (name == NULL && handle == 0) {
+        strncpy(srv->err, "JSON parsing error: missing group", sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", "JSON parsing error: missing group");
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (handle < 0 || handle > UINT32_MAX) {
+        strncpy(srv->err, "Invalid group handle", sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", "Invalid group handle");
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    dime_route_t route;
+
+    if (dime_client_route(&route, jsondata) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    route.group = (uint32_t)handle;
+
+    int ret = dime_client_send_route(clnt, srv, &route, pbindata, bindata_len);
+
+    free((char *)route.jsonstr);
+
+    return ret;
+}
+
+int dime_client_send_route(dime_client_t *clnt, dime_server_t *srv, const dime_route_t *route, void **pbindata, size_t bindata_len) {
+    const char *name = route->name;
+    dime_group_t *group;
+    char buf[48];
+
+    if (route->group != 0) {
+        group = dime_client_group(srv, route->group);
+
+        snprintf(buf, sizeof(buf), "%" PRIu32, route->group);
+        name = buf;
+    } else {
+        group = dime_table_search(&srv->name2clnt, name);
+    }
+
+    if (group == NULL || group->clnts_len == 0) {
+        strncpy(srv->err, "No such group exists: ", sizeof(srv->err));
+        strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "No such group exists: ", name);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    /* Hold a reference of our own until the message is fully queued */
+    dime_rcmessage_t *msg = dime_rcmessage_new(srv, route, *pbindata, bindata_len);
+    if (msg == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    *pbindata = NULL;
+
+    /* Binary data passed in shared memory stays there */
+    msg->shmfd = dime_socket_shm(&clnt->sock, &msg->bindata);
+
+#ifdef DIME_USE_TRACE
+    msg->trace = &group->trace;
+#endif
+
+    /* Variables sent as deltas have their full value kept up to date */
+    dime_delta_t *delta = NULL;
+    dime_rcmessage_t *full = NULL;
+
+    if (route->delta >= 0) {
+        const char *error = NULL;
+
+        if (route->varname == NULL) {
+            error = "Deltas need a variable name";
+        } else if ((delta = dime_group_delta(group, route->varname, !route->delta)) == NULL && !route->delta) {
+            error = strerror(errno);
+        } else if (route->delta && (delta == NULL || delta->sender != clnt)) {
+            error = "No previous value to apply the delta to";
+        } else if (route->delta && dime_delta_apply(delta, msg->bindata, msg->bindata_len) < 0) {
+            error = "Malformed delta";
+        } else if (!route->delta) {
+            void *value = malloc(msg->bindata_len);
+
+            if (value == NULL && msg->bindata_len > 0) {
+                error = strerror(errno);
+            } else {
+                if (msg->bindata_len > 0) {
+                    memcpy(value, msg->bindata, msg->bindata_len);
+                }
+
+                free(delta->value);
+
+                delta->value = value;
+                delta->value_len = msg->bindata_len;
+                delta->sender = clnt;
+
+                /* Already full, so it goes to everyone as is */
+                dime_rcmessage_incref(msg);
+                full = msg;
             }
         }
 
-        dime_group_t *group = dime_table_search(&srv->name2clnt, name);
-        if (group == NULL) {
-            group = malloc(sizeof(dime_group_t));
-            if (group == NULL) {
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+        if (error != NULL) {
+            dime_rcmessage_decref(msg);
 
-                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
+            strncpy(srv->err, error, sizeof(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
 
-                return -1;
+            json_t *response = json_pack("{siss}", "status", -1, "error", error);
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
             }
 
-            group->name = strdup(name);
-            if (group->name == NULL) {
-                free(group);
+            return -1;
+        }
 
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+        delta->version++;
+    }
 
-                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
+    size_t delivered = 0, rejected = 0;
 
-                return -1;
+    group->stats.msgs++;
+    group->stats.bytes += dime_rcmessage_size(msg);
+
+    for (size_t i = 0; i < group->clnts_len; i++) {
+        dime_client_t *other = group->clnts[i].clnt;
+        const char *names[] = {group->name};
+        dime_rcmessage_t *out = msg;
+
+        /* Only clients queued the previous version can apply a delta */
+        if (delta != NULL && (other->peer || !dime_client_current(other, delta))) {
+            if (full == NULL) {
+                full = dime_rcmessage_full(srv, route, delta);
+
+#ifdef DIME_USE_TRACE
+                if (full != NULL) {
+                    full->trace = &group->trace;
+                }
+#endif
             }
 
-            group->clnts_len = 0;
-            group->clnts_cap = 4;
+            out = full;
+        }
 
-            group->clnts = malloc(sizeof(dime_client_t *) * group->clnts_cap);
-            if (group->clnts == NULL) {
-                free(group->name);
-                free(group);
+        int queued = -1;
 
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+        if (out != NULL) {
+            queued = other->peer ?
+                     dime_client_forward_to(other, out, names, 1) :
+                     dime_client_deliver(other, out);
+        }
 
-                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
+        if (queued >= 0 && delta != NULL && !other->peer && dime_client_track(other, delta, queued == 0) < 0) {
+            queued = -1;
+        }
 
-                return -1;
-            }
+        if (queued == 0) {
+            group->stats.fanout++;
+            delivered++;
+        }
 
-            if (dime_table_insert(&srv->name2clnt, group->name, group) < 0) {
-                free(group->clnts);
-                free(group->name);
-                free(group);
+        if (queued < 0) {
+            if (full != NULL) {
+                dime_rcmessage_decref(full);
+            }
 
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+            dime_rcmessage_decref(msg);
 
-                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
 
-                return -1;
+            json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
             }
+
+            return -1;
         }
 
-        if (clnt->groups_len >= clnt->groups_cap) {
-            size_t ncap = (clnt->groups_cap * 3) / 2;
+        if (queued > 0) {
+            rejected++;
+        }
+    }
 
-            dime_group_t **ngroups = realloc(clnt->groups, sizeof(dime_group_t *) * ncap);
-            if (ngroups == NULL) {
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+    if (full != NULL) {
+        dime_rcmessage_decref(full);
+    }
 
-                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
+    dime_rcmessage_decref(msg);
 
-                return -1;
-            }
+    if (rejected > 0) {
+        return dime_client_rejected(clnt, srv, delivered, rejected);
+    }
 
-            clnt->groups = ngroups;
-            clnt->groups_cap = ncap;
+    if (srv->verbosity >= 2) {
+        const char *varname = (route->varname != NULL) ? route->varname : "(unknown)";
+
+        dime_info("%s sent a variable \"%s\" to group \"%s\"", clnt->addr, varname, group->name);
+    }
+
+    if (clnt->sock.v2.noack) {
+        return 0;
+    }
+
+    /* Let clients sending by name switch to the handle */
+    if (route->group == 0) {
+        snprintf(buf, sizeof(buf), "{\"status\":0,\"group\":%" PRIu32 "}", group->handle);
+    } else {
+        strcpy(buf, "{\"status\":0}");
+    }
+
+    if (dime_socket_push_str(&clnt->sock, buf, NULL, 0) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
         }
 
-        if (group->clnts_len >= group->clnts_cap) {
-            size_t ncap = (group->clnts_cap * 3) / 2;
+        return -1;
+    }
+
+    return 0;
+}
+
+int dime_client_broadcast(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    dime_route_t route;
+
+    if (dime_client_route(&route, jsondata) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    int ret = dime_client_broadcast_route(clnt, srv, &route, pbindata, bindata_len);
+
+    free((char *)route.jsonstr);
+
+    return ret;
+}
+
+int dime_client_broadcast_route(dime_client_t *clnt, dime_server_t *srv, const dime_route_t *route, void **pbindata, size_t bindata_len) {
+    /* Hold a reference of our own until the message is fully queued */
+    dime_rcmessage_t *msg = dime_rcmessage_new(srv, route, *pbindata, bindata_len);
+    if (msg == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    *pbindata = NULL;
+
+    /* Binary data passed in shared memory stays there */
+    msg->shmfd = dime_socket_shm(&clnt->sock, &msg->bindata);
+
+    /* Deltas are kept per group, so recipients would have nothing to apply them to */
+    if (route->delta >= 0) {
+        dime_rcmessage_decref(msg);
+
+        strncpy(srv->err, "Deltas can only be sent to a group", sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", "Deltas can only be sent to a group");
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    size_t delivered = 0, rejected = 0;
+
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_client_t *other = srv->clnts[i];
+
+        if (other != clnt) {
+            int queued = other->peer ?
+                         dime_client_forward_to(other, msg, NULL, 0) :
+                         dime_client_deliver(other, msg);
+
+            if (queued < 0) {
+                dime_rcmessage_decref(msg);
 
-            dime_client_t **nclnts = realloc(group->clnts, sizeof(dime_client_t *) * ncap);
-            if (nclnts == NULL) {
                 strncpy(srv->err, strerror(errno), sizeof(srv->err));
                 srv->err[sizeof(srv->err) - 1] = '\0';
 
@@ -444,19 +1947,28 @@ int dime_client_join(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
                 return -1;
             }
 
-            group->clnts = nclnts;
-            group->clnts_cap = ncap;
+            if (queued == 0) {
+                delivered++;
+            } else {
+                rejected++;
+            }
         }
+    }
+
+    dime_rcmessage_decref(msg);
+
+    if (rejected > 0) {
+        return dime_client_rejected(clnt, srv, delivered, rejected);
+    }
 
-        clnt->groups[clnt->groups_len] = group;
-        clnt->groups_len++;
+    if (srv->verbosity >= 2) {
+        const char *varname = (route->varname != NULL) ? route->varname : "(unknown)";
 
-        group->clnts[group->clnts_len] = clnt;
-        group->clnts_len++;
+        dime_info("%s broadcasted a variable \"%s\"", clnt->addr, varname);
+    }
 
-        if (srv->verbosity >= 2) {
-            dime_info("%s joined group \"%s\"", clnt->addr, group->name);
-        }
+    if (clnt->sock.v2.noack) {
+        return 0;
     }
 
     if (dime_socket_push_str(&clnt->sock, "{\"status\":0}", NULL, 0) < 0) {
@@ -475,11 +1987,25 @@ int dime_client_join(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
     return 0;
 }
 
-int dime_client_leave(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
-    json_t *arr;
+/* Looks up a group named or referred to by handle in a JSON value */
+static dime_group_t *dime_client_group_value(dime_server_t *srv, const json_t *v, char *buf, size_t siz, const char **name) {
+    if (json_is_integer(v)) {
+        snprintf(buf, siz, "%" JSON_INTEGER_FORMAT, json_integer_value(v));
+        *name = buf;
+
+        return dime_client_group(srv, json_integer_value(v));
+    }
+
+    *name = json_string_value(v);
+
+    return (*name != NULL) ? dime_table_search(&srv->name2clnt, *name) : NULL;
+}
+
+int dime_client_batch(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_t *names, *varnames, *lengths;
     json_error_t err;
 
-    if (json_unpack_ex(jsondata, &err, 0, "{so}", "name", &arr) < 0) {
+    if (json_unpack_ex(jsondata, &err, 0, "{sososo}", "name", &names, "varnames", &varnames, "lengths", &lengths) < 0) {
         strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
         strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
         srv->err[sizeof(srv->err) - 1] = '\0';
@@ -493,65 +2019,39 @@ int dime_client_leave(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
         return -1;
     }
 
-    size_t i;
+    /* Recipients split the binary data by these, so they had better add up */
+    size_t total = 0, i;
     json_t *v;
+    int valid = json_is_array(names) && json_is_array(varnames) && json_is_array(lengths) &&
+                json_array_size(varnames) == json_array_size(lengths);
 
-    json_array_foreach(arr, i, v) {
-        const char *name = json_string_value(v);
-        if (name == NULL) {
-            strncpy(srv->err, "JSON parsing error: expected string", sizeof(srv->err));
-            srv->err[sizeof(srv->err) - 1] = '\0';
-
-            json_t *response = json_pack("{siss}", "status", -1, "error", "JSON parsing error: expected string");
-            if (response != NULL) {
-                dime_socket_push(&clnt->sock, response, NULL, 0);
-                json_decref(response);
-            }
+    json_array_foreach(varnames, i, v) {
+        json_t *len = json_array_get(lengths, i);
 
-            return -1;
+        if (!valid || !json_is_string(v) || !json_is_integer(len) ||
+            json_integer_value(len) < 0 || (uint64_t)json_integer_value(len) > bindata_len - total) {
+            valid = 0;
+            break;
         }
 
-        for (size_t i = 0; i < clnt->groups_len; i++) {
-            dime_group_t *group = clnt->groups[i];
-
-            if (strcmp(name, group->name) == 0) {
-                for (size_t j = 0; j < group->clnts_len; j++) {
-                    if (group->clnts[j] == clnt) {
-                        group->clnts_len--;
-                        group->clnts[j] = group->clnts[group->clnts_len];
-
-                        clnt->groups_len--;
-                        clnt->groups[i] = clnt->groups[clnt->groups_len];
-
-                        if (srv->verbosity >= 2) {
-                            dime_info("%s left group \"%s\"", clnt->addr, group->name);
-                        }
-
-                        goto next;
-                    }
-                }
-
-                assert(0); /* This should be unreachable */
-            }
-        }
+        total += json_integer_value(len);
+    }
 
-        strncpy(srv->err, "Client is not in group: ", sizeof(srv->err));
-        strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
+    if (!valid || total != bindata_len) {
+        strncpy(srv->err, "Malformed batch", sizeof(srv->err));
         srv->err[sizeof(srv->err) - 1] = '\0';
 
-        json_t *response = json_pack("{siss+}", "status", -1, "error", "Client is not in group: ", name);
+        json_t *response = json_pack("{siss}", "status", -1, "error", "Malformed batch");
         if (response != NULL) {
             dime_socket_push(&clnt->sock, response, NULL, 0);
             json_decref(response);
         }
 
         return -1;
-
-    next:
-        ;
     }
 
-    if (dime_socket_push_str(&clnt->sock, "{\"status\":0}", NULL, 0) < 0) {
+    json_t *handles = json_array();
+    if (handles == NULL) {
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
         srv->err[sizeof(srv->err) - 1] = '\0';
 
@@ -564,44 +2064,64 @@ int dime_client_leave(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
         return -1;
     }
 
-    return 0;
-}
+    /* Check every group before queueing anything */
+    json_array_foreach(names, i, v) {
+        char buf[24];
+        const char *name;
+        dime_group_t *group = dime_client_group_value(srv, v, buf, sizeof(buf), &name);
 
-int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
-    const char *name;
-    json_error_t err;
+        if (name == NULL) {
+            json_decref(handles);
 
-    if (json_unpack_ex(jsondata, &err, 0, "{ss}", "name", &name) < 0) {
-        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
-        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
+            strncpy(srv->err, "JSON parsing error: expected string", sizeof(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
 
-        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
+            json_t *response = json_pack("{siss}", "status", -1, "error", "JSON parsing error: expected string");
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
+            }
+
+            return -1;
         }
 
-        return -1;
-    }
+        if (group == NULL || group->clnts_len == 0) {
+            json_decref(handles);
 
-    dime_group_t *group = dime_table_search(&srv->name2clnt, name);
-    if (group == NULL || group->clnts_len == 0) {
-        strncpy(srv->err, "No such group exists: ", sizeof(srv->err));
-        strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
+            strncpy(srv->err, "No such group exists: ", sizeof(srv->err));
+            strncat(srv->err, name, sizeof(srv->err) - strlen(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
 
-        json_t *response = json_pack("{siss+}", "status", -1, "error", "No such group exists: ", name);
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
+            json_t *response = json_pack("{siss+}", "status", -1, "error", "No such group exists: ", name);
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
+            }
+
+            return -1;
         }
 
-        return -1;
+        if (json_array_append_new(handles, json_integer(group->handle)) < 0) {
+            json_decref(handles);
+
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
+
+            json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
+            }
+
+            return -1;
+        }
     }
 
-    dime_rcmessage_t *msg = malloc(sizeof(dime_rcmessage_t));
-    if (msg == NULL) {
+    dime_route_t route;
+
+    if (dime_client_route(&route, jsondata) < 0) {
+        json_decref(handles);
+
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
         srv->err[sizeof(srv->err) - 1] = '\0';
 
@@ -614,9 +2134,13 @@ int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
         return -1;
     }
 
-    msg->jsondata = json_dumps(jsondata, JSON_COMPACT);
-    if (msg->jsondata == NULL) {
-        free(msg);
+    /* Hold a reference of our own until the message is fully queued */
+    dime_rcmessage_t *msg = dime_rcmessage_new(srv, &route, *pbindata, bindata_len);
+
+    free((char *)route.jsonstr);
+
+    if (msg == NULL) {
+        json_decref(handles);
 
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
         srv->err[sizeof(srv->err) - 1] = '\0';
@@ -630,86 +2154,158 @@ int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
         return -1;
     }
 
-    msg->refs = 0;
-    msg->bindata = *pbindata;
-    msg->bindata_len = bindata_len;
-
     *pbindata = NULL;
 
-    for (size_t i = 0; i < group->clnts_len; i++) {
-        if (dime_deque_pushr(&group->clnts[i]->queue, msg) < 0) {
-            if (msg->refs == 0) {
-                free(msg->jsondata);
-                free(msg->bindata);
-                free(msg);
+    /* Binary data passed in shared memory stays there */
+    msg->shmfd = dime_socket_shm(&clnt->sock, &msg->bindata);
+
+#ifdef DIME_USE_TRACE
+    if (json_array_size(handles) == 1) {
+        msg->trace = &dime_client_group(srv, json_integer_value(json_array_get(handles, 0)))->trace;
+    }
+#endif
+
+    /* Clients in several of the groups get the batch once */
+    uint64_t batch = ++srv->batches;
+    size_t delivered = 0, rejected = 0;
+
+    json_array_foreach(handles, i, v) {
+        dime_group_t *group = dime_client_group(srv, json_integer_value(v));
+
+        group->stats.msgs++;
+        group->stats.bytes += dime_rcmessage_size(msg);
+
+        for (size_t j = 0; j < group->clnts_len; j++) {
+            dime_client_t *other = group->clnts[j].clnt;
+
+            /* Peered servers are forwarded the batch below */
+            if (other->peer || other->batch == batch) {
+                continue;
             }
 
-            strncpy(srv->err, strerror(errno), sizeof(srv->err));
-            srv->err[sizeof(srv->err) - 1] = '\0';
+            other->batch = batch;
 
-            json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-            if (response != NULL) {
-                dime_socket_push(&clnt->sock, response, NULL, 0);
-                json_decref(response);
+            int queued = dime_client_deliver(other, msg);
+
+            if (queued == 0) {
+                group->stats.fanout++;
+                delivered++;
             }
 
-            return -1;
-        }
+            if (queued < 0) {
+                dime_rcmessage_decref(msg);
+                json_decref(handles);
 
-        if (group->clnts[i]->waiting) {
-            json_t *response = json_pack("{sisI}", "status", 0, "n", (json_int_t)dime_deque_len(&group->clnts[i]->queue));
-            if (response == NULL) {
                 strncpy(srv->err, strerror(errno), sizeof(srv->err));
                 srv->err[sizeof(srv->err) - 1] = '\0';
 
-                response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
                 if (response != NULL) {
-                    dime_socket_push(&group->clnts[i]->sock, response, NULL, 0);
+                    dime_socket_push(&clnt->sock, response, NULL, 0);
                     json_decref(response);
                 }
 
                 return -1;
             }
 
-            if (dime_socket_push(&group->clnts[i]->sock, response, NULL, 0) < 0) {
-                json_decref(response);
+            if (queued > 0) {
+                rejected++;
+            }
+        }
+    }
 
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+    /* Each peered server gets the batch once, naming every group it is in */
+    const char **peernames = malloc(sizeof(const char *) * (json_array_size(handles) + 1));
+    if (peernames == NULL) {
+        dime_rcmessage_decref(msg);
+        json_decref(handles);
 
-                response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&group->clnts[i]->sock, response, NULL, 0);
-                    json_decref(response);
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    for (size_t k = 0; k < srv->clnts_len; k++) {
+        dime_client_t *peer = srv->clnts[k];
+        size_t names_len = 0;
+
+        if (!peer->peer) {
+            continue;
+        }
+
+        json_array_foreach(handles, i, v) {
+            dime_group_t *group = dime_client_group(srv, json_integer_value(v));
+
+            if (dime_client_ingroup(peer, group)) {
+                /* Counted where the peer is first reached, like clients above */
+                if (names_len == 0) {
+                    group->stats.fanout++;
                 }
 
-                return -1;
+                peernames[names_len++] = group->name;
             }
+        }
 
-            group->clnts[i]->waiting = 0;
-            json_decref(response);
+        if (names_len > 0 && dime_client_forward_to(peer, msg, peernames, names_len) < 0) {
+            free(peernames);
+            dime_rcmessage_decref(msg);
+            json_decref(handles);
+
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+            srv->err[sizeof(srv->err) - 1] = '\0';
+
+            json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+            if (response != NULL) {
+                dime_socket_push(&clnt->sock, response, NULL, 0);
+                json_decref(response);
+            }
+
+            return -1;
         }
 
-        msg->refs++;
+        if (names_len > 0) {
+            delivered++;
+        }
     }
 
-    assert(msg->refs > 0);
+    free(peernames);
+    dime_rcmessage_decref(msg);
+
+    if (rejected > 0) {
+        json_decref(handles);
+
+        return dime_client_rejected(clnt, srv, delivered, rejected);
+    }
 
     if (srv->verbosity >= 2) {
-        const char *varname;
+        dime_info("%s sent a batch of %zu variables to %zu groups", clnt->addr, json_array_size(varnames), json_array_size(names));
+    }
 
-        if (json_unpack(jsondata, "{ss}", "varname", &varname) < 0) {
-            varname = "(unknown)";
-        }
+    if (clnt->sock.v2.noack) {
+        json_decref(handles);
 
-        dime_info("%s sent a variable \"%s\" to group \"%s\"", clnt->addr, varname, group->name);
+        return 0;
     }
 
-    if (dime_socket_push_str(&clnt->sock, "{\"status\":0}", NULL, 0) < 0) {
+    json_t *response = json_pack("{siso}", "status", 0, "handles", handles);
+    if (response == NULL) {
+        return -1;
+    }
+
+    if (dime_socket_push(&clnt->sock, response, NULL, 0) < 0) {
+        json_decref(response);
+
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
         srv->err[sizeof(srv->err) - 1] = '\0';
 
-        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        response = json_pack("{siss}", "status", -1, "error", strerror(errno));
         if (response != NULL) {
             dime_socket_push(&clnt->sock, response, NULL, 0);
             json_decref(response);
@@ -718,173 +2314,274 @@ int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
         return -1;
     }
 
+    json_decref(response);
+
     return 0;
 }
 
-int dime_client_broadcast(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
-    dime_rcmessage_t *msg = malloc(sizeof(dime_rcmessage_t));
-    if (msg == NULL) {
-        strncpy(srv->err, strerror(errno), sizeof(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
-        srv->err[sizeof(srv->err) - 1] = '\0';
+/* Push a queued message, handing the queue's reference over to the outbuffer */
+static ssize_t dime_client_push_msg(dime_client_t *clnt, dime_rcmessage_t *msg, int framing, uint64_t now) {
+    size_t hdr_len;
+    const unsigned char *hdr = dime_rcmessage_frame(msg, framing, &hdr_len);
+    ssize_t ret;
 
-        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
+#ifdef DIME_USE_TRACE
+    /* Pushing may release the message */
+    dime_trace_t *trace = msg->trace;
+#endif
+
+    switch (framing) {
+    case DIME_FRAMING_SHM:
+        ret = dime_socket_push_shm(&clnt->sock, hdr, hdr_len, msg->jsondata, msg->jsondata_len, msg->shmfd, dime_rcmessage_release, msg);
+        break;
+
+    case DIME_FRAMING_ZLIB:
+        ret = dime_socket_push_ref(&clnt->sock, hdr, hdr_len, msg->jsondata, msg->jsondata_len, msg->comp[framing].data, msg->comp[framing].len, dime_rcmessage_release, msg);
+        break;
+
+    case DIME_FRAMING_WS_DEFLATE:
+        ret = dime_socket_push_ref(&clnt->sock, hdr, hdr_len, msg->jsondata, 0, msg->comp[framing].data, msg->comp[framing].len, dime_rcmessage_release, msg);
+        break;
+
+    default:
+        ret = dime_socket_push_ref(&clnt->sock, hdr, hdr_len, msg->jsondata, msg->jsondata_len, msg->bindata, msg->bindata_len, dime_rcmessage_release, msg);
+    }
+
+#ifdef DIME_USE_TRACE
+    if (ret >= 0) {
+        dime_socket_trace(&clnt->sock, trace, now);
+    }
+#endif
+
+    return ret;
+}
+
+/*
+ * Push queued messages as one message, {"messages":[...],"lengths":[...]},
+ * whose binary portion is theirs concatenated. The JSON portion and
+ * framing header are built in one buffer; the binary portions are still
+ * referenced rather than copied. The queue's references are consumed even
+ * on failure, since part of the message may already be in the outbuffer.
+ */
+static int dime_client_push_run(dime_client_t *clnt, int framing, dime_rcmessage_t **run, size_t run_len, uint64_t now) {
+    size_t i = 0;
+
+    if (run_len == 1) {
+        if (dime_client_push_msg(clnt, run[0], framing, now) < 0) {
+            goto fail;
         }
 
-        return -1;
+        return 0;
     }
 
-    msg->jsondata = json_dumps(jsondata, JSON_COMPACT);
-    if (msg->jsondata == NULL) {
-        free(msg);
+    size_t jsondata_len = 32, bindata_len = 0;
 
-        strncpy(srv->err, strerror(errno), sizeof(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
+    for (size_t j = 0; j < run_len; j++) {
+        jsondata_len += run[j]->jsondata_len + 22;
+        bindata_len += run[j]->bindata_len;
+    }
 
-        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
+    char *buf = malloc(DIME_FRAME_MAXLEN + jsondata_len);
+    if (buf == NULL) {
+        goto fail;
+    }
+
+    char *p = buf + DIME_FRAME_MAXLEN;
+
+    p += sprintf(p, "{\"messages\":[");
+
+    for (size_t j = 0; j < run_len; j++) {
+        if (j > 0) {
+            *p++ = ',';
         }
 
-        return -1;
+        memcpy(p, run[j]->jsondata, run[j]->jsondata_len);
+        p += run[j]->jsondata_len;
     }
 
-    msg->refs = 0;
-    msg->bindata = *pbindata;
-    msg->bindata_len = bindata_len;
+    p += sprintf(p, "],\"lengths\":[");
 
-    *pbindata = NULL;
+    for (size_t j = 0; j < run_len; j++) {
+        p += sprintf(p, (j > 0) ? ",%zu" : "%zu", run[j]->bindata_len);
+    }
 
-    dime_table_iter_t it;
+    p += sprintf(p, "]}");
 
-    dime_table_iter_init(&it, &srv->fd2clnt);
+    jsondata_len = p - (buf + DIME_FRAME_MAXLEN);
 
-    while (dime_table_iter_next(&it)) {
-        dime_client_t *other = it.val;
+    /* Put the header right before the JSON portion */
+    unsigned char hdr[DIME_FRAME_MAXLEN];
+    size_t hdr_len = dime_socket_frame(framing, hdr, jsondata_len, bindata_len);
+    char *frame = buf + DIME_FRAME_MAXLEN - hdr_len;
 
-        if (clnt->fd != other->fd) {
-            if (dime_deque_pushr(&other->queue, msg) < 0) {
-                if (msg->refs == 0) {
-                    free(msg->jsondata);
-                    free(msg->bindata);
-                    free(msg);
-                }
+    memcpy(frame, hdr, hdr_len);
 
-                strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
+    if (dime_socket_push_ref(&clnt->sock, frame, hdr_len + jsondata_len, NULL, 0, NULL, 0, free, buf) < 0) {
+        free(buf);
+
+        goto fail;
+    }
+
+    for (; i < run_len; i++) {
+#ifdef DIME_USE_TRACE
+        /* Pushing may release the message */
+        dime_trace_t *trace = run[i]->trace;
+#endif
+
+        if (dime_socket_push_ref(&clnt->sock, NULL, 0, NULL, 0, run[i]->bindata, run[i]->bindata_len, dime_rcmessage_release, run[i]) < 0) {
+            goto fail;
+        }
+
+#ifdef DIME_USE_TRACE
+        dime_socket_trace(&clnt->sock, trace, now);
+#endif
+    }
+
+    return 0;
+
+fail:
+    for (; i < run_len; i++) {
+        dime_rcmessage_decref(run[i]);
+    }
+
+    return -1;
+}
+
+/*
+ * Push up to m queued messages, coalescing them into messages of at most
+ * cap bytes if cap is nonzero. *npushed is set to the number of queued
+ * messages that left the queue, even on failure.
+ */
+static int dime_client_flush(dime_client_t *clnt, size_t m, size_t cap, size_t *npushed) {
+    /* Messages that can go out in the socket's plain framing are coalesced */
+    int plain = clnt->sock.ws.enabled ? DIME_FRAMING_WS : DIME_FRAMING_RAW;
+
+    dime_rcmessage_t **run = NULL;
+    size_t run_len = 0, run_cap = 0, run_bytes = 0;
+    int ret = 0;
+    uint64_t now = 0;
+
+#ifdef DIME_USE_TRACE
+    if (m > 0 && dime_deque_len(&clnt->queue) > 0) {
+        now = dime_trace_now();
+    }
+#endif
+
+    *npushed = 0;
+
+    while (*npushed < m) {
+        dime_rcmessage_t *msg = dime_deque_popl(&clnt->queue);
+
+        if (msg == NULL) {
+            break;
+        }
 
-                json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
+        clnt->queue_bytes -= dime_rcmessage_size(msg);
 
-                return -1;
-            }
+#ifdef DIME_USE_TRACE
+        /* Pushing may release the message */
+        uint64_t arrived = msg->arrived;
+        dime_trace_t *trace = msg->trace;
+#endif
 
-            if (other->waiting) {
-                json_t *response = json_pack("{sisI}", "status", 0, "n", (json_int_t)dime_deque_len(&other->queue));
-                if (response == NULL) {
-                    strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                    srv->err[sizeof(srv->err) - 1] = '\0';
+        int framing = dime_rcmessage_framing(msg, &clnt->sock);
+        size_t siz = dime_rcmessage_size(msg);
+        int coalescable = (framing == plain && siz <= cap);
 
-                    response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                    if (response != NULL) {
-                        dime_socket_push(&other->sock, response, NULL, 0);
-                        json_decref(response);
-                    }
+        if (run_len > 0 && (!coalescable || run_bytes + siz > cap)) {
+            ret = dime_client_push_run(clnt, plain, run, run_len, now);
+            run_len = 0;
+            run_bytes = 0;
 
-                    return -1;
-                }
+            if (ret < 0) {
+                dime_deque_pushl(&clnt->queue, msg);
+                clnt->queue_bytes += siz;
 
-                if (dime_socket_push(&other->sock, response, NULL, 0) < 0) {
-                    json_decref(response);
+                break;
+            }
+        }
 
-                    strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                    srv->err[sizeof(srv->err) - 1] = '\0';
+        if (coalescable) {
+            if (run_len >= run_cap) {
+                size_t ncap = (run_cap > 0) ? (run_cap * 3) / 2 : 16;
+                dime_rcmessage_t **nrun = realloc(run, ncap * sizeof(dime_rcmessage_t *));
 
-                    response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-                    if (response != NULL) {
-                        dime_socket_push(&other->sock, response, NULL, 0);
-                        json_decref(response);
-                    }
+                if (nrun == NULL) {
+                    dime_deque_pushl(&clnt->queue, msg);
+                    clnt->queue_bytes += siz;
+                    ret = -1;
 
-                    return -1;
+                    break;
                 }
 
-                other->waiting = 0;
-                json_decref(response);
+                run = nrun;
+                run_cap = ncap;
             }
 
-            msg->refs++;
+            run[run_len++] = msg;
+            run_bytes += siz;
+        } else if (dime_client_push_msg(clnt, msg, framing, now) < 0) {
+            dime_deque_pushl(&clnt->queue, msg);
+            clnt->queue_bytes += siz;
+            ret = -1;
+
+            break;
         }
-    }
 
-    if (msg->refs == 0) {
-        free(msg->jsondata);
-        free(msg->bindata);
-        free(msg);
+#ifdef DIME_USE_TRACE
+        dime_trace_residence(trace, now - arrived);
+#endif
+
+        (*npushed)++;
     }
 
-    if (srv->verbosity >= 2) {
-        const char *varname;
+    if (run_len > 0) {
+        if (ret < 0) {
+            /* Put back what was never pushed, keeping its order */
+            while (run_len > 0) {
+                dime_rcmessage_t *msg = run[--run_len];
 
-        if (json_unpack(jsondata, "{ss}", "varname", &varname) < 0) {
-            varname = "(unknown)";
+                dime_deque_pushl(&clnt->queue, msg);
+                clnt->queue_bytes += dime_rcmessage_size(msg);
+                (*npushed)--;
+            }
+        } else {
+            ret = dime_client_push_run(clnt, plain, run, run_len, now);
         }
-
-        dime_info("%s broadcasted a variable \"%s\"", clnt->addr, varname);
     }
 
-    if (dime_socket_push_str(&clnt->sock, "{\"status\":0}", NULL, 0) < 0) {
-        strncpy(srv->err, strerror(errno), sizeof(srv->err));
-        srv->err[sizeof(srv->err) - 1] = '\0';
-
-        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
-        if (response != NULL) {
-            dime_socket_push(&clnt->sock, response, NULL, 0);
-            json_decref(response);
-        }
+    free(run);
 
-        return -1;
-    }
+    clnt->stats.msgs_out += *npushed;
 
-    return 0;
+    return ret;
 }
 
-int dime_client_sync(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
-    json_int_t n;
+/* Push queued messages to a subscribed client, as far as its credits allow */
+static int dime_client_stream(dime_client_t *clnt, size_t *npushed) {
+    *npushed = 0;
 
-    if (json_unpack(jsondata, "{sI}", "n", &n) < 0) {
-        return -1;
+    if (clnt->credits == 0) {
+        return 0;
     }
 
-    size_t m = (size_t)(n < 0 ? -1 : n);
+    int ret = dime_client_flush(clnt, clnt->credits, clnt->coalesce, npushed);
 
-    for (size_t i = 0; i < m; i++) {
-        dime_rcmessage_t *msg = dime_deque_popl(&clnt->queue);
-
-        if (msg == NULL) {
-            break;
-        }
+    clnt->credits -= *npushed;
 
-        if (dime_socket_push_str(&clnt->sock, msg->jsondata, msg->bindata, msg->bindata_len) < 0) {
-            dime_deque_pushl(&clnt->queue, msg);
+    return ret;
+}
 
-            return -1;
-        }
+int dime_client_sync(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_int_t n, coalesce = 0;
+    size_t npushed;
 
-        msg->refs--;
+    if (json_unpack(jsondata, "{sIs?I}", "n", &n, "coalesce", &coalesce) < 0) {
+        return -1;
+    }
 
-        if (msg->refs == 0) {
-            free(msg->jsondata);
-            free(msg->bindata);
-            free(msg);
-        }
+    if (dime_client_flush(clnt, (size_t)(n < 0 ? -1 : n), (coalesce > 0) ? (size_t)coalesce : 0, &npushed) < 0) {
+        return -1;
     }
 
     if (srv->verbosity >= 2) {
@@ -913,12 +2610,11 @@ int dime_client_sync(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
 
 int dime_client_wait(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
     if (dime_deque_len(&clnt->queue) > 0) {
-        json_t *response = json_pack("{sisI}", "status", 0, "n", (json_int_t)dime_deque_len(&clnt->queue));
-        if (response == NULL) {
+        if (dime_client_push_n(&clnt->sock, dime_deque_len(&clnt->queue), 0) < 0) {
             strncpy(srv->err, strerror(errno), sizeof(srv->err));
             srv->err[sizeof(srv->err) - 1] = '\0';
 
-            response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+            json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
             if (response != NULL) {
                 dime_socket_push(&clnt->sock, response, NULL, 0);
                 json_decref(response);
@@ -926,14 +2622,61 @@ int dime_client_wait(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
 
             return -1;
         }
+    } else {
+        clnt->waiting = 1;
+    }
+
+    return 0;
+}
+
+int dime_client_subscribe(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_int_t credits, coalesce = -1;
+    json_error_t err;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{sIs?I}", "credits", &credits, "coalesce", &coalesce) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
 
-        if (dime_socket_push(&clnt->sock, response, NULL, 0) < 0) {
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
             json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (credits < 0) {
+        clnt->credits = 0;
+    } else if ((uint64_t)credits > SIZE_MAX - clnt->credits) {
+        clnt->credits = SIZE_MAX;
+    } else {
+        clnt->credits += credits;
+    }
+
+    if (coalesce >= 0) {
+        clnt->coalesce = coalesce;
+    }
+
+    if (srv->verbosity >= 2) {
+        if (credits < 0) {
+            dime_info("%s unsubscribed", clnt->addr);
+        } else {
+            dime_info("%s subscribed with %zu credits", clnt->addr, clnt->credits);
+        }
+    }
+
+    if (!clnt->sock.v2.noack) {
+        char buf[48];
+
+        snprintf(buf, sizeof(buf), "{\"status\":0,\"credits\":%zu}", clnt->credits);
 
+        if (dime_socket_push_str(&clnt->sock, buf, NULL, 0) < 0) {
             strncpy(srv->err, strerror(errno), sizeof(srv->err));
             srv->err[sizeof(srv->err) - 1] = '\0';
 
-            response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+            json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
             if (response != NULL) {
                 dime_socket_push(&clnt->sock, response, NULL, 0);
                 json_decref(response);
@@ -941,10 +2684,16 @@ int dime_client_wait(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
 
             return -1;
         }
+    }
 
-        json_decref(response);
-    } else {
-        clnt->waiting = 1;
+    /* Whatever was queued before now goes out without waiting for more */
+    size_t streamed;
+
+    if (dime_client_stream(clnt, &streamed) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        return -1;
     }
 
     return 0;
@@ -965,12 +2714,8 @@ int dime_client_devices(dime_client_t *clnt, dime_server_t *srv, json_t *jsondat
         return -1;
     }
 
-    dime_table_iter_t it;
-
-    dime_table_iter_init(&it, &srv->name2clnt);
-
-    while (dime_table_iter_next(&it)) {
-        dime_group_t *group = it.val;
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_group_t *group = srv->groups[i];
 
         if (group->clnts_len > 0) {
             json_t *str = json_string(group->name);
@@ -1042,3 +2787,225 @@ int dime_client_devices(dime_client_t *clnt, dime_server_t *srv, json_t *jsondat
 
     return 0;
 }
+
+int dime_client_stats(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_t *stats = dime_stats_json(srv);
+    if (stats == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (json_object_set_new(stats, "status", json_integer(0)) < 0 ||
+        dime_socket_push(&clnt->sock, stats, NULL, 0) < 0) {
+        json_decref(stats);
+
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    json_decref(stats);
+
+    return 0;
+}
+
+int dime_client_peer(dime_client_t *clnt, dime_server_t *srv) {
+    json_t *names = json_array();
+    if (names == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        if (srv->groups[i]->locals > 0 && json_array_append_new(names, json_string(srv->groups[i]->name)) < 0) {
+            json_decref(names);
+
+            return -1;
+        }
+    }
+
+    clnt->peer = 1;
+
+    int ret = 0;
+
+    if (json_array_size(names) > 0) {
+        ret = dime_client_notify_peer(clnt, "join", names);
+    }
+
+    json_decref(names);
+
+    if (srv->verbosity >= 1) {
+        dime_info("Peered with %s", clnt->addr);
+    }
+
+    return ret;
+}
+
+int dime_client_forward(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    json_t *names = NULL;
+    json_int_t jsondata_len;
+    json_error_t err;
+
+    if (json_unpack_ex(jsondata, &err, 0, "{sIs?o}", "json", &jsondata_len, "name", &names) < 0) {
+        strncpy(srv->err, "JSON parsing error: ", sizeof(srv->err));
+        strncat(srv->err, err.text, sizeof(srv->err) - strlen(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss+}", "status", -1, "error", "JSON parsing error: ", err.text);
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (!clnt->peer) {
+        strncpy(srv->err, "Only peered servers may forward messages", sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", "Only peered servers may forward messages");
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    if (jsondata_len < 0 || (uint64_t)jsondata_len > bindata_len || (names != NULL && !json_is_array(names))) {
+        strncpy(srv->err, "Malformed forward", sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", "Malformed forward");
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    /* The original JSON portion trails the binary portion, which stays put */
+    size_t orig_len = bindata_len - jsondata_len;
+    dime_route_t route;
+
+    if (dime_route_scan(&route, (const char *)*pbindata + orig_len, jsondata_len) <= 0) {
+        route.varname = NULL;
+        route.delta = -1;
+    }
+
+    /* Hold a reference of our own until the message is fully queued */
+    dime_rcmessage_t *msg = dime_rcmessage_new(srv, &route, *pbindata, orig_len);
+    if (msg == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+
+        return -1;
+    }
+
+    *pbindata = NULL;
+
+    /* Clients in several of the groups get the message once */
+    uint64_t batch = ++srv->batches;
+    size_t i;
+    json_t *v;
+
+    if (names == NULL) {
+        for (size_t j = 0; j < srv->clnts_len; j++) {
+            dime_client_t *other = srv->clnts[j];
+
+            if (!other->peer && dime_client_deliver(other, msg) < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    json_array_foreach(names, i, v) {
+        const char *name = json_string_value(v);
+        dime_group_t *group = (name != NULL) ? dime_table_search(&srv->name2clnt, name) : NULL;
+
+        /* The group may have lost its members since it was advertised */
+        if (group == NULL) {
+            continue;
+        }
+
+#ifdef DIME_USE_TRACE
+        if (json_array_size(names) == 1) {
+            msg->trace = &group->trace;
+        }
+#endif
+
+        group->stats.msgs++;
+        group->stats.bytes += dime_rcmessage_size(msg);
+
+        for (size_t j = 0; j < group->clnts_len; j++) {
+            dime_client_t *other = group->clnts[j].clnt;
+
+            if (other->peer || other->batch == batch) {
+                continue;
+            }
+
+            other->batch = batch;
+
+            /* Full values of variables sent as deltas elsewhere replace what the client had */
+            if (route.delta >= 0) {
+                dime_client_forget(other, route.varname);
+            }
+
+            int queued = dime_client_deliver(other, msg);
+
+            if (queued == 0) {
+                group->stats.fanout++;
+            }
+
+            if (queued < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    if (srv->verbosity >= 2) {
+        const char *varname = (msg->varname != NULL) ? msg->varname : "(unknown)";
+
+        dime_info("%s forwarded a variable \"%s\"", clnt->addr, varname);
+    }
+
+    dime_rcmessage_decref(msg);
+
+    return 0;
+
+fail:
+    dime_rcmessage_decref(msg);
+
+    strncpy(srv->err, strerror(errno), sizeof(srv->err));
+    srv->err[sizeof(srv->err) - 1] = '\0';
+
+    json_t *response = json_pack("{siss}", "status", -1, "error", strerror(errno));
+    if (response != NULL) {
+        dime_socket_push(&clnt->sock, response, NULL, 0);
+        json_decref(response);
+    }
+
+    return -1;
+}
@@ -28,10 +28,13 @@
 
 #include <stdint.h>
 
+#include <pthread.h>
 #include <jansson.h>
 #include "deque.h"
+#include "pool.h"
 #include "server.h"
 #include "socket.h"
+#include "trace.h"
 
 #ifndef __DIME_client_H
 #define __DIME_client_H
@@ -59,57 +62,212 @@ extern "C" {
  * @see dime_client_sync
  * @see dime_client_wait
  * @see dime_client_devices
+ * @see dime_client_stats
+ * @see dime_client_forward
  */
 typedef struct __dime_client dime_client_t;
 
+/* Longest JSON portion stored inside a dime_rcmessage_t */
+#define DIME_RCMESSAGE_INLINE 256
+
+/* Longest variable name stored inside a dime_rcmessage_t, including the NUL */
+#define DIME_RCMESSAGE_VARNAME_INLINE 64
+
 /**
  * @brief Reference-counted message
  *
  * Record that contains a single DiME message and a count of how many
- * references it has in memory. Note that there are no functions
- * introduced to manage this struct; the reference count is managed
- * directly by the functions in this file, and when the reference count
- * reaches zero, it is deallocated manually by said functions.
+ * references it has in memory. Messages are shared between the queues
+ * of clients owned by different worker threads, so the reference count
+ * must only be modified via @link dime_rcmessage_incref @endlink and
+ * @link dime_rcmessage_decref @endlink, the latter of which
+ * deallocates the message once the count reaches zero.
+ *
+ * The framing header for each wire framing is built the first time the
+ * message is sent with that framing, and shared by every recipient
+ * afterwards. Likewise, binary data large enough to be compressed for a
+ * recipient is compressed once per compressed framing, and the result
+ * reused. Headers and compressed data are only built under the server
+ * lock.
+ *
+ * Messages are allocated from the server's message pool, and JSON that
+ * fits is serialized into the message itself rather than a separate
+ * allocation.
+ *
+ * Binary data that was passed in shared memory is never copied: the
+ * message keeps the segment mapped at @em bindata and its file
+ * descriptor open for as long as it is referenced, and passes the file
+ * descriptor on to recipients that accept shared memory.
+ *
+ * With @c DIME_USE_TRACE, messages remember when they arrived, and the
+ * trace of the group they were sent to, or the server's for broadcasts
+ * and batches sent to several groups.
  */
 typedef struct {
-    unsigned int refs; /** Reference count */
+    unsigned int refs; /** Reference count (atomic) */
+    dime_pool_t *pool; /** Pool the message was allocated from */
+
+    char *jsondata;      /** JSON portion of the message (not NUL-terminated) */
+    size_t jsondata_len; /** Length of JSON portion of the message */
+    void *bindata;       /** Binary portion of the message */
+    size_t bindata_len;  /** Length of binary portion of the message */
+    int shmfd;           /** Shared memory segment mapped at bindata, or -1 */
+
+    unsigned char frames[DIME_FRAMING_COUNT][DIME_FRAME_MAXLEN]; /** Framing headers */
+    size_t frames_len[DIME_FRAMING_COUNT]; /** Lengths of framing headers, or 0 if not yet built */
+
+    struct {
+        unsigned char *data; /** Compressed payload, or NULL if not yet built */
+        size_t len;          /** Length of compressed payload */
+        int failed;          /** Whether compression failed or did not pay off */
+    } comp[DIME_FRAMING_COUNT]; /** Compressed payloads, for compressed framings */
+
+    char *varname; /** Name of the variable carried by the message, or NULL */
 
-    char *jsondata;     /** JSON portion of the message as a string */
-    void *bindata;      /** Binary portion of the message */
-    size_t bindata_len; /** Length of binary portion of the message */
+#ifdef DIME_USE_TRACE
+    uint64_t arrived;    /** When the message was received, from dime_trace_now */
+    dime_trace_t *trace; /** Where to record the message's latencies */
+#endif
+
+    char json_inline[DIME_RCMESSAGE_INLINE];             /** Storage for short JSON portions */
+    char varname_inline[DIME_RCMESSAGE_VARNAME_INLINE]; /** Storage for short variable names */
 } dime_rcmessage_t;
 
+/**
+ * @brief Policy for a client whose queue is over its limits
+ *
+ * Conflation never discards the pending value of another variable: a
+ * message with nothing to replace is refused as with
+ * @c DIME_QUEUE_REJECT. A replacement larger than the message it replaces
+ * may take the queue past its byte limit.
+ *
+ * @see dime_client_handshake
+ */
+enum dime_queue_policy {
+    DIME_QUEUE_REJECT,      /** Refuse new messages, reporting an error to the sender */
+    DIME_QUEUE_DROP_OLDEST, /** Discard the oldest queued messages */
+    DIME_QUEUE_CONFLATE     /** Replace a queued message for the same variable, else refuse it */
+};
+
+/**
+ * @brief Last full value of a variable sent to a group as deltas
+ *
+ * Kept for each variable that was sent to a group with the JSON field
+ * @c delta, so that deltas can be applied to it. Never freed before its
+ * group.
+ *
+ * @see dime_client_send
+ */
+typedef struct {
+    char *varname;        /** Variable name */
+    unsigned char *value; /** Binary portion of the last full value */
+    size_t value_len;     /** Length of the last full value */
+    uint64_t version;     /** Number of values sent so far, full or delta */
+    const void *sender;   /** Client that sent them, only ever compared */
+} dime_delta_t;
+
 /**
  * @brief Group of clients
  *
  * Record that contains a list of clients that all share a named group.
+ * Groups are never freed before the server, so their handles can be used
+ * in place of their names for as long as it runs. Peered servers with
+ * members of the group are members of it themselves.
  */
-typedef struct {
-    char *name; /** Group name */
+typedef struct __dime_group {
+    char *name;      /** Group name */
+    uint32_t handle; /** Index of the group in the server's group array, plus one */
+    size_t locals;   /** Members that are clients rather than peered servers */
 
-    dime_client_t **clnts; /** Array of clients */
-    size_t clnts_len;      /** Length of client array */
-    size_t clnts_cap;      /** Capacity of client array */
+    dime_table_t *deltas; /** Variables sent as deltas, by name, or NULL if none yet */
+
+    struct {
+        dime_client_t *clnt; /** Member client */
+        size_t index;        /** Index of this group in the client's group array */
+    } *clnts;
+    size_t clnts_len; /** Length of client array */
+    size_t clnts_cap; /** Capacity of client array */
+
+    struct {
+        uint64_t msgs;   /** Messages sent to the group */
+        uint64_t bytes;  /** Total size of those messages */
+        uint64_t fanout; /** Copies of those messages queued for members */
+    } stats; /** Counters, guarded by the server lock */
+
+#ifdef DIME_USE_TRACE
+    dime_trace_t trace; /** Latencies of messages sent to the group */
+#endif
 } dime_group_t;
 
 struct __dime_client {
     int fd;      /** File descriptor */
     int waiting; /** Whether or not this client is waiting for a new message */
+    int peer;    /** Whether the connection is to another DiME server */
+
+    uint64_t batch; /** Last "batch" command queued for this client */
+
+    size_t credits;  /** Messages that may still be streamed to this client unprompted */
+    size_t coalesce; /** Limit on the size of coalesced streamed messages, or 0 for none */
+
+    dime_worker_t *worker; /** Worker thread that owns this connection */
+    pthread_mutex_t lock;  /** Guards the outbuffer of the socket */
 
     char *addr; /** Address of connection, as a human-readable string */
 
-    dime_group_t **groups; /** Array of associated groups */
-    size_t groups_len;     /** Length of groups */
-    size_t groups_cap;     /** Capacity of groups */
+    size_t index; /** Index of this client in the server's client array */
+
+    struct {
+        dime_group_t *group; /** Associated group */
+        size_t index;        /** Index of this client in the group's client array */
+    } *groups;
+    size_t groups_len; /** Length of groups */
+    size_t groups_cap; /** Capacity of groups */
 
     dime_socket_t sock; /** DiME socket */
     dime_deque_t queue; /** Queue of reference-counted messages */
 
+    size_t queue_bytes;     /** Total size of the messages in queue */
+    size_t queue_max_bytes; /** Limit on queue_bytes, or 0 for none */
+    size_t queue_max_len;   /** Limit on the number of queued messages, or 0 for none */
+    int queue_policy;       /** What to do once a limit is reached */
+
+    dime_table_t *deltas; /** Versions of variables sent as deltas last queued, by name, or NULL */
+
+    struct {
+        uint64_t msgs_in;      /** Commands received */
+        uint64_t msgs_queued;  /** Messages queued by other clients */
+        uint64_t msgs_out;     /** Queued messages pushed to the socket */
+        uint64_t msgs_dropped; /** Messages rejected or dropped at the queue limits */
+        size_t queue_peak;     /** Most messages ever queued at once */
+        size_t rbuf_len;       /** Bytes left in the inbuffer after the last command */
+    } stats; /** Counters, guarded by the server lock */
+
     dime_server_t *srv;
 
     char err[81]; /** Error string */
 };
 
+/**
+ * @brief Add a reference to a message
+ *
+ * @param msg Pointer to a @link dime_rcmessage_t @endlink struct
+ *
+ * @see dime_rcmessage_decref
+ */
+void dime_rcmessage_incref(dime_rcmessage_t *msg);
+
+/**
+ * @brief Remove a reference from a message
+ *
+ * Atomically decrements the reference count of @em msg, and frees it
+ * if the count reaches zero.
+ *
+ * @param msg Pointer to a @link dime_rcmessage_t @endlink struct
+ *
+ * @see dime_rcmessage_incref
+ */
+void dime_rcmessage_decref(dime_rcmessage_t *msg);
+
 /**
  * @brief Initialize a new client
  *
@@ -136,11 +294,56 @@ int dime_client_init(dime_client_t *clnt, int fd, const struct sockaddr *addr);
  */
 void dime_client_destroy(dime_client_t *clnt);
 
+/**
+ * @brief Make a client reachable by other clients
+ *
+ * Adds @em clnt to the server's file descriptor table and its dense
+ * array of clients. The caller must hold the server lock, if any.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_unregister
+ */
+int dime_client_register(dime_client_t *clnt, dime_server_t *srv);
+
+/**
+ * @brief Undo @link dime_client_register @endlink
+ *
+ * Removes @em clnt from the server's file descriptor table and its
+ * dense array of clients, in constant time. The caller must hold the
+ * server lock, if any.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ *
+ * @see dime_client_register
+ */
+void dime_client_unregister(dime_client_t *clnt, dime_server_t *srv);
+
 /**
  * @brief Handle a "handshake" command
  *
  * The "handshake" command mostly does housekeeping w.r.t. the
- * serialization method.
+ * serialization method. It may also bound the client's queue with the
+ * optional fields @c queue_max_bytes and @c queue_max_len, and pick
+ * what happens to messages past those limits with @c queue_policy:
+ * "reject" (the default), "drop_oldest" or "conflate". Clients on the
+ * same host may set @c shm to pass binary data in shared memory; the
+ * response's @c shm field says whether this was granted. Clients may
+ * also set @c zlib to exchange large binary data compressed, if the
+ * server allows it; the response's @c zlib and @c zlib_threshold fields
+ * say whether this was granted and the smallest binary portion that is
+ * compressed. Clients that set @c version to 2 or more may frame their
+ * subsequent messages with the DiME v2 header; the response's @c version
+ * field says which version was granted. Other DiME servers set @c peer
+ * to peer with this one (see @link dime_client_peer @endlink), in which
+ * case the serialization method is left alone.
  *
  * @param clnt Pointer to a @link dime_client_t @endlink struct
  * @param srv Pointer to the @link dime_server_t @endlink struct from
@@ -160,7 +363,9 @@ int dime_client_handshake(dime_client_t *clnt, dime_server_t *srv, json_t *jsond
  * @brief Handle a "join" command
  *
  * The "join" command instructs the server to add the client @em clnt to
- * the group specified in the JSON field @c name.
+ * the groups specified in the JSON array @c name. The response lists the
+ * handles of those groups, in the same order, in the JSON array @c
+ * handles.
  *
  * @param clnt Pointer to a @link dime_client_t @endlink struct
  * @param srv Pointer to the @link dime_server_t @endlink struct from
@@ -180,7 +385,8 @@ int dime_client_join(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
  * @brief Handle a "leave" command
  *
  * The "leave" command instructs the server to remove the client @em
- * clnt from the group specified in the JSON field @c name.
+ * clnt from the groups specified in the JSON array @c name, by name or by
+ * handle.
  *
  * @param clnt Pointer to a @link dime_client_t @endlink struct
  * @param srv Pointer to the @link dime_server_t @endlink struct from
@@ -201,7 +407,28 @@ int dime_client_leave(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
  * @brief Handle a "send" command
  *
  * The "send" command instructs the server to relay the message to all
- * clients in the group specified in the JSON field @c name.
+ * clients in the group specified by the handle in the JSON field @c
+ * group, or else by the name in the JSON field @c name. When sent by name,
+ * the response carries the group's handle in the JSON field @c group.
+ * No response is sent on success if the message's v2 header has the
+ * @c DIME_FLAG_NOACK flag.
+ *
+ * If the boolean JSON field @c delta is present, the server keeps the
+ * value of the variable named in the JSON field @c varname for the group.
+ * If it is false, the binary portion is the full value. If it is true,
+ * the binary portion patches the value last sent by the same client: a
+ * 32-bit big-endian length, which must equal that of the value, followed
+ * by runs of a 32-bit big-endian offset, a 32-bit big-endian length and
+ * that many bytes to overwrite. Clients that were queued the previous
+ * version, and that never drop messages, are relayed the delta; all
+ * others are relayed the full value with @c delta set to false.
+ *
+ * If recipients' queues refuse the message (see @link dime_queue_policy
+ * @endlink), the response has @c status -1 when none queued it, or -2
+ * when others did, and counts the recipients that queued and refused it
+ * in the JSON fields @c delivered and @c rejected. Resending after -2
+ * duplicates the message for those that queued it. Such responses are
+ * sent even with the @c DIME_FLAG_NOACK flag.
  *
  * @param clnt Pointer to a @link dime_client_t @endlink struct
  * @param srv Pointer to the @link dime_server_t @endlink struct from
@@ -219,11 +446,35 @@ int dime_client_leave(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
  */
 int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
 
+/**
+ * @brief Handle a "send" command without parsing it
+ *
+ * Functions like @link dime_client_send @endlink, but takes the
+ * message's routing information instead of its parsed JSON. The JSON
+ * portion is relayed exactly as it was received.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ * @param route Routing information of the message
+ * @param pbindata Binary portion of the message
+ * @param bindata_len Length of binary portion of the message
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_send
+ * @see dime_route_scan
+ */
+int dime_client_send_route(dime_client_t *clnt, dime_server_t *srv, const dime_route_t *route, void **pbindata, size_t bindata_len);
+
 /**
  * @brief Handle a "broadcast" command
  *
  * The "broadcast" command instructs the server to relay the message to
- * all other clients.
+ * all other clients. No response is sent on success if the message's v2
+ * header has the @c DIME_FLAG_NOACK flag. Messages refused by full queues
+ * are reported as for @link dime_client_send @endlink.
  *
  * @param clnt Pointer to a @link dime_client_t @endlink struct
  * @param srv Pointer to the @link dime_server_t @endlink struct from
@@ -242,13 +493,68 @@ int dime_client_send(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
 int dime_client_broadcast(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
 
 /**
- * @brief Handle a "sync" command
+ * @brief Handle a "broadcast" command without parsing it
+ *
+ * Functions like @link dime_client_broadcast @endlink, but takes the
+ * message's routing information instead of its parsed JSON. The JSON
+ * portion is relayed exactly as it was received.
  *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ * @param route Routing information of the message
+ * @param pbindata Binary portion of the message
+ * @param bindata_len Length of binary portion of the message
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_broadcast
+ * @see dime_route_scan
+ */
+int dime_client_broadcast_route(dime_client_t *clnt, dime_server_t *srv, const dime_route_t *route, void **pbindata, size_t bindata_len);
+
+/**
+ * @brief Handle a "batch" command
+ *
+ * The "batch" command instructs the server to relay the message once to
+ * every client in any of the groups specified in the JSON array @c name,
+ * by name or by handle. The message carries several variables: their
+ * names are in the JSON array @c varnames, and the lengths of their binary
+ * portions, which are concatenated in the message's binary portion, are
+ * in the JSON array @c lengths. The response lists the handles of the
+ * groups, in the same order, in the JSON array @c handles. No response is
+ * sent on success if the message's v2 header has the @c DIME_FLAG_NOACK
+ * flag. Messages refused by full queues are reported as for @link
+ * dime_client_send @endlink, counting each recipient once.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ * @param jsondata JSON portion of the message
+ * @param pbindata Binary portion of the message
+ * @param bindata_len Length of binary portion of the message
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_send
+ * @see dime_client_sync
+ */
+int dime_client_batch(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
 
+/**
+ * @brief Handle a "sync" command
+ *
  * The "sync" command instructs the server to send the client @em clnt
  * the messages that have been relayed by other clients. The JSON field
  * @c n may optionally specify a limit on the number of messages to
- * download.
+ * download. If the JSON field @c coalesce is positive, consecutive
+ * messages are sent as few messages of at most that many bytes each, of
+ * the form {"messages":[...],"lengths":[...]}: the JSON portions of the
+ * original messages, and the lengths of their binary portions, which are
+ * concatenated in the binary portion. Messages passed in shared memory or
+ * compressed are never coalesced.
  *
  * @param clnt Pointer to a @link dime_client_t @endlink struct
  * @param srv Pointer to the @link dime_server_t @endlink struct from
@@ -288,6 +594,36 @@ int dime_client_sync(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
  */
 int dime_client_wait(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
 
+/**
+ * @brief Handle a "subscribe" command
+ *
+ * The "subscribe" command grants the client @em clnt the number of
+ * credits in the JSON field @c credits, or revokes all of its credits if
+ * it is negative. While it has credits left, messages relayed to the
+ * client are pushed to it as soon as they are queued, without waiting for
+ * a "sync", each using up one credit; clients grant more credits as they
+ * consume the messages. The optional JSON field @c coalesce sets a limit
+ * on the size of pushed messages to coalesce, as in
+ * @link dime_client_sync @endlink. The response carries the number of
+ * credits granted in the JSON field @c credits, and precedes the queued
+ * messages it lets through. No response is sent on success if the
+ * message's v2 header has the @c DIME_FLAG_NOACK flag.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ * @param jsondata JSON portion of the message
+ * @param pbindata Binary portion of the message
+ * @param bindata_len Length of binary portion of the message
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_sync
+ * @see dime_client_wait
+ */
+int dime_client_subscribe(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
+
 /**
  * @brief Handle a "devices" command
  *
@@ -306,6 +642,82 @@ int dime_client_wait(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata,
  */
 int dime_client_devices(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
 
+/**
+ * @brief Handle a "stats" command
+ *
+ * The "stats" command instructs the server to send the client its
+ * counters: totals for the server, including the rate of commands per
+ * second since the previous "stats" command, under the JSON field
+ * @c server; one object per connected client under @c clients, with its
+ * queue length and size, outbuffer and inbuffer sizes, and bytes and
+ * messages in and out; and one object per group with members under
+ * @c groups, with the messages sent to it, their size and their fan-out.
+ * With @c DIME_USE_TRACE, the server and each group also carry a
+ * @c latency object summarizing their @link dime_trace_t @endlink.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ * @param jsondata JSON portion of the message
+ * @param pbindata Binary portion of the message
+ * @param bindata_len Length of binary portion of the message
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_stats_json
+ */
+int dime_client_stats(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
+
+/**
+ * @brief Make a connection a link to a peered server
+ *
+ * Marks @em clnt as another DiME server, and advertises to it every
+ * group with local members with a "join" command. From then on, groups
+ * gaining their first local member or losing their last are advertised
+ * to every peer with "join" and "leave" commands, so that each peer is a
+ * member of the groups that have members on the other end. Messages
+ * relayed to a peer are not queued, but sent straight away as a
+ * "forward" command, once per peer no matter how many of its clients
+ * they reach. Responses from peers are only logged.
+ *
+ * Forwarded messages are never forwarded again, so every server must be
+ * peered with every other one.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted or made
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_forward
+ */
+int dime_client_peer(dime_client_t *clnt, dime_server_t *srv);
+
+/**
+ * @brief Handle a "forward" command
+ *
+ * The "forward" command is sent by peered servers to relay a message to
+ * local clients only: to those in any of the groups named in the JSON
+ * array @c name, or to every client if it is missing. The binary portion
+ * is that of the original message followed by its JSON portion, whose
+ * length is in the JSON field @c json. No response is sent on success.
+ *
+ * @param clnt Pointer to a @link dime_client_t @endlink struct
+ * @param srv Pointer to the @link dime_server_t @endlink struct from
+ * which the client connection was accepted
+ * @param jsondata JSON portion of the message
+ * @param pbindata Binary portion of the message
+ * @param bindata_len Length of binary portion of the message
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_client_peer
+ */
+int dime_client_forward(dime_client_t *clnt, dime_server_t *srv, json_t *jsondata, void **pbindata, size_t bindata_len);
+
 #ifdef __cplusplus
 }
 #endif
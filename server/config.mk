@@ -16,6 +16,17 @@ CFLAGS := ${CFLAGS} -std=c99 -D_POSIX_C_SOURCE=200112L -D_XOPEN_SOURCE=500 -Wall
 # C linker flags
 LDFLAGS := ${LDFLAGS} -pie -pthread
 
+# Event loop backend, select() is used if none is enabled. epoll is
+# available on Linux, kqueue on BSD and macOS (add -D_DARWIN_C_SOURCE to
+# the kqueue line on macOS), and io_uring on Linux 6.0 and later
+CFLAGS += -DDIME_USE_EPOLL
+#CFLAGS += -DDIME_USE_KQUEUE
+#CFLAGS += -DDIME_USE_IO_URING
+
+# Latency histograms of relayed messages, reported by "stats". Comment
+# out the line below to compile the tracing out entirely
+CFLAGS += -DDIME_USE_TRACE
+
 # Uncomment the lines below for a release build
 #CFLAGS += -DNDEBUG -O3
 
@@ -108,7 +108,7 @@ void *dime_deque_popr(dime_deque_t *deck) {
     }
 
     if (deck->end == 0) {
-        deck->begin = deck->cap;
+        deck->end = deck->cap;
     }
     deck->end--;
 
@@ -119,35 +119,59 @@ void *dime_deque_popr(dime_deque_t *deck) {
     return p;
 }
 
+void *dime_deque_peekl(const dime_deque_t *deck) {
+    if (deck->len == 0) {
+        return NULL;
+    }
+
+    return deck->arr[deck->begin];
+}
+
 size_t dime_deque_len(const dime_deque_t *deck) {
     return deck->len;
 }
 
 void dime_deque_iter_init(dime_deque_iter_t *it, dime_deque_t *deck) {
     it->deck = deck;
-    it->i = deck->begin - 1;
+    it->n = 0;
 }
 
 int dime_deque_iter_next(dime_deque_iter_t *it) {
-    it->i++;
-
-    if (it->i == it->deck->cap) {
-        it->i = 0;
+    /*
+     * Count elements rather than comparing against the end index, since
+     * begin and end coincide when the deque is full
+     */
+    if (it->n >= it->deck->len) {
+        return 0;
     }
 
-    if (it->i == it->deck->end) {
-        return 0;
+    size_t i = it->deck->begin + it->n;
+
+    if (i >= it->deck->cap) {
+        i -= it->deck->cap;
     }
 
-    it->val = it->deck->arr[it->i];
+    it->val = it->deck->arr[i];
+    it->n++;
 
     return 1;
 }
 
+void dime_deque_iter_set(dime_deque_iter_t *it, void *p) {
+    size_t i = it->deck->begin + it->n - 1;
+
+    if (i >= it->deck->cap) {
+        i -= it->deck->cap;
+    }
+
+    it->deck->arr[i] = p;
+    it->val = p;
+}
+
 void dime_deque_apply(dime_deque_t *deck, int(*f)(void *, void *), void *p) {
     size_t i = deck->begin;
 
-    while (i != deck->end) {
+    for (size_t n = 0; n < deck->len; n++) {
         if (!f(deck->arr[i], p)) {
             break;
         }
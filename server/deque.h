@@ -47,6 +47,7 @@ extern "C" {
  * @see dime_deque_pushr
  * @see dime_deque_popl
  * @see dime_deque_popr
+ * @see dime_deque_peekl
  * @see dime_deque_len
  * @see dime_deque_iter_t
  */
@@ -135,6 +136,18 @@ void *dime_deque_popl(dime_deque_t *deck);
  */
 void *dime_deque_popr(dime_deque_t *deck);
 
+/**
+ * @brief Get the element at the head of the deque without removing it
+ *
+ * @param deck Pointer to a @link dime_deque_t @endlink struct
+ *
+ * @return The element at the head of the deque, or NULL if the deque is
+ * empty
+ *
+ * @see dime_deque_popl
+ */
+void *dime_deque_peekl(const dime_deque_t *deck);
+
 /**
  * @brief Get the number of elements in the deque
  *
@@ -180,7 +193,7 @@ typedef struct {
     void *val; /** Current element */
 
     dime_deque_t *deck; /* Deque */
-    size_t i;           /* Index in deque array */
+    size_t n;           /* Number of elements visited so far */
 } dime_deque_iter_t;
 
 /**
@@ -201,6 +214,15 @@ void dime_deque_iter_init(dime_deque_iter_t *it, dime_deque_t *deck);
  */
 int dime_deque_iter_next(dime_deque_iter_t *it);
 
+/**
+ * @brief Replace the element at the current iterator position
+ *
+ * @param it Pointer to a @link dime_deque_iter_t @endlink struct, on
+ * which @link dime_deque_iter_next @endlink has returned a nonzero value
+ * @param p New value of the element
+ */
+void dime_deque_iter_set(dime_deque_iter_t *it, void *p);
+
 /**
  * @brief Execute a function for each element in the deque
  *
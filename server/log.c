@@ -10,8 +10,12 @@ static void dime_print(const char *typestr, const char *fmt, va_list args) {
     struct tm timeval;
 
     time(&t);
-    //localtime_r(&t, &timeval);
-    timeval = *localtime(&t);
+#ifdef _WIN32
+    localtime_s(&timeval, &t);
+#else
+    /* Workers may log concurrently, so avoid localtime's static buffer */
+    localtime_r(&t, &timeval);
+#endif
 
 
     char timestr[32], outstr[161];
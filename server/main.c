@@ -16,7 +16,8 @@
 static dime_server_t srv;
 
 static void sighandler(int signal) {
-    exit(0);
+    /* Cleanup runs once the loop returns, not here, as it joins threads that may wait on locks held by this one */
+    dime_server_stop(&srv);
 }
 
 static void cleanup() {
@@ -42,6 +43,8 @@ int main(int argc, char **argv) {
 
     char *listens[(argc + 1) / 2];
     size_t listens_len = 0;
+    char *peers[(argc + 1) / 2];
+    size_t peers_len = 0;
 #ifdef _WIN32
     char listens_default[] = "tcp:5000";
     WSADATA _d;
@@ -91,6 +94,8 @@ int main(int argc, char **argv) {
                            "-d                     Forks the process to the background Only works on \n"
                            "                       Unix-like systems.\n"
                            "-h                     Displays this help message.\n"
+                           "-j <threads>           Specifies the number of worker threads to spread \n"
+                           "                       client connections over. Defaults to 1.\n"
                            "-k <privkeyfile>       Specifies a private key file to use for TLS \n"
                            "                       encryption. Requires -c to be specified as well. \n"
                            "                       Note that TLS is a work in progress, and is \n"
@@ -102,14 +107,27 @@ int main(int argc, char **argv) {
                            "                       of unix) or a port on the local machine (in the \n"
                            "                       case of tcp and ws). The unix protocol only works \n"
                            "                       on Unix-like systems.\n"
-                           "-v                     Increases the verbosity of the server.\n",
+                           "-m [<host>:]<port>     Serves counters in the Prometheus text format over \n"
+                           "                       HTTP on a port of the loopback interface, or of \n"
+                           "                       the address given (0.0.0.0 or [::] for all \n"
+                           "                       interfaces). The same counters are available to \n"
+                           "                       clients through the \"stats\" command.\n"
+                           "-p <protocol>:<info>   Peers with another, already running server, so \n"
+                           "                       that groups span both of them. Valid protocols \n"
+                           "                       are unix, ipc (an alias for unix), and tcp. \n"
+                           "                       Additional information is either a socket file \n"
+                           "                       (in the case of unix) or a host and port \n"
+                           "                       separated by a colon (in the case of tcp). Only \n"
+                           "                       one server of each pair should name the other.\n"
+                           "-v                     Increases the verbosity of the server.\n"
+                           "-z <threshold>         Compresses binary data of at least threshold \n"
+                           "                       bytes for clients that ask for it, and for \n"
+                           "                       WebSocket clients that offer permessage-deflate.\n",
                            argv[0]);
                         
                     return 0;
 
                 case 'j':
-                    goto usage_err; // disable this for now
-                        
                     if (argi + 1 > argc) {
                         goto usage_err;
                     }
@@ -143,10 +161,72 @@ int main(int argc, char **argv) {
 
                     break;
 
+                case 'm':
+                    if (argi + 1 > argc) {
+                        goto usage_err;
+                    }
+
+                    skip = 1;
+
+                    /* Either a port, or a host and port separated by the last colon */
+                    char *port_s = strrchr(argv[argi + 1], ':');
+
+                    if (port_s != NULL) {
+                        char *host = argv[argi + 1];
+                        size_t host_len = port_s - host;
+
+                        *port_s++ = '\0';
+
+                        /* IPv6 addresses are bracketed, as in URLs */
+                        if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']') {
+                            host[host_len - 1] = '\0';
+                            host++;
+                        }
+
+                        if (host[0] == '\0') {
+                            goto usage_err;
+                        }
+
+                        srv.metrics_host = host;
+                    } else {
+                        port_s = argv[argi + 1];
+                    }
+
+                    srv.metrics_port = strtoul(port_s, NULL, 0);
+                    if (srv.metrics_port == 0) {
+                        goto usage_err;
+                    }
+
+                    break;
+
+                case 'p':
+                    if (argi + 1 > argc) {
+                        goto usage_err;
+                    }
+
+                    skip = 1;
+                    peers[peers_len++] = argv[argi + 1];
+
+                    break;
+
                 case 'v':
                     srv.verbosity++;
                     break;
 
+                case 'z':
+                    if (argi + 1 > argc) {
+                        goto usage_err;
+                    }
+
+                    skip = 1;
+                    srv.zlib = 1;
+                    srv.zlib_threshold = strtoul(argv[argi + 1], NULL, 0);
+                    if (srv.zlib_threshold == 0) {
+                        goto usage_err;
+                    }
+
+                    break;
+
                 default:
                     goto usage_err;
                 }
@@ -288,6 +368,56 @@ int main(int argc, char **argv) {
         }
     }
 
+    for (size_t i = 0; i < peers_len; i++) {
+        char *type;
+
+        type = strtok(peers[i], ":");
+
+        if (strcmp(type, "unix") == 0 || strcmp(type, "ipc") == 0) {
+            const char *pathname = strtok(NULL, ":");
+            if (pathname == NULL) {
+                goto usage_err;
+            }
+
+            if (strtok(NULL, ":") != NULL) {
+                goto usage_err;
+            }
+
+            if (dime_server_peer(&srv, DIME_UNIX, pathname) < 0) {
+                fprintf(stderr, "Fatal error while initializing server: %s\n", srv.err);
+
+                return -1;
+            }
+        } else if (strcmp(type, "tcp") == 0) {
+            const char *host = strtok(NULL, ":");
+            if (host == NULL) {
+                goto usage_err;
+            }
+
+            const char *port_s = strtok(NULL, ":");
+            if (port_s == NULL) {
+                goto usage_err;
+            }
+
+            if (strtok(NULL, ":") != NULL) {
+                goto usage_err;
+            }
+
+            uint16_t port = strtoul(port_s, NULL, 0);
+            if (port == 0) {
+                goto usage_err;
+            }
+
+            if (dime_server_peer(&srv, DIME_TCP, host, port) < 0) {
+                fprintf(stderr, "Fatal error while initializing server: %s\n", srv.err);
+
+                return -1;
+            }
+        } else {
+            goto usage_err;
+        }
+    }
+
     if (dime_server_loop(&srv) < 0) {
         fprintf(stderr, "Fatal error while running server: %s\n", srv.err);
         return -1;
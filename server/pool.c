@@ -0,0 +1,122 @@
+/*
+ * pool.c - Fixed-size object pool
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+#include <stdlib.h>
+
+#include <pthread.h>
+#include "pool.h"
+
+/* Strictest alignment malloc guarantees, in C99 terms */
+typedef union {
+    void *p;
+    long double ld;
+    long long ll;
+    void (*fn)(void);
+} dime_pool_align_t;
+
+int dime_pool_init(dime_pool_t *pool, size_t objsiz, size_t blklen) {
+    size_t align = sizeof(dime_pool_align_t);
+
+    /* Free objects store the next pointer of the free list in place */
+    if (objsiz < sizeof(void *)) {
+        objsiz = sizeof(void *);
+    }
+
+    pool->objsiz = ((objsiz + align - 1) / align) * align;
+    pool->blklen = (blklen > 0) ? blklen : 1;
+    pool->freelist = NULL;
+
+    pool->blks_len = 0;
+    pool->blks_cap = 8;
+    pool->blks = malloc(pool->blks_cap * sizeof(void *));
+    if (pool->blks == NULL) {
+        return -1;
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool->blks);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+void dime_pool_destroy(dime_pool_t *pool) {
+    for (size_t i = 0; i < pool->blks_len; i++) {
+        free(pool->blks[i]);
+    }
+
+    free(pool->blks);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void *dime_pool_alloc(dime_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->freelist == NULL) {
+        if (pool->blks_len >= pool->blks_cap) {
+            size_t ncap = (pool->blks_cap * 3) / 2;
+            void **nblks = realloc(pool->blks, ncap * sizeof(void *));
+            if (nblks == NULL) {
+                pthread_mutex_unlock(&pool->lock);
+
+                return NULL;
+            }
+
+            pool->blks = nblks;
+            pool->blks_cap = ncap;
+        }
+
+        unsigned char *blk = malloc(pool->objsiz * pool->blklen);
+        if (blk == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+
+            return NULL;
+        }
+
+        pool->blks[pool->blks_len++] = blk;
+
+        /* Thread the new objects onto the free list, first one on top */
+        for (size_t i = pool->blklen; i > 0; i--) {
+            void *obj = blk + (i - 1) * pool->objsiz;
+
+            *(void **)obj = pool->freelist;
+            pool->freelist = obj;
+        }
+    }
+
+    void *p = pool->freelist;
+    pool->freelist = *(void **)p;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return p;
+}
+
+void dime_pool_free(dime_pool_t *pool, void *p) {
+    if (p == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    *(void **)p = pool->freelist;
+    pool->freelist = p;
+
+    pthread_mutex_unlock(&pool->lock);
+}
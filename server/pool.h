@@ -0,0 +1,120 @@
+/*
+ * pool.h - Fixed-size object pool
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+/**
+ * @file pool.h
+ * @brief Fixed-size object pool
+ * @author Nicholas West
+ * @date 2020
+ *
+ * Implements a slab allocator for objects of a single size. Objects are
+ * carved out of large blocks and recycled through a free list, so that
+ * allocating and freeing them is @f$\mathcal{O}(1)@f$ and rarely calls
+ * into @c malloc. Blocks are only returned to the system when the pool
+ * is destroyed. Pools may be shared between threads.
+ */
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+#ifndef __DIME_pool_H
+#define __DIME_pool_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Fixed-size object pool
+ *
+ * Should be treated as opaque; use relevant methods to allocate and
+ * free objects.
+ *
+ * @see dime_pool_init
+ * @see dime_pool_destroy
+ * @see dime_pool_alloc
+ * @see dime_pool_free
+ */
+typedef struct {
+    size_t objsiz; /* Size of each object, rounded up for alignment */
+    size_t blklen; /* Number of objects per block */
+
+    void *freelist; /* Singly-linked list of free objects */
+
+    void **blks;     /* Array of blocks */
+    size_t blks_len; /* Number of blocks */
+    size_t blks_cap; /* Capacity of block array */
+
+    pthread_mutex_t lock; /* Guards the free list and blocks */
+} dime_pool_t;
+
+/**
+ * @brief Initialize a new pool
+ *
+ * @param pool Pointer to a @link dime_pool_t @endlink struct
+ * @param objsiz Size of each object
+ * @param blklen Number of objects to allocate at once when the pool
+ * runs out
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_pool_destroy
+ */
+int dime_pool_init(dime_pool_t *pool, size_t objsiz, size_t blklen);
+
+/**
+ * @brief Free resources used by a pool
+ *
+ * Every object allocated from the pool is freed along with it.
+ *
+ * @param pool Pointer to a @link dime_pool_t @endlink struct
+ *
+ * @see dime_pool_init
+ */
+void dime_pool_destroy(dime_pool_t *pool);
+
+/**
+ * @brief Allocate an object from a pool
+ *
+ * The contents of the object are unspecified.
+ *
+ * @param pool Pointer to a @link dime_pool_t @endlink struct
+ *
+ * @return Pointer to the object, suitably aligned for any type, or NULL
+ * on failure
+ *
+ * @see dime_pool_free
+ */
+void *dime_pool_alloc(dime_pool_t *pool);
+
+/**
+ * @brief Return an object to a pool
+ *
+ * @param pool Pointer to a @link dime_pool_t @endlink struct
+ * @param p Object allocated from the same pool, or NULL
+ *
+ * @see dime_pool_alloc
+ */
+void dime_pool_free(dime_pool_t *pool, void *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
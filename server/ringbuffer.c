@@ -1,107 +1,327 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
 #include "ringbuffer.h"
 
-int dime_ringbuffer_init(dime_ringbuffer_t *ring) {
-    ring->cap = 1024;
-    ring->arr = malloc(ring->cap);
-    if (ring->arr == NULL) {
-        return -1;
+/* Size of each chunk */
+#define CHUNKLEN 16384
+
+/* Idle chunks kept in the pool, beyond which they are freed */
+#define POOLLEN 1024
+
+struct dime_ringbuffer_chunk {
+    struct dime_ringbuffer_chunk *next;
+    unsigned char arr[CHUNKLEN];
+};
+
+typedef struct dime_ringbuffer_chunk dime_ringbuffer_chunk_t;
+
+/* Chunks shared by all ring buffers */
+static struct {
+    dime_ringbuffer_chunk_t *freelist;
+    size_t len;
+
+    pthread_mutex_t lock;
+} pool = {NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/* Returns a NULL-terminated list of chunks */
+static void dime_ringbuffer_give(dime_ringbuffer_chunk_t *first) {
+    pthread_mutex_lock(&pool.lock);
+
+    while (first != NULL && pool.len < POOLLEN) {
+        dime_ringbuffer_chunk_t *next = first->next;
+
+        first->next = pool.freelist;
+        pool.freelist = first;
+        pool.len++;
+
+        first = next;
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    while (first != NULL) {
+        dime_ringbuffer_chunk_t *next = first->next;
+
+        free(first);
+
+        first = next;
     }
+}
+
+/* Takes n chunks, linked from first to last */
+static int dime_ringbuffer_take(size_t n, dime_ringbuffer_chunk_t **first, dime_ringbuffer_chunk_t **last) {
+    dime_ringbuffer_chunk_t *head = NULL, *tail = NULL;
+    size_t k = 0;
+
+    pthread_mutex_lock(&pool.lock);
 
+    if (pool.len > 0) {
+        head = tail = pool.freelist;
+        k = 1;
+
+        while (k < n && tail->next != NULL) {
+            tail = tail->next;
+            k++;
+        }
+
+        pool.freelist = tail->next;
+        pool.len -= k;
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    for (; k < n; k++) {
+        dime_ringbuffer_chunk_t *chunk = malloc(sizeof(dime_ringbuffer_chunk_t));
+        if (chunk == NULL) {
+            if (head != NULL) {
+                tail->next = NULL;
+                dime_ringbuffer_give(head);
+            }
+
+            return -1;
+        }
+
+        if (head == NULL) {
+            head = chunk;
+        } else {
+            tail->next = chunk;
+        }
+
+        tail = chunk;
+    }
+
+    tail->next = NULL;
+
+    *first = head;
+    *last = tail;
+
+    return 0;
+}
+
+int dime_ringbuffer_init(dime_ringbuffer_t *ring) {
     ring->len = 0;
+
+    ring->head = ring->tail = ring->last = NULL;
+    ring->spares = 0;
+
     ring->begin = ring->end = 0;
 
     return 0;
 }
 
 void dime_ringbuffer_destroy(dime_ringbuffer_t *ring) {
-    free(ring->arr);
+    dime_ringbuffer_give(ring->head);
+}
+
+/* Returns every chunk of an empty buffer, so that idle buffers hold no memory */
+static void dime_ringbuffer_release(dime_ringbuffer_t *ring) {
+    dime_ringbuffer_chunk_t *first = ring->head;
+
+    ring->head = ring->tail = ring->last = NULL;
+    ring->spares = 0;
+    ring->begin = ring->end = 0;
+
+    dime_ringbuffer_give(first);
 }
 
 size_t dime_ringbuffer_read(dime_ringbuffer_t *ring, void *buf, size_t siz) {
     return dime_ringbuffer_discard(ring, dime_ringbuffer_peek(ring, buf, siz));
 }
 
+/* Ensures there is room for siz more bytes */
+static int dime_ringbuffer_grow(dime_ringbuffer_t *ring, size_t siz) {
+    size_t avail = (ring->head != NULL) ? (CHUNKLEN - ring->end) + ring->spares * CHUNKLEN : 0;
+
+    if (avail >= siz) {
+        return 0;
+    }
+
+    size_t n = (siz - avail + CHUNKLEN - 1) / CHUNKLEN;
+    dime_ringbuffer_chunk_t *first, *last;
+
+    if (dime_ringbuffer_take(n, &first, &last) < 0) {
+        return -1;
+    }
+
+    if (ring->head == NULL) {
+        ring->head = ring->tail = first;
+        ring->begin = ring->end = 0;
+        ring->spares = n - 1;
+    } else {
+        ring->last->next = first;
+        ring->spares += n;
+    }
+
+    ring->last = last;
+
+    return 0;
+}
+
+/* Advances the writeable bytes by siz, copying buf into them if it is not NULL */
+static void dime_ringbuffer_advance(dime_ringbuffer_t *ring, const void *buf, size_t siz) {
+    ring->len += siz;
+
+    while (siz > 0) {
+        if (ring->end == CHUNKLEN) {
+            ring->tail = ring->tail->next;
+            ring->end = 0;
+            ring->spares--;
+        }
+
+        size_t k = CHUNKLEN - ring->end;
+
+        if (k > siz) {
+            k = siz;
+        }
+
+        if (buf != NULL) {
+            memcpy(ring->tail->arr + ring->end, buf, k);
+            buf = (const unsigned char *)buf + k;
+        }
+
+        ring->end += k;
+        siz -= k;
+    }
+}
+
 ssize_t dime_ringbuffer_write(dime_ringbuffer_t *ring, const void *buf, size_t siz) {
     if (siz == 0) {
         return 0;
     }
 
-    if (ring->len + siz >= ring->cap) {
-        size_t ncap = (3 * (ring->len + siz)) / 2;
+    if (dime_ringbuffer_grow(ring, siz) < 0) {
+        return -1;
+    }
 
-        unsigned char *narr = realloc(ring->arr, ncap);
-        if (narr == NULL) {
-            return -1;
-        }
+    dime_ringbuffer_advance(ring, buf, siz);
+
+    return siz;
+}
+
+size_t dime_ringbuffer_peek(const dime_ringbuffer_t *ring, void *buf, size_t siz) {
+    const void *bufs[8];
+    size_t lens[8];
+    size_t n = 0;
 
-        if (ring->end < ring->begin) {
-            size_t nbegin = ring->begin + (ncap - ring->cap);
+    while (n < siz) {
+        size_t nbufs = dime_ringbuffer_regions(ring, n, siz - n, bufs, lens, 8);
 
-            memmove(narr + nbegin, narr + ring->begin, ncap - nbegin);
+        if (nbufs == 0) {
+            break;
+        }
 
-            ring->begin = nbegin;
+        for (size_t i = 0; i < nbufs; i++) {
+            memcpy((unsigned char *)buf + n, bufs[i], lens[i]);
+            n += lens[i];
         }
+    }
+
+    return n;
+}
 
-        ring->arr = narr;
-        ring->cap = ncap;
+size_t dime_ringbuffer_discard(dime_ringbuffer_t *ring, size_t siz) {
+    if (siz > ring->len) {
+        siz = ring->len;
     }
 
-    size_t spaceleft = ring->cap - ring->end;
+    ring->len -= siz;
 
-	if (spaceleft < siz) {
-		memcpy(ring->arr + ring->end, buf, spaceleft);
-		memcpy(ring->arr, (unsigned char *)buf + spaceleft, siz - spaceleft);
-	} else {
-		memcpy(ring->arr + ring->end, buf, siz);
-	}
+    if (ring->len == 0) {
+        dime_ringbuffer_release(ring);
 
-    ring->len += siz;
-	ring->end += siz;
+        return siz;
+    }
 
-    if (ring->end >= ring->cap) {
-        ring->end -= ring->cap;
+    ring->begin += siz;
+
+    if (ring->begin < CHUNKLEN) {
+        return siz;
+    }
+
+    dime_ringbuffer_chunk_t *first = ring->head, *chunk = NULL;
+
+    /* Bytes remain, so the head chunk that holds them comes before the tail */
+    while (ring->begin >= CHUNKLEN) {
+        chunk = ring->head;
+        ring->head = chunk->next;
+        ring->begin -= CHUNKLEN;
     }
 
+    chunk->next = NULL;
+
+    dime_ringbuffer_give(first);
+
     return siz;
 }
 
-size_t dime_ringbuffer_peek(const dime_ringbuffer_t *ring, void *buf, size_t siz) {
-	if (siz > ring->len) {
-		siz = ring->len;
-	}
-
-    if (siz == 0) {
+size_t dime_ringbuffer_regions(const dime_ringbuffer_t *ring, size_t off, size_t siz, const void **bufs, size_t *lens, size_t cap) {
+    if (off >= ring->len) {
         return 0;
     }
 
-	size_t spaceleft = ring->cap - ring->begin;
+    if (siz > ring->len - off) {
+        siz = ring->len - off;
+    }
 
-	if (spaceleft < siz) {
-		memcpy(buf, ring->arr + ring->begin, spaceleft);
-		memcpy((unsigned char *)buf + spaceleft, ring->arr, siz - spaceleft);
-	} else {
-		memcpy(buf, ring->arr + ring->begin, siz);
-	}
+    const dime_ringbuffer_chunk_t *chunk = ring->head;
+    size_t start = ring->begin + off, n = 0;
 
-    return siz;
+    while (start >= CHUNKLEN) {
+        chunk = chunk->next;
+        start -= CHUNKLEN;
+    }
+
+    while (siz > 0 && n < cap) {
+        size_t k = CHUNKLEN - start;
+
+        if (k > siz) {
+            k = siz;
+        }
+
+        bufs[n] = chunk->arr + start;
+        lens[n] = k;
+        n++;
+
+        siz -= k;
+        chunk = chunk->next;
+        start = 0;
+    }
+
+    return n;
 }
 
-size_t dime_ringbuffer_discard(dime_ringbuffer_t *ring, size_t siz) {
-	if (siz > ring->len) {
-		siz = ring->len;
-	}
+ssize_t dime_ringbuffer_reserve(dime_ringbuffer_t *ring, size_t siz, void **bufs, size_t *lens, size_t cap) {
+    if (dime_ringbuffer_grow(ring, (siz > 0) ? siz : 1) < 0) {
+        return -1;
+    }
 
-	ring->len -= siz;
-	ring->begin += siz;
+    dime_ringbuffer_chunk_t *chunk = ring->tail;
+    size_t n = 0;
 
-    if (ring->begin >= ring->cap) {
-        ring->begin -= ring->cap;
+    if (ring->end < CHUNKLEN) {
+        bufs[n] = chunk->arr + ring->end;
+        lens[n] = CHUNKLEN - ring->end;
+        n++;
     }
 
-    return siz;
+    for (chunk = chunk->next; chunk != NULL && n < cap; chunk = chunk->next) {
+        bufs[n] = chunk->arr;
+        lens[n] = CHUNKLEN;
+        n++;
+    }
+
+    return n;
+}
+
+void dime_ringbuffer_commit(dime_ringbuffer_t *ring, size_t siz) {
+    dime_ringbuffer_advance(ring, NULL, siz);
+
+    /* Nothing was written into the reservation, so let it go */
+    if (ring->len == 0) {
+        dime_ringbuffer_release(ring);
+    }
 }
 
 size_t dime_ringbuffer_len(const dime_ringbuffer_t *ring) {
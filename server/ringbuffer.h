@@ -25,6 +25,13 @@
  * byte-oriented data. Can be thought of as a pipe with an unlimited
  * internal buffer. These ring buffers are used by the sockets to store
  * partially sent/received messages.
+ *
+ * The bytes are kept in a chain of fixed-size chunks, which are taken
+ * from a pool shared by all ring buffers as data is written and returned
+ * to it as data is discarded. A ring buffer therefore holds about as much
+ * memory as the data in it, rather than as much as it ever held, and
+ * writing to it never moves the bytes already in it. The pool keeps a
+ * bounded number of idle chunks for reuse and frees the rest.
  */
 
 #include <stddef.h>
@@ -37,6 +44,8 @@
 extern "C" {
 #endif
 
+struct dime_ringbuffer_chunk;
+
 /**
  * @brief Ring buffer
  *
@@ -53,11 +62,13 @@ extern "C" {
 typedef struct {
     size_t len; /* Number of bytes in the buffer */
 
-    unsigned char *arr; /* Byte array */
-    size_t cap;         /* Capacity of byte array */
+    struct dime_ringbuffer_chunk *head; /* First chunk, or NULL if there are none */
+    struct dime_ringbuffer_chunk *tail; /* Chunk holding the first writeable byte */
+    struct dime_ringbuffer_chunk *last; /* Last chunk, after any reserved ones */
+    size_t spares;                      /* Number of chunks after tail */
 
-    size_t begin; /* Start of readable bytes in array */
-    size_t end;   /* Start of writeable bytes in array */
+    size_t begin; /* Start of readable bytes in head */
+    size_t end;   /* Start of writeable bytes in tail */
 } dime_ringbuffer_t;
 
 /**
@@ -133,6 +144,9 @@ size_t dime_ringbuffer_peek(const dime_ringbuffer_t *ring,
 /**
  * @brief Advance a certain number of bytes in the ring buffer
  *
+ * Chunks left without readable bytes are returned to the pool, and an
+ * emptied ring buffer returns all of its chunks, holding no memory.
+ *
  * @param ring Pointer to a @c dime_ringbuffer_t struct
  * @param siz Number of bytes to discard
  *
@@ -142,6 +156,76 @@ size_t dime_ringbuffer_peek(const dime_ringbuffer_t *ring,
  */
 size_t dime_ringbuffer_discard(dime_ringbuffer_t *ring, size_t siz);
 
+/**
+ * @brief Locate bytes in the ring buffer without copying them
+ *
+ * Finds the contiguous regions of the internal chunks that hold the
+ * @em siz bytes starting @em off bytes past the first readable byte,
+ * one region per chunk. If there are more than @em cap of them, only
+ * the first @em cap regions are returned, covering fewer than @em siz
+ * bytes. The pointers remain valid until the bytes they point to are
+ * discarded.
+ *
+ * @param ring Pointer to a @c dime_ringbuffer_t struct
+ * @param off Offset from the first readable byte
+ * @param siz Number of bytes
+ * @param bufs Array of @em cap pointers to receive the region addresses
+ * @param lens Array of @em cap sizes to receive the region lengths
+ * @param cap Maximum number of regions
+ *
+ * @return Number of regions, no more than @em cap
+ *
+ * @see dime_ringbuffer_peek
+ */
+size_t dime_ringbuffer_regions(const dime_ringbuffer_t *ring,
+                               size_t off,
+                               size_t siz,
+                               const void **bufs,
+                               size_t *lens,
+                               size_t cap);
+
+/**
+ * @brief Get writable space at the end of the ring buffer
+ *
+ * Adds chunks to the ring buffer so that at least @em siz bytes are
+ * free, and finds the contiguous regions of the chunks that make up the
+ * free space, so that data may be written into them directly. At most
+ * @em cap regions are returned, which may cover more or fewer than
+ * @em siz bytes. Written bytes become readable once
+ * @link dime_ringbuffer_commit @endlink is called. The pointers remain
+ * valid until the next call to @link dime_ringbuffer_write @endlink,
+ * @link dime_ringbuffer_discard @endlink or
+ * @link dime_ringbuffer_reserve @endlink.
+ *
+ * @param ring Pointer to a @c dime_ringbuffer_t struct
+ * @param siz Minimum number of free bytes
+ * @param bufs Array of @em cap pointers to receive the region addresses
+ * @param lens Array of @em cap sizes to receive the region lengths
+ * @param cap Maximum number of regions, at least 1
+ *
+ * @return Number of regions, or a negative value on failure
+ *
+ * @see dime_ringbuffer_commit
+ */
+ssize_t dime_ringbuffer_reserve(dime_ringbuffer_t *ring,
+                                size_t siz,
+                                void **bufs,
+                                size_t *lens,
+                                size_t cap);
+
+/**
+ * @brief Make bytes written into reserved space readable
+ *
+ * Must also be called, with @em siz 0, if nothing was written; a ring
+ * buffer left empty then returns the reserved chunks to the pool.
+ *
+ * @param ring Pointer to a @c dime_ringbuffer_t struct
+ * @param siz Number of bytes written, no more than were reserved
+ *
+ * @see dime_ringbuffer_reserve
+ */
+void dime_ringbuffer_commit(dime_ringbuffer_t *ring, size_t siz);
+
 /**
  * @brief Get the number of bytes in the ring buffer
  *
@@ -0,0 +1,449 @@
+/*
+ * route.c - Routing information of DiME messages
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "route.h"
+
+/* Same nesting limit as jansson */
+static const unsigned int MAXDEPTH = 2048;
+
+/*
+ * Most integer digits that always fit in a json_int_t. With at most two
+ * exponent digits, no real with this many before the point can overflow a
+ * double either, however many follow it, so longer ones are left to the
+ * full parser.
+ */
+static const size_t MAXINTLEN = 18;
+
+/* Names of the commands, indexed by opcode */
+static const char *const COMMANDS[DIME_OP_COUNT] = {
+    NULL,
+    "handshake",
+    "join",
+    "leave",
+    "send",
+    "broadcast",
+    "sync",
+    "wait",
+    "devices",
+    "batch",
+    "subscribe",
+    "stats",
+    "forward"
+};
+
+/* Opcodes of the commands, sorted by name */
+static const int BYNAME[] = {
+    DIME_OP_BATCH,
+    DIME_OP_BROADCAST,
+    DIME_OP_DEVICES,
+    DIME_OP_FORWARD,
+    DIME_OP_HANDSHAKE,
+    DIME_OP_JOIN,
+    DIME_OP_LEAVE,
+    DIME_OP_SEND,
+    DIME_OP_STATS,
+    DIME_OP_SUBSCRIBE,
+    DIME_OP_SYNC,
+    DIME_OP_WAIT
+};
+
+static const unsigned char *dime_route_value(const unsigned char *p, const unsigned char *end, unsigned int depth);
+
+static const unsigned char *dime_route_ws(const unsigned char *p, const unsigned char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+
+    return p;
+}
+
+/* Skips one UTF-8 encoded code point that is not ASCII */
+static const unsigned char *dime_route_utf8(const unsigned char *p, const unsigned char *end) {
+    unsigned int cp;
+    size_t n;
+
+    if (*p >= 0xC2 && *p <= 0xDF) {
+        cp = *p & 0x1F;
+        n = 1;
+    } else if (*p >= 0xE0 && *p <= 0xEF) {
+        cp = *p & 0x0F;
+        n = 2;
+    } else if (*p >= 0xF0 && *p <= 0xF4) {
+        cp = *p & 0x07;
+        n = 3;
+    } else {
+        return NULL;
+    }
+
+    if ((size_t)(end - p) <= n) {
+        return NULL;
+    }
+
+    for (size_t i = 1; i <= n; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return NULL;
+        }
+
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+
+    /* Overlong encodings, surrogates and code points past U+10FFFF */
+    if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) ||
+        (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+        return NULL;
+    }
+
+    return p + n + 1;
+}
+
+/*
+ * Skips a string, p pointing at its opening quote. *plain is set to
+ * whether it has no escapes, in which case its contents are the bytes
+ * between the quotes.
+ */
+static const unsigned char *dime_route_string(const unsigned char *p, const unsigned char *end, int *plain) {
+    *plain = 1;
+    p++;
+
+    while (p < end) {
+        if (*p == '"') {
+            return p + 1;
+        } else if (*p == '\\') {
+            if (p + 1 >= end) {
+                return NULL;
+            }
+
+            /* Unicode escapes may hide NULs and unpaired surrogates */
+            if (strchr("\"\\/bfnrt", p[1]) == NULL || p[1] == '\0') {
+                return NULL;
+            }
+
+            *plain = 0;
+            p += 2;
+        } else if (*p < 0x20) {
+            return NULL;
+        } else if (*p < 0x80) {
+            p++;
+        } else {
+            p = dime_route_utf8(p, end);
+            if (p == NULL) {
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static const unsigned char *dime_route_number(const unsigned char *p, const unsigned char *end) {
+    if (p < end && *p == '-') {
+        p++;
+    }
+
+    if (p < end && *p == '0') {
+        p++;
+    } else if (p < end && *p >= '1' && *p <= '9') {
+        const unsigned char *digits = p;
+
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+
+        if ((size_t)(p - digits) > MAXINTLEN) {
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+
+    if (p < end && *p == '.') {
+        p++;
+
+        if (p >= end || *p < '0' || *p > '9') {
+            return NULL;
+        }
+
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+
+        if (p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+
+        const unsigned char *digits = p;
+
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+
+        /* Exponents past two digits may overflow a double */
+        if (p == digits || p - digits > 2) {
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+static const unsigned char *dime_route_literal(const unsigned char *p, const unsigned char *end, const char *lit) {
+    size_t n = strlen(lit);
+
+    if ((size_t)(end - p) < n || memcmp(p, lit, n) != 0) {
+        return NULL;
+    }
+
+    return p + n;
+}
+
+/* Skips an object or array, p pointing at its opening bracket */
+static const unsigned char *dime_route_container(const unsigned char *p, const unsigned char *end, unsigned int depth) {
+    int object = (*p == '{');
+    unsigned char close = object ? '}' : ']';
+
+    if (depth >= MAXDEPTH) {
+        return NULL;
+    }
+
+    p = dime_route_ws(p + 1, end);
+
+    if (p < end && *p == close) {
+        return p + 1;
+    }
+
+    while (p < end) {
+        if (object) {
+            int plain;
+
+            if (*p != '"') {
+                return NULL;
+            }
+
+            p = dime_route_string(p, end, &plain);
+            if (p == NULL) {
+                return NULL;
+            }
+
+            p = dime_route_ws(p, end);
+            if (p >= end || *p != ':') {
+                return NULL;
+            }
+
+            p = dime_route_ws(p + 1, end);
+        }
+
+        p = dime_route_value(p, end, depth + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        p = dime_route_ws(p, end);
+
+        if (p < end && *p == close) {
+            return p + 1;
+        } else if (p >= end || *p != ',') {
+            return NULL;
+        }
+
+        p = dime_route_ws(p + 1, end);
+    }
+
+    return NULL;
+}
+
+static const unsigned char *dime_route_value(const unsigned char *p, const unsigned char *end, unsigned int depth) {
+    int plain;
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    switch (*p) {
+    case '{':
+    case '[':
+        return dime_route_container(p, end, depth);
+
+    case '"':
+        return dime_route_string(p, end, &plain);
+
+    case 't':
+        return dime_route_literal(p, end, "true");
+
+    case 'f':
+        return dime_route_literal(p, end, "false");
+
+    case 'n':
+        return dime_route_literal(p, end, "null");
+
+    default:
+        return dime_route_number(p, end);
+    }
+}
+
+/* Copies the contents of a plain string into a NUL-terminated buffer */
+static int dime_route_copy(char *buf, size_t siz, const unsigned char *str, const unsigned char *str_end) {
+    size_t n = (str_end - str) - 2;
+
+    if (n >= siz) {
+        return -1;
+    }
+
+    memcpy(buf, str + 1, n);
+    buf[n] = '\0';
+
+    return 0;
+}
+
+int dime_route_scan(dime_route_t *route, const char *jsonstr, size_t jsondata_len) {
+    const unsigned char *p = (const unsigned char *)jsonstr;
+    const unsigned char *end = p + jsondata_len;
+
+    route->jsonstr = jsonstr;
+    route->jsondata_len = jsondata_len;
+    route->command = NULL;
+    route->name = NULL;
+    route->varname = NULL;
+    route->delta = -1;
+
+    p = dime_route_ws(p, end);
+
+    if (p >= end || *p != '{') {
+        return 0;
+    }
+
+    p = dime_route_ws(p + 1, end);
+
+    if (p < end && *p == '}') {
+        return dime_route_ws(p + 1, end) == end;
+    }
+
+    /* Like the top level of dime_route_container, noting the fields we want */
+    while (1) {
+        const unsigned char *key = p, *key_end, *val, *val_end;
+        int plain;
+
+        if (p >= end || *p != '"') {
+            return 0;
+        }
+
+        key_end = dime_route_string(key, end, &plain);
+        if (key_end == NULL) {
+            return 0;
+        }
+
+        p = dime_route_ws(key_end, end);
+        if (p >= end || *p != ':') {
+            return 0;
+        }
+
+        val = dime_route_ws(p + 1, end);
+        val_end = dime_route_value(val, end, 1);
+        if (val_end == NULL) {
+            return 0;
+        }
+
+        size_t key_len = (key_end - key) - 2;
+        const char **field = NULL;
+        char *buf = NULL;
+        size_t siz = 0;
+
+        if (key_len == 7 && memcmp(key + 1, "command", 7) == 0) {
+            field = &route->command;
+            buf = route->command_buf;
+            siz = sizeof(route->command_buf);
+        } else if (key_len == 4 && memcmp(key + 1, "name", 4) == 0) {
+            field = &route->name;
+            buf = route->name_buf;
+            siz = sizeof(route->name_buf);
+        } else if (key_len == 7 && memcmp(key + 1, "varname", 7) == 0) {
+            field = &route->varname;
+            buf = route->varname_buf;
+            siz = sizeof(route->varname_buf);
+        } else if (key_len == 5 && memcmp(key + 1, "delta", 5) == 0) {
+            if (*val == 't') {
+                route->delta = 1;
+            } else if (*val == 'f') {
+                route->delta = 0;
+            } else {
+                return 0;
+            }
+        }
+
+        /* Duplicates override earlier values, as in the full parser */
+        if (field != NULL) {
+            if (*val != '"') {
+                return 0;
+            }
+
+            dime_route_string(val, end, &plain);
+
+            if (!plain || dime_route_copy(buf, siz, val, val_end) < 0) {
+                return 0;
+            }
+
+            *field = buf;
+        }
+
+        p = dime_route_ws(val_end, end);
+
+        if (p < end && *p == '}') {
+            break;
+        } else if (p >= end || *p != ',') {
+            return 0;
+        }
+
+        p = dime_route_ws(p + 1, end);
+    }
+
+    return dime_route_ws(p + 1, end) == end;
+}
+
+int dime_route_routable(const dime_route_t *route) {
+    switch (route->opcode) {
+    case DIME_OP_SEND:
+        /* Let the full parser report a missing recipient */
+        return route->name != NULL || route->group != 0;
+
+    case DIME_OP_BROADCAST:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+static int dime_route_cmp(const void *a, const void *b) {
+    return strcmp(a, COMMANDS[*(const int *)b]);
+}
+
+int dime_route_opcode(const char *command) {
+    const int *opcode = bsearch(command, BYNAME, sizeof(BYNAME) / sizeof(BYNAME[0]), sizeof(BYNAME[0]), dime_route_cmp);
+
+    return (opcode != NULL) ? *opcode : DIME_OP_UNKNOWN;
+}
+
+const char *dime_route_command(int opcode) {
+    return (opcode >= 0 && opcode < DIME_OP_COUNT) ? COMMANDS[opcode] : NULL;
+}
@@ -0,0 +1,159 @@
+/*
+ * route.h - Routing information of DiME messages
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+/**
+ * @file route.h
+ * @brief Routing information of DiME messages
+ * @author Nicholas West
+ * @date 2020
+ *
+ * Messages that are only forwarded to other clients, i.e. "send" and
+ * "broadcast" commands, are never looked at by the server beyond a
+ * handful of fields. Rather than parsing their JSON portion into a tree
+ * and serializing it again for each forward, the server scans the
+ * original bytes once for those fields and forwards the bytes as they
+ * were received.
+ *
+ * The scan also validates the JSON, so that nothing is forwarded that
+ * the full parser would reject. Messages with anything unusual in them,
+ * such as Unicode escapes or very long names, are left to the full
+ * parser instead.
+ *
+ * Every command also has an opcode, which is how DiME v2 messages name
+ * their command (see @link dime_socket_init_v2 @endlink), and by which
+ * the server dispatches all messages.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __DIME_route_H
+#define __DIME_route_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Longest group or variable name that can be routed, including the NUL */
+#define DIME_ROUTE_NAMELEN 256
+
+/**
+ * @brief Command opcodes
+ *
+ * These are part of the DiME v2 wire format, so existing values must
+ * never change.
+ */
+enum {
+    DIME_OP_UNKNOWN = -1,   /** Not a known command */
+    DIME_OP_RESPONSE = 0,   /** Message from the server */
+    DIME_OP_HANDSHAKE = 1,  /** "handshake" */
+    DIME_OP_JOIN = 2,       /** "join" */
+    DIME_OP_LEAVE = 3,      /** "leave" */
+    DIME_OP_SEND = 4,       /** "send" */
+    DIME_OP_BROADCAST = 5,  /** "broadcast" */
+    DIME_OP_SYNC = 6,       /** "sync" */
+    DIME_OP_WAIT = 7,       /** "wait" */
+    DIME_OP_DEVICES = 8,    /** "devices" */
+    DIME_OP_BATCH = 9,      /** "batch" */
+    DIME_OP_SUBSCRIBE = 10, /** "subscribe" */
+    DIME_OP_STATS = 11,     /** "stats" */
+    DIME_OP_FORWARD = 12,   /** "forward", only sent between peered servers */
+    DIME_OP_COUNT
+};
+
+/**
+ * @brief Routing information of a DiME message
+ *
+ * Filled in by @link dime_route_scan @endlink, except for the fields
+ * that DiME v2 messages carry in their header.
+ */
+typedef struct {
+    const char *jsonstr; /** JSON portion of the message (not NUL-terminated) */
+    size_t jsondata_len; /** Length of JSON portion of the message */
+
+    int opcode;     /** Command opcode */
+    uint32_t group; /** Recipient group handle, or 0 if none */
+    uint32_t seq;   /** Sequence number, or 0 if none */
+
+    const char *command; /** Command named in the JSON portion, or NULL if none */
+    const char *name;    /** Recipient group, or NULL if none */
+    const char *varname; /** Variable name, or NULL if none */
+    int delta;           /** Value of the boolean @c delta field, or -1 if none */
+
+    char command_buf[16];                  /** Storage for command */
+    char name_buf[DIME_ROUTE_NAMELEN];    /** Storage for name */
+    char varname_buf[DIME_ROUTE_NAMELEN]; /** Storage for varname */
+} dime_route_t;
+
+/**
+ * @brief Scan the JSON portion of a message for routing information
+ *
+ * Fills in the fields of @em route that come from the JSON portion.
+ * Succeeds only if the JSON is a valid object and every field of
+ * interest in it could be read without a full parse. Otherwise, the
+ * message should be parsed in full, which also reports any errors in
+ * it.
+ *
+ * @param route Pointer to a @link dime_route_t @endlink struct
+ * @param jsonstr JSON portion of the message, which must outlive
+ * @em route
+ * @param jsondata_len Length of JSON portion of the message
+ *
+ * @return A positive value on success, or zero if the message should be
+ * parsed in full
+ *
+ * @see dime_route_routable
+ */
+int dime_route_scan(dime_route_t *route, const char *jsonstr, size_t jsondata_len);
+
+/**
+ * @brief Whether a scanned message can be handled without a full parse
+ *
+ * @param route Pointer to a @link dime_route_t @endlink struct filled
+ * in by @link dime_route_scan @endlink
+ *
+ * @return Nonzero if the message need not be parsed, or zero otherwise
+ */
+int dime_route_routable(const dime_route_t *route);
+
+/**
+ * @brief Look up the opcode of a command
+ *
+ * @param command Name of the command
+ *
+ * @return The opcode, or @c DIME_OP_UNKNOWN if there is no such command
+ *
+ * @see dime_route_command
+ */
+int dime_route_opcode(const char *command);
+
+/**
+ * @brief Look up the name of a command
+ *
+ * @param opcode Command opcode
+ *
+ * @return The name of the command, or NULL if there is no such command
+ *
+ * @see dime_route_opcode
+ */
+const char *dime_route_command(int opcode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,6 +5,7 @@
 #else
 #   include <arpa/inet.h>
 #   include <fcntl.h>
+#   include <netdb.h>
 #   include <netinet/in.h>
 #   include <unistd.h>
 #   include <sys/select.h>
@@ -12,6 +13,15 @@
 #   include <sys/un.h>
 #endif
 
+#if defined(DIME_USE_EPOLL)
+#   include <sys/epoll.h>
+#elif defined(DIME_USE_KQUEUE)
+#   include <sys/event.h>
+#elif defined(DIME_USE_IO_URING)
+#   include <poll.h>
+#   include <sys/uio.h>
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -21,6 +31,7 @@
 #include <stdarg.h>
 #include <errno.h>
 
+#include <pthread.h>
 #ifdef DIME_USE_LIBEV
 #   include <ev.h>
 #endif
@@ -32,13 +43,26 @@
 #include "server.h"
 #include "table.h"
 #include "deque.h"
+#include "pool.h"
 #include "socket.h"
+#include "stats.h"
 #include "log.h"
 
 #ifdef _WIN32
 #   define close closesocket
 #endif
 
+/* Backends that only report changes in readiness, so sockets must be drained */
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE) || defined(DIME_USE_IO_URING)
+#   define DIME_EDGE_TRIGGERED
+#endif
+
+#ifdef DIME_USE_IO_URING
+/* Sends submitted per batch, and buffers per send */
+#   define DIME_URING_BATCH 64
+#   define DIME_URING_IOVLEN 64
+#endif
+
 static int cmp_fd(const void *a, const void *b) {
     return (*(const int *)b) - (*(const int *)a);
 }
@@ -47,34 +71,293 @@ static uint64_t hash_fd(const void *a) {
     return (*(const int *)a) * 0x9E3779B97F4A7BB9;
 }
 
-static int cmp_name(const void *a, const void *b) {
-    return strcmp(a, b);
-}
+/* Handlers of each command, indexed by opcode */
+static const struct {
+    int (*handler)(dime_client_t *, dime_server_t *, json_t *, void **, size_t);
+    int (*route_handler)(dime_client_t *, dime_server_t *, const dime_route_t *, void **, size_t);
+} COMMANDS[DIME_OP_COUNT] = {
+    [DIME_OP_HANDSHAKE] = {dime_client_handshake, NULL},
+    [DIME_OP_JOIN] = {dime_client_join, NULL},
+    [DIME_OP_LEAVE] = {dime_client_leave, NULL},
+    [DIME_OP_SEND] = {dime_client_send, dime_client_send_route},
+    [DIME_OP_BROADCAST] = {dime_client_broadcast, dime_client_broadcast_route},
+    [DIME_OP_SYNC] = {dime_client_sync, NULL},
+    [DIME_OP_WAIT] = {dime_client_wait, NULL},
+    [DIME_OP_DEVICES] = {dime_client_devices, NULL},
+    [DIME_OP_BATCH] = {dime_client_batch, NULL},
+    [DIME_OP_SUBSCRIBE] = {dime_client_subscribe, NULL},
+    [DIME_OP_STATS] = {dime_client_stats, NULL},
+    [DIME_OP_FORWARD] = {dime_client_forward, NULL}
+};
 
 /*
- * Note: FNV1a is currently used here to hash strings, but since this is a
- * network-enabled program, we may want to use a randomized hashing algorithm
- * like SipHash
+ * Handles a message popped from a client's socket. The caller must hold
+ * the server lock, if any, and still owns jsondata and *pbindata unless
+ * the handler claims the latter.
  */
-static uint64_t hash_name(const void *a) {
-    uint64_t y = 0xCBF29CE484222325;
+static int dime_server_dispatch(dime_server_t *srv, dime_client_t *clnt, const dime_route_t *route, json_t *jsondata, void **pbindata, size_t bindata_len) {
+    const char *cmd = dime_route_command(route->opcode);
+    int err;
+
+    if (cmd == NULL) {
+        cmd = "";
+    }
+
+    /* Peered servers answer our advertisements, and only errors matter */
+    if (clnt->peer && route->opcode == DIME_OP_UNKNOWN) {
+        json_int_t status = 0;
+        const char *error = "";
+
+        if (jsondata != NULL && json_unpack(jsondata, "{sI}", "status", &status) == 0 && status < 0 && srv->verbosity >= 1) {
+            json_unpack(jsondata, "{ss}", "error", &error);
+
+            dime_warn("Peer %s reported an error: %s", clnt->addr, error);
+        }
+
+        return 0;
+    }
+
+    srv->stats.msgs++;
+    clnt->stats.msgs_in++;
+
+    /* The worker dispatching is the one that owns the inbuffer */
+    clnt->stats.rbuf_len = dime_socket_recvlen(&clnt->sock);
+
+    if (srv->verbosity >= 3) {
+        dime_info("Got DiME message with command \"%s\" from %s", cmd, clnt->addr);
+    }
+
+    if (route->opcode <= DIME_OP_RESPONSE || route->opcode >= DIME_OP_COUNT) {
+        err = -1;
+
+        strncpy(srv->err, "Unknown command", sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        json_t *response = json_pack("{siss}", "status", -1, "error", "Unknown command");
+        if (response != NULL) {
+            dime_socket_push(&clnt->sock, response, NULL, 0);
+            json_decref(response);
+        }
+    } else if (jsondata == NULL) {
+        err = COMMANDS[route->opcode].route_handler(clnt, srv, route, pbindata, bindata_len);
+    } else {
+        /* The JSON handlers take the group handle of a v2 header as a field */
+        if (route->group != 0) {
+            json_object_set_new(jsondata, "group", json_integer(route->group));
+        }
+
+        err = COMMANDS[route->opcode].handler(clnt, srv, jsondata, pbindata, bindata_len);
+    }
+
+    if (err < 0 && srv->verbosity >= 1) {
+        dime_warn("Failed to handle command \"%s\" from %s: %s", cmd, clnt->addr, srv->err);
+    }
+
+    return err;
+}
+
+/* Answers a WebSocket ping that came in with the messages just popped */
+static int dime_server_pong(dime_client_t *clnt) {
+    if (clnt->sock.ws.pong_len < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&clnt->lock);
+
+    ssize_t n = dime_socket_ws_pong(&clnt->sock);
+
+    pthread_mutex_unlock(&clnt->lock);
+
+    if (n < 0) {
+        return -1;
+    }
+
+    dime_server_wake(clnt->worker);
+
+    return 0;
+}
+
+/* Sentinel handed through a worker's self-pipe to stop it */
+static char dime_worker_quit;
+
+static int dime_worker_init(dime_worker_t *worker, dime_server_t *srv) {
+    worker->srv = srv;
+    worker->woken = 0;
+
+    worker->clnts_len = 0;
+    worker->clnts_cap = 16;
+    worker->clnts = malloc(sizeof(dime_client_t *) * worker->clnts_cap);
+    if (worker->clnts == NULL) {
+        return -1;
+    }
+
+#ifdef _WIN32
+    /* Only a single worker is supported on Windows, so no wakeups */
+    worker->pipefd[0] = worker->pipefd[1] = -1;
+#else
+    if (pipe(worker->pipefd) < 0) {
+        free(worker->clnts);
+
+        return -1;
+    }
+#endif
+
+#if defined(DIME_USE_EPOLL)
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = worker;
+
+    worker->pollfd = epoll_create1(0);
+
+    if (worker->pollfd < 0 || epoll_ctl(worker->pollfd, EPOLL_CTL_ADD, worker->pipefd[0], &ev) < 0) {
+        if (worker->pollfd >= 0) {
+            close(worker->pollfd);
+        }
+
+        close(worker->pipefd[0]);
+        close(worker->pipefd[1]);
+        free(worker->clnts);
+
+        return -1;
+    }
+#elif defined(DIME_USE_KQUEUE)
+    struct kevent ev;
+
+    EV_SET(&ev, worker->pipefd[0], EVFILT_READ, EV_ADD, 0, 0, worker);
+
+    worker->pollfd = kqueue();
+
+    if (worker->pollfd < 0 || kevent(worker->pollfd, &ev, 1, NULL, 0, NULL) < 0) {
+        if (worker->pollfd >= 0) {
+            close(worker->pollfd);
+        }
+
+        close(worker->pipefd[0]);
+        close(worker->pipefd[1]);
+        free(worker->clnts);
+
+        return -1;
+    }
+#elif defined(DIME_USE_IO_URING)
+    worker->msgs = malloc(sizeof(struct msghdr) * DIME_URING_BATCH);
+    worker->iovs = malloc(sizeof(struct iovec) * DIME_URING_BATCH * DIME_URING_IOVLEN);
+
+    worker->stash_len = 0;
+    worker->stash_cap = 16;
+    worker->stash = malloc(sizeof(struct io_uring_cqe) * worker->stash_cap);
+
+    if (worker->msgs == NULL || worker->iovs == NULL || worker->stash == NULL) {
+        free(worker->msgs);
+        free(worker->iovs);
+        free(worker->stash);
+        close(worker->pipefd[0]);
+        close(worker->pipefd[1]);
+        free(worker->clnts);
+
+        return -1;
+    }
+
+    if (dime_deque_init(&worker->dirty) < 0) {
+        free(worker->msgs);
+        free(worker->iovs);
+        free(worker->stash);
+        close(worker->pipefd[0]);
+        close(worker->pipefd[1]);
+        free(worker->clnts);
+
+        return -1;
+    }
+
+    /* 64 receive buffers of 64 KiB each */
+    if (dime_uring_init(&worker->ring, 256, 64, 65536) < 0) {
+        dime_deque_destroy(&worker->dirty);
+        free(worker->msgs);
+        free(worker->iovs);
+        free(worker->stash);
+        close(worker->pipefd[0]);
+        close(worker->pipefd[1]);
+        free(worker->clnts);
+
+        return -1;
+    }
+
+    pthread_mutex_init(&worker->dirtylock, NULL);
+#endif
+
+    return 0;
+}
+
+static void dime_worker_destroy(dime_worker_t *worker) {
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    close(worker->pollfd);
+#elif defined(DIME_USE_IO_URING)
+    dime_uring_destroy(&worker->ring);
+    dime_deque_destroy(&worker->dirty);
+    pthread_mutex_destroy(&worker->dirtylock);
+    free(worker->msgs);
+    free(worker->iovs);
+    free(worker->stash);
+#endif
+
+    if (worker->pipefd[0] >= 0) {
+        close(worker->pipefd[0]);
+        close(worker->pipefd[1]);
+    }
+
+    free(worker->clnts);
+}
+
+void dime_server_wake(dime_worker_t *worker) {
+    void *p = NULL;
+
+    /*
+     * One pending wakeup is as good as many, and a worker relaying to many
+     * of its own clients would otherwise fill its self-pipe and block on it
+     */
+    if (worker == NULL || worker->pipefd[1] < 0 || __atomic_exchange_n(&worker->woken, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    if (write(worker->pipefd[1], &p, sizeof(void *)) < 0) {
+        dime_err("Failed to wake worker (%s)", strerror(errno));
+    }
+}
 
-    for (const char *s = a; *s != '\0'; s++) {
-        y = (y ^ *s) * 1099511628211;
+void dime_server_stop(dime_server_t *srv) {
+#ifdef DIME_USE_LIBEV
+    /* The libev loop is single-threaded, so nothing can hold a lock */
+    exit(0);
+#else
+    int saved = errno;
+    void *p = &dime_worker_quit;
+
+    srv->stopping = 1;
+
+    /*
+     * Signals are blocked on every other thread, so worker 0 is not midway
+     * through being set up. If it does not exist yet, the loop checks
+     * stopping before it starts.
+     */
+    if (srv->workers_len > 0) {
+        ssize_t n = write(srv->workers[0].pipefd[1], &p, sizeof(void *));
+        (void)n;
     }
 
-    return y;
+    errno = saved;
+#endif
 }
 
 int dime_server_init(dime_server_t *srv) {
     srv->err[0] = '\0';
+    srv->metrics_fd = -1;
 
     if (dime_table_init(&srv->fd2clnt, cmp_fd, hash_fd) < 0) {
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
         printf("%d %s\n", __LINE__, strerror(errno)); return -1;
     }
 
-    if (dime_table_init(&srv->name2clnt, cmp_name, hash_name) < 0) {
+    if (dime_table_init(&srv->name2clnt, dime_table_cmp_str, dime_table_hash_str) < 0) {
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
 
         dime_table_destroy(&srv->fd2clnt);
@@ -131,7 +414,7 @@ int dime_server_init(dime_server_t *srv) {
 #endif
     }
 
-/*    if (srv->tls) {
+    if (srv->tls) {
         if (srv->certname == NULL) {
             if (srv->verbosity >= 1) {
                 dime_warn("Certificate file not given, TLS will be disabled");
@@ -183,14 +466,116 @@ int dime_server_init(dime_server_t *srv) {
             goto tls_break;
         }
     }
-tls_break:*/
+tls_break:
+
+    if (pthread_mutex_init(&srv->lock, NULL) != 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        free(srv->pathnames);
+        free(srv->fds);
+        dime_table_destroy(&srv->name2clnt);
+        dime_table_destroy(&srv->fd2clnt);
+
+        printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+    }
+
+    if (dime_pool_init(&srv->msgpool, sizeof(dime_rcmessage_t), 256) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        pthread_mutex_destroy(&srv->lock);
+        free(srv->pathnames);
+        free(srv->fds);
+        dime_table_destroy(&srv->name2clnt);
+        dime_table_destroy(&srv->fd2clnt);
+
+        return -1;
+    }
+
+    srv->batches = 0;
+
+    srv->peers = NULL;
+    srv->peers_len = 0;
+    srv->peers_cap = 0;
+
+    srv->groups_len = 0;
+    srv->groups_cap = 16;
+    srv->groups = malloc(srv->groups_cap * sizeof(dime_group_t *));
+    if (srv->groups == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        dime_pool_destroy(&srv->msgpool);
+        pthread_mutex_destroy(&srv->lock);
+        free(srv->pathnames);
+        free(srv->fds);
+        dime_table_destroy(&srv->name2clnt);
+        dime_table_destroy(&srv->fd2clnt);
+
+        return -1;
+    }
+
+    srv->clnts_len = 0;
+    srv->clnts_cap = 16;
+    srv->clnts = malloc(srv->clnts_cap * sizeof(dime_client_t *));
+    if (srv->clnts == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        free(srv->groups);
+        dime_pool_destroy(&srv->msgpool);
+        pthread_mutex_destroy(&srv->lock);
+        free(srv->pathnames);
+        free(srv->fds);
+        dime_table_destroy(&srv->name2clnt);
+        dime_table_destroy(&srv->fd2clnt);
+
+        return -1;
+    }
+
+    srv->workers = NULL;
+    srv->workers_len = 0;
+    srv->nextworker = 0;
 
     srv->serialization = DIME_NO_SERIALIZATION;
 
+    memset(&srv->stats, 0, sizeof(srv->stats));
+    clock_gettime(CLOCK_MONOTONIC, &srv->stats.start);
+    srv->stats.last = srv->stats.start;
+
+#ifdef DIME_USE_TRACE
+    memset(&srv->trace, 0, sizeof(srv->trace));
+#endif
+
     return 0;
 }
 
 void dime_server_destroy(dime_server_t *srv) {
+    dime_stats_stop(srv);
+
+    /* Stop the other workers before touching any clients they own */
+    for (size_t i = 1; i < srv->workers_len; i++) {
+        void *p = &dime_worker_quit;
+
+        if (write(srv->workers[i].pipefd[1], &p, sizeof(void *)) == sizeof(void *)) {
+            pthread_join(srv->workers[i].thread, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < srv->workers_len; i++) {
+        dime_worker_destroy(&srv->workers[i]);
+    }
+
+    free(srv->workers);
+
+    /* Also stops groups being advertised to peers as their clients go */
+    srv->workers = NULL;
+    srv->workers_len = 0;
+
+    for (size_t i = 0; i < srv->peers_len; i++) {
+        dime_client_destroy(srv->peers[i]);
+        free(srv->peers[i]);
+    }
+
+    free(srv->peers);
+
     for (size_t i = 0; i < srv->pathnames_len; i++) {
         unlink(srv->pathnames[i]);
         free(srv->pathnames[i]);
@@ -204,27 +589,51 @@ void dime_server_destroy(dime_server_t *srv) {
 
     free(srv->fds);
 
-    dime_table_iter_t it;
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_client_destroy(srv->clnts[i]);
+        free(srv->clnts[i]);
+    }
 
-    dime_table_iter_init(&it, &srv->fd2clnt);
+    free(srv->clnts);
 
-    while (dime_table_iter_next(&it)) {
-        dime_client_destroy(it.val);
-        free(it.val);
-    }
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_group_t *group = srv->groups[i];
 
-    dime_table_iter_init(&it, &srv->name2clnt);
+        if (group->deltas != NULL) {
+            dime_table_iter_t it;
+
+            dime_table_iter_init(&it, group->deltas);
+
+            while (dime_table_iter_next(&it)) {
+                dime_delta_t *delta = it.val;
+
+                free(delta->varname);
+                free(delta->value);
+                free(delta);
+            }
 
-    while (dime_table_iter_next(&it)) {
-        dime_group_t *group = it.val;
+            dime_table_destroy(group->deltas);
+            free(group->deltas);
+        }
 
         free(group->name);
         free(group->clnts);
         free(group);
     }
 
+    free(srv->groups);
+
     dime_table_destroy(&srv->fd2clnt);
     dime_table_destroy(&srv->name2clnt);
+
+    /* Every queued message was released along with the clients above */
+    dime_pool_destroy(&srv->msgpool);
+
+    if (srv->tlsctx != NULL) {
+        SSL_CTX_free(srv->tlsctx);
+    }
+
+    pthread_mutex_destroy(&srv->lock);
 }
 
 int dime_server_add(dime_server_t *srv, int protocol, ...) {
@@ -376,6 +785,153 @@ int dime_server_add(dime_server_t *srv, int protocol, ...) {
     return 0;
 }
 
+int dime_server_peer(dime_server_t *srv, int protocol, ...) {
+    if (srv->peers_len >= srv->peers_cap) {
+        size_t ncap = (srv->peers_cap > 0) ? (srv->peers_cap * 3) / 2 : 4;
+        dime_client_t **narr = realloc(srv->peers, ncap * sizeof(dime_client_t *));
+        if (narr == NULL) {
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+            return -1;
+        }
+
+        srv->peers = narr;
+        srv->peers_cap = ncap;
+    }
+
+    va_list args;
+    va_start(args, protocol);
+
+    struct sockaddr_storage addr;
+    int fd;
+
+    switch (protocol) {
+#ifndef _WIN32
+    case DIME_UNIX:
+        {
+            const char *pathname = va_arg(args, const char *);
+            va_end(args);
+
+            struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+
+            memset(&addr, 0, sizeof(addr));
+            un->sun_family = AF_UNIX;
+            strncpy(un->sun_path, pathname, sizeof(un->sun_path));
+            un->sun_path[sizeof(un->sun_path) - 1] = '\0';
+
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+                return -1;
+            }
+
+            if (connect(fd, (struct sockaddr *)un, sizeof(struct sockaddr_un)) < 0) {
+                snprintf(srv->err, sizeof(srv->err), "Failed to connect to peer %s (%s)", pathname, strerror(errno));
+
+                close(fd);
+
+                return -1;
+            }
+        }
+        break;
+#endif
+
+    case DIME_TCP:
+        {
+            const char *host = va_arg(args, const char *);
+            uint16_t port = va_arg(args, unsigned int);
+            va_end(args);
+
+            struct addrinfo hints, *res, *ai;
+            char port_s[8];
+
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+
+            snprintf(port_s, sizeof(port_s), "%hu", (unsigned short)port);
+
+            int gai = getaddrinfo(host, port_s, &hints, &res);
+            if (gai != 0) {
+                snprintf(srv->err, sizeof(srv->err), "Failed to resolve peer %s (%s)", host, gai_strerror(gai));
+                return -1;
+            }
+
+            fd = -1;
+
+            for (ai = res; ai != NULL; ai = ai->ai_next) {
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (fd < 0) {
+                    continue;
+                }
+
+                if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                    memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+                    break;
+                }
+
+                close(fd);
+                fd = -1;
+            }
+
+            if (fd < 0) {
+                snprintf(srv->err, sizeof(srv->err), "Failed to connect to peer %s:%s (%s)", host, port_s, strerror(errno));
+
+                freeaddrinfo(res);
+
+                return -1;
+            }
+
+            freeaddrinfo(res);
+        }
+        break;
+
+    default:
+        snprintf(srv->err, sizeof(srv->err), "Unknown peer protocol %d", protocol);
+
+        va_end(args);
+        return -1;
+    }
+
+    dime_client_t *clnt = malloc(sizeof(dime_client_t));
+    if (clnt == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        close(fd);
+
+        return -1;
+    }
+
+    if (dime_client_init(clnt, fd, (struct sockaddr *)&addr) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        close(fd);
+        free(clnt);
+
+        return -1;
+    }
+
+    clnt->srv = srv;
+
+    /* Goes out once the connection is handed to a worker */
+    json_t *handshake = json_pack("{sssssbsb}", "command", "handshake", "serialization", "dimeb", "tls", 0, "peer", 1);
+
+    if (handshake == NULL || dime_socket_push(&clnt->sock, handshake, NULL, 0) < 0 || dime_client_peer(clnt, srv) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        json_decref(handshake);
+        dime_client_destroy(clnt);
+        free(clnt);
+
+        return -1;
+    }
+
+    json_decref(handshake);
+
+    srv->peers[srv->peers_len++] = clnt;
+
+    return 0;
+}
+
 #ifdef DIME_USE_LIBEV
 static void ev_client_writable(struct ev_loop *loop, ev_io *watcher, int revents) {
     dime_client_t *clnt = watcher->data;
@@ -389,7 +945,7 @@ static void ev_client_writable(struct ev_loop *loop, ev_io *watcher, int revents
         ev_io_stop(loop, watcher);
         ev_io_stop(loop, &clnt->sock.rwatcher);
 
-        dime_table_remove(&srv->fd2clnt, &clnt->fd);
+        dime_client_unregister(clnt, srv);
 
         dime_client_destroy(clnt);
         free(clnt);
@@ -408,7 +964,7 @@ static void ev_client_writable(struct ev_loop *loop, ev_io *watcher, int revents
         ev_io_stop(loop, watcher);
         ev_io_stop(loop, &clnt->sock.rwatcher);
 
-        dime_table_remove(&srv->fd2clnt, &clnt->fd);
+        dime_client_unregister(clnt, srv);
 
         dime_client_destroy(clnt);
         free(clnt);
@@ -437,7 +993,7 @@ static void ev_client_readable(struct ev_loop *loop, ev_io *watcher, int revents
         ev_io_stop(loop, watcher);
         ev_io_stop(loop, &clnt->sock.wwatcher);
 
-        dime_table_remove(&srv->fd2clnt, &clnt->fd);
+        dime_client_unregister(clnt, srv);
 
         dime_client_destroy(clnt);
         free(clnt);
@@ -459,7 +1015,7 @@ static void ev_client_readable(struct ev_loop *loop, ev_io *watcher, int revents
         ev_io_stop(loop, watcher);
         ev_io_stop(loop, &clnt->sock.wwatcher);
 
-        dime_table_remove(&srv->fd2clnt, &clnt->fd);
+        dime_client_unregister(clnt, srv);
 
         dime_client_destroy(clnt);
         free(clnt);
@@ -473,62 +1029,14 @@ static void ev_client_readable(struct ev_loop *loop, ev_io *watcher, int revents
 
     while (1) {
         json_t *jsondata;
+        dime_route_t route;
         void *bindata;
         size_t bindata_len;
 
-        n = dime_socket_pop(&clnt->sock, &jsondata, &bindata, &bindata_len);
+        n = dime_socket_pop(&clnt->sock, &route, &jsondata, &bindata, &bindata_len);
 
         if (n > 0) {
-            const char *cmd;
-
-            if (json_unpack(jsondata, "{ss}", "command", &cmd) < 0) {
-                /* Just let this case propagate, it'll be caught below */
-                cmd = "";
-            }
-
-            if (srv->verbosity >= 3) {
-                dime_info("Got DiME message with command \"%s\" from %s", cmd, clnt->addr);
-            }
-
-            int err;
-
-            /*
-             * As more commands are added, this section of code
-             * might be more efficient as a table of function
-             * pointers
-             */
-            if (strcmp(cmd, "handshake") == 0) {
-                err = dime_client_handshake(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "join") == 0) {
-                err = dime_client_join(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "leave") == 0) {
-                err = dime_client_leave(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "send") == 0) {
-                err = dime_client_send(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "broadcast") == 0) {
-                err = dime_client_broadcast(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "sync") == 0) {
-                err = dime_client_sync(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "wait") == 0) {
-                err = dime_client_wait(clnt, srv, jsondata, &bindata, bindata_len);
-            } else if (strcmp(cmd, "devices") == 0) {
-                err = dime_client_devices(clnt, srv, jsondata, &bindata, bindata_len);
-            } else {
-                err = -1;
-
-                strncpy(srv->err, "Unknown command", sizeof(srv->err));
-                srv->err[sizeof(srv->err) - 1] = '\0';
-
-                json_t *response = json_pack("{siss}", "status", -1, "error", "Unknown command");
-                if (response != NULL) {
-                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                    json_decref(response);
-                }
-            }
-
-            if (err < 0 && srv->verbosity >= 1) {
-                dime_warn("Failed to handle command \"%s\" from %s: %s", cmd, clnt->addr, srv->err);
-            }
+            dime_server_dispatch(srv, clnt, &route, jsondata, &bindata, bindata_len);
 
             json_decref(jsondata);
             free(bindata);
@@ -540,6 +1048,10 @@ static void ev_client_readable(struct ev_loop *loop, ev_io *watcher, int revents
             break;
         }
     }
+
+    if (dime_server_pong(clnt) < 0) {
+        dime_err("Failed to answer a ping from %s (%s)", clnt->addr, clnt->sock.err);
+    }
 }
 
 static void ev_server_readable(struct ev_loop *loop, ev_io *watcher, int revents) {
@@ -590,7 +1102,7 @@ static void ev_server_readable(struct ev_loop *loop, ev_io *watcher, int revents
     clnt->srv = srv;
 
     if (srvfd->protocol == DIME_WS) {
-        if (dime_socket_init_ws(&clnt->sock) < 0) {
+        if (dime_socket_init_ws(&clnt->sock, srv->zlib ? srv->zlib_threshold : 0) < 0) {
             dime_err("Failed to complete WebSocket handhake for incoming connection %s (%s)", clnt->addr, clnt->sock.err);
 
             dime_client_destroy(clnt);
@@ -600,7 +1112,7 @@ static void ev_server_readable(struct ev_loop *loop, ev_io *watcher, int revents
         }
     }
 
-    if (dime_table_insert(&srv->fd2clnt, &clnt->fd, clnt) < 0) {
+    if (dime_client_register(clnt, srv) < 0) {
         strncpy(srv->err, strerror(errno), sizeof(srv->err));
 
         dime_client_destroy(clnt);
@@ -625,6 +1137,14 @@ static void ev_server_readable(struct ev_loop *loop, ev_io *watcher, int revents
 int dime_server_loop(dime_server_t *srv) {
     struct ev_loop *loop = ev_default_loop(0); // TODO: fix for Windows
 
+    if (srv->threads > 1 && srv->verbosity >= 1) {
+        dime_warn("-j is not supported by the libev event loop, using a single thread");
+    }
+
+    if (srv->peers_len > 0) {
+        dime_warn("-p is not supported by the libev event loop, not peering");
+    }
+
     if (loop == NULL) {
         strncpy(srv->err, "Could not initialize libev", sizeof(srv->err));
 
@@ -649,395 +1169,1302 @@ int dime_server_loop(dime_server_t *srv) {
     return 0;
 }
 #else
-int dime_server_loop(dime_server_t *srv) {
-    int maxfd = -1;
-    fd_set rfds[2], wfds[2];
 
-    FD_ZERO(&rfds[0]);
-    FD_ZERO(&wfds[0]);
+#ifdef DIME_USE_IO_URING
+/* Kinds of requests, stored in the low bits of their user data */
+enum {
+    DIME_URING_RECV = 1,
+    DIME_URING_POLLIN,
+    DIME_URING_SEND,
+    DIME_URING_POLLOUT,
+    DIME_URING_WAKE,
+    DIME_URING_ACCEPT,
+    DIME_URING_CANCEL
+};
+
+#define DIME_URING_KIND 7
+
+/* Connection states in the socket's uring.flags */
+enum {
+    DIME_URING_POLLED = 1,    /* Waits for readiness instead of receiving */
+    DIME_URING_WRITEWAIT = 2, /* Waiting for the socket to become writable */
+    DIME_URING_CLOSED = 4     /* Closed, to be freed once nothing is in flight */
+};
+
+static int dime_worker_poll(dime_worker_t *worker, int fd, unsigned events, int multishot, void *p, int kind) {
+    struct io_uring_sqe *sqe = dime_uring_sqe(&worker->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
 
-    for (size_t i = 0; i < srv->fds_len; i++) {
-        FD_SET(srv->fds[i].fd, &rfds[0]);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = (uintptr_t)p | kind;
 
-        if (listen(srv->fds[i].fd, 0) < 0) {
-            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
-        }
+    return 0;
+}
 
-        if (maxfd < srv->fds[i].fd + 1) {
-            maxfd = srv->fds[i].fd + 1;
+/* Arm receiving (or polling, for TLS) on a client's socket */
+static int dime_worker_recv(dime_worker_t *worker, dime_client_t *clnt) {
+    if (clnt->sock.uring.flags & DIME_URING_POLLED) {
+        if (dime_worker_poll(worker, clnt->fd, POLLIN, 1, clnt, DIME_URING_POLLIN) < 0) {
+            return -1;
+        }
+    } else {
+        struct io_uring_sqe *sqe = dime_uring_sqe(&worker->ring);
+        if (sqe == NULL) {
+            return -1;
         }
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = clnt->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = (uintptr_t)clnt | DIME_URING_RECV;
     }
 
-    while (1) {
-        memcpy(&rfds[1], &rfds[0], sizeof(fd_set));
-        memcpy(&wfds[1], &wfds[0], sizeof(fd_set));
+    clnt->sock.uring.inflight++;
 
-        if (select(maxfd, &rfds[1], &wfds[1], NULL, NULL) < 0) {
-            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+    return 0;
+}
+
+/* Queue a client for the next batch of sends; may be called from any worker */
+static void dime_worker_dirty(void *p) {
+    dime_client_t *clnt = p;
+    dime_worker_t *worker = clnt->worker;
+
+    pthread_mutex_lock(&worker->dirtylock);
+
+    if (!clnt->sock.uring.dirty && dime_deque_pushr(&worker->dirty, clnt) >= 0) {
+        clnt->sock.uring.dirty = 1;
+    }
+
+    pthread_mutex_unlock(&worker->dirtylock);
+}
+
+/* Cancel a client's requests and drop it from the send queue before closing */
+static void dime_worker_forget(dime_worker_t *worker, dime_client_t *clnt) {
+    struct io_uring_sqe *sqe = dime_uring_sqe(&worker->ring);
+
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = clnt->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = DIME_URING_CANCEL;
+
+        /* Cancellation is keyed by fd, so submit it before the fd is closed */
+        dime_uring_submit(&worker->ring, 0);
+    }
+
+    pthread_mutex_lock(&worker->dirtylock);
+
+    if (clnt->sock.uring.dirty) {
+        size_t n = dime_deque_len(&worker->dirty);
+
+        for (size_t i = 0; i < n; i++) {
+            dime_client_t *other = dime_deque_popl(&worker->dirty);
+
+            if (other != clnt) {
+                dime_deque_pushr(&worker->dirty, other);
+            }
         }
 
-        for (int i = 3; i < maxfd; i++) {
-            dime_client_t *clnt = NULL;
+        clnt->sock.uring.dirty = 0;
+    }
 
-            if (FD_ISSET(i, &rfds[1])) {
-                clnt = dime_table_search(&srv->fd2clnt, &i);
+    pthread_mutex_unlock(&worker->dirtylock);
+}
+#endif
 
-                if (clnt == NULL) {
-                    dime_server_fd_t *srvfd = NULL;
+static int dime_worker_add(dime_worker_t *worker, dime_client_t *clnt) {
+    if (worker->clnts_len >= worker->clnts_cap) {
+        size_t ncap = (worker->clnts_cap * 3) / 2;
 
-                    for (size_t j = 0; j < srv->fds_len; j++) {
-                        if (srv->fds[j].fd == i) {
-                            srvfd = &srv->fds[j];
-                            break;
-                        }
-                    }
+        dime_client_t **nclnts = realloc(worker->clnts, sizeof(dime_client_t *) * ncap);
+        if (nclnts == NULL) {
+            return -1;
+        }
 
-                    if (srvfd == NULL) {
-                        continue;
-                    }
+        worker->clnts = nclnts;
+        worker->clnts_cap = ncap;
+    }
 
-                    clnt = malloc(sizeof(dime_client_t));
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    if (dime_socket_watch(&clnt->sock, worker->pollfd, clnt) < 0) {
+        return -1;
+    }
+#elif defined(DIME_USE_IO_URING)
+    dime_server_t *srv = worker->srv;
 
-                    if (clnt == NULL) {
-                        strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                        srv->err[0] = '\0';
+    clnt->worker = worker;
 
-                        printf("%d %s\n", __LINE__, strerror(errno)); return -1;
-                    }
+    /* TLS needs OpenSSL to do the reads, so only wait for readiness */
+    clnt->sock.uring.flags = (srv->tlsctx != NULL) ? DIME_URING_POLLED : 0;
+    clnt->sock.uring.dirty = 0;
 
-                    struct sockaddr_storage addr;
-                    socklen_t siz = sizeof(struct sockaddr_storage);
+    if (dime_worker_recv(worker, clnt) < 0) {
+        return -1;
+    }
 
-                    int fd = accept(i, (struct sockaddr *)&addr, &siz);
-                    if (fd < 0) {
-                        strncpy(srv->err, strerror(errno), sizeof(srv->err));
-                        dime_err("Failed to accept a socket from fd %d (%s)", i, srv->err);
-                        srv->err[0] = '\0';
+    pthread_mutex_lock(&clnt->lock);
 
-                        free(clnt);
+    clnt->sock.uring.onwrite = dime_worker_dirty;
+    clnt->sock.uring.data = clnt;
 
-                        continue;
-                    }
+    int pending = (dime_socket_sendlen(&clnt->sock) > 0);
 
-                    /* Attempt to make sockets non-blocking for network connections */
-    #ifdef __unix__
-                    if (srvfd->protocol != DIME_UNIX) {
-                        int flags = fcntl(fd, F_GETFL, 0);
+    pthread_mutex_unlock(&clnt->lock);
 
-                        if (flags >= 0) {
-                            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-                        }
-                    }
-    #endif
+    if (pending) {
+        dime_worker_dirty(clnt);
+    }
+#endif
 
-                    if (dime_client_init(clnt, fd, (struct sockaddr *)&addr) < 0) {
-                        strncpy(srv->err, clnt->err, sizeof(srv->err));
-                        srv->err[0] = '\0';
+    clnt->worker = worker;
+    worker->clnts[worker->clnts_len++] = clnt;
 
-                        close(fd);
-                        free(clnt);
+    return 0;
+}
 
-                        printf("%d %s\n", __LINE__, strerror(errno)); return -1;
-                    }
+static void dime_worker_close(dime_worker_t *worker, size_t i) {
+    dime_server_t *srv = worker->srv;
+    dime_client_t *clnt = worker->clnts[i];
 
-                    clnt->srv = srv;
+    worker->clnts_len--;
+    worker->clnts[i] = worker->clnts[worker->clnts_len];
 
-                    if (srvfd->protocol == DIME_WS) {
-                        if (dime_socket_init_ws(&clnt->sock) < 0) {
-                            dime_err("Failed to complete WebSocket handhake for incoming connection %s (%s)", clnt->addr, clnt->sock.err);
+#ifdef DIME_USE_IO_URING
+    dime_worker_forget(worker, clnt);
+#endif
 
-                            dime_client_destroy(clnt);
-                            free(clnt);
+    pthread_mutex_lock(&srv->lock);
 
-                            continue;
-                        }
-                    }
+    dime_client_unregister(clnt, srv);
+    dime_client_destroy(clnt);
 
-                    if (dime_table_insert(&srv->fd2clnt, &clnt->fd, clnt) < 0) {
-                        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+    pthread_mutex_unlock(&srv->lock);
 
-                        dime_client_destroy(clnt);
-                        free(clnt);
-                    }
+#ifdef DIME_USE_IO_URING
+    /* Completions still to come refer to the client, so free it after them */
+    clnt->sock.uring.flags |= DIME_URING_CLOSED;
 
-                    FD_SET(fd, &rfds[0]);
+    if (clnt->sock.uring.inflight > 0) {
+        return;
+    }
+#endif
 
-                    if (maxfd < fd + 1) {
-                        maxfd = fd + 1;
-                    }
+    free(clnt);
+}
 
-                    if (srv->verbosity >= 1) {
-                        dime_info("Opened new connection from %s", clnt->addr);
-                    }
+static void dime_worker_accept(dime_worker_t *worker, dime_server_fd_t *srvfd) {
+    dime_server_t *srv = worker->srv;
+    dime_client_t *clnt = malloc(sizeof(dime_client_t));
 
-                    clnt = NULL;
-                } else {
-                    ssize_t n = dime_socket_recvpartial(&clnt->sock);
-
-                    if (n <= 0) {
-                        if (srv->verbosity >= 1) {
-                            if (n == 0) {
-                                dime_info("Connection closed from %s", clnt->addr);
-                            } else {
-                                dime_err("Read failed on %s (%s), closing", clnt->addr, strerror(errno));
-                            }
-                        }
+    if (clnt == NULL) {
+        dime_err("Failed to allocate a client for fd %d (%s)", srvfd->fd, strerror(errno));
 
-                        dime_table_remove(&srv->fd2clnt, &clnt->fd);
+        return;
+    }
 
-                        FD_CLR(clnt->fd, &rfds[0]);
-                        FD_CLR(clnt->fd, &wfds[0]);
+    struct sockaddr_storage addr;
+    socklen_t siz = sizeof(struct sockaddr_storage);
 
-                        dime_client_destroy(clnt);
-                        free(clnt);
+    int fd = accept(srvfd->fd, (struct sockaddr *)&addr, &siz);
+    if (fd < 0) {
+        dime_err("Failed to accept a socket from fd %d (%s)", srvfd->fd, strerror(errno));
 
-                        continue;
-                    }
+        free(clnt);
 
-                    if (srv->verbosity >= 3) {
-                        dime_info("Received %zd bytes of data from %s", n, clnt->addr);
-                    }
+        return;
+    }
 
-                    while (1) {
-                        json_t *jsondata;
-                        void *bindata;
-                        size_t bindata_len;
-
-                        n = dime_socket_pop(&clnt->sock, &jsondata, &bindata, &bindata_len);
-
-                        if (n > 0) {
-                            const char *cmd;
-
-                            if (json_unpack(jsondata, "{ss}", "command", &cmd) < 0) {
-                                /* Just let this case propagate, it'll be caught below */
-                                cmd = "";
-                            }
-
-                            if (srv->verbosity >= 3) {
-                                dime_info("Got DiME message with command \"%s\" from %s", cmd, clnt->addr);
-                            }
-
-                            int err;
-
-                            /*
-                             * As more commands are added, this section of code
-                             * might be more efficient as a table of function
-                             * pointers
-                             */
-                            if (strcmp(cmd, "handshake") == 0) {
-                                err = dime_client_handshake(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "join") == 0) {
-                                err = dime_client_join(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "leave") == 0) {
-                                err = dime_client_leave(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "send") == 0) {
-                                err = dime_client_send(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "broadcast") == 0) {
-                                err = dime_client_broadcast(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "sync") == 0) {
-                                err = dime_client_sync(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "wait") == 0) {
-                                err = dime_client_wait(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else if (strcmp(cmd, "devices") == 0) {
-                                err = dime_client_devices(clnt, srv, jsondata, &bindata, bindata_len);
-                            } else {
-                                err = -1;
-
-                                strncpy(srv->err, "Unknown command", sizeof(srv->err));
-                                srv->err[sizeof(srv->err) - 1] = '\0';
-
-                                json_t *response = json_pack("{siss}", "status", -1, "error", "Unknown command");
-                                if (response != NULL) {
-                                    dime_socket_push(&clnt->sock, response, NULL, 0);
-                                    json_decref(response);
-                                }
-                            }
-
-                            if (err < 0 && srv->verbosity >= 1) {
-                                dime_warn("Failed to handle command \"%s\" from %s: %s", cmd, clnt->addr, srv->err);
-                            }
-
-                            json_decref(jsondata);
-                            free(bindata);
-                        } else if (n < 0) {
-                            strncpy(srv->err, strerror(errno), sizeof(srv->err));
-
-                            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
-                        } else {
-                            break;
-                        }
-                    }
-                }
-            }
+    /*
+     * Attempt to make sockets non-blocking for network connections.
+     * Edge-triggered backends must drain every socket until it would
+     * block, so there all connections are made non-blocking.
+     */
+#ifndef _WIN32
+#   ifdef DIME_EDGE_TRIGGERED
+    int nonblocking = 1;
+#   else
+    int nonblocking = (srvfd->protocol != DIME_UNIX);
+#   endif
 
-            if (FD_ISSET(i, &wfds[1])) {
-                if (clnt == NULL) {
-                    clnt = dime_table_search(&srv->fd2clnt, &i);
+    if (nonblocking) {
+        int flags = fcntl(fd, F_GETFL, 0);
 
-                    if (clnt == NULL) {
-                        continue;
-                    }
-                }
+        if (flags >= 0) {
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+#endif
 
-                ssize_t n = dime_socket_sendpartial(&clnt->sock);
+    if (dime_client_init(clnt, fd, (struct sockaddr *)&addr) < 0) {
+        dime_err("Failed to initialize a client for fd %d (%s)", fd, clnt->err);
 
-                /* Note: The server should close the socket here, not crash */
-                if (n < 0) {
-                    if (srv->verbosity >= 1) {
-                        dime_err("Write failed on %s (%s), closing", clnt->addr, strerror(errno));
-                    }
+        close(fd);
+        free(clnt);
 
-                    dime_table_remove(&srv->fd2clnt, &clnt->fd);
+        return;
+    }
 
-                    FD_CLR(clnt->fd, &rfds[0]);
-                    FD_CLR(clnt->fd, &wfds[0]);
+    clnt->srv = srv;
 
-                    dime_client_destroy(clnt);
-                    free(clnt);
+    if (srvfd->protocol == DIME_WS) {
+        if (dime_socket_init_ws(&clnt->sock, srv->zlib ? srv->zlib_threshold : 0) < 0) {
+            dime_err("Failed to complete WebSocket handhake for incoming connection %s (%s)", clnt->addr, clnt->sock.err);
 
-                    continue;
-                }
+            dime_client_destroy(clnt);
+            free(clnt);
 
-                if (srv->verbosity >= 3) {
-                    dime_info("Sent %zd bytes of data to %s", n, clnt->addr);
-                }
-            }
+            return;
         }
+    }
 
-        for (int i = 3; i < maxfd; i++) {
-            if (FD_ISSET(i, &rfds[0])) {
-                dime_client_t *clnt = dime_table_search(&srv->fd2clnt, &i);
+    dime_worker_t *target = &srv->workers[srv->nextworker];
 
-                if (clnt != NULL) {
-                    if (dime_socket_sendlen(&clnt->sock) > 0) {
-                        FD_SET(i, &wfds[0]);
-                    } else {
-                        FD_CLR(i, &wfds[0]);
-                    }
-                }
-            }
+    srv->nextworker = (srv->nextworker + 1) % srv->workers_len;
+
+    pthread_mutex_lock(&srv->lock);
+
+    if (dime_client_register(clnt, srv) < 0) {
+        pthread_mutex_unlock(&srv->lock);
+
+        dime_err("Failed to register connection %s (%s)", clnt->addr, strerror(errno));
+
+        dime_client_destroy(clnt);
+        free(clnt);
+
+        return;
+    }
+
+    /* Set before the connection is reachable by other workers */
+    clnt->worker = target;
+
+    pthread_mutex_unlock(&srv->lock);
+
+    if (srv->verbosity >= 1) {
+        dime_info("Opened new connection from %s", clnt->addr);
+    }
+
+    if (target == worker) {
+        if (dime_worker_add(worker, clnt) < 0) {
+            dime_err("Failed to register connection %s (%s)", clnt->addr, strerror(errno));
+
+            pthread_mutex_lock(&srv->lock);
+
+            dime_client_unregister(clnt, srv);
+            dime_client_destroy(clnt);
+
+            pthread_mutex_unlock(&srv->lock);
+
+            free(clnt);
         }
+    } else if (write(target->pipefd[1], &clnt, sizeof(dime_client_t *)) != sizeof(dime_client_t *)) {
+        dime_err("Failed to hand connection %s to a worker (%s)", clnt->addr, strerror(errno));
+
+        pthread_mutex_lock(&srv->lock);
+
+        dime_client_unregister(clnt, srv);
+        dime_client_destroy(clnt);
+
+        pthread_mutex_unlock(&srv->lock);
+
+        free(clnt);
     }
 }
-#if 0
 
-    while (1) {
-        if (poll(pollfds, pollfds_len, -1) < 0) {
-            signal(SIGPIPE, sigpipe_f);
-            signal(SIGTERM, sigterm_f);
-            signal(SIGINT, sigint_f);
-            free(pollfds);
+/* Hands a connection to another server made by dime_server_peer to a worker */
+static void dime_worker_adopt(dime_server_t *srv, dime_client_t *clnt) {
+#ifndef _WIN32
+    int flags = fcntl(clnt->fd, F_GETFL, 0);
 
-            printf("%d\n", __LINE__); printf("%d %s\n", __LINE__, strerror(errno)); return -1;
-        }
+    if (flags >= 0) {
+        fcntl(clnt->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+#endif
 
-        for (size_t i = srv->fds_len; i < pollfds_len; i++) {
-            dime_client_t *clnt = dime_table_search(&srv->fd2clnt, &pollfds[i].fd);
-            assert(clnt != NULL);
+    dime_worker_t *target = &srv->workers[srv->nextworker];
 
-            if (pollfds[i].revents & POLLHUP) {
-                if (srv->verbosity >= 1) {
-                    dime_info("Closed connection from %s", clnt->addr);
-                }
+    srv->nextworker = (srv->nextworker + 1) % srv->workers_len;
 
-                dime_table_remove(&srv->fd2clnt, &clnt->fd);
+    pthread_mutex_lock(&srv->lock);
 
-                dime_client_destroy(clnt);
-                free(clnt);
+    if (dime_client_register(clnt, srv) < 0) {
+        pthread_mutex_unlock(&srv->lock);
 
-                pollfds[i] = pollfds[pollfds_len - 1];
-                pollfds_len--;
-                i--;
+        dime_err("Failed to register connection to peer %s (%s)", clnt->addr, strerror(errno));
 
-                continue;
-            }
+        dime_client_destroy(clnt);
+        free(clnt);
 
-            if (pollfds[i].revents & POLLIN) {
-                ssize_t n = dime_socket_recvpartial(&clnt->sock);
+        return;
+    }
 
-                if (n <= 0) {
-                    if (srv->verbosity >= 1) {
-                        if (n == 0) {
-                            dime_info("Connection closed from %s", clnt->addr);
-                        } else {
-                            dime_err("Read failed on %s (%s), closing", clnt->addr, strerror(errno));
-                        }
-                    }
+    clnt->worker = target;
 
-                    dime_table_remove(&srv->fd2clnt, &clnt->fd);
+    pthread_mutex_unlock(&srv->lock);
 
-                    dime_client_destroy(clnt);
-                    free(clnt);
+    if (write(target->pipefd[1], &clnt, sizeof(dime_client_t *)) != sizeof(dime_client_t *)) {
+        dime_err("Failed to hand connection to peer %s to a worker (%s)", clnt->addr, strerror(errno));
 
-                    pollfds[i] = pollfds[pollfds_len - 1];
-                    pollfds_len--;
-                    i--;
+        pthread_mutex_lock(&srv->lock);
 
-                    continue;
-                }
+        dime_client_unregister(clnt, srv);
+        dime_client_destroy(clnt);
 
-                if (srv->verbosity >= 3) {
-                    dime_info("Received %zd bytes of data from %s", n, clnt->addr);
-                }
+        pthread_mutex_unlock(&srv->lock);
 
-                while (1) {
-                    json_t *jsondata;
-                    void *bindata;
-                    size_t bindata_len;
+        free(clnt);
+    }
+}
 
-                    n = dime_socket_pop(&clnt->sock, &jsondata, &bindata, &bindata_len);
+/* Handles every complete message received on a connection */
+static int dime_worker_dispatch(dime_worker_t *worker, dime_client_t *clnt) {
+    dime_server_t *srv = worker->srv;
 
-                    if (n > 0) {
-                        const char *cmd;
+    while (1) {
+        json_t *jsondata;
+        dime_route_t route;
+        ssize_t n;
+        void *bindata;
+        size_t bindata_len;
 
-                        if (json_unpack(jsondata, "{ss}", "command", &cmd) < 0) {
-                            /* Just let this case propagate, it'll be caught below */
-                            cmd = "";
-                        }
+        n = dime_socket_pop(&clnt->sock, &route, &jsondata, &bindata, &bindata_len);
 
-                        if (srv->verbosity >= 3) {
-                            dime_info("Got DiME message with command \"%s\" from %s", cmd, clnt->addr);
-                        }
+        if (n > 0) {
+            pthread_mutex_lock(&srv->lock);
 
-                        int err;
-
-                        /*
-                         * As more commands are added, this section of code
-                         * might be more efficient as a table of function
-                         * pointers
-                         */
-                        if (strcmp(cmd, "handshake") == 0) {
-                            err = dime_client_handshake(clnt, srv, jsondata, &bindata, bindata_len);
-                        }else if (strcmp(cmd, "join") == 0) {
-                            err = dime_client_join(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else if (strcmp(cmd, "leave") == 0) {
-                            err = dime_client_leave(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else if (strcmp(cmd, "send") == 0) {
-                            err = dime_client_send(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else if (strcmp(cmd, "broadcast") == 0) {
-                            err = dime_client_broadcast(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else if (strcmp(cmd, "sync") == 0) {
-                            err = dime_client_sync(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else if (strcmp(cmd, "wait") == 0) {
-                            err = dime_client_wait(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else if (strcmp(cmd, "devices") == 0) {
-                            err = dime_client_devices(clnt, srv, jsondata, &bindata, bindata_len);
-                        } else {
-                            err = -1;
+            dime_server_dispatch(srv, clnt, &route, jsondata, &bindata, bindata_len);
 
-                            strncpy(srv->err, "Unknown command", sizeof(srv->err));
-                            srv->err[sizeof(srv->err) - 1] = '\0';
+            pthread_mutex_unlock(&srv->lock);
 
-                            json_t *response = json_pack("{siss}", "status", -1, "error", "Unknown command");
-                            if (response != NULL) {
-                                dime_socket_push(&clnt->sock, response, NULL, 0);
-                                json_decref(response);
-                            }
-                        }
+            json_decref(jsondata);
+            free(bindata);
+        } else if (n < 0) {
+            dime_err("Invalid message from %s (%s), closing", clnt->addr, clnt->sock.err);
 
-                        if (err < 0 && srv->verbosity >= 1) {
-                            dime_warn("Failed to handle command \"%s\" from %s: %s", cmd, clnt->addr, srv->err);
-                        }
+            return -1;
+        } else {
+            break;
+        }
+    }
+
+    if (dime_server_pong(clnt) < 0) {
+        dime_err("Failed to answer a ping from %s (%s), closing", clnt->addr, clnt->sock.err);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns 0 if the connection should stay open, or -1 to close it */
+static int dime_worker_readable(dime_worker_t *worker, dime_client_t *clnt) {
+    dime_server_t *srv = worker->srv;
+
+    while (1) {
+        ssize_t n = dime_socket_recvpartial(&clnt->sock);
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+
+        if (n <= 0) {
+            if (srv->verbosity >= 1) {
+                if (n == 0) {
+                    dime_info("Connection closed from %s", clnt->addr);
+                } else {
+                    dime_err("Read failed on %s (%s), closing", clnt->addr, strerror(errno));
+                }
+            }
+
+            return -1;
+        }
+
+        if (srv->verbosity >= 3) {
+            dime_info("Received %zd bytes of data from %s", n, clnt->addr);
+        }
+
+        if (dime_worker_dispatch(worker, clnt) < 0) {
+            return -1;
+        }
+
+#ifndef DIME_EDGE_TRIGGERED
+        /* select is level-triggered, so it will report any remaining data */
+        return 0;
+#endif
+    }
+}
+
+static int dime_worker_writable(dime_worker_t *worker, dime_client_t *clnt) {
+    dime_server_t *srv = worker->srv;
+
+    pthread_mutex_lock(&clnt->lock);
+
+    ssize_t n = dime_socket_sendpartial(&clnt->sock);
+
+#ifdef DIME_EDGE_TRIGGERED
+    /* Edge-triggered, so keep going until the socket would block */
+    while (n > 0 && dime_socket_sendlen(&clnt->sock) > 0) {
+        ssize_t m = dime_socket_sendpartial(&clnt->sock);
+
+        if (m < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                n = m;
+            }
+
+            break;
+        }
+
+        n += m;
+    }
+#endif
+
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    /* Pushing onto an empty outbuffer requests write events again */
+    if (n >= 0 && dime_socket_sendlen(&clnt->sock) == 0) {
+        dime_socket_pollwrite(&clnt->sock, 0);
+    }
+#endif
+
+    pthread_mutex_unlock(&clnt->lock);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    /* Note: The server should close the socket here, not crash */
+    if (n < 0) {
+        if (srv->verbosity >= 1) {
+            dime_err("Write failed on %s (%s), closing", clnt->addr, strerror(errno));
+        }
+
+        return -1;
+    }
+
+    if (srv->verbosity >= 3) {
+        dime_info("Sent %zd bytes of data to %s", n, clnt->addr);
+    }
+
+    return 0;
+}
+
+/* Processes the self-pipe; returns 1 if the worker should stop */
+static int dime_worker_handoffs(dime_worker_t *worker) {
+    dime_server_t *srv = worker->srv;
+    void *handoffs[64];
+
+    /* Cleared first, so that a wakeup racing with the read is not lost */
+    __atomic_store_n(&worker->woken, 0, __ATOMIC_RELEASE);
+
+    ssize_t nread = read(worker->pipefd[0], handoffs, sizeof(handoffs));
+
+    for (ssize_t i = 0; i < nread / (ssize_t)sizeof(void *); i++) {
+        if (handoffs[i] == &dime_worker_quit) {
+            return 1;
+        } else if (handoffs[i] != NULL) {
+            dime_client_t *clnt = handoffs[i];
+
+            if (dime_worker_add(worker, clnt) < 0) {
+                dime_err("Failed to register connection %s (%s)", clnt->addr, strerror(errno));
+
+                pthread_mutex_lock(&srv->lock);
+
+                dime_client_unregister(clnt, srv);
+                dime_client_destroy(clnt);
+
+                pthread_mutex_unlock(&srv->lock);
+
+                free(clnt);
+            }
+        }
+    }
+
+    return 0;
+}
+
+#ifdef DIME_EDGE_TRIGGERED
+/* Closes the connection of a client owned by the worker */
+static void dime_worker_close_clnt(dime_worker_t *worker, dime_client_t *clnt) {
+    for (size_t i = 0; i < worker->clnts_len; i++) {
+        if (worker->clnts[i] == clnt) {
+            dime_worker_close(worker, i);
+            return;
+        }
+    }
+}
+#endif
+
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+/* Finds the listening socket an event was reported for, if any */
+static dime_server_fd_t *dime_worker_srvfd(dime_worker_t *worker, void *p) {
+    dime_server_t *srv = worker->srv;
+
+    for (size_t i = 0; i < srv->fds_len; i++) {
+        if (p == &srv->fds[i]) {
+            return &srv->fds[i];
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+#if defined(DIME_USE_EPOLL)
+static int dime_worker_loop(dime_worker_t *worker) {
+    dime_server_t *srv = worker->srv;
+    struct epoll_event events[64];
+
+    /* The listening sockets are level-triggered; only worker 0 accepts */
+    if (worker == &srv->workers[0]) {
+        for (size_t i = 0; i < srv->fds_len; i++) {
+            struct epoll_event ev;
+
+            ev.events = EPOLLIN;
+            ev.data.ptr = &srv->fds[i];
+
+            if (epoll_ctl(worker->pollfd, EPOLL_CTL_ADD, srv->fds[i].fd, &ev) < 0) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+                return -1;
+            }
+        }
+    }
+
+    while (1) {
+        int nevents = epoll_wait(worker->pollfd, events, sizeof(events) / sizeof(struct epoll_event), -1);
+
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+            return -1;
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            void *p = events[i].data.ptr;
+            dime_server_fd_t *srvfd;
+
+            if (p == worker) {
+                if (dime_worker_handoffs(worker) > 0) {
+                    return 0;
+                }
+            } else if ((srvfd = dime_worker_srvfd(worker, p)) != NULL) {
+                dime_worker_accept(worker, srvfd);
+            } else {
+                dime_client_t *clnt = p;
+
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && dime_worker_readable(worker, clnt) < 0) {
+                    dime_worker_close_clnt(worker, clnt);
+                    continue;
+                }
+
+                if ((events[i].events & EPOLLOUT) && dime_worker_writable(worker, clnt) < 0) {
+                    dime_worker_close_clnt(worker, clnt);
+                    continue;
+                }
+            }
+        }
+    }
+}
+#elif defined(DIME_USE_KQUEUE)
+static int dime_worker_loop(dime_worker_t *worker) {
+    dime_server_t *srv = worker->srv;
+    struct kevent events[64];
+
+    /* The listening sockets are level-triggered; only worker 0 accepts */
+    if (worker == &srv->workers[0]) {
+        for (size_t i = 0; i < srv->fds_len; i++) {
+            struct kevent ev;
+
+            EV_SET(&ev, srv->fds[i].fd, EVFILT_READ, EV_ADD, 0, 0, &srv->fds[i]);
+
+            if (kevent(worker->pollfd, &ev, 1, NULL, 0, NULL) < 0) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+                return -1;
+            }
+        }
+    }
+
+    while (1) {
+        int nevents = kevent(worker->pollfd, NULL, 0, events, sizeof(events) / sizeof(struct kevent), NULL);
+
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+            return -1;
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            void *p = events[i].udata;
+            dime_server_fd_t *srvfd;
+
+            if (p == NULL) {
+                /* Belonged to a connection closed earlier in this batch */
+                continue;
+            } else if (p == worker) {
+                if (dime_worker_handoffs(worker) > 0) {
+                    return 0;
+                }
+            } else if ((srvfd = dime_worker_srvfd(worker, p)) != NULL) {
+                dime_worker_accept(worker, srvfd);
+            } else {
+                dime_client_t *clnt = p;
+                int err;
+
+                if (events[i].filter == EVFILT_READ) {
+                    err = dime_worker_readable(worker, clnt);
+                } else {
+                    err = dime_worker_writable(worker, clnt);
+                }
+
+                /* Read and write events are reported separately */
+                if (err < 0) {
+                    for (int j = i + 1; j < nevents; j++) {
+                        if (events[j].udata == clnt) {
+                            events[j].udata = NULL;
+                        }
+                    }
+
+                    dime_worker_close_clnt(worker, clnt);
+                }
+            }
+        }
+    }
+}
+#elif defined(DIME_USE_IO_URING)
+/* Sets a completion aside to be handled once the current batch is done */
+static int dime_worker_stash(dime_worker_t *worker, const struct io_uring_cqe *cqe) {
+    if (worker->stash_len >= worker->stash_cap) {
+        size_t ncap = (worker->stash_cap * 3) / 2;
+
+        struct io_uring_cqe *nstash = realloc(worker->stash, sizeof(struct io_uring_cqe) * ncap);
+        if (nstash == NULL) {
+            return -1;
+        }
+
+        worker->stash = nstash;
+        worker->stash_cap = ncap;
+    }
+
+    worker->stash[worker->stash_len++] = *cqe;
+
+    return 0;
+}
+
+/* Waits for the sends in a batch, leaving each client unlocked afterwards */
+static int dime_worker_sent(dime_worker_t *worker, size_t nsends) {
+    dime_server_t *srv = worker->srv;
+    dime_client_t *failed[DIME_URING_BATCH];
+    size_t left = nsends, failed_len = 0;
+
+    if (dime_uring_submit(&worker->ring, 0) < 0) {
+        return -1;
+    }
+
+    while (left > 0) {
+        struct io_uring_cqe *cqe = dime_uring_cqe(&worker->ring);
+
+        if (cqe == NULL) {
+            if (dime_uring_submit(&worker->ring, 1) < 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        struct io_uring_cqe c = *cqe;
+
+        dime_uring_seen(&worker->ring);
+
+        if ((c.user_data & DIME_URING_KIND) != DIME_URING_SEND) {
+            if (dime_worker_stash(worker, &c) < 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        dime_client_t *clnt = (dime_client_t *)(uintptr_t)(c.user_data & ~(uint64_t)DIME_URING_KIND);
+
+        clnt->sock.uring.inflight--;
+        left--;
+
+        if (c.res > 0) {
+            dime_socket_sent(&clnt->sock, c.res);
+
+            if (srv->verbosity >= 3) {
+                dime_info("Sent %d bytes of data to %s", c.res, clnt->addr);
+            }
+        }
+
+        size_t remaining = dime_socket_sendlen(&clnt->sock);
+
+        pthread_mutex_unlock(&clnt->lock);
+
+        if (c.res == -EAGAIN) {
+            /* Wait until the socket is writable, then try again */
+            if (dime_worker_poll(worker, clnt->fd, POLLOUT, 0, clnt, DIME_URING_POLLOUT) < 0) {
+                return -1;
+            }
+
+            clnt->sock.uring.flags |= DIME_URING_WRITEWAIT;
+            clnt->sock.uring.inflight++;
+        } else if (c.res < 0) {
+            if (srv->verbosity >= 1) {
+                dime_err("Write failed on %s (%s), closing", clnt->addr, strerror(-c.res));
+            }
+
+            /* Closing needs the server lock, so wait until no client is locked */
+            failed[failed_len++] = clnt;
+        } else if (remaining > 0) {
+            dime_worker_dirty(clnt);
+        }
+    }
+
+    for (size_t i = 0; i < failed_len; i++) {
+        dime_worker_close_clnt(worker, failed[i]);
+    }
+
+    return 0;
+}
+
+/* Sends the outbuffers of every client with pending data, in batches */
+static int dime_worker_flush(dime_worker_t *worker) {
+    size_t batch_len = 0;
+
+    while (1) {
+        pthread_mutex_lock(&worker->dirtylock);
+
+        dime_client_t *clnt = dime_deque_popl(&worker->dirty);
+        if (clnt != NULL) {
+            clnt->sock.uring.dirty = 0;
+        }
+
+        pthread_mutex_unlock(&worker->dirtylock);
+
+        if (clnt == NULL) {
+            if (batch_len == 0) {
+                break;
+            }
+
+            /* Send what is batched; partial sends queue their client again */
+            if (dime_worker_sent(worker, batch_len) < 0) {
+                return -1;
+            }
+
+            batch_len = 0;
+
+            continue;
+        }
+
+        if (clnt->sock.uring.flags & (DIME_URING_CLOSED | DIME_URING_WRITEWAIT)) {
+            continue;
+        }
+
+        if (clnt->sock.uring.flags & DIME_URING_POLLED) {
+            /* TLS records are written by OpenSSL itself */
+            if (dime_worker_writable(worker, clnt) < 0) {
+                dime_worker_close_clnt(worker, clnt);
+                continue;
+            }
+
+            pthread_mutex_lock(&clnt->lock);
+
+            size_t remaining = dime_socket_sendlen(&clnt->sock);
+
+            pthread_mutex_unlock(&clnt->lock);
+
+            if (remaining > 0) {
+                if (dime_worker_poll(worker, clnt->fd, POLLOUT, 0, clnt, DIME_URING_POLLOUT) < 0) {
+                    return -1;
+                }
+
+                clnt->sock.uring.flags |= DIME_URING_WRITEWAIT;
+                clnt->sock.uring.inflight++;
+            }
+
+            continue;
+        }
+
+        /*
+         * The client stays locked until the kernel is done with its
+         * buffers. Holding several client locks at once cannot deadlock:
+         * everyone else takes at most one, and only this thread ever
+         * locks the clients it owns while holding another.
+         */
+        pthread_mutex_lock(&clnt->lock);
+
+        struct iovec *iov = worker->iovs + batch_len * DIME_URING_IOVLEN;
+        size_t iovlen = dime_socket_sendprep(&clnt->sock, iov, DIME_URING_IOVLEN);
+
+        if (iovlen == 0) {
+            pthread_mutex_unlock(&clnt->lock);
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = dime_uring_sqe(&worker->ring);
+        if (sqe == NULL) {
+            pthread_mutex_unlock(&clnt->lock);
+            return -1;
+        }
+
+        struct msghdr *msg = &worker->msgs[batch_len];
+
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_iov = iov;
+        msg->msg_iovlen = iovlen;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = clnt->fd;
+        sqe->addr = (uintptr_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+        sqe->user_data = (uintptr_t)clnt | DIME_URING_SEND;
+
+        clnt->sock.uring.inflight++;
+        batch_len++;
+
+        if (batch_len == DIME_URING_BATCH) {
+            if (dime_worker_sent(worker, batch_len) < 0) {
+                return -1;
+            }
+
+            batch_len = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Handles one completion; returns 1 if the worker should stop */
+static int dime_worker_complete(dime_worker_t *worker, const struct io_uring_cqe *cqe) {
+    dime_server_t *srv = worker->srv;
+    int kind = cqe->user_data & DIME_URING_KIND;
+    void *p = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)DIME_URING_KIND);
+
+    if (kind == DIME_URING_WAKE) {
+        if (dime_worker_handoffs(worker) > 0) {
+            return 1;
+        }
+
+        return dime_worker_poll(worker, worker->pipefd[0], POLLIN, 0, worker, DIME_URING_WAKE);
+    } else if (kind == DIME_URING_ACCEPT) {
+        dime_worker_accept(worker, p);
+
+        return dime_worker_poll(worker, ((dime_server_fd_t *)p)->fd, POLLIN, 0, p, DIME_URING_ACCEPT);
+    } else if (kind == DIME_URING_CANCEL) {
+        return 0;
+    }
+
+    dime_client_t *clnt = p;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (kind == DIME_URING_RECV) {
+        int closed = clnt->sock.uring.flags & DIME_URING_CLOSED;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            if (cqe->res > 0 && !closed) {
+                if (srv->verbosity >= 3) {
+                    dime_info("Received %d bytes of data from %s", cqe->res, clnt->addr);
+                }
+
+                if (dime_socket_received(&clnt->sock, dime_uring_buf(&worker->ring, cqe), cqe->res) < 0 || dime_worker_dispatch(worker, clnt) < 0) {
+                    dime_worker_close_clnt(worker, clnt);
+                }
+            }
+
+            dime_uring_putbuf(&worker->ring, cqe);
+        }
+
+        if (!closed) {
+            if (cqe->res == 0) {
+                if (srv->verbosity >= 1) {
+                    dime_info("Connection closed from %s", clnt->addr);
+                }
+
+                dime_worker_close_clnt(worker, clnt);
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                if (srv->verbosity >= 1) {
+                    dime_err("Read failed on %s (%s), closing", clnt->addr, strerror(-cqe->res));
+                }
+
+                dime_worker_close_clnt(worker, clnt);
+            } else if (!more && !(clnt->sock.uring.flags & DIME_URING_CLOSED)) {
+                /* Out of buffers, or the kernel ended the multishot receive */
+                if (dime_worker_recv(worker, clnt) < 0) {
+                    return -1;
+                }
+            }
+        }
+    } else if (kind == DIME_URING_POLLIN) {
+        if (!(clnt->sock.uring.flags & DIME_URING_CLOSED)) {
+            if (dime_worker_readable(worker, clnt) < 0) {
+                dime_worker_close_clnt(worker, clnt);
+            } else if (!more && dime_worker_recv(worker, clnt) < 0) {
+                return -1;
+            }
+        }
+    } else if (kind == DIME_URING_POLLOUT) {
+        clnt->sock.uring.flags &= ~DIME_URING_WRITEWAIT;
+
+        if (!(clnt->sock.uring.flags & DIME_URING_CLOSED)) {
+            dime_worker_dirty(clnt);
+        }
+    }
+
+    /* Counted down last, so that closing above cannot free the client */
+    if (!more) {
+        clnt->sock.uring.inflight--;
+    }
+
+    /* The last completion for a closed client frees it */
+    if ((clnt->sock.uring.flags & DIME_URING_CLOSED) && clnt->sock.uring.inflight == 0) {
+        free(clnt);
+    }
+
+    return 0;
+}
+
+static int dime_worker_loop(dime_worker_t *worker) {
+    dime_server_t *srv = worker->srv;
+    int ret = 0;
+
+    if (dime_worker_poll(worker, worker->pipefd[0], POLLIN, 0, worker, DIME_URING_WAKE) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        return -1;
+    }
+
+    /* Only worker 0 accepts */
+    if (worker == &srv->workers[0]) {
+        for (size_t i = 0; i < srv->fds_len; i++) {
+            if (dime_worker_poll(worker, srv->fds[i].fd, POLLIN, 0, &srv->fds[i], DIME_URING_ACCEPT) < 0) {
+                strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+                return -1;
+            }
+        }
+    }
+
+    while (ret == 0) {
+        /* Completions that arrived while a batch of sends was in flight */
+        for (size_t i = 0; ret == 0 && i < worker->stash_len; i++) {
+            ret = dime_worker_complete(worker, &worker->stash[i]);
+        }
+
+        worker->stash_len = 0;
+
+        if (ret == 0) {
+            ret = dime_worker_flush(worker);
+        }
+
+        if (ret != 0 || worker->stash_len > 0) {
+            continue;
+        }
+
+        if (dime_uring_submit(&worker->ring, 1) < 0) {
+            ret = -1;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+
+        while (ret == 0 && (cqe = dime_uring_cqe(&worker->ring)) != NULL) {
+            struct io_uring_cqe c = *cqe;
+
+            dime_uring_seen(&worker->ring);
+            ret = dime_worker_complete(worker, &c);
+        }
+    }
+
+    if (ret < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        return -1;
+    }
+
+    return 0;
+}
+#else
+static int dime_worker_loop(dime_worker_t *worker) {
+    dime_server_t *srv = worker->srv;
+    int accepting = (worker == &srv->workers[0]);
+
+    while (1) {
+        int maxfd = -1;
+        fd_set rfds, wfds;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+
+        if (worker->pipefd[0] >= 0) {
+            FD_SET(worker->pipefd[0], &rfds);
+            maxfd = worker->pipefd[0] + 1;
+        }
+
+        if (accepting) {
+            for (size_t i = 0; i < srv->fds_len; i++) {
+                FD_SET(srv->fds[i].fd, &rfds);
+
+                if (maxfd < srv->fds[i].fd + 1) {
+                    maxfd = srv->fds[i].fd + 1;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < worker->clnts_len; i++) {
+            dime_client_t *clnt = worker->clnts[i];
+
+            FD_SET(clnt->fd, &rfds);
+
+            pthread_mutex_lock(&clnt->lock);
+
+            if (dime_socket_sendlen(&clnt->sock) > 0) {
+                FD_SET(clnt->fd, &wfds);
+            }
+
+            pthread_mutex_unlock(&clnt->lock);
+
+            if (maxfd < clnt->fd + 1) {
+                maxfd = clnt->fd + 1;
+            }
+        }
+
+        if (select(maxfd, &rfds, &wfds, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+        }
+
+        /*
+         * Iterate in reverse so that closing a connection (which moves
+         * the last client into its slot) does not skip any clients.
+         * Connections handed to us below are only examined after the
+         * next call to select.
+         */
+        for (size_t i = worker->clnts_len; i > 0; i--) {
+            dime_client_t *clnt = worker->clnts[i - 1];
+
+            if (FD_ISSET(clnt->fd, &rfds) && dime_worker_readable(worker, clnt) < 0) {
+                dime_worker_close(worker, i - 1);
+                continue;
+            }
+
+            if (FD_ISSET(clnt->fd, &wfds) && dime_worker_writable(worker, clnt) < 0) {
+                dime_worker_close(worker, i - 1);
+                continue;
+            }
+        }
+
+        if (worker->pipefd[0] >= 0 && FD_ISSET(worker->pipefd[0], &rfds)) {
+            if (dime_worker_handoffs(worker) > 0) {
+                return 0;
+            }
+        }
+
+        if (accepting) {
+            for (size_t i = 0; i < srv->fds_len; i++) {
+                if (FD_ISSET(srv->fds[i].fd, &rfds)) {
+                    dime_worker_accept(worker, &srv->fds[i]);
+                }
+            }
+        }
+    }
+}
+
+#endif
+
+static void *dime_worker_main(void *p) {
+    dime_worker_t *worker = p;
+    dime_server_t *srv = worker->srv;
+
+    if (dime_worker_loop(worker) < 0) {
+        dime_err("Worker thread exited: %s", srv->err);
+    }
+
+    return NULL;
+}
+
+int dime_server_loop(dime_server_t *srv) {
+    unsigned int nthreads = (srv->threads > 0) ? srv->threads : 1;
+
+#ifdef _WIN32
+    if (nthreads > 1) {
+        dime_warn("-j specified on Windows, using a single worker");
+        nthreads = 1;
+    }
+#endif
+
+    for (size_t i = 0; i < srv->fds_len; i++) {
+        if (listen(srv->fds[i].fd, 0) < 0) {
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+        }
+    }
+
+    if (srv->metrics_port != 0 && dime_stats_start(srv) < 0) {
+        return -1;
+    }
+
+    srv->workers = malloc(sizeof(dime_worker_t) * nthreads);
+    if (srv->workers == NULL) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+        printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+    }
+
+    srv->workers_len = 0;
+    srv->nextworker = 0;
+
+    for (unsigned int i = 0; i < nthreads; i++) {
+        if (dime_worker_init(&srv->workers[i], srv) < 0) {
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+        }
+
+        srv->workers_len++;
+    }
+
+    /* No worker runs yet, so nothing can race the peers' registration */
+    for (size_t i = 0; i < srv->peers_len; i++) {
+        dime_worker_adopt(srv, srv->peers[i]);
+    }
+
+    srv->peers_len = 0;
+
+#ifndef _WIN32
+    /* Keep signals on this thread, so that cleanup can stop the others */
+    sigset_t set, oldset;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+#   ifdef SIGHUP
+    sigaddset(&set, SIGHUP);
+#   endif
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+#endif
+
+    for (size_t i = 1; i < srv->workers_len; i++) {
+        if (pthread_create(&srv->workers[i].thread, NULL, dime_worker_main, &srv->workers[i]) != 0) {
+            strncpy(srv->err, strerror(errno), sizeof(srv->err));
+
+            /* Only join threads that were actually started */
+            for (size_t j = i; j < srv->workers_len; j++) {
+                dime_worker_destroy(&srv->workers[j]);
+            }
+            srv->workers_len = i;
+
+            printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+        }
+    }
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+
+    srv->workers[0].thread = pthread_self();
+
+    if (srv->verbosity >= 1 && srv->workers_len > 1) {
+        dime_info("Started %zu worker threads", srv->workers_len);
+    }
+
+    /* Stopped before worker 0 existed to be told */
+    if (srv->stopping) {
+        return 0;
+    }
+
+    return dime_worker_loop(&srv->workers[0]);
+}
+#if 0
+
+    while (1) {
+        if (poll(pollfds, pollfds_len, -1) < 0) {
+            signal(SIGPIPE, sigpipe_f);
+            signal(SIGTERM, sigterm_f);
+            signal(SIGINT, sigint_f);
+            free(pollfds);
+
+            printf("%d\n", __LINE__); printf("%d %s\n", __LINE__, strerror(errno)); return -1;
+        }
+
+        for (size_t i = srv->fds_len; i < pollfds_len; i++) {
+            dime_client_t *clnt = dime_table_search(&srv->fd2clnt, &pollfds[i].fd);
+            assert(clnt != NULL);
+
+            if (pollfds[i].revents & POLLHUP) {
+                if (srv->verbosity >= 1) {
+                    dime_info("Closed connection from %s", clnt->addr);
+                }
+
+                dime_client_unregister(clnt, srv);
+
+                dime_client_destroy(clnt);
+                free(clnt);
+
+                pollfds[i] = pollfds[pollfds_len - 1];
+                pollfds_len--;
+                i--;
+
+                continue;
+            }
+
+            if (pollfds[i].revents & POLLIN) {
+                ssize_t n = dime_socket_recvpartial(&clnt->sock);
+
+                if (n <= 0) {
+                    if (srv->verbosity >= 1) {
+                        if (n == 0) {
+                            dime_info("Connection closed from %s", clnt->addr);
+                        } else {
+                            dime_err("Read failed on %s (%s), closing", clnt->addr, strerror(errno));
+                        }
+                    }
+
+                    dime_client_unregister(clnt, srv);
+
+                    dime_client_destroy(clnt);
+                    free(clnt);
+
+                    pollfds[i] = pollfds[pollfds_len - 1];
+                    pollfds_len--;
+                    i--;
+
+                    continue;
+                }
+
+                if (srv->verbosity >= 3) {
+                    dime_info("Received %zd bytes of data from %s", n, clnt->addr);
+                }
+
+                while (1) {
+                    json_t *jsondata;
+                    dime_route_t route;
+                    void *bindata;
+                    size_t bindata_len;
+
+                    n = dime_socket_pop(&clnt->sock, &route, &jsondata, &bindata, &bindata_len);
+
+                    if (n > 0) {
+                        dime_server_dispatch(srv, clnt, &route, jsondata, &bindata, bindata_len);
 
                         json_decref(jsondata);
                         free(bindata);
@@ -1063,7 +2490,7 @@ int dime_server_loop(dime_server_t *srv) {
                         dime_err("Write failed on %s (%s), closing", clnt->addr, strerror(errno));
                     }
 
-                    dime_table_remove(&srv->fd2clnt, &clnt->fd);
+                    dime_client_unregister(clnt, srv);
 
                     dime_client_destroy(clnt);
                     free(clnt);
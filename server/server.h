@@ -31,14 +31,23 @@
  * @todo This could be global data, assuming we only run one server per process
  */
 
+#include <signal.h>
 #include <stdint.h>
+#include <time.h>
 
+#include <pthread.h>
 #ifdef DIME_USE_LIBEV
 #   include <ev.h>
 #endif
 #include <openssl/ssl.h>
 
+#include "deque.h"
+#include "pool.h"
 #include "table.h"
+#include "trace.h"
+#ifdef DIME_USE_IO_URING
+#   include "uring.h"
+#endif
 
 #ifndef __DIME_server_H
 #define __DIME_server_H
@@ -64,6 +73,49 @@ typedef struct {
     void *srv;
 } dime_server_fd_t;
 
+/**
+ * @brief Event loop worker
+ *
+ * Each worker runs an event loop over the connections that have been
+ * handed to it. Worker 0 runs on the thread that called
+ * @link dime_server_loop @endlink, and additionally accepts new
+ * connections and distributes them to the workers round-robin. Other
+ * threads communicate with a worker through its self-pipe, either to
+ * hand it a new connection or to wake it up after data was queued on
+ * one of its sockets.
+ *
+ * The event loop uses @c select by default. If built with
+ * @c DIME_USE_EPOLL or @c DIME_USE_KQUEUE, each worker instead owns an
+ * epoll or kqueue instance with its connections registered
+ * edge-triggered, so the cost of a wakeup depends on the number of
+ * active connections rather than the total. With @c DIME_USE_IO_URING,
+ * each worker owns an io_uring instance with multishot receives into
+ * kernel-registered buffers, and submits the writes of every connection
+ * with pending output in one batch per loop iteration.
+ */
+typedef struct {
+    pthread_t thread; /** Thread running this worker */
+    int pipefd[2];    /** Self-pipe for handoffs and wakeups */
+    int woken;        /** Whether a wakeup is already in the self-pipe, modified atomically */
+    void *srv;        /** Owning server */
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    int pollfd; /** epoll/kqueue file descriptor */
+#elif defined(DIME_USE_IO_URING)
+    dime_uring_t ring;         /** io_uring instance */
+    dime_deque_t dirty;        /** Clients with output waiting to be submitted */
+    pthread_mutex_t dirtylock; /** Guards dirty, which other workers push onto */
+    struct msghdr *msgs;       /** Headers of sends in the current batch */
+    struct iovec *iovs;        /** Buffers of sends in the current batch */
+    struct io_uring_cqe *stash; /** Completions set aside during a batch */
+    size_t stash_len;           /** Length of stash */
+    size_t stash_cap;           /** Capacity of stash */
+#endif
+
+    struct __dime_client **clnts; /** Array of owned clients */
+    size_t clnts_len;             /** Length of client array */
+    size_t clnts_cap;             /** Capacity of client array */
+} dime_worker_t;
+
 enum dime_protocol {
     DIME_UNIX,
     DIME_TCP,
@@ -96,6 +148,7 @@ typedef struct {
     const char *privkeyname; /** Private key pathname (if using TLS) */
     const char *socketname;  /** Socket pathname (if using Unix socket) */
     uint16_t port;           /** Port (if using TCP socket) */
+    size_t zlib_threshold;   /** Smallest binary portion to compress (if using zlib) */
 
     unsigned int verbosity; /** Verbosity level */
     unsigned int threads;   /** Number of worker threads */
@@ -104,8 +157,54 @@ typedef struct {
 
     int fd;                 /** File descriptor */
     dime_table_t fd2clnt;   /** File descriptor-to-client translation table */
+
+    struct __dime_client **clnts; /** Dense array of registered clients */
+    size_t clnts_len;             /** Length of client array */
+    size_t clnts_cap;             /** Capacity of client array */
+
     dime_table_t name2clnt; /** Name-to-client translation table */
+
+    struct __dime_group **groups; /** Every group ever joined, indexed by handle - 1 */
+    size_t groups_len;            /** Length of group array */
+    size_t groups_cap;            /** Capacity of group array */
+
+    uint64_t batches; /** Number of "batch" and "forward" commands relayed so far */
+
+    struct __dime_client **peers; /** Connections to peered servers not yet handed to a worker */
+    size_t peers_len;             /** Length of peer array */
+    size_t peers_cap;             /** Capacity of peer array */
+
+    struct {
+        struct timespec start; /** When the server was initialized */
+        struct timespec last;  /** When the previous "stats" command was handled */
+        uint64_t last_msgs;    /** Value of msgs as of the previous "stats" command */
+        uint64_t msgs;         /** Commands handled */
+        uint64_t relayed;      /** Copies of messages queued for clients */
+        uint64_t forwarded;    /** Copies of messages forwarded to peered servers */
+        uint64_t dropped;      /** Messages rejected or dropped at client queue limits */
+        uint64_t connections;  /** Connections accepted */
+        uint64_t bytes_in;     /** Bytes received from clients that have disconnected */
+        uint64_t bytes_out;    /** Bytes sent to clients that have disconnected */
+    } stats; /** Counters, guarded by the server lock */
+
+#ifdef DIME_USE_TRACE
+    dime_trace_t trace; /** Latencies of every relayed message */
+#endif
+
+    const char *metrics_host; /** Address to serve Prometheus metrics on, or NULL for loopback */
+    uint16_t metrics_port;  /** Port to serve Prometheus metrics on, or 0 for none */
+    int metrics_fd;         /** Metrics listener, or -1 */
+    int metrics_pipefd[2];  /** Self-pipe that stops the metrics thread */
+    pthread_t metrics_thread; /** Thread serving metrics, if metrics_fd is valid */
+
     SSL_CTX *tlsctx;        /** OpenSSL context */
+    dime_pool_t msgpool;    /** Pool of reference-counted messages */
+
+    pthread_mutex_t lock;  /** Guards the tables, groups and client queues */
+    dime_worker_t *workers; /** Array of event loop workers */
+    size_t workers_len;     /** Number of running workers */
+    size_t nextworker;      /** Worker to hand the next connection to */
+    volatile sig_atomic_t stopping; /** Set by dime_server_stop */
 } dime_server_t;
 
 /**
@@ -133,6 +232,29 @@ void dime_server_destroy(dime_server_t *srv);
 
 int dime_server_add(dime_server_t *srv, int protocol, ...);
 
+/**
+ * @brief Peer with another DiME server
+ *
+ * Connects to another DiME server, either over a Unix socket given its
+ * pathname (@c DIME_UNIX), or over TCP given its host name and port
+ * (@c DIME_TCP), and asks it to peer with this one. Peered servers
+ * advertise the groups their clients are in to each other, and forward
+ * each message to every other server with recipients once, which relays
+ * it to its own clients (see @link dime_client_peer @endlink).
+ *
+ * Forwarded messages are never forwarded again, so every pair of
+ * servers must be peered exactly once, by either of the two. The
+ * connection is handed to a worker once
+ * @link dime_server_loop @endlink is called.
+ *
+ * @param srv Pointer to a @link dime_server_t @endlink struct
+ * @param protocol @c DIME_UNIX or @c DIME_TCP
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ */
+int dime_server_peer(dime_server_t *srv, int protocol, ...);
+
 /**
  * @brief Run the event loop for the server
  *
@@ -144,6 +266,30 @@ int dime_server_add(dime_server_t *srv, int protocol, ...);
  */
 int dime_server_loop(dime_server_t *srv);
 
+/**
+ * @brief Stop the event loop of the server
+ *
+ * Makes @link dime_server_loop @endlink return once worker 0 is done
+ * with the events at hand, or as soon as it starts if it has not yet.
+ * Only writes to a self-pipe, so it is safe to call from a signal
+ * handler on the thread that runs the loop.
+ *
+ * @param srv Pointer to a @link dime_server_t @endlink struct
+ */
+void dime_server_stop(dime_server_t *srv);
+
+/**
+ * @brief Wake up a worker
+ *
+ * Causes the worker to re-examine which of its sockets have pending
+ * output. Must be called after data is added to the outbuffer of a
+ * client from a thread other than the one running the client's worker.
+ *
+ * @param worker Pointer to a @link dime_worker_t @endlink struct, or
+ * @c NULL
+ */
+void dime_server_wake(dime_worker_t *worker);
+
 #ifdef __cplusplus
 }
 #endif
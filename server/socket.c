@@ -1,3 +1,8 @@
+/* For F_GET_SEALS and MSG_CMSG_CLOEXEC */
+#ifdef __linux__
+#   define _GNU_SOURCE
+#endif
+
 #ifdef _WIN32
 #   include <winsock2.h>
 #   include <ws2tcpip.h>
@@ -6,11 +11,22 @@
 #   include <arpa/inet.h>
 #   include <fcntl.h>
 #   include <unistd.h>
+#   include <sys/mman.h>
 #   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/time.h>
+#   include <sys/uio.h>
+#endif
+
+#if defined(DIME_USE_EPOLL)
+#   include <sys/epoll.h>
+#elif defined(DIME_USE_KQUEUE)
+#   include <sys/event.h>
 #endif
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +36,7 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "deque.h"
 #include "ringbuffer.h"
 #include "socket.h"
 
@@ -35,8 +52,48 @@ typedef struct {
     uint32_t bindata_len;
 } dime_header_t;
 
+/* DiME v2 header, with every field naturally aligned */
+typedef struct {
+    int8_t magic[4];
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t group;
+    uint32_t seq;
+    uint32_t jsondata_len;
+    uint32_t bindata_len;
+} dime_header2_t;
+
+#define DIME_HEADER2_LEN 24
+
+/* Longest header of a message from the server, WebSocket frame included */
+#define DIME_REPLY_MAXLEN (10 + DIME_HEADER2_LEN)
+
 static const size_t SENDBUFLEN = 200000000;
-static const size_t RECVBUFLEN = 200000000;
+
+/* Minimum free space in the inbuffer for each receive */
+static const size_t RECVBUFLEN = 65536;
+
+/* Binary data of at least this size is received directly into place */
+static const size_t RECVDIRECTLEN = 65536;
+
+/* Maximum number of buffers passed to a single sendmsg call */
+#define SENDIOVLEN 64
+
+/* Maximum number of buffers passed to a single recvmsg call */
+#define RECVIOVLEN 8
+
+/* Messages up to this size are copied rather than sent by reference */
+static const size_t PUSHCOPYLEN = 16384;
+
+/* Scratch buffers that grew past this size are freed once used */
+static const size_t SCRATCHLEN = 65536;
+
+/* Maximum number of file descriptors accepted by a single recvmsg call */
+#define RECVFDLEN 16
+
+/* Seconds a stalled TLS handshake may block its worker for */
+static const long TLSTIMEOUT = 10;
 
 static int dime_socket_setnonblocking(dime_socket_t *sock, int nonblocking) {
 #ifdef _WIN32
@@ -74,20 +131,140 @@ int dime_socket_init(dime_socket_t *sock, int fd) {
         return -1;
     }
 
+    if (dime_deque_init(&sock->wsegs) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        dime_ringbuffer_destroy(&sock->wbuf);
+        dime_ringbuffer_destroy(&sock->rbuf);
+
+        return -1;
+    }
+
+    sock->wtail = NULL;
+    sock->wlen = 0;
+    sock->spares_len = 0;
+
+    sock->wscratch.buf = NULL;
+    sock->wscratch.cap = 0;
+    sock->rscratch.buf = NULL;
+    sock->rscratch.cap = 0;
+    sock->rdone = 0;
+
 #ifdef DIME_USE_LIBEV
     sock->loop = NULL;
 #endif
 
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    sock->pollfd = -1;
+#endif
+
+#ifdef DIME_USE_IO_URING
+    sock->uring.onwrite = NULL;
+    sock->uring.inflight = 0;
+    sock->uring.flags = 0;
+    sock->uring.dirty = 0;
+#endif
+
+    sock->rmsg.pending = 0;
+    sock->rmsg.jsondata = NULL;
+    sock->rmsg.bindata = NULL;
+
+    sock->shm.enabled = 0;
+    sock->shm.fds = NULL;
+    sock->shm.fds_len = 0;
+    sock->shm.fds_cap = 0;
+    sock->shm.fd = -1;
+
     sock->tls.enabled = 0;
+    sock->tls.ktls_send = 0;
     sock->ws.enabled = 0;
+    sock->ws.pong_len = -1;
     sock->zlib.enabled = 0;
+    sock->zlib.threshold = 0;
+    sock->v2.enabled = 0;
+    sock->v2.seq = 0;
+    sock->v2.noack = 0;
+
+    sock->stats.bytes_in = 0;
+    sock->stats.bytes_out = 0;
+
+#ifdef DIME_USE_TRACE
+    sock->marks.arr = NULL;
+    sock->marks.begin = 0;
+    sock->marks.len = 0;
+    sock->marks.cap = 0;
+#endif
 
     return 0;
 }
 
+#ifdef DIME_USE_TRACE
+/* Traced point in the outbound stream */
+typedef struct dime_socket_mark {
+    uint64_t end;    /* Value of stats.bytes_out once the point is reached */
+    uint64_t pushed; /* When the data up to the point was pushed */
+    dime_trace_t *trace;
+} dime_socket_mark_t;
+
+/* Initial capacity of the marks, which are few unless the peer falls behind */
+#define MARKLEN 4
+#endif
+
+/* Adds to a counter that only this thread writes, but others may read */
+static void dime_socket_count(uint64_t *counter, size_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Releases the shared memory segment of the last popped message, unless it was claimed */
+static void dime_socket_shm_release(dime_socket_t *sock) {
+#ifndef _WIN32
+    if (sock->shm.fd >= 0) {
+        if (sock->shm.len > 0) {
+            munmap(sock->shm.addr, sock->shm.len);
+        }
+
+        close(sock->shm.fd);
+        sock->shm.fd = -1;
+    }
+#endif
+}
+
 void dime_socket_destroy(dime_socket_t *sock) {
+    dime_socket_seg_t *seg;
+
+    while ((seg = dime_deque_popl(&sock->wsegs)) != NULL) {
+        if (seg->nbufs > 0 && seg->release != NULL) {
+            seg->release(seg->p);
+        }
+
+        free(seg);
+    }
+
+    for (size_t i = 0; i < sock->spares_len; i++) {
+        free(sock->spares[i]);
+    }
+
+    free(sock->wscratch.buf);
+    free(sock->rscratch.buf);
+
+    if (sock->rmsg.pending) {
+        json_decref(sock->rmsg.jsondata);
+        free(sock->rmsg.bindata);
+    }
+
+    dime_socket_shm_release(sock);
+
+    for (size_t i = 0; i < sock->shm.fds_len; i++) {
+        close(sock->shm.fds[i]);
+    }
+
+    free(sock->shm.fds);
+
+    dime_deque_destroy(&sock->wsegs);
     dime_ringbuffer_destroy(&sock->rbuf);
     dime_ringbuffer_destroy(&sock->wbuf);
+#ifdef DIME_USE_TRACE
+    free(sock->marks.arr);
+#endif
 
     if (sock->tls.enabled) {
         SSL_shutdown(sock->tls.ctx);
@@ -96,18 +273,17 @@ void dime_socket_destroy(dime_socket_t *sock) {
 
     if (sock->ws.enabled) {
         dime_ringbuffer_destroy(&sock->ws.rbuf);
-    }
 
-    if (sock->zlib.enabled) {
-        dime_ringbuffer_destroy(&sock->zlib.rbuf);
-        deflateEnd(&sock->zlib.ctx);
+        if (sock->ws.deflate) {
+            inflateEnd(&sock->zlib.ctx);
+        }
     }
 
     shutdown(sock->fd, SHUT_RDWR);
     close(sock->fd);
 }
 
-int dime_socket_init_ws(dime_socket_t *sock) {
+int dime_socket_init_ws(dime_socket_t *sock, size_t threshold) {
     if (dime_socket_setnonblocking(sock, 0) < 0) {
         strncpy(sock->err, strerror(errno), sizeof(sock->err));
 
@@ -189,9 +365,9 @@ int dime_socket_init_ws(dime_socket_t *sock) {
         return -1;
     }
 
-    char *connection, *upgrade, *sec_ws_key, *sec_ws_version;
+    char *connection, *upgrade, *sec_ws_key, *sec_ws_version, *sec_ws_extensions;
 
-    connection = upgrade = sec_ws_key = sec_ws_version = NULL;
+    connection = upgrade = sec_ws_key = sec_ws_version = sec_ws_extensions = NULL;
 
     while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
         char *delimiter = strstr(line, ": ");
@@ -218,6 +394,8 @@ int dime_socket_init_ws(dime_socket_t *sock) {
             sec_ws_key = val;
         } else if (strcmp(key, "Sec-WebSocket-Version") == 0) {
             sec_ws_version = val;
+        } else if (strcmp(key, "Sec-WebSocket-Extensions") == 0) {
+            sec_ws_extensions = val;
         }
     }
 
@@ -256,16 +434,27 @@ int dime_socket_init_ws(dime_socket_t *sock) {
 
     EVP_EncodeBlock((unsigned char *)b64_sha1sum, sha1sum, 20);
 
+    /*
+     * Every message is compressed on its own, so that compressed frames
+     * can be shared between connections. Offers that limit our window
+     * size are declined rather than honored.
+     */
+    int deflate = (threshold > 0 && sec_ws_extensions != NULL &&
+                   strstr(sec_ws_extensions, "permessage-deflate") != NULL &&
+                   strstr(sec_ws_extensions, "server_max_window_bits") == NULL);
+
     free(http_hdr);
 
-    char response[200];
+    char response[300];
 
     int response_len = snprintf(response, sizeof(response),
                                 "HTTP/%d.%d 101 Switching Protocols\r\n"
                                 "Connection: Upgrade\r\n"
                                 "Upgrade: websocket\r\n"
-                                "Sec-WebSocket-Accept: %s\r\n\r\n",
-                                major, minor, b64_sha1sum);
+                                "Sec-WebSocket-Accept: %s\r\n"
+                                "%s\r\n",
+                                major, minor, b64_sha1sum,
+                                deflate ? "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_no_context_takeover\r\n" : "");
 
     assert(response_len >= 0 && response_len < sizeof(response));
 
@@ -282,328 +471,1642 @@ int dime_socket_init_ws(dime_socket_t *sock) {
         return 0;
     }
 
-    sock->ws.enabled = 1;
-
     if (dime_ringbuffer_init(&sock->ws.rbuf) < 0) {
         strncpy(sock->err, strerror(errno), sizeof(sock->err));
         return -1;
     }
 
+    if (deflate) {
+        memset(&sock->zlib.ctx, 0, sizeof(z_stream));
+
+        if (inflateInit2(&sock->zlib.ctx, -MAX_WBITS) != Z_OK) {
+            strncpy(sock->err, "Can't initialize zlib", sizeof(sock->err));
+            dime_ringbuffer_destroy(&sock->ws.rbuf);
+
+            return -1;
+        }
+
+        sock->zlib.enabled = 1;
+        sock->zlib.threshold = threshold;
+    }
+
+    sock->ws.enabled = 1;
+    sock->ws.deflate = deflate;
+    sock->ws.inflating = 0;
+    sock->ws.fin = 1;
+    sock->ws.remaining = 0;
+    sock->ws.pong_len = -1;
+
     return 0;
 }
 
-int dime_socket_init_tls(dime_socket_t *sock, SSL_CTX *tlsctx) {
-    /* Ensure the underlying socket is blocking for the TLS handshake */
-    if (dime_socket_setnonblocking(sock, 0) < 0) {
-        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+int dime_socket_init_zlib(dime_socket_t *sock, size_t threshold) {
+    if (sock->ws.enabled || threshold == 0) {
+        strncpy(sock->err, "Invalid zlib configuration", sizeof(sock->err));
+        return -1;
+    }
+
+    sock->zlib.enabled = 1;
+    sock->zlib.threshold = threshold;
+
+    return 0;
+}
+
+int dime_socket_init_v2(dime_socket_t *sock) {
+    sock->v2.enabled = 1;
+    sock->v2.seq = 0;
+
+    return 0;
+}
+
+/* Sets the send and receive timeouts of the underlying socket, 0 meaning none */
+static int dime_socket_settimeout(dime_socket_t *sock, long seconds) {
+#ifdef _WIN32
+    DWORD ms = seconds * 1000;
+
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&ms, sizeof(ms)) < 0 ||
+        setsockopt(sock->fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&ms, sizeof(ms)) < 0) {
+        return -1;
+    }
+#else
+    struct timeval tv;
+
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(sock->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
 
+int dime_socket_flush(dime_socket_t *sock) {
+    if (dime_socket_sendlen(sock) == 0) {
         return 0;
     }
 
-    assert(dime_ringbuffer_len(&sock->rbuf) == 0);
+    if (dime_socket_setnonblocking(sock, 0) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+
+        return -1;
+    }
 
-    while (dime_ringbuffer_len(&sock->wbuf) > 0) {
+    while (dime_socket_sendlen(sock) > 0) {
         if (dime_socket_sendpartial(sock) < 0) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            dime_socket_setnonblocking(sock, 1);
+
             return -1;
         }
     }
 
-    sock->tls.ctx = SSL_new(tlsctx);
-    if (sock->tls.ctx == NULL) {
+    if (dime_socket_setnonblocking(sock, 1) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+
         return -1;
     }
 
-    SSL_set_mode(sock->tls.ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
-
-    if (SSL_set_fd(sock->tls.ctx, sock->fd) <= 0) {
-        ERR_error_string_n(ERR_get_error(), sock->err, sizeof(sock->err));
+    return 0;
+}
 
-        SSL_free(sock->tls.ctx);
+int dime_socket_init_tls(dime_socket_t *sock, SSL_CTX *tlsctx) {
+    /* The popped handshake itself may still be in the inbuffer, but nothing after it */
+    assert(dime_socket_recvlen(sock) == 0);
+
+    /*
+     * Ensure the underlying socket is blocking for the TLS handshake, but
+     * only for so long. The outbuffer is left alone, as other threads may
+     * push to it meanwhile.
+     */
+    if (dime_socket_setnonblocking(sock, 0) < 0 || dime_socket_settimeout(sock, TLSTIMEOUT) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        dime_socket_setnonblocking(sock, 1);
 
         return -1;
     }
 
-    if (SSL_accept(sock->tls.ctx) <= 0) {
+    sock->tls.ctx = SSL_new(tlsctx);
+    if (sock->tls.ctx == NULL) {
         ERR_error_string_n(ERR_get_error(), sock->err, sizeof(sock->err));
 
-        SSL_free(sock->tls.ctx);
+        goto fail;
+    }
 
-        return -1;
+    /* Outbound buffers may differ between retries, since they are gathered anew every time */
+    SSL_set_mode(sock->tls.ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    /*
+     * Hand the record layer to the kernel after the handshake, if it and
+     * the negotiated cipher support it; OpenSSL stays in charge otherwise
+     */
+    SSL_set_options(sock->tls.ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    if (SSL_set_fd(sock->tls.ctx, sock->fd) <= 0 || SSL_accept(sock->tls.ctx) <= 0) {
+        unsigned long sslerr = ERR_get_error();
+
+        if (sslerr != 0) {
+            ERR_error_string_n(sslerr, sock->err, sizeof(sock->err));
+        } else {
+            strncpy(sock->err, "TLS handshake failed", sizeof(sock->err));
+        }
+
+        goto fail;
     }
 
     /* Reset the original socket flags */
-    if (dime_socket_setnonblocking(sock, 1) < 0) {
+    if (dime_socket_settimeout(sock, 0) < 0 || dime_socket_setnonblocking(sock, 1) < 0) {
         strncpy(sock->err, strerror(errno), sizeof(sock->err));
 
-        return 0;
+        goto fail;
     }
 
     sock->tls.enabled = 1;
 
+#ifdef SSL_OP_ENABLE_KTLS
+    sock->tls.ktls_send = BIO_get_ktls_send(SSL_get_wbio(sock->tls.ctx));
+#endif
+
     return 0;
-}
 
-ssize_t dime_socket_push(dime_socket_t *sock, const json_t *jsondata, const void *bindata, size_t bindata_len) {
-    char *jsonstr = json_dumps(jsondata, JSON_COMPACT);
-    if (jsonstr == NULL) {
-        strncpy(sock->err, "Can't encode JSON data", sizeof(sock->err));
-        return -1;
-    }
+fail:
+    SSL_free(sock->tls.ctx);
+    sock->tls.ctx = NULL;
 
-    ssize_t ret = dime_socket_push_str(sock, jsonstr, bindata, bindata_len);
+    /* Leave the socket as the event loop expects it */
+    dime_socket_settimeout(sock, 0);
+    dime_socket_setnonblocking(sock, 1);
 
-    free(jsonstr);
-    return ret;
+    return -1;
 }
 
-ssize_t dime_socket_push_str(dime_socket_t *sock, const char *jsonstr, const void *bindata, size_t bindata_len) {
-    dime_header_t hdr;
+int dime_socket_init_shm(dime_socket_t *sock) {
+#if defined(_WIN32) || defined(DIME_USE_IO_URING)
+    /* io_uring receives into provided buffers, without ancillary data */
+    strncpy(sock->err, "Shared memory is not supported", sizeof(sock->err));
 
-#ifdef DIME_USE_LIBEV
-    if (dime_ringbuffer_len(&sock->wbuf) == 0 && sock->loop != NULL) {
-        ev_io_start(sock->loop, &sock->wwatcher);
+    return -1;
+#else
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (getsockname(sock->fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+
+        return -1;
     }
-#endif
 
-    memcpy(hdr.magic, "DiME", 4);
+    if (addr.ss_family != AF_UNIX || sock->tls.enabled || sock->ws.enabled) {
+        strncpy(sock->err, "Shared memory requires a plain Unix domain socket", sizeof(sock->err));
 
-    size_t ws_len = 0;
-    size_t jsondata_len = strlen(jsonstr);
+        return -1;
+    }
 
-    hdr.jsondata_len = htonl(jsondata_len);
-    hdr.bindata_len = htonl(bindata_len);
+    sock->shm.enabled = 1;
 
-    if (sock->ws.enabled) {
-        uint8_t ws_hdr[10];
-        ws_hdr[0] = 0x82;
+    return 0;
+#endif
+}
 
-        size_t payload_len = 12 + jsondata_len + bindata_len;
+int dime_socket_shm_enabled(const dime_socket_t *sock) {
+    return sock->shm.enabled;
+}
 
-        if (payload_len < 126) {
-            ws_hdr[1] = payload_len;
+static size_t dime_socket_ws_header(uint8_t *ws_hdr, size_t payload_len) {
+    ws_hdr[0] = 0x82;
 
-            ws_len = 2;
-        } else if (payload_len < (1 << 16)) {
-            ws_hdr[1] = 126;
-            ws_hdr[2] = (payload_len >> 8) & 0xFF;
-            ws_hdr[3] = payload_len & 0xFF;
+    if (payload_len < 126) {
+        ws_hdr[1] = payload_len;
 
-            ws_len = 4;
-        } else {
-            assert((payload_len & (1ull << 63)) == 0);
+        return 2;
+    } else if (payload_len < (1 << 16)) {
+        ws_hdr[1] = 126;
+        ws_hdr[2] = (payload_len >> 8) & 0xFF;
+        ws_hdr[3] = payload_len & 0xFF;
 
-            ws_hdr[1] = 127;
-            ws_hdr[2] = (payload_len >> 56) & 0xFF;
-            ws_hdr[3] = (payload_len >> 48) & 0xFF;
-            ws_hdr[4] = (payload_len >> 40) & 0xFF;
-            ws_hdr[5] = (payload_len >> 32) & 0xFF;
-            ws_hdr[6] = (payload_len >> 24) & 0xFF;
-            ws_hdr[7] = (payload_len >> 16) & 0xFF;
-            ws_hdr[8] = (payload_len >> 8) & 0xFF;
-            ws_hdr[9] = payload_len & 0xFF;
+        return 4;
+    } else {
+        assert((payload_len & (1ull << 63)) == 0);
+
+        ws_hdr[1] = 127;
+        ws_hdr[2] = (payload_len >> 56) & 0xFF;
+        ws_hdr[3] = (payload_len >> 48) & 0xFF;
+        ws_hdr[4] = (payload_len >> 40) & 0xFF;
+        ws_hdr[5] = (payload_len >> 32) & 0xFF;
+        ws_hdr[6] = (payload_len >> 24) & 0xFF;
+        ws_hdr[7] = (payload_len >> 16) & 0xFF;
+        ws_hdr[8] = (payload_len >> 8) & 0xFF;
+        ws_hdr[9] = payload_len & 0xFF;
+
+        return 10;
+    }
+}
 
-            ws_len = 10;
-        }
+int dime_socket_framing(const dime_socket_t *sock, size_t bindata_len) {
+    int compress = (sock->zlib.enabled && bindata_len >= sock->zlib.threshold);
 
-        if (dime_ringbuffer_write(&sock->wbuf, ws_hdr, ws_len) < ws_len) {
-            strncpy(sock->err, strerror(errno), sizeof(sock->err));
-            return -1;
-        }
+    if (sock->ws.enabled) {
+        return compress ? DIME_FRAMING_WS_DEFLATE : DIME_FRAMING_WS;
     }
 
-    if (dime_ringbuffer_write(&sock->wbuf, &hdr, 12) < 12 ||
-        dime_ringbuffer_write(&sock->wbuf, jsonstr, jsondata_len) < jsondata_len ||
-        dime_ringbuffer_write(&sock->wbuf, bindata, bindata_len) < bindata_len) {
+    return compress ? DIME_FRAMING_ZLIB : DIME_FRAMING_RAW;
+}
 
-        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+int dime_socket_compress(int framing, const char *jsonstr, size_t jsondata_len, const void *bindata, size_t bindata_len, unsigned char **out, size_t *out_len) {
+    if (jsondata_len > UINT32_MAX || bindata_len > UINT32_MAX) {
+        errno = EMSGSIZE;
         return -1;
     }
 
-    return 12 + ws_len + jsondata_len + bindata_len;
-}
+    if (framing == DIME_FRAMING_ZLIB) {
+        uLongf len = compressBound(bindata_len);
+        unsigned char *buf = malloc(4 + len);
+        if (buf == NULL) {
+            return -1;
+        }
 
-ssize_t dime_socket_pop(dime_socket_t *sock, json_t **jsondata, void **bindata, size_t *bindata_len) {
-    if (sock->ws.enabled) {
-        while (1) {
-            uint8_t ws_hdr[14], mask[4];
-            size_t hdr_len, frame_len;
+        uint32_t orig_len = htonl(bindata_len);
 
-            size_t nread = dime_ringbuffer_peek(&sock->ws.rbuf, ws_hdr, 14);
+        memcpy(buf, &orig_len, 4);
 
-            if ((ws_hdr[1] & ~0x80) < 126 && nread >= 6) {
-                hdr_len = 6;
-                frame_len = ws_hdr[1] & ~0x80;
+        if (compress2(buf + 4, &len, bindata, bindata_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            free(buf);
+            errno = ENOMEM;
 
-                mask[0] = ws_hdr[2];
-                mask[1] = ws_hdr[3];
-                mask[2] = ws_hdr[4];
-                mask[3] = ws_hdr[5];
-            } else if ((ws_hdr[1] & ~0x80) == 126 && nread >= 8) {
-                hdr_len = 8;
-                frame_len = ((size_t)ws_hdr[2] << 8) | ws_hdr[3];
+            return -1;
+        }
 
-                mask[0] = ws_hdr[4];
-                mask[1] = ws_hdr[5];
-                mask[2] = ws_hdr[6];
-                mask[3] = ws_hdr[7];
-            } else if ((ws_hdr[1] & ~0x80) == 127 && nread == 14) {
-                hdr_len = 14;
-                frame_len = ((size_t)ws_hdr[2] << 56) |
-                            ((size_t)ws_hdr[3] << 48) |
-                            ((size_t)ws_hdr[4] << 40) |
-                            ((size_t)ws_hdr[5] << 32) |
-                            ((size_t)ws_hdr[6] << 24) |
-                            ((size_t)ws_hdr[7] << 16) |
-                            ((size_t)ws_hdr[8] << 8) |
-                            ws_hdr[9];
+        *out = buf;
+        *out_len = 4 + len;
 
-                mask[0] = ws_hdr[10];
-                mask[1] = ws_hdr[11];
-                mask[2] = ws_hdr[12];
-                mask[3] = ws_hdr[13];
-            } else {
-                break;
-            }
+        return 0;
+    }
 
-            if ((ws_hdr[1] & 0x80) == 0) {
-                return -1;
-            }
+    assert(framing == DIME_FRAMING_WS_DEFLATE);
 
-            size_t msgsiz = hdr_len + frame_len;
-            unsigned char *msg = malloc(msgsiz);
-            if (msg == NULL) {
-                return -1;
-            }
+    z_stream z;
 
-            if (dime_ringbuffer_peek(&sock->ws.rbuf, msg, msgsiz) == msgsiz) {
-                unsigned char *frame = msg + hdr_len;
+    memset(&z, 0, sizeof(z_stream));
 
-                for (size_t i = 0; i < frame_len; i++) {
-                    frame[i] ^= mask[i & 3];
-                }
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
 
-                if (dime_ringbuffer_write(&sock->rbuf, frame, frame_len) < 0) {
-                    strncpy(sock->err, strerror(errno), sizeof(sock->err));
+    unsigned char hdr[DIME_FRAME_MAXLEN];
+    size_t hdr_len = dime_socket_frame(DIME_FRAMING_RAW, hdr, jsondata_len, bindata_len);
 
-                    free(msg);
+    const void *bufs[3] = {hdr, jsonstr, bindata};
+    size_t lens[3] = {hdr_len, jsondata_len, bindata_len};
 
-                    return -1;
-                }
+    /* Room for the empty block that ends a sync flush */
+    size_t cap = deflateBound(&z, hdr_len + jsondata_len + bindata_len) + 16;
+    unsigned char *buf = malloc(cap);
+    if (buf == NULL) {
+        deflateEnd(&z);
 
-                dime_ringbuffer_discard(&sock->ws.rbuf, msgsiz);
-                free(msg);
-            } else {
-                free(msg);
-                break;
-            }
-        }
+        return -1;
     }
 
-    dime_header_t hdr;
+    z.next_out = buf;
+    z.avail_out = cap;
 
-    if (dime_ringbuffer_peek(&sock->rbuf, &hdr, 12) == 12) {
-        if (memcmp(&hdr, "DiME", 4) != 0) {
-            strncpy(sock->err, "Invalid DiME header", sizeof(sock->err));
-            return -1;
+    for (size_t i = 0; i < 4; i++) {
+        if (i < 3) {
+            z.next_in = (unsigned char *)bufs[i];
+            z.avail_in = lens[i];
         }
 
-        hdr.jsondata_len = ntohl(hdr.jsondata_len);
-        hdr.bindata_len = ntohl(hdr.bindata_len);
-
-        size_t msgsiz = 12 + hdr.jsondata_len + hdr.bindata_len;
+        if (deflate(&z, (i < 3) ? Z_NO_FLUSH : Z_SYNC_FLUSH) != Z_OK || z.avail_in > 0) {
+            free(buf);
+            deflateEnd(&z);
+            errno = ENOMEM;
 
-        void *buf = malloc(msgsiz);
-        if (buf == NULL) {
-            strncpy(sock->err, strerror(errno), sizeof(sock->err));
             return -1;
         }
+    }
 
-        if (dime_ringbuffer_peek(&sock->rbuf, buf, msgsiz) == msgsiz) {
-            json_error_t jsonerr;
-            json_t *jsondata_p = json_loadb((char *)buf + 12, hdr.jsondata_len, 0, &jsonerr);
-            if (jsondata_p == NULL) {
-                strncpy(sock->err, jsonerr.text, sizeof(sock->err));
+    size_t len = cap - z.avail_out;
 
-                free(buf);
+    deflateEnd(&z);
 
-                return -1;
-            }
+    /* RFC 7692 section 7.2.1: the trailing 00 00 FF FF is left off */
+    assert(len >= 4 && memcmp(buf + len - 4, "\x00\x00\xFF\xFF", 4) == 0);
 
-            void *bindata_p = malloc(hdr.bindata_len);
+    *out = buf;
+    *out_len = len - 4;
 
-            if (bindata_p == NULL) {
-                strncpy(sock->err, strerror(errno), sizeof(sock->err));
+    return 0;
+}
 
-                json_decref(jsondata_p);
-                free(buf);
+size_t dime_socket_frame(int framing, unsigned char *buf, size_t jsondata_len, size_t bindata_len) {
+    size_t ws_len = 0;
+    dime_header_t hdr;
 
-                return -1;
-            }
+    /* The DiME header is part of the compressed payload */
+    if (framing == DIME_FRAMING_WS_DEFLATE) {
+        ws_len = dime_socket_ws_header(buf, jsondata_len + bindata_len);
+        buf[0] |= 0x40; /* RSV1 */
 
-            memcpy(bindata_p, (unsigned char *)buf + 12 + hdr.jsondata_len, hdr.bindata_len);
+        return ws_len;
+    }
 
-            *jsondata = jsondata_p;
-            *bindata = bindata_p;
-            *bindata_len = hdr.bindata_len;
+    if (framing == DIME_FRAMING_WS) {
+        ws_len = dime_socket_ws_header(buf, 12 + jsondata_len + bindata_len);
+    }
 
-            dime_ringbuffer_discard(&sock->rbuf, msgsiz);
+    switch (framing) {
+    case DIME_FRAMING_SHM:
+        memcpy(hdr.magic, "DiMS", 4);
+        break;
 
-            free(buf);
-            return msgsiz;
-        }
+    case DIME_FRAMING_ZLIB:
+        memcpy(hdr.magic, "DiMZ", 4);
+        break;
 
-        free(buf);
+    default:
+        memcpy(hdr.magic, "DiME", 4);
+        break;
     }
 
-    return 0;
-}
+    hdr.jsondata_len = htonl(jsondata_len);
+    hdr.bindata_len = htonl(bindata_len);
 
-ssize_t dime_socket_sendpartial(dime_socket_t *sock) {
-    void *buf = malloc(SENDBUFLEN);
-    if (buf == NULL) {
-        return -1;
-    }
+    memcpy(buf + ws_len, &hdr, 12);
 
-    size_t nread = dime_ringbuffer_peek(&sock->wbuf, buf, SENDBUFLEN);
-    ssize_t nsent;
+    return ws_len + 12;
+}
 
-    if (sock->tls.enabled) {
-        nsent = SSL_write(sock->tls.ctx, buf, nread);
-    } else {
-        nsent = send(sock->fd, buf, nread, 0);
+/* Requests write readiness if the outbuffer is about to become non-empty */
+static void dime_socket_wantwrite(dime_socket_t *sock) {
+    if (sock->wlen > 0) {
+        return;
     }
 
-    if (nsent < 0) {
-        if (sock->tls.enabled) {
+#ifdef DIME_USE_LIBEV
+    if (sock->loop != NULL) {
+        ev_io_start(sock->loop, &sock->wwatcher);
+    }
+#endif
+
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    dime_socket_pollwrite(sock, 1);
+#endif
+
+#ifdef DIME_USE_IO_URING
+    if (sock->uring.onwrite != NULL) {
+        sock->uring.onwrite(sock->uring.data);
+    }
+#endif
+}
+
+/* Gets an outbound segment, reusing one that was already sent if possible */
+static dime_socket_seg_t *dime_socket_seg_alloc(dime_socket_t *sock) {
+    if (sock->spares_len > 0) {
+        return sock->spares[--sock->spares_len];
+    }
+
+    return malloc(sizeof(dime_socket_seg_t));
+}
+
+static void dime_socket_seg_free(dime_socket_t *sock, dime_socket_seg_t *seg) {
+    if (sock->spares_len < sizeof(sock->spares) / sizeof(sock->spares[0])) {
+        sock->spares[sock->spares_len++] = seg;
+    } else {
+        free(seg);
+    }
+}
+
+/* Ensures a scratch buffer can hold at least len bytes */
+static char *dime_socket_scratch(char **buf, size_t *cap, size_t len) {
+    if (*cap < len) {
+        size_t ncap = (*cap > 0) ? *cap : 1024;
+
+        while (ncap < len) {
+            ncap = (ncap * 3) / 2;
+        }
+
+        char *nbuf = realloc(*buf, ncap);
+        if (nbuf == NULL) {
+            return NULL;
+        }
+
+        *buf = nbuf;
+        *cap = ncap;
+    }
+
+    return *buf;
+}
+
+/* Frees a scratch buffer that grew past SCRATCHLEN, so it does not stay at its peak */
+static void dime_socket_scratch_trim(char **buf, size_t *cap) {
+    if (*cap > SCRATCHLEN) {
+        free(*buf);
+
+        *buf = NULL;
+        *cap = 0;
+    }
+}
+
+/* Accounts for bytes just written to the outbuffer */
+static int dime_socket_pushed(dime_socket_t *sock, size_t n) {
+    if (sock->wtail == NULL || sock->wtail->nbufs > 0) {
+        dime_socket_seg_t *seg = dime_socket_seg_alloc(sock);
+        if (seg == NULL) {
+            return -1;
+        }
+
+        seg->ringlen = 0;
+        seg->nbufs = 0;
+        seg->fd = -1;
+        seg->release = NULL;
+
+        if (dime_deque_pushr(&sock->wsegs, seg) < 0) {
+            dime_socket_seg_free(sock, seg);
+
+            return -1;
+        }
+
+        sock->wtail = seg;
+    }
+
+    sock->wtail->ringlen += n;
+    sock->wlen += n;
+
+    return 0;
+}
+
+static ssize_t dime_socket_push_buf(dime_socket_t *sock, const void *hdr, size_t hdr_len, const char *jsonstr, size_t jsondata_len, const void *bindata, size_t bindata_len) {
+    dime_socket_wantwrite(sock);
+
+    if (dime_ringbuffer_write(&sock->wbuf, hdr, hdr_len) < hdr_len ||
+        dime_socket_pushed(sock, hdr_len) < 0 ||
+        dime_ringbuffer_write(&sock->wbuf, jsonstr, jsondata_len) < jsondata_len ||
+        dime_socket_pushed(sock, jsondata_len) < 0 ||
+        dime_ringbuffer_write(&sock->wbuf, bindata, bindata_len) < bindata_len ||
+        dime_socket_pushed(sock, bindata_len) < 0) {
+
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        return -1;
+    }
+
+    return hdr_len + jsondata_len + bindata_len;
+}
+
+/*
+ * Frames a message originating from the server. On v2 sockets it carries
+ * the sequence number seq, which is 0 for unsolicited messages.
+ */
+static size_t dime_socket_reply(dime_socket_t *sock, unsigned char *buf, size_t jsondata_len, size_t bindata_len, uint32_t seq) {
+    size_t ws_len = 0;
+    dime_header2_t hdr;
+
+    if (!sock->v2.enabled) {
+        return dime_socket_frame(sock->ws.enabled ? DIME_FRAMING_WS : DIME_FRAMING_RAW, buf, jsondata_len, bindata_len);
+    }
+
+    if (sock->ws.enabled) {
+        ws_len = dime_socket_ws_header(buf, DIME_HEADER2_LEN + jsondata_len + bindata_len);
+    }
+
+    memcpy(hdr.magic, "DiM2", 4);
+    hdr.opcode = DIME_OP_RESPONSE;
+    hdr.flags = 0;
+    hdr.reserved = 0;
+    hdr.group = 0;
+    hdr.seq = htonl(seq);
+    hdr.jsondata_len = htonl(jsondata_len);
+    hdr.bindata_len = htonl(bindata_len);
+
+    memcpy(buf + ws_len, &hdr, DIME_HEADER2_LEN);
+
+    return ws_len + DIME_HEADER2_LEN;
+}
+
+ssize_t dime_socket_push_str(dime_socket_t *sock, const char *jsonstr, const void *bindata, size_t bindata_len) {
+    unsigned char hdr[DIME_REPLY_MAXLEN];
+    size_t jsondata_len = strlen(jsonstr);
+    size_t hdr_len = dime_socket_reply(sock, hdr, jsondata_len, bindata_len, sock->v2.seq);
+
+    return dime_socket_push_buf(sock, hdr, hdr_len, jsonstr, jsondata_len, bindata, bindata_len);
+}
+
+ssize_t dime_socket_notify_str(dime_socket_t *sock, const char *jsonstr) {
+    unsigned char hdr[DIME_REPLY_MAXLEN];
+    size_t jsondata_len = strlen(jsonstr);
+    size_t hdr_len = dime_socket_reply(sock, hdr, jsondata_len, 0, 0);
+
+    return dime_socket_push_buf(sock, hdr, hdr_len, jsonstr, jsondata_len, NULL, 0);
+}
+
+ssize_t dime_socket_push(dime_socket_t *sock, const json_t *jsondata, const void *bindata, size_t bindata_len) {
+    size_t jsondata_len = json_dumpb(jsondata, sock->wscratch.buf, sock->wscratch.cap, JSON_COMPACT);
+
+    /* Serialize again once the scratch buffer is large enough */
+    if (jsondata_len > sock->wscratch.cap) {
+        if (dime_socket_scratch(&sock->wscratch.buf, &sock->wscratch.cap, jsondata_len) == NULL) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            return -1;
+        }
+
+        jsondata_len = json_dumpb(jsondata, sock->wscratch.buf, sock->wscratch.cap, JSON_COMPACT);
+    }
+
+    if (jsondata_len == 0) {
+        strncpy(sock->err, "Can't encode JSON data", sizeof(sock->err));
+        return -1;
+    }
+
+    unsigned char hdr[DIME_REPLY_MAXLEN];
+    size_t hdr_len = dime_socket_reply(sock, hdr, jsondata_len, bindata_len, sock->v2.seq);
+
+    ssize_t ret = dime_socket_push_buf(sock, hdr, hdr_len, sock->wscratch.buf, jsondata_len, bindata, bindata_len);
+
+    dime_socket_scratch_trim(&sock->wscratch.buf, &sock->wscratch.cap);
+
+    return ret;
+}
+
+/* Queues a segment referencing external buffers */
+static ssize_t dime_socket_push_seg(dime_socket_t *sock, const void *hdr, size_t hdr_len, const char *jsonstr, size_t jsondata_len, const void *bindata, size_t bindata_len, int fd, void (*release)(void *), void *p) {
+    dime_socket_seg_t *seg = dime_socket_seg_alloc(sock);
+    if (seg == NULL) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        return -1;
+    }
+
+    seg->ringlen = 0;
+    seg->off = 0;
+
+    seg->bufs[0] = hdr;
+    seg->lens[0] = hdr_len;
+    seg->bufs[1] = jsonstr;
+    seg->lens[1] = jsondata_len;
+    seg->bufs[2] = bindata;
+    seg->lens[2] = bindata_len;
+    seg->nbufs = 3;
+    seg->fd = fd;
+
+    seg->release = release;
+    seg->p = p;
+
+    dime_socket_wantwrite(sock);
+
+    if (dime_deque_pushr(&sock->wsegs, seg) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+
+        dime_socket_seg_free(sock, seg);
+
+        return -1;
+    }
+
+    sock->wtail = seg;
+    sock->wlen += hdr_len + jsondata_len + bindata_len;
+
+    return hdr_len + jsondata_len + bindata_len;
+}
+
+ssize_t dime_socket_push_ref(dime_socket_t *sock, const void *hdr, size_t hdr_len, const char *jsonstr, size_t jsondata_len, const void *bindata, size_t bindata_len, void (*release)(void *), void *p) {
+    /* Not worth the bookkeeping for small messages */
+    if (jsondata_len + bindata_len <= PUSHCOPYLEN) {
+        ssize_t ret = dime_socket_push_buf(sock, hdr, hdr_len, jsonstr, jsondata_len, bindata, bindata_len);
+
+        if (ret >= 0) {
+            release(p);
+        }
+
+        return ret;
+    }
+
+    return dime_socket_push_seg(sock, hdr, hdr_len, jsonstr, jsondata_len, bindata, bindata_len, -1, release, p);
+}
+
+ssize_t dime_socket_push_shm(dime_socket_t *sock, const void *hdr, size_t hdr_len, const char *jsonstr, size_t jsondata_len, int fd, void (*release)(void *), void *p) {
+    return dime_socket_push_seg(sock, hdr, hdr_len, jsonstr, jsondata_len, NULL, 0, fd, release, p);
+}
+
+/*
+ * Copies n bytes from src to dst, XORing them with the WebSocket masking key
+ * starting maskoff bytes into it. Eight bytes go at a time, with the key
+ * repeated twice over, which compilers widen further into vector loops.
+ */
+static void dime_socket_ws_xor(unsigned char *dst, const unsigned char *src, size_t n, const uint8_t mask[4], size_t maskoff) {
+    unsigned char key[8];
+    uint64_t word;
+    size_t i;
+
+    for (i = 0; i < 8; i++) {
+        key[i] = mask[(maskoff + i) & 3];
+    }
+
+    memcpy(&word, key, 8);
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint64_t x;
+
+        memcpy(&x, src + i, 8);
+        x ^= word;
+        memcpy(dst + i, &x, 8);
+    }
+
+    for (; i < n; i++) {
+        dst[i] = src[i] ^ key[i & 7];
+    }
+}
+
+/* Copies received DiME data to dst, unmasking it if masked is nonzero */
+static void dime_socket_copyin(dime_socket_t *sock, void *dst, const unsigned char *src, size_t n, int masked) {
+    if (masked) {
+        dime_socket_ws_xor(dst, src, n, sock->ws.mask, sock->ws.maskoff);
+        sock->ws.maskoff = (sock->ws.maskoff + n) & 3;
+    } else {
+        memcpy(dst, src, n);
+    }
+}
+
+/*
+ * Appends received DiME data, filling in a pending message's binary data
+ * first. Masked WebSocket payload is unmasked on the way, straight into
+ * wherever it ends up.
+ */
+static int dime_socket_deliver(dime_socket_t *sock, const unsigned char *buf, size_t n, int masked) {
+    if (sock->rmsg.pending) {
+        size_t k = sock->rmsg.bindata_len - sock->rmsg.off;
+
+        if (k > n) {
+            k = n;
+        }
+
+        dime_socket_copyin(sock, sock->rmsg.bindata + sock->rmsg.off, buf, k, masked);
+        sock->rmsg.off += k;
+
+        buf += k;
+        n -= k;
+    }
+
+    while (n > 0) {
+        void *bufs[8];
+        size_t lens[8];
+
+        ssize_t nbufs = dime_ringbuffer_reserve(&sock->rbuf, n, bufs, lens, 8);
+        if (nbufs < 0) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            return -1;
+        }
+
+        size_t m = 0;
+
+        for (ssize_t i = 0; i < nbufs && m < n; i++) {
+            size_t k = (lens[i] < n - m) ? lens[i] : n - m;
+
+            dime_socket_copyin(sock, bufs[i], buf + m, k, masked);
+            m += k;
+        }
+
+        dime_ringbuffer_commit(&sock->rbuf, m);
+
+        buf += m;
+        n -= m;
+    }
+
+    return 0;
+}
+
+/* Inflates a piece of a compressed WebSocket message and delivers it */
+static int dime_socket_ws_inflate(dime_socket_t *sock, const unsigned char *buf, size_t n) {
+    unsigned char out[16384];
+    z_stream *z = &sock->zlib.ctx;
+
+    z->next_in = (unsigned char *)buf;
+    z->avail_in = n;
+
+    do {
+        z->next_out = out;
+        z->avail_out = sizeof(out);
+
+        int err = inflate(z, Z_SYNC_FLUSH);
+        if (err != Z_OK && err != Z_BUF_ERROR && err != Z_STREAM_END) {
+            strncpy(sock->err, "Invalid compressed WebSocket message", sizeof(sock->err));
+            return -1;
+        }
+
+        if (dime_socket_deliver(sock, out, sizeof(out) - z->avail_out, 0) < 0) {
+            return -1;
+        }
+
+        /*
+         * A sender may end the message with a final deflate block. Without
+         * context takeover nothing carries over, so the rest of the input
+         * (usually just the restored trailer) starts afresh
+         */
+        if (err == Z_STREAM_END) {
+            inflateReset(z);
+        }
+    } while (z->avail_in > 0 || z->avail_out == 0);
+
+    return 0;
+}
+
+/*
+ * Consumes a whole WebSocket control frame. This runs without the locks
+ * that guard the outbuffer, so a ping is only recorded, for
+ * dime_socket_ws_pong to answer. Closing the connection answers a close
+ * frame well enough.
+ */
+static int dime_socket_ws_control(dime_socket_t *sock, int opcode, size_t hdr_len, size_t frame_len) {
+    uint8_t frame[14 + 125];
+
+    switch (opcode) {
+    case 0x8:
+        strncpy(sock->err, "WebSocket connection closed by peer", sizeof(sock->err));
+        return -1;
+
+    case 0x9:
+        /* Control frames are at most 125 bytes, checked by the caller */
+        dime_ringbuffer_peek(&sock->ws.rbuf, frame, hdr_len + frame_len);
+        dime_socket_ws_xor(sock->ws.pong, frame + hdr_len, frame_len, frame + hdr_len - 4, 0);
+        sock->ws.pong_len = frame_len;
+
+        dime_ringbuffer_discard(&sock->ws.rbuf, hdr_len + frame_len);
+        return 0;
+
+    case 0xA:
+        /* Pongs only show the connection is alive */
+        dime_ringbuffer_discard(&sock->ws.rbuf, hdr_len + frame_len);
+        return 0;
+
+    default:
+        strncpy(sock->err, "Invalid WebSocket frame", sizeof(sock->err));
+        return -1;
+    }
+}
+
+/* Unmasks as much WebSocket payload as has been received */
+static int dime_socket_ws_unmask(dime_socket_t *sock) {
+    while (1) {
+        /* RFC 7692 section 7.2.2: restore the trailer left off by the sender */
+        if (sock->ws.remaining == 0 && sock->ws.inflating && sock->ws.fin) {
+            if (dime_socket_ws_inflate(sock, (const unsigned char *)"\x00\x00\xFF\xFF", 4) < 0) {
+                return -1;
+            }
+
+            inflateReset(&sock->zlib.ctx);
+            sock->ws.inflating = 0;
+        }
+
+        if (sock->ws.remaining == 0) {
+            uint8_t ws_hdr[14];
+            size_t hdr_len, frame_len;
+
+            size_t nread = dime_ringbuffer_peek(&sock->ws.rbuf, ws_hdr, 14);
+
+            if (nread < 2) {
+                return 0;
+            } else if ((ws_hdr[1] & ~0x80) < 126 && nread >= 6) {
+                hdr_len = 6;
+                frame_len = ws_hdr[1] & ~0x80;
+            } else if ((ws_hdr[1] & ~0x80) == 126 && nread >= 8) {
+                hdr_len = 8;
+                frame_len = ((size_t)ws_hdr[2] << 8) | ws_hdr[3];
+            } else if ((ws_hdr[1] & ~0x80) == 127 && nread == 14) {
+                hdr_len = 14;
+                frame_len = ((size_t)ws_hdr[2] << 56) |
+                            ((size_t)ws_hdr[3] << 48) |
+                            ((size_t)ws_hdr[4] << 40) |
+                            ((size_t)ws_hdr[5] << 32) |
+                            ((size_t)ws_hdr[6] << 24) |
+                            ((size_t)ws_hdr[7] << 16) |
+                            ((size_t)ws_hdr[8] << 8) |
+                            ws_hdr[9];
+            } else {
+                return 0;
+            }
+
+            if ((ws_hdr[1] & 0x80) == 0) {
+                strncpy(sock->err, "Unmasked WebSocket frame", sizeof(sock->err));
+                return -1;
+            }
+
+            int fin = (ws_hdr[0] & 0x80) != 0;
+            int rsv1 = (ws_hdr[0] & 0x40) != 0;
+            int opcode = ws_hdr[0] & 0x0F;
+
+            /* Control frames may come between the fragments of a message */
+            if (opcode >= 8) {
+                if (!fin || rsv1 || frame_len > 125) {
+                    strncpy(sock->err, "Invalid WebSocket control frame", sizeof(sock->err));
+                    return -1;
+                }
+
+                if (dime_ringbuffer_len(&sock->ws.rbuf) < hdr_len + frame_len) {
+                    return 0;
+                }
+
+                if (dime_socket_ws_control(sock, opcode, hdr_len, frame_len) < 0) {
+                    return -1;
+                }
+
+                continue;
+            }
+
+            /*
+             * Continuations carry on a fragmented message, and only the first
+             * frame of a message says whether it is compressed
+             */
+            if (opcode > 2 || (opcode == 0) == sock->ws.fin || (rsv1 && (!sock->ws.deflate || opcode == 0))) {
+                strncpy(sock->err, "Invalid WebSocket frame", sizeof(sock->err));
+                return -1;
+            }
+
+            if (opcode != 0) {
+                sock->ws.inflating = rsv1;
+            }
+
+            sock->ws.fin = fin;
+
+            memcpy(sock->ws.mask, ws_hdr + hdr_len - 4, 4);
+            sock->ws.maskoff = 0;
+            sock->ws.remaining = frame_len;
+
+            dime_ringbuffer_discard(&sock->ws.rbuf, hdr_len);
+
+            continue;
+        }
+
+        const void *bufs[8];
+        size_t lens[8];
+
+        size_t nbufs = dime_ringbuffer_regions(&sock->ws.rbuf, 0, sock->ws.remaining, bufs, lens, 8);
+        if (nbufs == 0) {
+            return 0;
+        }
+
+        size_t n = 0;
+
+        for (size_t i = 0; i < nbufs; i++) {
+            const unsigned char *frame = bufs[i];
+            int err;
+
+            if (sock->ws.inflating) {
+                /* The WebSocket inbuffer is ours, so unmask in place */
+                dime_socket_copyin(sock, (unsigned char *)frame, frame, lens[i], 1);
+                err = dime_socket_ws_inflate(sock, frame, lens[i]);
+            } else {
+                err = dime_socket_deliver(sock, frame, lens[i], 1);
+            }
+
+            if (err < 0) {
+                return -1;
+            }
+
+            n += lens[i];
+        }
+
+        dime_ringbuffer_discard(&sock->ws.rbuf, n);
+        sock->ws.remaining -= n;
+    }
+}
+
+/* Copies bytes out of the inbuffer, starting off bytes in */
+static void dime_socket_copyout(const dime_socket_t *sock, size_t off, void *buf, size_t siz) {
+    const void *bufs[8];
+    size_t lens[8];
+    size_t nbufs;
+
+    while ((nbufs = dime_ringbuffer_regions(&sock->rbuf, off, siz, bufs, lens, 8)) > 0) {
+        for (size_t i = 0; i < nbufs; i++) {
+            memcpy(buf, bufs[i], lens[i]);
+            buf = (unsigned char *)buf + lens[i];
+
+            off += lens[i];
+            siz -= lens[i];
+        }
+    }
+}
+
+#ifndef _WIN32
+/* Maps the next received file descriptor as the binary data of a message */
+static int dime_socket_shm_map(dime_socket_t *sock, size_t len) {
+    if (sock->shm.fds_len == 0) {
+        strncpy(sock->err, "Missing file descriptor for shared memory", sizeof(sock->err));
+        return -1;
+    }
+
+    int fd = sock->shm.fds[0];
+
+    sock->shm.fds_len--;
+    memmove(sock->shm.fds, sock->shm.fds + 1, sock->shm.fds_len * sizeof(int));
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        close(fd);
+
+        return -1;
+    }
+
+    /* Reading past the end of a segment that shrank would raise SIGBUS */
+    if (st.st_size < 0 || (size_t)st.st_size < len) {
+        strncpy(sock->err, "Shared memory segment is too small", sizeof(sock->err));
+        close(fd);
+
+        return -1;
+    }
+
+#ifdef F_SEAL_SHRINK
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+        strncpy(sock->err, "Shared memory segment is not sealed", sizeof(sock->err));
+        close(fd);
+
+        return -1;
+    }
+#endif
+
+    void *addr = NULL;
+
+    if (len > 0) {
+        addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (addr == MAP_FAILED) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            close(fd);
+
+            return -1;
+        }
+    }
+
+    sock->shm.fd = fd;
+    sock->shm.addr = addr;
+    sock->shm.len = len;
+
+    return 0;
+}
+
+/* Queues file descriptors passed along with received data */
+static int dime_socket_shm_collect(dime_socket_t *sock, struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        if (sock->shm.fds_len + n > sock->shm.fds_cap) {
+            size_t ncap = (sock->shm.fds_cap > 0) ? sock->shm.fds_cap : 8;
+
+            while (ncap < sock->shm.fds_len + n) {
+                ncap = (ncap * 3) / 2;
+            }
+
+            int *nfds = realloc(sock->shm.fds, ncap * sizeof(int));
+            if (nfds == NULL) {
+                strncpy(sock->err, strerror(errno), sizeof(sock->err));
+
+                /* Closed so they are not leaked, which desynchronizes the stream anyway */
+                for (size_t i = 0; i < n; i++) {
+                    int fd;
+
+                    memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    close(fd);
+                }
+
+                return -1;
+            }
+
+            sock->shm.fds = nfds;
+            sock->shm.fds_cap = ncap;
+        }
+
+        memcpy(sock->shm.fds + sock->shm.fds_len, CMSG_DATA(cmsg), n * sizeof(int));
+        sock->shm.fds_len += n;
+    }
+
+    if (msg->msg_flags & MSG_CTRUNC) {
+        strncpy(sock->err, "Too many file descriptors received", sizeof(sock->err));
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+int dime_socket_shm(dime_socket_t *sock, void **addr) {
+    int fd = sock->shm.fd;
+
+    if (fd >= 0) {
+        *addr = sock->shm.addr;
+        sock->shm.fd = -1;
+    }
+
+    return fd;
+}
+
+/* Replaces a DiMZ message's binary data with its uncompressed form */
+static int dime_socket_uncompress(dime_socket_t *sock, void **bindata, size_t *bindata_len) {
+    unsigned char *src = *bindata;
+    uint32_t orig_len;
+    int err = Z_DATA_ERROR;
+
+    if (*bindata_len >= 4) {
+        memcpy(&orig_len, src, 4);
+        orig_len = ntohl(orig_len);
+
+        unsigned char *dst = malloc(orig_len > 0 ? orig_len : 1);
+        if (dst == NULL) {
+            err = Z_MEM_ERROR;
+        } else {
+            uLongf len = orig_len;
+
+            err = uncompress(dst, &len, src + 4, *bindata_len - 4);
+
+            if (err == Z_OK && len == orig_len) {
+                free(src);
+
+                *bindata = dst;
+                *bindata_len = orig_len;
+
+                return 0;
+            }
+
+            free(dst);
+        }
+    }
+
+    free(src);
+    *bindata = NULL;
+
+    strncpy(sock->err, (err == Z_MEM_ERROR) ? strerror(ENOMEM) : "Invalid compressed binary data", sizeof(sock->err));
+
+    return -1;
+}
+
+ssize_t dime_socket_pop(dime_socket_t *sock, dime_route_t *route, json_t **jsondata, void **bindata, size_t *bindata_len) {
+    dime_socket_shm_release(sock);
+
+    /* The last popped message is done with, including its JSON */
+    dime_ringbuffer_discard(&sock->rbuf, sock->rdone);
+    sock->rdone = 0;
+
+    if (!sock->rmsg.pending) {
+        dime_socket_scratch_trim(&sock->rscratch.buf, &sock->rscratch.cap);
+    }
+
+    if (sock->ws.enabled) {
+        if (dime_socket_ws_unmask(sock) < 0) {
+            return -1;
+        }
+    }
+
+    /* Finish off a large message still being received */
+    if (sock->rmsg.pending) {
+        if (sock->rmsg.off < sock->rmsg.bindata_len) {
+            return 0;
+        }
+
+        /* A routed message's JSON was set aside in the scratch buffer */
+        if (sock->rmsg.jsondata == NULL) {
+            dime_route_scan(route, sock->rscratch.buf, sock->rmsg.jsondata_len);
+        }
+
+        route->opcode = sock->rmsg.opcode;
+        route->group = sock->rmsg.group;
+        route->seq = sock->rmsg.seq;
+        sock->v2.noack = sock->rmsg.noack;
+
+        *jsondata = sock->rmsg.jsondata;
+        *bindata = sock->rmsg.bindata;
+        *bindata_len = sock->rmsg.bindata_len;
+
+        sock->rmsg.pending = 0;
+        sock->rmsg.jsondata = NULL;
+        sock->rmsg.bindata = NULL;
+        sock->v2.seq = route->seq;
+
+        if (sock->rmsg.compressed && dime_socket_uncompress(sock, bindata, bindata_len) < 0) {
+            json_decref(*jsondata);
+
+            return -1;
+        }
+
+        return sock->rmsg.msgsiz;
+    }
+
+    unsigned char raw[DIME_HEADER2_LEN];
+    size_t hdr_len, jsondata_len, bindata_len_p;
+    int shm, compressed, noack, v2;
+
+    size_t nread = dime_ringbuffer_peek(&sock->rbuf, raw, DIME_HEADER2_LEN);
+
+    if (nread < 12) {
+        return 0;
+    }
+
+    v2 = (memcmp(raw, "DiM2", 4) == 0);
+
+    if (v2) {
+        dime_header2_t hdr;
+
+        if (!sock->v2.enabled) {
+            strncpy(sock->err, "DiME v2 header without negotiation", sizeof(sock->err));
+            return -1;
+        }
+
+        if (nread < DIME_HEADER2_LEN) {
+            return 0;
+        }
+
+        memcpy(&hdr, raw, DIME_HEADER2_LEN);
+
+        if ((hdr.flags & ~(DIME_FLAG_SHM | DIME_FLAG_ZLIB | DIME_FLAG_NOACK)) != 0 ||
+            ((hdr.flags & DIME_FLAG_SHM) && !sock->shm.enabled) ||
+            ((hdr.flags & DIME_FLAG_ZLIB) && (!sock->zlib.enabled || sock->ws.enabled)) ||
+            (hdr.flags & DIME_FLAG_SHM && hdr.flags & DIME_FLAG_ZLIB)) {
+            strncpy(sock->err, "Invalid DiME v2 flags", sizeof(sock->err));
+            return -1;
+        }
+
+        shm = (hdr.flags & DIME_FLAG_SHM) != 0;
+        compressed = (hdr.flags & DIME_FLAG_ZLIB) != 0;
+        noack = (hdr.flags & DIME_FLAG_NOACK) != 0;
+        hdr_len = DIME_HEADER2_LEN;
+        jsondata_len = ntohl(hdr.jsondata_len);
+        bindata_len_p = ntohl(hdr.bindata_len);
+
+        /* Opcodes the server does not know are reported by the dispatcher */
+        route->opcode = (hdr.opcode > DIME_OP_RESPONSE && hdr.opcode < DIME_OP_COUNT) ? hdr.opcode : DIME_OP_UNKNOWN;
+        route->group = ntohl(hdr.group);
+        route->seq = ntohl(hdr.seq);
+    } else {
+        dime_header_t hdr;
+
+        memcpy(&hdr, raw, 12);
+
+        /* Binary data passed in shared memory is not part of the stream */
+        shm = (sock->shm.enabled && memcmp(&hdr, "DiMS", 4) == 0);
+        compressed = (sock->zlib.enabled && !sock->ws.enabled && memcmp(&hdr, "DiMZ", 4) == 0);
+
+        if (!shm && !compressed && memcmp(&hdr, "DiME", 4) != 0) {
+            strncpy(sock->err, "Invalid DiME header", sizeof(sock->err));
+            return -1;
+        }
+
+        hdr_len = 12;
+        jsondata_len = ntohl(hdr.jsondata_len);
+        bindata_len_p = ntohl(hdr.bindata_len);
+
+        route->opcode = DIME_OP_UNKNOWN;
+        route->group = 0;
+        route->seq = 0;
+        noack = 0;
+    }
+
+    size_t msgsiz = hdr_len + jsondata_len + (shm ? 0 : bindata_len_p);
+    size_t avail = dime_ringbuffer_len(&sock->rbuf);
+
+    /*
+     * Small messages are parsed once they have been received completely;
+     * large ones as soon as their JSON is in, so the rest of their binary
+     * data can be received directly into its final allocation
+     */
+    if (avail < hdr_len + jsondata_len || (bindata_len_p < RECVDIRECTLEN && avail < msgsiz)) {
+        return 0;
+    }
+
+    const void *bufs[1];
+    size_t lens[1];
+    json_error_t jsonerr;
+    json_t *jsondata_p;
+
+    const char *jsonstr;
+    int large = (avail < msgsiz);
+
+    /*
+     * Read the JSON in place unless it spans chunks of the inbuffer. That
+     * of a large message must survive until the rest arrives, in case it
+     * is routed.
+     */
+    if (dime_ringbuffer_regions(&sock->rbuf, hdr_len, jsondata_len, bufs, lens, 1) == 1 && lens[0] == jsondata_len && !large) {
+        jsonstr = bufs[0];
+    } else {
+        char *buf = dime_socket_scratch(&sock->rscratch.buf, &sock->rscratch.cap, jsondata_len);
+        if (buf == NULL) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            return -1;
+        }
+
+        dime_socket_copyout(sock, hdr_len, buf, jsondata_len);
+
+        jsonstr = buf;
+    }
+
+    int scanned = (dime_route_scan(route, jsonstr, jsondata_len) > 0);
+
+    /* DiME v1 messages name their command in the JSON */
+    if (!v2 && scanned && route->command != NULL) {
+        route->opcode = dime_route_opcode(route->command);
+    }
+
+    /* Messages that are only forwarded are left unparsed */
+    if (scanned && dime_route_routable(route)) {
+        jsondata_p = NULL;
+    } else {
+        jsondata_p = json_loadb(jsonstr, jsondata_len, 0, &jsonerr);
+
+        if (jsondata_p == NULL) {
+            strncpy(sock->err, jsonerr.text, sizeof(sock->err));
+            return -1;
+        }
+
+        const char *cmd;
+
+        if (!v2 && !scanned && json_unpack(jsondata_p, "{ss}", "command", &cmd) == 0) {
+            route->opcode = dime_route_opcode(cmd);
+        }
+    }
+
+#ifndef _WIN32
+    if (shm) {
+        if (dime_socket_shm_map(sock, bindata_len_p) < 0) {
+            json_decref(jsondata_p);
+
+            return -1;
+        }
+
+        sock->rdone = msgsiz;
+
+        *jsondata = jsondata_p;
+        *bindata = NULL;
+        *bindata_len = bindata_len_p;
+        sock->v2.seq = route->seq;
+        sock->v2.noack = noack;
+
+        return msgsiz;
+    }
+#endif
+
+    unsigned char *bindata_p = malloc(bindata_len_p);
+    if (bindata_p == NULL && bindata_len_p > 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+
+        json_decref(jsondata_p);
+
+        return -1;
+    }
+
+    size_t k = avail - hdr_len - jsondata_len;
+
+    if (k > bindata_len_p) {
+        k = bindata_len_p;
+    }
+
+    dime_socket_copyout(sock, hdr_len + jsondata_len, bindata_p, k);
+
+    if (k < bindata_len_p) {
+        dime_ringbuffer_discard(&sock->rbuf, hdr_len + jsondata_len + k);
+
+        sock->rmsg.pending = 1;
+        sock->rmsg.jsondata = jsondata_p;
+        sock->rmsg.jsondata_len = jsondata_len;
+        sock->rmsg.bindata = bindata_p;
+        sock->rmsg.bindata_len = bindata_len_p;
+        sock->rmsg.off = k;
+        sock->rmsg.msgsiz = msgsiz;
+        sock->rmsg.compressed = compressed;
+        sock->rmsg.opcode = route->opcode;
+        sock->rmsg.group = route->group;
+        sock->rmsg.seq = route->seq;
+        sock->rmsg.noack = noack;
+
+        return 0;
+    }
+
+    sock->rdone = msgsiz;
+
+    *jsondata = jsondata_p;
+    *bindata = bindata_p;
+    *bindata_len = bindata_len_p;
+    sock->v2.seq = route->seq;
+    sock->v2.noack = noack;
+
+    if (compressed && dime_socket_uncompress(sock, bindata, bindata_len) < 0) {
+        json_decref(jsondata_p);
+
+        return -1;
+    }
+
+    return msgsiz;
+}
+
+/* Removes sent bytes from the front of the outbound segments */
+static void dime_socket_consume(dime_socket_t *sock, size_t n) {
+    sock->wlen -= n;
+
+    dime_socket_count(&sock->stats.bytes_out, n);
+
+#ifdef DIME_USE_TRACE
+    if (sock->marks.len > 0) {
+        uint64_t now = dime_trace_now();
+
+        while (sock->marks.len > 0 && sock->marks.arr[sock->marks.begin].end <= sock->stats.bytes_out) {
+            dime_socket_mark_t *mark = &sock->marks.arr[sock->marks.begin];
+
+            dime_trace_drain(mark->trace, now - mark->pushed);
+
+            sock->marks.begin = (sock->marks.begin + 1) % sock->marks.cap;
+            sock->marks.len--;
+        }
+    }
+#endif
+
+    while (n > 0) {
+        dime_socket_seg_t *seg = dime_deque_peekl(&sock->wsegs);
+        int done;
+
+        assert(seg != NULL);
+
+        if (seg->nbufs > 0) {
+            size_t total = 0;
+
+            for (size_t i = 0; i < seg->nbufs; i++) {
+                total += seg->lens[i];
+            }
+
+            size_t k = (n < total - seg->off) ? n : total - seg->off;
+
+            seg->off += k;
+            n -= k;
+
+            done = (seg->off == total);
+        } else {
+            size_t k = (n < seg->ringlen) ? n : seg->ringlen;
+
+            dime_ringbuffer_discard(&sock->wbuf, k);
+            seg->ringlen -= k;
+            n -= k;
+
+            done = (seg->ringlen == 0);
+        }
+
+        if (done) {
+            dime_deque_popl(&sock->wsegs);
+
+            if (seg == sock->wtail) {
+                sock->wtail = NULL;
+            }
+
+            if (seg->nbufs > 0 && seg->release != NULL) {
+                seg->release(seg->p);
+            }
+
+            dime_socket_seg_free(sock, seg);
+        }
+    }
+}
+
+/*
+ * Gathers buffers from as many outbound segments as will fit. If fd is
+ * not NULL, it is set to a file descriptor to pass along with the
+ * buffers, or -1. Such a segment is only ever gathered first, so that
+ * each file descriptor accompanies the first byte of its own header.
+ */
+static size_t dime_socket_gather(const dime_socket_t *sock, const void **bufs, size_t *lens, size_t cap, int *fd) {
+    size_t nbufs = 0, ringoff = 0, total = 0;
+
+    if (fd != NULL) {
+        *fd = -1;
+    }
+
+    dime_deque_iter_t it;
+    dime_deque_iter_init(&it, (dime_deque_t *)&sock->wsegs);
+
+    while (nbufs + 3 <= cap && total < SENDBUFLEN && dime_deque_iter_next(&it)) {
+        dime_socket_seg_t *seg = it.val;
+
+        if (fd != NULL && seg->fd >= 0 && seg->off == 0) {
+            if (nbufs > 0) {
+                break;
+            }
+
+            *fd = seg->fd;
+        }
+
+        if (seg->nbufs > 0) {
+            size_t skip = seg->off;
+
+            for (size_t i = 0; i < seg->nbufs; i++) {
+                if (skip >= seg->lens[i]) {
+                    skip -= seg->lens[i];
+                    continue;
+                }
+
+                bufs[nbufs] = (const unsigned char *)seg->bufs[i] + skip;
+                lens[nbufs] = seg->lens[i] - skip;
+                total += lens[nbufs];
+                nbufs++;
+
+                skip = 0;
+            }
+        } else {
+            size_t n = dime_ringbuffer_regions(&sock->wbuf, ringoff, seg->ringlen, bufs + nbufs, lens + nbufs, cap - nbufs);
+            size_t k = 0;
+
+            for (size_t i = 0; i < n; i++) {
+                k += lens[nbufs + i];
+            }
+
+            total += k;
+            nbufs += n;
+            ringoff += seg->ringlen;
+
+            /* The rest of the segment is gathered by the next call */
+            if (k < seg->ringlen) {
+                break;
+            }
+        }
+    }
+
+    return nbufs;
+}
+
+ssize_t dime_socket_sendpartial(dime_socket_t *sock) {
+    const void *bufs[SENDIOVLEN];
+    size_t lens[SENDIOVLEN];
+
+    int fd;
+    size_t nbufs = dime_socket_gather(sock, bufs, lens, SENDIOVLEN, &fd);
+
+    if (nbufs == 0) {
+        return 0;
+    }
+
+    ssize_t nsent;
+
+    /* The kernel frames plain writes as TLS records once it has the keys */
+    if (sock->tls.enabled && !sock->tls.ktls_send) {
+        nsent = 0;
+
+        for (size_t i = 0; i < nbufs; i++) {
+            int n = SSL_write(sock->tls.ctx, bufs[i], lens[i] > INT_MAX ? INT_MAX : lens[i]);
+
+            if (n <= 0) {
+                if (nsent == 0) {
+                    int sslerr = SSL_get_error(sock->tls.ctx, n);
+
+                    if (sslerr == SSL_ERROR_WANT_READ || sslerr == SSL_ERROR_WANT_WRITE) {
+                        errno = EAGAIN;
+                    }
+
+                    nsent = -1;
+                }
+
+                break;
+            }
+
+            nsent += n;
+
+            if ((size_t)n < lens[i]) {
+                break;
+            }
+        }
+    } else {
+#ifdef _WIN32
+        nsent = send(sock->fd, bufs[0], lens[0], 0);
+#else
+        struct iovec iov[SENDIOVLEN];
+        struct msghdr msg;
+
+        for (size_t i = 0; i < nbufs; i++) {
+            iov[i].iov_base = (void *)bufs[i];
+            iov[i].iov_len = lens[i];
+        }
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nbufs;
+
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+
+        if (fd >= 0) {
+            memset(&ctl, 0, sizeof(ctl));
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = sizeof(ctl.buf);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        nsent = sendmsg(sock->fd, &msg, 0);
+#endif
+    }
+
+    if (nsent < 0) {
+        if (sock->tls.enabled && !sock->tls.ktls_send) {
             ERR_error_string_n(ERR_get_error(), sock->err, sizeof(sock->err));
         } else {
             strncpy(sock->err, strerror(errno), sizeof(sock->err));
         }
 
-        free(buf);
-
         return -1;
     }
 
-    dime_ringbuffer_discard(&sock->wbuf, nsent);
-    free(buf);
+    dime_socket_consume(sock, nsent);
 
     return nsent;
 }
 
 ssize_t dime_socket_recvpartial(dime_socket_t *sock) {
-    void *buf = malloc(RECVBUFLEN);
-    if (buf == NULL) {
-        strncpy(sock->err, strerror(errno), sizeof(sock->err));
-        return -1;
+    void *bufs[RECVIOVLEN];
+    size_t lens[RECVIOVLEN];
+    ssize_t nbufs;
+    dime_ringbuffer_t *rbuf = NULL;
+
+    if (sock->ws.enabled) {
+        rbuf = &sock->ws.rbuf;
+    } else if (!sock->rmsg.pending) {
+        rbuf = &sock->rbuf;
+    }
+
+    if (rbuf != NULL) {
+        nbufs = dime_ringbuffer_reserve(rbuf, RECVBUFLEN, bufs, lens, RECVIOVLEN);
+        if (nbufs < 0) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            return -1;
+        }
+    } else {
+        /* Receive the rest of a large message directly into place */
+        bufs[0] = sock->rmsg.bindata + sock->rmsg.off;
+        lens[0] = sock->rmsg.bindata_len - sock->rmsg.off;
+        nbufs = 1;
     }
 
     ssize_t nrecvd;
 
     if (sock->tls.enabled) {
-        nrecvd = SSL_read(sock->tls.ctx, buf, RECVBUFLEN);
+        nrecvd = SSL_read(sock->tls.ctx, bufs[0], lens[0] > INT_MAX ? INT_MAX : lens[0]);
+
+        if (nrecvd <= 0) {
+            int sslerr = SSL_get_error(sock->tls.ctx, nrecvd);
+
+            if (sslerr == SSL_ERROR_ZERO_RETURN) {
+                nrecvd = 0;
+            } else if (sslerr == SSL_ERROR_WANT_READ || sslerr == SSL_ERROR_WANT_WRITE) {
+                errno = EAGAIN;
+                nrecvd = -1;
+            } else {
+                nrecvd = -1;
+            }
+        }
     } else {
-        nrecvd = recv(sock->fd, buf, RECVBUFLEN, 0);
+#ifdef _WIN32
+        nrecvd = recv(sock->fd, bufs[0], lens[0], 0);
+#else
+        struct iovec iov[RECVIOVLEN];
+        struct msghdr msg;
+
+        for (ssize_t i = 0; i < nbufs; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = lens[i];
+        }
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nbufs;
+
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(RECVFDLEN * sizeof(int))];
+        } ctl;
+        int flags = 0;
+
+        if (sock->shm.enabled) {
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = sizeof(ctl.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+            flags = MSG_CMSG_CLOEXEC;
+#endif
+        }
+
+        nrecvd = recvmsg(sock->fd, &msg, flags);
+
+        if (nrecvd >= 0 && sock->shm.enabled && dime_socket_shm_collect(sock, &msg) < 0) {
+            return -1;
+        }
+#endif
     }
 
     if (nrecvd < 0) {
@@ -613,32 +2116,179 @@ ssize_t dime_socket_recvpartial(dime_socket_t *sock) {
             strncpy(sock->err, strerror(errno), sizeof(sock->err));
         }
 
-        free(buf);
+        /* Give back the reservation of an idle connection, saving errno */
+        if (rbuf != NULL) {
+            int saved = errno;
+
+            dime_ringbuffer_commit(rbuf, 0);
+            errno = saved;
+        }
+
+        return -1;
+    }
+
+    if (rbuf != NULL) {
+        dime_ringbuffer_commit(rbuf, nrecvd);
+    } else {
+        sock->rmsg.off += nrecvd;
+    }
+
+    dime_socket_count(&sock->stats.bytes_in, nrecvd);
+
+    return nrecvd;
+}
+
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+int dime_socket_watch(dime_socket_t *sock, int pollfd, void *data) {
+#ifdef DIME_USE_EPOLL
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = data;
+
+    if (sock->wlen > 0) {
+        ev.events |= EPOLLOUT;
+    }
+
+    if (epoll_ctl(pollfd, EPOLL_CTL_ADD, sock->fd, &ev) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        return -1;
+    }
+#else
+    struct kevent ev[2];
+
+    EV_SET(&ev[0], sock->fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, data);
+    EV_SET(&ev[1], sock->fd, EVFILT_WRITE, EV_ADD | EV_CLEAR | (sock->wlen > 0 ? EV_ENABLE : EV_DISABLE), 0, 0, data);
+
+    if (kevent(pollfd, ev, 2, NULL, 0, NULL) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        return -1;
+    }
+#endif
+
+    sock->pollfd = pollfd;
+    sock->polldata = data;
+
+    return 0;
+}
+
+int dime_socket_pollwrite(dime_socket_t *sock, int enable) {
+    if (sock->pollfd < 0) {
+        return 0;
+    }
+
+#ifdef DIME_USE_EPOLL
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = sock->polldata;
+
+    if (epoll_ctl(sock->pollfd, EPOLL_CTL_MOD, sock->fd, &ev) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        return -1;
+    }
+#else
+    struct kevent ev;
+
+    EV_SET(&ev, sock->fd, EVFILT_WRITE, EV_CLEAR | (enable ? EV_ENABLE : EV_DISABLE), 0, 0, sock->polldata);
 
+    if (kevent(sock->pollfd, &ev, 1, NULL, 0, NULL) < 0) {
+        strncpy(sock->err, strerror(errno), sizeof(sock->err));
         return -1;
     }
+#endif
+
+    return 0;
+}
+#endif
+
+#ifdef DIME_USE_IO_URING
+size_t dime_socket_sendprep(const dime_socket_t *sock, struct iovec *iov, size_t iovlen) {
+    const void *bufs[SENDIOVLEN];
+    size_t lens[SENDIOVLEN];
+
+    size_t nbufs = dime_socket_gather(sock, bufs, lens, (iovlen < SENDIOVLEN) ? iovlen : SENDIOVLEN, NULL);
+
+    for (size_t i = 0; i < nbufs; i++) {
+        iov[i].iov_base = (void *)bufs[i];
+        iov[i].iov_len = lens[i];
+    }
+
+    return nbufs;
+}
+
+void dime_socket_sent(dime_socket_t *sock, size_t n) {
+    dime_socket_consume(sock, n);
+}
 
+int dime_socket_received(dime_socket_t *sock, const void *buf, size_t n) {
     dime_ringbuffer_t *rbuf;
 
+    dime_socket_count(&sock->stats.bytes_in, n);
+
     if (sock->ws.enabled) {
         rbuf = &sock->ws.rbuf;
-    } else if (sock->zlib.enabled) {
-        rbuf = &sock->zlib.rbuf;
     } else {
-        rbuf = &sock->rbuf;
+        return dime_socket_deliver(sock, buf, n, 0);
     }
 
-    if (dime_ringbuffer_write(rbuf, buf, nrecvd) < 0) {
+    if (dime_ringbuffer_write(rbuf, buf, n) < 0) {
         strncpy(sock->err, strerror(errno), sizeof(sock->err));
+        return -1;
+    }
+
+    return 0;
+}
+#endif
 
-        free(buf);
+#ifdef DIME_USE_TRACE
+int dime_socket_trace(dime_socket_t *sock, dime_trace_t *trace, uint64_t now) {
+    if (sock->marks.len >= sock->marks.cap) {
+        size_t ncap = (sock->marks.cap > 0) ? (sock->marks.cap * 3) / 2 : MARKLEN;
 
-        return -1;
+        dime_socket_mark_t *narr = realloc(sock->marks.arr, sizeof(dime_socket_mark_t) * ncap);
+        if (narr == NULL) {
+            strncpy(sock->err, strerror(errno), sizeof(sock->err));
+            return -1;
+        }
+
+        /* As in dime_deque, move the marks before the end of the old array to the end of the new one */
+        if (sock->marks.begin > 0) {
+            size_t nbegin = sock->marks.begin + (ncap - sock->marks.cap);
+
+            memmove(narr + nbegin, narr + sock->marks.begin, sizeof(dime_socket_mark_t) * (sock->marks.cap - sock->marks.begin));
+
+            sock->marks.begin = nbegin;
+        }
+
+        sock->marks.arr = narr;
+        sock->marks.cap = ncap;
     }
 
-    free(buf);
+    dime_socket_mark_t *mark = &sock->marks.arr[(sock->marks.begin + sock->marks.len) % sock->marks.cap];
 
-    return nrecvd;
+    mark->end = dime_socket_bytes_out(sock) + sock->wlen;
+    mark->pushed = now;
+    mark->trace = trace;
+
+    sock->marks.len++;
+
+    return 0;
+}
+#endif
+
+ssize_t dime_socket_ws_pong(dime_socket_t *sock) {
+    if (sock->ws.pong_len < 0) {
+        return 0;
+    }
+
+    /* RFC 6455 section 5.5.3: a pong echoes the ping's payload, unmasked */
+    uint8_t hdr[2] = {0x8A, sock->ws.pong_len};
+    ssize_t n = dime_socket_push_buf(sock, hdr, 2, (const char *)sock->ws.pong, sock->ws.pong_len, NULL, 0);
+
+    sock->ws.pong_len = -1;
+
+    return n;
 }
 
 int dime_socket_fd(const dime_socket_t *sock) {
@@ -646,9 +2296,17 @@ int dime_socket_fd(const dime_socket_t *sock) {
 }
 
 size_t dime_socket_sendlen(const dime_socket_t *sock) {
-    return dime_ringbuffer_len(&sock->wbuf);
+    return sock->wlen;
 }
 
 size_t dime_socket_recvlen(const dime_socket_t *sock) {
-    return dime_ringbuffer_len(&sock->rbuf);
+    return dime_ringbuffer_len(&sock->rbuf) - sock->rdone;
+}
+
+uint64_t dime_socket_bytes_in(const dime_socket_t *sock) {
+    return __atomic_load_n(&sock->stats.bytes_in, __ATOMIC_RELAXED);
+}
+
+uint64_t dime_socket_bytes_out(const dime_socket_t *sock) {
+    return __atomic_load_n(&sock->stats.bytes_out, __ATOMIC_RELAXED);
 }
@@ -38,17 +38,72 @@
  * without blocking for them to be written, and allows it to perform a
  * read if input is detected via @c select or @c poll without waiting
  * for a full message to be received.
-
+ *
+ * Large payloads that are shared between several sockets (e.g. a message
+ * fanned out to a group) need not be copied into the outbuffer at all;
+ * @link dime_socket_push_ref @endlink queues a reference to them which
+ * is written out with scatter/gather I/O and released once sent. The
+ * framing header depends only on the socket's framing (see
+ * @link dime_socket_framing @endlink) and the message lengths, so it
+ * can be built once via @link dime_socket_frame @endlink and shared by
+ * every socket with the same framing.
+ *
+ * Clients on the same host may also negotiate passing binary data out of
+ * band (see @link dime_socket_init_shm @endlink). Such a message starts
+ * with the magic value "DiMS" instead, and its binary portion is not
+ * part of the stream at all: it is the contents of a sealed shared
+ * memory segment (e.g. a memfd) whose file descriptor is passed via
+ * @c SCM_RIGHTS along with the first byte of the header.
+ *
+ * Binary data may also be compressed, if negotiated (see
+ * @link dime_socket_init_zlib @endlink). A compressed message starts
+ * with the magic value "DiMZ", and its binary portion is the 4-byte
+ * big-endian length of the original binary data followed by a zlib
+ * stream. WebSocket connections instead use the permessage-deflate
+ * extension (RFC 7692) without context takeover, so that every message
+ * is compressed on its own and the result can be shared between
+ * sockets, just like the framing headers.
+ *
+ * Clients may also negotiate DiME v2 messages (see
+ * @link dime_socket_init_v2 @endlink), whose header carries the routing
+ * information the server needs in fixed-width binary fields, so that the
+ * JSON portion only holds metadata for the recipients:
+ * - A 4-byte magic value ("DiM2" in ASCII)
+ * - A 1-byte command opcode (see @link dime_route_t @endlink)
+ * - A 1-byte set of flags: @c DIME_FLAG_SHM or @c DIME_FLAG_ZLIB,
+ *   standing in for the "DiMS" and "DiMZ" magic values, and @c
+ *   DIME_FLAG_NOACK, asking the server not to acknowledge a successful
+ *   "send" or "broadcast"
+ * - 2 reserved bytes, which must be zero
+ * - A 4-byte big-endian handle of the recipient group, or 0 if none
+ * - A 4-byte big-endian sequence number chosen by the sender
+ * - The same two lengths and two portions as a DiME message
+ *
+ * The server answers a v2 client's commands with v2 messages whose
+ * opcode is @c DIME_OP_RESPONSE and whose sequence number is that of
+ * the command, so a client that sends a batch of unacknowledged
+ * commands followed by an acknowledged one can attribute any errors and
+ * knows the batch is done once the last one is answered. Messages
+ * forwarded from other clients keep the framing
+ * described above, so that they can still be framed once for every
+ * recipient.
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
+#ifdef DIME_USE_IO_URING
+#   include <sys/uio.h>
+#endif
 
 #include <ev.h>
 #include <jansson.h>
 #include <openssl/ssl.h>
 #include <zlib.h>
+#include "deque.h"
 #include "ringbuffer.h"
+#include "route.h"
+#include "trace.h"
 
 #ifndef __DIME_socket_H
 #define __DIME_socket_H
@@ -57,6 +112,56 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Wire framings
+ *
+ * Distinct ways a message may be framed on the wire. Sockets with the
+ * same framing send byte-identical headers for the same message.
+ */
+enum {
+    DIME_FRAMING_RAW = 0, /** Bare DiME header */
+    DIME_FRAMING_WS,      /** WebSocket binary frame around a DiME header */
+    DIME_FRAMING_SHM,     /** Bare header of a message whose binary data is passed as a file descriptor */
+    DIME_FRAMING_ZLIB,    /** Bare header of a message with compressed binary data */
+    DIME_FRAMING_WS_DEFLATE, /** WebSocket binary frame around a message compressed with permessage-deflate */
+    DIME_FRAMING_COUNT    /** Number of framings */
+};
+
+/**
+ * @brief Maximum length of a framing header
+ */
+#define DIME_FRAME_MAXLEN 24
+
+/* DiME v2 flag: the binary portion is passed in shared memory */
+#define DIME_FLAG_SHM 0x01
+
+/* DiME v2 flag: the binary portion is compressed */
+#define DIME_FLAG_ZLIB 0x02
+
+/* DiME v2 flag: the sender does not want a status reply */
+#define DIME_FLAG_NOACK 0x04
+
+/**
+ * @brief Outbound segment
+ *
+ * A run of pending outbound data. A segment either covers a number of
+ * bytes at the head of the outbuffer, or references externally owned
+ * buffers (framing header, JSON and binary data) that are released once
+ * they have been completely sent.
+ */
+typedef struct {
+    size_t ringlen; /* Bytes of the outbuffer covered by this segment */
+
+    const void *bufs[3];   /* External buffers, including the header */
+    size_t lens[3];        /* Lengths of external buffers */
+    size_t nbufs;          /* Number of external buffers, or 0 */
+    size_t off;            /* Bytes of external buffers already sent */
+    int fd;                /* File descriptor to pass with the first byte, or -1 */
+
+    void (*release)(void *); /* Called once the segment has been sent */
+    void *p;                 /* Argument to release */
+} dime_socket_seg_t;
+
 /**
  * @brief Asynchronous DiME socket
  *
@@ -67,7 +172,12 @@ extern "C" {
  * @see dime_socket_destroy
  * @see dime_socket_push
  * @see dime_socket_push_str
+ * @see dime_socket_push_ref
+ * @see dime_socket_push_shm
+ * @see dime_socket_framing
+ * @see dime_socket_frame
  * @see dime_socket_pop
+ * @see dime_socket_shm
  * @see dime_socket_sendpartial
  * @see dime_socket_recvpartial
  * @see dime_socket_fd
@@ -80,28 +190,111 @@ typedef struct {
     dime_ringbuffer_t rbuf; /** Inbuffer */
     dime_ringbuffer_t wbuf; /** Outbuffer */
 
+    dime_deque_t wsegs;       /** Queue of pending outbound segments */
+    dime_socket_seg_t *wtail; /** Last segment in wsegs, or NULL */
+    size_t wlen;              /** Total number of pending outbound bytes */
+
+    dime_socket_seg_t *spares[8]; /** Sent segments kept for reuse */
+    size_t spares_len;            /** Number of segments in spares */
+
+    struct {
+        char *buf;
+        size_t cap;
+    } wscratch, rscratch; /** Reusable buffers for serializing and parsing JSON */
+
+    size_t rdone; /** Bytes of the last popped message, which its route may still point into, left in rbuf */
+
     struct {
         int enabled;
         SSL *ctx;
+        int ktls_send; /** Whether the kernel encrypts outbound records, so they are sent without OpenSSL */
     } tls;
 
+    struct {
+        int pending;            /** Whether a message is pending */
+        json_t *jsondata;       /** JSON portion, or NULL if the message is routed */
+        size_t jsondata_len;    /** Length of JSON portion */
+        unsigned char *bindata; /** Binary portion, allocated in full */
+        size_t bindata_len;     /** Length of binary portion */
+        size_t off;             /** Bytes of binary portion received so far */
+        size_t msgsiz;          /** Total size of the message */
+        int compressed;         /** Whether the binary portion is zlib-compressed */
+        int opcode;             /** Command opcode */
+        uint32_t group;         /** Recipient group handle */
+        uint32_t seq;           /** Sequence number */
+        int noack;              /** Whether not to acknowledge success */
+    } rmsg; /** Large inbound message that has only been partly received */
+
+    struct {
+        int enabled;
+        int *fds;       /** Received file descriptors not yet claimed by a message */
+        size_t fds_len; /** Number of file descriptors in fds */
+        size_t fds_cap; /** Capacity of fds */
+        int fd;         /** Segment holding the binary data of the last popped message, or -1 */
+        void *addr;     /** Read-only mapping of fd */
+        size_t len;     /** Length of mapping */
+    } shm;
+
     struct {
         int enabled;
+        int deflate;      /** Whether permessage-deflate was negotiated */
+        int inflating;    /** Whether the current message is compressed */
+        int fin;          /** Whether the last frame ended a message, so none is in progress */
         dime_ringbuffer_t rbuf;
+        size_t remaining; /** Payload bytes left in the current frame */
+        uint8_t mask[4];  /** Masking key of the current frame */
+        size_t maskoff;   /** Position in the masking key */
+        uint8_t pong[125]; /** Unmasked payload of the last ping */
+        int pong_len;      /** Length of pong, or -1 if no ping awaits a pong */
     } ws;
 
     struct {
         int enabled;
-        z_stream ctx;
-        dime_ringbuffer_t rbuf;
+        size_t threshold; /** Binary data of at least this many bytes is compressed */
+        z_stream ctx;     /** Inflates compressed WebSocket messages */
     } zlib;
 
+    struct {
+        int enabled;
+        uint32_t seq; /** Sequence number of the last popped message */
+        int noack;    /** Whether the last popped message asked not to be acknowledged */
+    } v2;
+
+    struct {
+        uint64_t bytes_in;  /** Bytes received, including framing */
+        uint64_t bytes_out; /** Bytes sent, including framing */
+    } stats; /** Counters, only written by the thread that owns the socket */
+
+#ifdef DIME_USE_TRACE
+    struct {
+        struct dime_socket_mark *arr; /** Circular array of marks, or NULL until the first */
+        size_t begin;                 /** Index of the earliest mark */
+        size_t len;                   /** Number of marks */
+        size_t cap;                   /** Capacity of arr */
+    } marks; /** Traced messages not yet sent, guarded like wsegs */
+#endif
+
 #ifdef DIME_USE_LIBEV
     ev_io rwatcher;
     ev_io wwatcher;
     struct ev_loop *loop;
 #endif
 
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+    int pollfd;     /** epoll/kqueue instance watching the socket, or -1 */
+    void *polldata; /** User data reported with events on the socket */
+#endif
+
+#ifdef DIME_USE_IO_URING
+    struct {
+        void (*onwrite)(void *); /** Called when the outbuffer becomes non-empty */
+        void *data;              /** Argument to onwrite */
+        unsigned inflight;       /** Requests submitted for the socket and not yet completed */
+        int flags;               /** Event loop state */
+        int dirty;               /** Queued to be flushed, guarded by the event loop */
+    } uring;
+#endif
+
     char err[81]; /** Error string */
 } dime_socket_t;
 
@@ -135,9 +328,19 @@ void dime_socket_destroy(dime_socket_t *sock);
 /**
  * @brief Enable TLS encryption on the socket
  *
-
- * Performs a TLS handshake on the underlying socket. Subsequent reads/writes from the socket will be encrypted anddecrypted via TLS.
-
+ * Performs a TLS handshake on the underlying socket. Subsequent
+ * reads/writes from the socket will be encrypted and decrypted via TLS.
+ *
+ * With OpenSSL 3 on Linux, the record layer is handed to the kernel
+ * (kTLS) after the handshake, if the kernel and the negotiated cipher
+ * support it. Outbound data is then sent with plain scatter/gather
+ * writes, as on unencrypted sockets, and decrypted by the kernel on the
+ * way in. Otherwise, OpenSSL encrypts and decrypts it as before.
+ *
+ * The handshake blocks for up to ten seconds of silence from the peer.
+ * It only touches the file descriptor, not the outbuffer, so messages
+ * may be pushed from other threads meanwhile; anything already in the
+ * outbuffer must be sent with @link dime_socket_flush @endlink first.
  *
  * @param sock Pointer to a @link dime_socket_t @endlink struct
  * @param ctx OpenSSL context
@@ -150,34 +353,86 @@ void dime_socket_destroy(dime_socket_t *sock);
  */
 int dime_socket_init_tls(dime_socket_t *sock, SSL_CTX *ctx);
 
+/**
+ * @brief Send everything in the outbuffer
+ *
+ * Blocks until the outbuffer is empty.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_socket_sendpartial
+ */
+int dime_socket_flush(dime_socket_t *sock);
+
 /**
  * @brief Enable WebSocket protocol on the socket
  *
+ * If @em threshold is non-zero and the client offers it, the
+ * permessage-deflate extension is negotiated as well, and messages with
+ * at least @em threshold bytes of binary data are sent compressed.
+ *
  * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param threshold Compression threshold, or 0 to disable compression
  *
  * @return A nonnegative value on success, or a negative value on
  * failure
  *
  * @todo Make this non-blocking
  */
-int dime_socket_init_ws(dime_socket_t *sock);
+int dime_socket_init_ws(dime_socket_t *sock, size_t threshold);
 
 /**
  * @brief Enable zlib compression on the socket
  *
-
- * Subsequent reads/writes on the socket will be (de)compressed via zlib.
-
+ * Subsequent messages with at least @em threshold bytes of binary data
+ * are sent with their binary data compressed, and compressed messages
+ * are accepted from the peer. Not applicable to WebSocket connections,
+ * which negotiate compression in @link dime_socket_init_ws @endlink.
  *
  * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param threshold Compression threshold, greater than 0
  *
  * @return A nonnegative value on success, or a negative value on
  * failure
  *
- * @todo Make this non-blocking
  * @see dime_socket_init_tls
  */
-int dime_socket_init_zlib(dime_socket_t *sock);
+int dime_socket_init_zlib(dime_socket_t *sock, size_t threshold);
+
+/**
+ * @brief Enable passing binary data through shared memory on the socket
+ *
+ * Subsequent messages may carry their binary data in a shared memory
+ * segment rather than inline, in both directions. Only possible on Unix
+ * domain sockets without TLS or WebSocket, and not with the
+ * io_uring event loop, which receives without ancillary data.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return A nonnegative value on success, or a negative value if the
+ * socket does not support it
+ *
+ * @see dime_socket_shm
+ * @see dime_socket_push_shm
+ */
+int dime_socket_init_shm(dime_socket_t *sock);
+
+/**
+ * @brief Enable DiME v2 messages on the socket
+ *
+ * DiME v2 messages are accepted from the peer alongside DiME ones, and
+ * messages pushed with @link dime_socket_push @endlink and its variants
+ * are sent as v2 responses.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ */
+int dime_socket_init_v2(dime_socket_t *sock);
 
 /**
  * @brief Adds a DiME message to the outbuffer
@@ -188,6 +443,10 @@ int dime_socket_init_zlib(dime_socket_t *sock);
  * @link dime_socket_sendpartial @endlink will send the message at some
  * point in the future.
  *
+ * On a socket with DiME v2 enabled, the message is framed as the
+ * response to the last message popped from the socket, so this must
+ * only be called by the thread handling that message.
+ *
  * @param sock Pointer to a @link dime_socket_t @endlink struct
  * @param jsondata JSON portion of the message to send
  * @param bindata Binary portion of the message to send
@@ -229,6 +488,161 @@ ssize_t dime_socket_push_str(dime_socket_t *sock,
                              const void *bindata,
                              size_t bindata_len);
 
+/**
+ * @brief Adds a DiME message that answers no particular command to the
+ * outbuffer
+ *
+ * Functions identically to @link dime_socket_push_str @endlink, except
+ * that on a socket with DiME v2 enabled, the message carries sequence
+ * number 0. Unlike the other push functions, this may be used on
+ * sockets owned by other threads, as long as the outbuffer is guarded.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param jsonstr JSON portion of the message to send, as a
+ * NUL-terminated string
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_socket_push_str
+ */
+ssize_t dime_socket_notify_str(dime_socket_t *sock, const char *jsonstr);
+
+/**
+ * @brief Get the framing the socket uses for a message
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param bindata_len Length of binary data of the message
+ *
+ * @return One of the @c DIME_FRAMING_* constants, other than
+ * @c DIME_FRAMING_SHM
+ *
+ * @see dime_socket_frame
+ */
+int dime_socket_framing(const dime_socket_t *sock, size_t bindata_len);
+
+/**
+ * @brief Compress a message for a compressed framing
+ *
+ * For @c DIME_FRAMING_ZLIB, the binary portion of the message is
+ * compressed, and the JSON portion is sent as is. For
+ * @c DIME_FRAMING_WS_DEFLATE, the whole message, DiME header included,
+ * is compressed into a single payload which takes the place of the
+ * binary portion, with no JSON portion.
+ *
+ * @param framing @c DIME_FRAMING_ZLIB or @c DIME_FRAMING_WS_DEFLATE
+ * @param jsonstr JSON portion of the message
+ * @param jsondata_len Length of JSON data
+ * @param bindata Binary portion of the message
+ * @param bindata_len Length of binary data
+ * @param out Set to the compressed data, to be freed with @c free
+ * @param out_len Set to the length of the compressed data
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_socket_frame
+ */
+int dime_socket_compress(int framing,
+                         const char *jsonstr,
+                         size_t jsondata_len,
+                         const void *bindata,
+                         size_t bindata_len,
+                         unsigned char **out,
+                         size_t *out_len);
+
+/**
+ * @brief Build the framing header of a message
+ *
+ * Writes the header that precedes a message with the given JSON and
+ * binary lengths on a socket with framing @em framing. For the
+ * compressed framings, the lengths are those of the portions as
+ * returned by @link dime_socket_compress @endlink.
+ *
+ * @param framing One of the @c DIME_FRAMING_* constants
+ * @param buf Buffer of at least @c DIME_FRAME_MAXLEN bytes
+ * @param jsondata_len Length of JSON data
+ * @param bindata_len Length of binary data
+ *
+ * @return Length of the header
+ *
+ * @see dime_socket_framing
+ * @see dime_socket_push_ref
+ */
+size_t dime_socket_frame(int framing,
+                         unsigned char *buf,
+                         size_t jsondata_len,
+                         size_t bindata_len);
+
+/**
+ * @brief Adds a pre-framed DiME message to the outbuffer by reference
+ *
+ * Functions similarly to @link dime_socket_push_str @endlink, but the
+ * header and data are not copied into the outbuffer. Instead, a
+ * reference to them is queued and written directly from the provided
+ * buffers, which must stay valid and unmodified until @em release is
+ * called with @em p. This happens exactly once, either when the data
+ * has been completely sent or when the socket is destroyed. Small
+ * messages may be copied and released immediately.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param hdr Framing header built by @link dime_socket_frame @endlink
+ * for this socket's framing
+ * @param hdr_len Length of framing header
+ * @param jsonstr JSON portion of the message to send
+ * @param jsondata_len Length of JSON data
+ * @param bindata Binary portion of the message to send
+ * @param bindata_len Length of binary data
+ * @param release Function to call once the buffers are no longer needed
+ * @param p Argument to @em release
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure, in which case @em release is not called
+ *
+ * @see dime_socket_push_str
+ */
+ssize_t dime_socket_push_ref(dime_socket_t *sock,
+                             const void *hdr,
+                             size_t hdr_len,
+                             const char *jsonstr,
+                             size_t jsondata_len,
+                             const void *bindata,
+                             size_t bindata_len,
+                             void (*release)(void *),
+                             void *p);
+
+/**
+ * @brief Adds a message whose binary data is in shared memory by reference
+ *
+ * Functions like @link dime_socket_push_ref @endlink, but instead of
+ * sending the binary data, @em fd is passed to the peer. @em hdr must
+ * have been built with the @c DIME_FRAMING_SHM framing, and @em fd must
+ * stay open until @em release is called.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct with
+ * shared memory enabled
+ * @param hdr Framing header
+ * @param hdr_len Length of framing header
+ * @param jsonstr JSON portion of the message to send
+ * @param jsondata_len Length of JSON data
+ * @param fd File descriptor of the shared memory segment
+ * @param release Function to call once the buffers are no longer needed
+ * @param p Argument to @em release
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure, in which case @em release is not called
+ *
+ * @see dime_socket_init_shm
+ */
+ssize_t dime_socket_push_shm(dime_socket_t *sock,
+                             const void *hdr,
+                             size_t hdr_len,
+                             const char *jsonstr,
+                             size_t jsondata_len,
+                             int fd,
+                             void (*release)(void *),
+                             void *p);
+
 /**
  * @brief Attempts to get a DiME message from the inbuffer
  *
@@ -239,7 +653,19 @@ ssize_t dime_socket_push_str(dime_socket_t *sock,
  * bindata should be freed with @c json_decref and @c free,
  * respectively, once they are no longer needed.
  *
+ * If the binary data was passed in shared memory, @em bindata is set to
+ * NULL; the data can be claimed with @link dime_socket_shm @endlink
+ * until the next call to this function.
+ *
+ * The opcode and sequence number of the message, from its v2 header or
+ * its JSON portion, are stored in @em route. Messages that can be routed
+ * without parsing their JSON portion (see @link dime_route_routable
+ * @endlink) are not parsed; for those, @em jsondata is set to NULL and
+ * the rest of @em route is filled in instead. Its JSON portion stays
+ * valid until the next call to this function.
+ *
  * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param route Pointer to a @link dime_route_t @endlink struct
  * @param jsondata Pointer to the JSON portion of the message received
  * @param bindata Pointer to the binary portion of the message received
  * @param bindata_len Pointer to the length of the binary data
@@ -251,10 +677,41 @@ ssize_t dime_socket_push_str(dime_socket_t *sock,
  * @see dime_socket_recvpartial
  */
 ssize_t dime_socket_pop(dime_socket_t *sock,
+                        dime_route_t *route,
                         json_t **jsondata,
                         void **bindata,
                         size_t *bindata_len);
 
+/**
+ * @brief Claim the shared memory segment of the last popped message
+ *
+ * If the binary data of the message last returned by
+ * @link dime_socket_pop @endlink was passed in shared memory, ownership
+ * of the segment passes to the caller, who must eventually @c munmap
+ * @em addr for the binary data length and @c close the returned file
+ * descriptor. Otherwise, nothing happens.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param addr Set to the read-only mapping of the segment, if there is
+ * one
+ *
+ * @return File descriptor of the segment, or -1 if there is none
+ *
+ * @see dime_socket_pop
+ */
+int dime_socket_shm(dime_socket_t *sock, void **addr);
+
+/**
+ * @brief Whether file descriptors can be passed over the socket
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return Non-zero if shared memory has been enabled on the socket
+ *
+ * @see dime_socket_init_shm
+ */
+int dime_socket_shm_enabled(const dime_socket_t *sock);
+
 /**
  * @brief Sends data in the outbuffer
  *
@@ -265,7 +722,8 @@ ssize_t dime_socket_pop(dime_socket_t *sock,
  * @param sock Pointer to a @link dime_socket_t @endlink struct
  *
  * @return Number of bytes sent on success, or a negative value on
- * failure
+ * failure. If the socket is non-blocking and no data could be sent,
+ * @c errno is set to @c EAGAIN.
  *
  * @see dime_socket_push
  * @see dime_socket_recvpartial
@@ -282,13 +740,136 @@ ssize_t dime_socket_sendpartial(dime_socket_t *sock);
  * @param sock Pointer to a @link dime_socket_t @endlink struct
  *
  * @return Number of bytes received on success, or a negative value on
- * failure
+ * failure. If the socket is non-blocking and no data was available,
+ * @c errno is set to @c EAGAIN.
  *
  * @see dime_socket_pop
  * @see dime_socket_sendpartial
  */
 ssize_t dime_socket_recvpartial(dime_socket_t *sock);
 
+#if defined(DIME_USE_EPOLL) || defined(DIME_USE_KQUEUE)
+/**
+ * @brief Register the socket with an epoll or kqueue instance
+ *
+ * Readability is reported edge-triggered for the lifetime of the
+ * socket. Writability is only requested when the outbuffer goes from
+ * empty to non-empty, and should be dropped again via
+ * @link dime_socket_pollwrite @endlink once the outbuffer has been
+ * drained, so that idle connections generate no events.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param pollfd epoll or kqueue file descriptor
+ * @param data Pointer to report with events on the socket
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_socket_pollwrite
+ */
+int dime_socket_watch(dime_socket_t *sock, int pollfd, void *data);
+
+/**
+ * @brief Request or drop write readiness events for the socket
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param enable Non-zero to request write events, zero to drop them
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_socket_watch
+ */
+int dime_socket_pollwrite(dime_socket_t *sock, int enable);
+#endif
+
+#ifdef DIME_USE_IO_URING
+/**
+ * @brief Describe pending outbound data for an asynchronous send
+ *
+ * Fills @em iov with the buffers making up the start of the outbuffer,
+ * without sending anything. The buffers stay valid until the next push
+ * onto the socket, so the caller must prevent pushes until the send
+ * has completed and been reported via
+ * @link dime_socket_sent @endlink.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param iov Array of @em iovlen I/O vectors
+ * @param iovlen Length of @em iov
+ *
+ * @return Number of I/O vectors filled in, or 0 if the outbuffer is
+ * empty
+ *
+ * @see dime_socket_sent
+ */
+size_t dime_socket_sendprep(const dime_socket_t *sock,
+                            struct iovec *iov,
+                            size_t iovlen);
+
+/**
+ * @brief Remove sent bytes from the outbuffer
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param n Number of bytes sent from the buffers returned by
+ * @link dime_socket_sendprep @endlink
+ *
+ * @see dime_socket_sendprep
+ */
+void dime_socket_sent(dime_socket_t *sock, size_t n);
+
+/**
+ * @brief Hand received bytes to the socket
+ *
+ * Functions like @link dime_socket_recvpartial @endlink, but the data
+ * has already been received by the caller into @em buf.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param buf Received data
+ * @param n Length of received data
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_socket_pop
+ */
+int dime_socket_received(dime_socket_t *sock, const void *buf, size_t n);
+#endif
+
+#ifdef DIME_USE_TRACE
+/**
+ * @brief Time how long the data pushed so far takes to be sent
+ *
+ * Once every byte pushed onto the socket before this call has been
+ * sent, the time since @em now is recorded as the drain time of
+ * @em trace. Must be called under the same conditions as pushing.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ * @param trace Pointer to a @link dime_trace_t @endlink struct, which
+ * must outlive the socket
+ * @param now Current time, from @link dime_trace_now @endlink
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ */
+int dime_socket_trace(dime_socket_t *sock, dime_trace_t *trace, uint64_t now);
+#endif
+
+/**
+ * @brief Adds a pong answering the last WebSocket ping to the outbuffer
+ *
+ * Pings are only recorded while messages are popped, since answering
+ * them takes the lock that guards the outbuffer. Only the last ping
+ * received since the previous call is answered, as RFC 6455 allows.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return The number of bytes added, 0 if no ping awaits a pong, or a
+ * negative value on failure
+ *
+ * @see dime_socket_pop
+ */
+ssize_t dime_socket_ws_pong(dime_socket_t *sock);
+
 /**
  * @brief Get the file descriptor of the socket
  *
@@ -316,6 +897,28 @@ size_t dime_socket_sendlen(const dime_socket_t *sock);
  */
 size_t dime_socket_recvlen(const dime_socket_t *sock);
 
+/**
+ * @brief Get the number of bytes received on the socket
+ *
+ * Safe to call from any thread.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return Total bytes received so far
+ */
+uint64_t dime_socket_bytes_in(const dime_socket_t *sock);
+
+/**
+ * @brief Get the number of bytes sent on the socket
+ *
+ * Safe to call from any thread.
+ *
+ * @param sock Pointer to a @link dime_socket_t @endlink struct
+ *
+ * @return Total bytes sent so far
+ */
+uint64_t dime_socket_bytes_out(const dime_socket_t *sock);
+
 #ifdef __cplusplus
 }
 #endif
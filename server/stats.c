@@ -0,0 +1,696 @@
+#ifndef _WIN32
+#   include <arpa/inet.h>
+#   include <netdb.h>
+#   include <netinet/in.h>
+#   include <poll.h>
+#   include <unistd.h>
+#   include <sys/socket.h>
+#   include <sys/time.h>
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <jansson.h>
+#include "client.h"
+#include "log.h"
+#include "server.h"
+#include "socket.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Longest HTTP request read from a scraper; the rest is ignored */
+#define DIME_STATS_REQLEN 4096
+
+/* Growable text buffer */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} dime_stats_text_t;
+
+static double dime_stats_elapsed(const struct timespec *since, const struct timespec *now) {
+    return (double)(now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void dime_stats_printf(dime_stats_text_t *text, const char *fmt, ...) {
+    va_list args;
+
+    if (text->failed) {
+        return;
+    }
+
+    while (1) {
+        va_start(args, fmt);
+        int n = vsnprintf(text->buf + text->len, text->cap - text->len, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            text->failed = 1;
+            return;
+        }
+
+        if ((size_t)n < text->cap - text->len) {
+            text->len += n;
+            return;
+        }
+
+        size_t ncap = (text->cap * 3) / 2;
+
+        while (ncap - text->len <= (size_t)n) {
+            ncap = (ncap * 3) / 2;
+        }
+
+        char *nbuf = realloc(text->buf, ncap);
+        if (nbuf == NULL) {
+            text->failed = 1;
+            return;
+        }
+
+        text->buf = nbuf;
+        text->cap = ncap;
+    }
+}
+
+/* Writes a label value, escaped as the exposition format requires */
+static void dime_stats_label(dime_stats_text_t *text, const char *s) {
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+        case '\\':
+            dime_stats_printf(text, "\\\\");
+            break;
+
+        case '"':
+            dime_stats_printf(text, "\\\"");
+            break;
+
+        case '\n':
+            dime_stats_printf(text, "\\n");
+            break;
+
+        default:
+            dime_stats_printf(text, "%c", *s);
+        }
+    }
+}
+
+/* Outbuffer length of a client, which its worker changes under the client lock */
+static size_t dime_stats_wbuf(dime_client_t *clnt) {
+    pthread_mutex_lock(&clnt->lock);
+    size_t len = dime_socket_sendlen(&clnt->sock);
+    pthread_mutex_unlock(&clnt->lock);
+
+    return len;
+}
+
+/* Bytes in and out of every connection the server has had */
+static void dime_stats_totals(dime_server_t *srv, uint64_t *bytes_in, uint64_t *bytes_out) {
+    *bytes_in = srv->stats.bytes_in;
+    *bytes_out = srv->stats.bytes_out;
+
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        *bytes_in += dime_socket_bytes_in(&srv->clnts[i]->sock);
+        *bytes_out += dime_socket_bytes_out(&srv->clnts[i]->sock);
+    }
+}
+
+#ifdef DIME_USE_TRACE
+/* Adds the latencies recorded in a trace to an object */
+static int dime_stats_latency(json_t *obj, const dime_trace_t *trace) {
+    json_t *latency = json_pack("{soso}", "residence", dime_hist_json(&trace->residence), "drain", dime_hist_json(&trace->drain));
+
+    return json_object_set_new(obj, "latency", latency);
+}
+#endif
+
+json_t *dime_stats_json(dime_server_t *srv) {
+    struct timespec now;
+    uint64_t bytes_in, bytes_out;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dime_stats_totals(srv, &bytes_in, &bytes_out);
+
+    double interval = dime_stats_elapsed(&srv->stats.last, &now);
+    double rate = (interval > 0) ? (srv->stats.msgs - srv->stats.last_msgs) / interval : 0;
+
+    srv->stats.last = now;
+    srv->stats.last_msgs = srv->stats.msgs;
+
+    json_t *clnts = json_array();
+    json_t *groups = json_array();
+
+    if (clnts == NULL || groups == NULL) {
+        json_decref(clnts);
+        json_decref(groups);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_client_t *clnt = srv->clnts[i];
+        json_t *names = json_array();
+
+        if (names == NULL) {
+            goto fail;
+        }
+
+        for (size_t j = 0; j < clnt->groups_len; j++) {
+            if (json_array_append_new(names, json_string(clnt->groups[j].group->name)) < 0) {
+                json_decref(names);
+                goto fail;
+            }
+        }
+
+        json_t *obj = json_pack("{sssbsosIsIsIsIsIsIsIsIsIsIsI}",
+                                "addr", clnt->addr,
+                                "peer", clnt->peer,
+                                "groups", names,
+                                "queue_len", (json_int_t)dime_deque_len(&clnt->queue),
+                                "queue_bytes", (json_int_t)clnt->queue_bytes,
+                                "queue_peak", (json_int_t)clnt->stats.queue_peak,
+                                "wbuf", (json_int_t)dime_stats_wbuf(clnt),
+                                "rbuf", (json_int_t)clnt->stats.rbuf_len,
+                                "bytes_in", (json_int_t)dime_socket_bytes_in(&clnt->sock),
+                                "bytes_out", (json_int_t)dime_socket_bytes_out(&clnt->sock),
+                                "msgs_in", (json_int_t)clnt->stats.msgs_in,
+                                "msgs_queued", (json_int_t)clnt->stats.msgs_queued,
+                                "msgs_out", (json_int_t)clnt->stats.msgs_out,
+                                "msgs_dropped", (json_int_t)clnt->stats.msgs_dropped);
+
+        if (obj == NULL || json_array_append_new(clnts, obj) < 0) {
+            goto fail;
+        }
+    }
+
+    size_t ngroups = 0;
+
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_group_t *group = srv->groups[i];
+
+        if (group->clnts_len == 0) {
+            continue;
+        }
+
+        json_t *obj = json_pack("{sssIsIsIsIsI}",
+                                "name", group->name,
+                                "handle", (json_int_t)group->handle,
+                                "members", (json_int_t)group->clnts_len,
+                                "msgs", (json_int_t)group->stats.msgs,
+                                "bytes", (json_int_t)group->stats.bytes,
+                                "fanout", (json_int_t)group->stats.fanout);
+
+        if (obj == NULL || json_array_append_new(groups, obj) < 0) {
+            goto fail;
+        }
+
+#ifdef DIME_USE_TRACE
+        if (dime_stats_latency(obj, &group->trace) < 0) {
+            goto fail;
+        }
+#endif
+
+        ngroups++;
+    }
+
+    json_t *server = json_pack("{sfsfsIsIsIsIsIsIsIsIsI}",
+                               "uptime", dime_stats_elapsed(&srv->stats.start, &now),
+                               "rate", rate,
+                               "connections", (json_int_t)srv->stats.connections,
+                               "clients", (json_int_t)srv->clnts_len,
+                               "groups", (json_int_t)ngroups,
+                               "msgs", (json_int_t)srv->stats.msgs,
+                               "relayed", (json_int_t)srv->stats.relayed,
+                               "dropped", (json_int_t)srv->stats.dropped,
+                               "forwarded", (json_int_t)srv->stats.forwarded,
+                               "bytes_in", (json_int_t)bytes_in,
+                               "bytes_out", (json_int_t)bytes_out);
+
+    if (server == NULL) {
+        goto fail;
+    }
+
+#ifdef DIME_USE_TRACE
+    if (dime_stats_latency(server, &srv->trace) < 0) {
+        json_decref(server);
+        goto fail;
+    }
+#endif
+
+    return json_pack("{sososo}", "server", server, "clients", clnts, "groups", groups);
+
+fail:
+    json_decref(clnts);
+    json_decref(groups);
+
+    return NULL;
+}
+
+/* Metric families, each with the help text Prometheus shows for it */
+static void dime_stats_family(dime_stats_text_t *text, const char *name, const char *type, const char *help) {
+    dime_stats_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void dime_stats_client(dime_stats_text_t *text, const char *name, const dime_client_t *clnt, uint64_t value) {
+    dime_stats_printf(text, "%s{client=\"", name);
+    dime_stats_label(text, clnt->addr);
+    dime_stats_printf(text, "\"} %" PRIu64 "\n", value);
+}
+
+/* Groups nobody has joined are left out, as in the "stats" reply */
+static void dime_stats_group(dime_stats_text_t *text, const char *name, const dime_group_t *group, uint64_t value) {
+    if (group->clnts_len == 0) {
+        return;
+    }
+
+    dime_stats_printf(text, "%s{group=\"", name);
+    dime_stats_label(text, group->name);
+    dime_stats_printf(text, "\"} %" PRIu64 "\n", value);
+}
+
+#ifdef DIME_USE_TRACE
+/* Writes the labels of a sample, for a group or else the whole server */
+static void dime_stats_labels(dime_stats_text_t *text, const dime_group_t *group, const char *quantile) {
+    if (group == NULL && quantile == NULL) {
+        return;
+    }
+
+    dime_stats_printf(text, "{");
+
+    if (group != NULL) {
+        dime_stats_printf(text, "group=\"");
+        dime_stats_label(text, group->name);
+        dime_stats_printf(text, (quantile != NULL) ? "\"," : "\"");
+    }
+
+    if (quantile != NULL) {
+        dime_stats_printf(text, "quantile=\"%s\"", quantile);
+    }
+
+    dime_stats_printf(text, "}");
+}
+
+static void dime_stats_summary(dime_stats_text_t *text, const char *name, const dime_group_t *group, const dime_hist_t *hist) {
+    static const struct {
+        const char *label;
+        double q;
+    } QUANTILES[] = {{"0.5", 0.5}, {"0.99", 0.99}, {"0.999", 0.999}};
+
+    if (group != NULL && group->clnts_len == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+        dime_stats_printf(text, "%s", name);
+        dime_stats_labels(text, group, QUANTILES[i].label);
+        dime_stats_printf(text, " %.9f\n", dime_hist_quantile(hist, QUANTILES[i].q) / 1e9);
+    }
+
+    dime_stats_printf(text, "%s_sum", name);
+    dime_stats_labels(text, group, NULL);
+    dime_stats_printf(text, " %.9f\n", __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1e9);
+
+    dime_stats_printf(text, "%s_count", name);
+    dime_stats_labels(text, group, NULL);
+    dime_stats_printf(text, " %" PRIu64 "\n", __atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+}
+#endif
+
+char *dime_stats_prometheus(dime_server_t *srv, size_t *len) {
+    dime_stats_text_t text;
+    struct timespec now;
+    uint64_t bytes_in, bytes_out;
+
+    text.len = 0;
+    text.cap = 4096;
+    text.failed = 0;
+    text.buf = malloc(text.cap);
+    if (text.buf == NULL) {
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dime_stats_totals(srv, &bytes_in, &bytes_out);
+
+    dime_stats_family(&text, "dime_uptime_seconds", "gauge", "Seconds since the server started");
+    dime_stats_printf(&text, "dime_uptime_seconds %.3f\n", dime_stats_elapsed(&srv->stats.start, &now));
+
+    dime_stats_family(&text, "dime_connections_total", "counter", "Connections accepted");
+    dime_stats_printf(&text, "dime_connections_total %" PRIu64 "\n", srv->stats.connections);
+
+    dime_stats_family(&text, "dime_clients", "gauge", "Connected clients");
+    dime_stats_printf(&text, "dime_clients %zu\n", srv->clnts_len);
+
+    dime_stats_family(&text, "dime_commands_total", "counter", "Commands handled");
+    dime_stats_printf(&text, "dime_commands_total %" PRIu64 "\n", srv->stats.msgs);
+
+    dime_stats_family(&text, "dime_relayed_total", "counter", "Copies of messages queued for clients");
+    dime_stats_printf(&text, "dime_relayed_total %" PRIu64 "\n", srv->stats.relayed);
+
+    dime_stats_family(&text, "dime_dropped_total", "counter", "Messages rejected or dropped at client queue limits");
+    dime_stats_printf(&text, "dime_dropped_total %" PRIu64 "\n", srv->stats.dropped);
+
+    dime_stats_family(&text, "dime_forwarded_total", "counter", "Copies of messages forwarded to peered servers");
+    dime_stats_printf(&text, "dime_forwarded_total %" PRIu64 "\n", srv->stats.forwarded);
+
+    dime_stats_family(&text, "dime_received_bytes_total", "counter", "Bytes received from clients");
+    dime_stats_printf(&text, "dime_received_bytes_total %" PRIu64 "\n", bytes_in);
+
+    dime_stats_family(&text, "dime_sent_bytes_total", "counter", "Bytes sent to clients");
+    dime_stats_printf(&text, "dime_sent_bytes_total %" PRIu64 "\n", bytes_out);
+
+    dime_stats_family(&text, "dime_client_queue_messages", "gauge", "Messages queued for a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_queue_messages", srv->clnts[i], dime_deque_len(&srv->clnts[i]->queue));
+    }
+
+    dime_stats_family(&text, "dime_client_queue_bytes", "gauge", "Total size of the messages queued for a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_queue_bytes", srv->clnts[i], srv->clnts[i]->queue_bytes);
+    }
+
+    dime_stats_family(&text, "dime_client_wbuf_bytes", "gauge", "Bytes waiting in a client's outbuffer");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_wbuf_bytes", srv->clnts[i], dime_stats_wbuf(srv->clnts[i]));
+    }
+
+    dime_stats_family(&text, "dime_client_rbuf_bytes", "gauge", "Bytes left in a client's inbuffer after its last command");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_rbuf_bytes", srv->clnts[i], srv->clnts[i]->stats.rbuf_len);
+    }
+
+    dime_stats_family(&text, "dime_client_received_bytes_total", "counter", "Bytes received from a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_received_bytes_total", srv->clnts[i], dime_socket_bytes_in(&srv->clnts[i]->sock));
+    }
+
+    dime_stats_family(&text, "dime_client_sent_bytes_total", "counter", "Bytes sent to a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_sent_bytes_total", srv->clnts[i], dime_socket_bytes_out(&srv->clnts[i]->sock));
+    }
+
+    dime_stats_family(&text, "dime_client_commands_total", "counter", "Commands received from a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_commands_total", srv->clnts[i], srv->clnts[i]->stats.msgs_in);
+    }
+
+    dime_stats_family(&text, "dime_client_queued_total", "counter", "Messages queued for a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_queued_total", srv->clnts[i], srv->clnts[i]->stats.msgs_queued);
+    }
+
+    dime_stats_family(&text, "dime_client_delivered_total", "counter", "Queued messages pushed to a client");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_delivered_total", srv->clnts[i], srv->clnts[i]->stats.msgs_out);
+    }
+
+    dime_stats_family(&text, "dime_client_dropped_total", "counter", "Messages rejected or dropped at a client's queue limits");
+    for (size_t i = 0; i < srv->clnts_len; i++) {
+        dime_stats_client(&text, "dime_client_dropped_total", srv->clnts[i], srv->clnts[i]->stats.msgs_dropped);
+    }
+
+    dime_stats_family(&text, "dime_group_members", "gauge", "Clients in a group");
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_stats_group(&text, "dime_group_members", srv->groups[i], srv->groups[i]->clnts_len);
+    }
+
+    dime_stats_family(&text, "dime_group_messages_total", "counter", "Messages sent to a group");
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_stats_group(&text, "dime_group_messages_total", srv->groups[i], srv->groups[i]->stats.msgs);
+    }
+
+    dime_stats_family(&text, "dime_group_bytes_total", "counter", "Total size of the messages sent to a group");
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_stats_group(&text, "dime_group_bytes_total", srv->groups[i], srv->groups[i]->stats.bytes);
+    }
+
+    dime_stats_family(&text, "dime_group_fanout_total", "counter", "Copies of messages to a group queued for its members");
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_stats_group(&text, "dime_group_fanout_total", srv->groups[i], srv->groups[i]->stats.fanout);
+    }
+
+#ifdef DIME_USE_TRACE
+    dime_stats_family(&text, "dime_residence_seconds", "summary", "Time relayed messages spend in a recipient's queue");
+    dime_stats_summary(&text, "dime_residence_seconds", NULL, &srv->trace.residence);
+
+    dime_stats_family(&text, "dime_drain_seconds", "summary", "Time relayed messages spend in a recipient's outbuffer");
+    dime_stats_summary(&text, "dime_drain_seconds", NULL, &srv->trace.drain);
+
+    dime_stats_family(&text, "dime_group_residence_seconds", "summary", "Time messages to a group spend in a member's queue");
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_stats_summary(&text, "dime_group_residence_seconds", srv->groups[i], &srv->groups[i]->trace.residence);
+    }
+
+    dime_stats_family(&text, "dime_group_drain_seconds", "summary", "Time messages to a group spend in a member's outbuffer");
+    for (size_t i = 0; i < srv->groups_len; i++) {
+        dime_stats_summary(&text, "dime_group_drain_seconds", srv->groups[i], &srv->groups[i]->trace.drain);
+    }
+#endif
+
+    if (text.failed) {
+        free(text.buf);
+        return NULL;
+    }
+
+    *len = text.len;
+
+    return text.buf;
+}
+
+#ifndef _WIN32
+static int dime_stats_writeall(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Answers one scrape, whatever was asked for, then hangs up */
+static void dime_stats_serve(dime_server_t *srv, int fd) {
+    char req[DIME_STATS_REQLEN];
+    struct timeval timeout = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* Wait for the end of the request headers, or as much as fits */
+    size_t req_len = 0;
+
+    while (req_len < sizeof(req) - 1) {
+        ssize_t n = read(fd, req + req_len, sizeof(req) - 1 - req_len);
+
+        if (n <= 0) {
+            return;
+        }
+
+        req_len += n;
+        req[req_len] = '\0';
+
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    size_t body_len;
+
+    pthread_mutex_lock(&srv->lock);
+    char *body = dime_stats_prometheus(srv, &body_len);
+    pthread_mutex_unlock(&srv->lock);
+
+    char hdr[160];
+    int hdr_len;
+
+    if (body == NULL) {
+        hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 500 Internal Server Error\r\n"
+                                             "Content-Length: 0\r\n"
+                                             "Connection: close\r\n\r\n");
+        dime_stats_writeall(fd, hdr, hdr_len);
+
+        return;
+    }
+
+    hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                                         "Content-Type: text/plain; version=0.0.4\r\n"
+                                         "Content-Length: %zu\r\n"
+                                         "Connection: close\r\n\r\n", body_len);
+
+    if (dime_stats_writeall(fd, hdr, hdr_len) == 0 && strncmp(req, "HEAD ", 5) != 0) {
+        dime_stats_writeall(fd, body, body_len);
+    }
+
+    free(body);
+}
+
+static void *dime_stats_main(void *p) {
+    dime_server_t *srv = p;
+    struct pollfd pollfds[2];
+
+    pollfds[0].fd = srv->metrics_pipefd[0];
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = srv->metrics_fd;
+    pollfds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(pollfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            dime_err("Metrics thread exited: %s", strerror(errno));
+            break;
+        }
+
+        if (pollfds[0].revents != 0) {
+            break;
+        }
+
+        if (pollfds[1].revents & POLLIN) {
+            int fd = accept(srv->metrics_fd, NULL, NULL);
+
+            if (fd >= 0) {
+                dime_stats_serve(srv, fd);
+                close(fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int dime_stats_start(dime_server_t *srv) {
+    /* Client addresses and group names are not for the whole network to see */
+    const char *host = (srv->metrics_host != NULL) ? srv->metrics_host : "127.0.0.1";
+    struct addrinfo hints, *res, *ai;
+    char port_s[6];
+    int fd = -1, no = 0, err = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    snprintf(port_s, sizeof(port_s), "%hu", (unsigned short)srv->metrics_port);
+
+    int gai = getaddrinfo(host, port_s, &hints, &res);
+    if (gai != 0) {
+        snprintf(srv->err, sizeof(srv->err), "Failed to resolve metrics address %s (%s)", host, gai_strerror(gai));
+        return -1;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        /* "::" also takes IPv4 connections, where the system allows */
+        if (ai->ai_family == AF_INET6) {
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(int));
+        }
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            break;
+        }
+
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        snprintf(srv->err, sizeof(srv->err), "Failed to serve metrics on %s:%s (%s)", host, port_s, strerror(err));
+
+        freeaddrinfo(res);
+
+        return -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (pipe(srv->metrics_pipefd) < 0) {
+        strncpy(srv->err, strerror(errno), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        close(fd);
+
+        return -1;
+    }
+
+    srv->metrics_fd = fd;
+
+    /* Leave signals to the thread that runs the main event loop */
+    sigset_t set, oldset;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    err = pthread_create(&srv->metrics_thread, NULL, dime_stats_main, srv);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (err != 0) {
+        strncpy(srv->err, strerror(err), sizeof(srv->err));
+        srv->err[sizeof(srv->err) - 1] = '\0';
+
+        close(srv->metrics_pipefd[0]);
+        close(srv->metrics_pipefd[1]);
+        close(fd);
+        srv->metrics_fd = -1;
+
+        return -1;
+    }
+
+    if (srv->verbosity >= 1) {
+        dime_info("Serving metrics on %s port %hu", (srv->metrics_host != NULL) ? srv->metrics_host : "127.0.0.1", (unsigned short)srv->metrics_port);
+    }
+
+    return 0;
+}
+
+void dime_stats_stop(dime_server_t *srv) {
+    if (srv->metrics_fd < 0) {
+        return;
+    }
+
+    char c = 0;
+
+    if (write(srv->metrics_pipefd[1], &c, 1) == 1) {
+        pthread_join(srv->metrics_thread, NULL);
+    }
+
+    close(srv->metrics_pipefd[0]);
+    close(srv->metrics_pipefd[1]);
+    close(srv->metrics_fd);
+    srv->metrics_fd = -1;
+}
+#else
+int dime_stats_start(dime_server_t *srv) {
+    strncpy(srv->err, "Metrics are not supported on Windows", sizeof(srv->err));
+    srv->err[sizeof(srv->err) - 1] = '\0';
+
+    return -1;
+}
+
+void dime_stats_stop(dime_server_t *srv) {
+}
+#endif
@@ -0,0 +1,102 @@
+/*
+ * stats.h - Server metrics
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+/**
+ * @file stats.h
+ * @brief Server metrics
+ * @author Nicholas West
+ * @date 2020
+ *
+ * Renders the counters kept by the server, its clients and its groups,
+ * either as JSON for the "stats" command or in the Prometheus text
+ * exposition format. The counters themselves are plain integers bumped
+ * where the events happen, under the server lock, except for the byte
+ * counts of each socket, which its worker bumps on its own. The
+ * Prometheus format is optionally served over HTTP by a thread of its
+ * own, so that scraping never waits on a busy event loop.
+ */
+
+#include <stddef.h>
+
+#include <jansson.h>
+#include "server.h"
+
+#ifndef __DIME_stats_H
+#define __DIME_stats_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Build a JSON object of the server's counters
+ *
+ * Also resets the interval over which the @c rate field is computed.
+ * The caller must hold the server lock.
+ *
+ * @param srv Pointer to a @link dime_server_t @endlink struct
+ *
+ * @return A new reference to the object, or @c NULL on failure
+ *
+ * @see dime_client_stats
+ */
+json_t *dime_stats_json(dime_server_t *srv);
+
+/**
+ * @brief Render the server's counters in the Prometheus text format
+ *
+ * The caller must hold the server lock.
+ *
+ * @param srv Pointer to a @link dime_server_t @endlink struct
+ * @param len Set to the length of the text
+ *
+ * @return A buffer to be freed with @c free, or @c NULL on failure
+ */
+char *dime_stats_prometheus(dime_server_t *srv, size_t *len);
+
+/**
+ * @brief Start serving metrics over HTTP
+ *
+ * Listens on @c metrics_port and starts a thread that answers every
+ * request with @link dime_stats_prometheus @endlink.
+ *
+ * @param srv Pointer to a @link dime_server_t @endlink struct
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_stats_stop
+ */
+int dime_stats_start(dime_server_t *srv);
+
+/**
+ * @brief Stop serving metrics over HTTP
+ *
+ * Does nothing if @link dime_stats_start @endlink was never called or
+ * failed.
+ *
+ * @param srv Pointer to a @link dime_server_t @endlink struct
+ *
+ * @see dime_stats_start
+ */
+void dime_stats_stop(dime_server_t *srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
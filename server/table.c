@@ -16,252 +16,374 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "table.h"
 
-enum dime_table_elem_use {
-    ELEM_FREE,
-    ELEM_OCCUPIED,
-    ELEM_REMOVED
+/* Control bytes of elements that are not occupied, all negative */
+enum dime_table_ctrl {
+    CTRL_FREE = -128,
+    CTRL_REMOVED = -2
 };
 
-/* Maximum ratio of used buckets to total buckets; 1 / 2 */
-static const double MAX_LOAD_FACTOR = 0.5;
+#define GROUPLEN DIME_TABLE_GROUPLEN
 
-/* Maximum ratio of hash collisions to used buckets; φ / 8 */
-static const double MAX_OVERFLOW_FACTOR = 0.20225424859373685602;
+/*
+ * Group matches are bit masks with one bit per control byte, which is
+ * found by shifting the index of the lowest set bit right by MASKSHIFT.
+ * NEON has no equivalent of movemask, so each byte gets four bits there.
+ */
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+#define MASKSHIFT 2
+#else
+#define MASKSHIFT 0
+#endif
 
-static void dime_table_relocate(dime_table_t *tbl, size_t i0) {
-    size_t i, k;
-    dime_table_elem_t tmp;
+#define CTZ(mask) (__builtin_ctzll(mask) >> MASKSHIFT)
 
-    if (tbl->arr[i0].use != ELEM_OCCUPIED) {
-        tbl->arr[i0].use = ELEM_FREE;
-        return;
-    }
+#if defined(__SSE2__)
+static uint64_t dime_table_match(const int8_t *ctrl, int8_t c) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
 
-    i = tbl->arr[i0].hash & (tbl->cap - 1);
-    k = 1;
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+}
 
-    if (i == i0) {
-        return;
-    }
+/* Matches free and removed elements, whose control bytes are below -1 */
+static uint64_t dime_table_match_avail(const int8_t *ctrl) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), group));
+}
+#elif defined(__ARM_NEON)
+static uint64_t dime_table_movemask(uint8x16_t cmp) {
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
 
-    tmp = tbl->arr[i0];
-    tbl->arr[i0].use = ELEM_FREE;
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888;
+}
 
-    while (dime_table_relocate(tbl, i), tbl->arr[i].use == ELEM_OCCUPIED) {
-        i = (i + k) & (tbl->cap - 1);
-        k++;
-    }
+static uint64_t dime_table_match(const int8_t *ctrl, int8_t c) {
+    return dime_table_movemask(vceqq_s8(vld1q_s8(ctrl), vdupq_n_s8(c)));
+}
 
-    tbl->arr[i] = tmp;
+static uint64_t dime_table_match_avail(const int8_t *ctrl) {
+    return dime_table_movemask(vcltq_s8(vld1q_s8(ctrl), vdupq_n_s8(-1)));
+}
+#else
+static uint64_t dime_table_match(const int8_t *ctrl, int8_t c) {
+    uint64_t mask = 0;
 
-    if (k > 1) {
-        tbl->ncollisions++;
+    for (size_t i = 0; i < GROUPLEN; i++) {
+        mask |= (uint64_t)(ctrl[i] == c) << i;
     }
-}
 
-static int dime_table_grow(dime_table_t *tbl) {
-    dime_table_elem_t *arr;
-    size_t cap;
+    return mask;
+}
 
-    cap = tbl->cap;
-    arr = realloc(tbl->arr, (cap << 1) * sizeof(dime_table_elem_t));
+static uint64_t dime_table_match_avail(const int8_t *ctrl) {
+    uint64_t mask = 0;
 
-    if (arr == NULL) {
-        return 0;
+    for (size_t i = 0; i < GROUPLEN; i++) {
+        mask |= (uint64_t)(ctrl[i] < -1) << i;
     }
 
-    tbl->arr = arr;
-    tbl->cap <<= 1;
+    return mask;
+}
+#endif
 
-    tbl->ncollisions = 0;
-    tbl->nfree = tbl->cap - tbl->len;
+/* Top 7 bits of a hash, stored in the control byte; the low bits pick the first group */
+static int8_t dime_table_h2(uint64_t hash) {
+    return (int8_t)(hash >> 57);
+}
 
-    for (size_t i = cap; i < tbl->cap; i++) {
-        tbl->arr[i].use = ELEM_FREE;
-    }
+/* Number of elements that may be occupied or removed at once; ⅞ of the capacity */
+static size_t dime_table_maxload(size_t cap) {
+    return cap - cap / 8;
+}
 
-    for (size_t i = cap; i > 0; i--) {
-        dime_table_relocate(tbl, i - 1);
-    }
+/* Sets a control byte, and its copy past the end for groups that wrap around */
+static void dime_table_setctrl(dime_table_t *tbl, size_t i, int8_t c) {
+    tbl->ctrl[i] = c;
 
-    return 1;
+    if (i < GROUPLEN) {
+        tbl->ctrl[tbl->cap + i] = c;
+    }
 }
 
-int dime_table_init(dime_table_t *tbl, int (*cmp_f)(const void *, const void *), uint64_t (*hash_f)(const void *)) {
-    tbl->cap = 32;
-    tbl->arr = malloc(tbl->cap * sizeof(dime_table_elem_t));
-    if (tbl->arr == NULL) {
+/* Allocates the elements and control bytes of a table with capacity cap */
+static int dime_table_alloc(dime_table_t *tbl, size_t cap) {
+    /* The control bytes share the allocation, after the elements */
+    dime_table_elem_t *arr = malloc(cap * sizeof(dime_table_elem_t) + cap + GROUPLEN);
+    if (arr == NULL) {
         return -1;
     }
 
-    tbl->len = 0;
-    tbl->cmp_f = cmp_f;
-    tbl->hash_f = hash_f;
-
-    for (size_t i = 0; i < tbl->cap; i++) {
-        tbl->arr[i].use = ELEM_FREE;
-    }
+    tbl->arr = arr;
+    tbl->ctrl = (int8_t *)(arr + cap);
+    tbl->cap = cap;
+    tbl->growth_left = dime_table_maxload(cap) - tbl->len;
 
-    tbl->ncollisions = 0;
-    tbl->nfree = tbl->cap;
+    memset(tbl->ctrl, CTRL_FREE, cap + GROUPLEN);
 
     return 0;
 }
 
-void dime_table_destroy(dime_table_t *tbl) {
-    free(tbl->arr);
+/* Finds the element with key key and hash hash, or returns (size_t)-1 */
+static size_t dime_table_find(const dime_table_t *tbl, const void *key, uint64_t hash) {
+    size_t mask = tbl->cap - 1;
+    size_t i = hash & mask;
+    int8_t h2 = dime_table_h2(hash);
+
+    for (size_t k = GROUPLEN; ; k += GROUPLEN) {
+        const int8_t *group = tbl->ctrl + i;
+
+        for (uint64_t m = dime_table_match(group, h2); m != 0; m &= m - 1) {
+            size_t j = (i + CTZ(m)) & mask;
+
+            if (tbl->arr[j].hash == hash && tbl->cmp_f(key, tbl->arr[j].key) == 0) {
+                return j;
+            }
+        }
+
+        /* Insertions fill the first available element, so empty groups end the probe */
+        if (dime_table_match(group, CTRL_FREE) != 0) {
+            return (size_t)-1;
+        }
+
+        i = (i + k) & mask;
+    }
 }
 
-int dime_table_insert(dime_table_t *tbl, const void *key, void *val) {
-    if (tbl->len >= tbl->cap) {
-        if (!dime_table_grow(tbl)) {
-            return -1;
+/* Finds the first free or removed element on the probe sequence of hash */
+static size_t dime_table_find_avail(const dime_table_t *tbl, uint64_t hash) {
+    size_t mask = tbl->cap - 1;
+    size_t i = hash & mask;
+
+    for (size_t k = GROUPLEN; ; k += GROUPLEN) {
+        uint64_t m = dime_table_match_avail(tbl->ctrl + i);
+
+        if (m != 0) {
+            return (i + CTZ(m)) & mask;
         }
-    } else if ((double)tbl->len > MAX_LOAD_FACTOR * tbl->cap) {
-        dime_table_grow(tbl);
+
+        i = (i + k) & mask;
     }
+}
 
-    size_t i, k;
-    uint64_t hash;
+/* Moves the elements into arrays twice as large */
+static int dime_table_grow(dime_table_t *tbl) {
+    dime_table_elem_t *arr = tbl->arr;
+    int8_t *ctrl = tbl->ctrl;
+    size_t cap = tbl->cap;
 
-    hash = tbl->hash_f(key);
+    if (dime_table_alloc(tbl, cap << 1) < 0) {
+        return -1;
+    }
 
-    i = hash & (tbl->cap - 1);
-    k = 1;
+    for (size_t i = 0; i < cap; i++) {
+        if (ctrl[i] >= 0) {
+            size_t j = dime_table_find_avail(tbl, arr[i].hash);
 
-    while (tbl->arr[i].use == ELEM_OCCUPIED) {
-        if (tbl->cmp_f(key, tbl->arr[i].key) == 0) {
-            return -1;
+            dime_table_setctrl(tbl, j, ctrl[i]);
+            tbl->arr[j] = arr[i];
         }
-
-        i = (i + k) & (tbl->cap - 1);
-        k++;
     }
 
-    int prevuse = tbl->arr[i].use;
+    free(arr);
+
+    return 0;
+}
+
+/*
+ * Clears tombstones without reallocating. Occupied elements are marked
+ * removed, and removed ones free; then each element still marked removed
+ * is moved to the first available element of its probe sequence, unless
+ * that is in the same group it already is in. Moving onto an element
+ * still marked removed swaps the two, and the displaced element is
+ * placed next.
+ */
+static void dime_table_rehash(dime_table_t *tbl) {
+    size_t mask = tbl->cap - 1;
 
-    tbl->arr[i].use = ELEM_OCCUPIED;
-    tbl->arr[i].hash = hash;
-    tbl->arr[i].key = key;
-    tbl->arr[i].val = val;
+    for (size_t i = 0; i < tbl->cap; i++) {
+        tbl->ctrl[i] = (tbl->ctrl[i] >= 0) ? CTRL_REMOVED : CTRL_FREE;
+    }
 
-    tbl->len++;
+    memcpy(tbl->ctrl + tbl->cap, tbl->ctrl, GROUPLEN);
 
-    if (k > 1) {
-        tbl->ncollisions++;
+    for (size_t i = 0; i < tbl->cap; i++) {
+        if (tbl->ctrl[i] != CTRL_REMOVED) {
+            continue;
+        }
 
-        if ((double)tbl->ncollisions > MAX_OVERFLOW_FACTOR * tbl->len) {
-            dime_table_grow(tbl);
+        uint64_t hash = tbl->arr[i].hash;
+        size_t first = hash & mask;
+        size_t j = dime_table_find_avail(tbl, hash);
+
+        if (((i - first) & mask) / GROUPLEN == ((j - first) & mask) / GROUPLEN) {
+            dime_table_setctrl(tbl, i, dime_table_h2(hash));
+            continue;
         }
-    }
 
-    if (prevuse == ELEM_FREE) {
-        tbl->nfree--;
+        if (tbl->ctrl[j] == CTRL_FREE) {
+            dime_table_setctrl(tbl, j, dime_table_h2(hash));
+            tbl->arr[j] = tbl->arr[i];
+            dime_table_setctrl(tbl, i, CTRL_FREE);
+        } else {
+            dime_table_elem_t tmp = tbl->arr[j];
 
-        if ((double)tbl->nfree < MAX_LOAD_FACTOR * tbl->cap) {
-            tbl->nfree = tbl->cap - tbl->len;
+            dime_table_setctrl(tbl, j, dime_table_h2(hash));
+            tbl->arr[j] = tbl->arr[i];
+            tbl->arr[i] = tmp;
 
-            for (i = 0; i < tbl->cap; i++) {
-                dime_table_relocate(tbl, i);
-            }
+            i--;
         }
     }
 
-    return 0;
+    tbl->growth_left = dime_table_maxload(tbl->cap) - tbl->len;
 }
 
-void *dime_table_search(dime_table_t *tbl, const void *key) {
-    size_t i, k, first, firstavail;
+int dime_table_init(dime_table_t *tbl, int (*cmp_f)(const void *, const void *), uint64_t (*hash_f)(const void *)) {
+    tbl->len = 0;
+    tbl->cmp_f = cmp_f;
+    tbl->hash_f = hash_f;
 
-    i = tbl->hash_f(key) & (tbl->cap - 1);
-    k = 1;
+    return dime_table_alloc(tbl, 32);
+}
 
-    first = i;
-    firstavail = ((size_t)-1);
+void dime_table_destroy(dime_table_t *tbl) {
+    free(tbl->arr);
+}
 
-    while (tbl->arr[i].use != ELEM_FREE) {
-        if (tbl->arr[i].use == ELEM_OCCUPIED) {
-            int cmp = tbl->cmp_f(key, tbl->arr[i].key);
+int dime_table_insert(dime_table_t *tbl, const void *key, void *val) {
+    uint64_t hash = tbl->hash_f(key);
+    int8_t h2 = dime_table_h2(hash);
 
-            if (cmp == 0) {
-                if (firstavail != ((size_t)-1)) {
-                    tbl->arr[firstavail] = tbl->arr[i];
-                    tbl->arr[i].use = ELEM_REMOVED;
+    size_t mask = tbl->cap - 1;
+    size_t i = hash & mask;
+    size_t avail = (size_t)-1;
 
-                    if (first == firstavail) {
-                        tbl->ncollisions--;
-                    }
+    /* Look for the key and the first available element in one probe */
+    for (size_t k = GROUPLEN; ; k += GROUPLEN) {
+        const int8_t *group = tbl->ctrl + i;
 
-                    i = firstavail;
-                }
+        for (uint64_t m = dime_table_match(group, h2); m != 0; m &= m - 1) {
+            size_t j = (i + CTZ(m)) & mask;
 
-                return tbl->arr[i].val;
+            if (tbl->arr[j].hash == hash && tbl->cmp_f(key, tbl->arr[j].key) == 0) {
+                return -1;
             }
-        } else if (firstavail == ((size_t)-1)) {
-            firstavail = i;
         }
 
-        i = (i + k) & (tbl->cap - 1);
-        k++;
-    }
+        if (avail == (size_t)-1) {
+            uint64_t m = dime_table_match_avail(group);
 
-    return NULL;
-}
-
-const void *dime_table_search_r(const dime_table_t *tbl, const void *key) {
-    size_t i, k;
+            if (m != 0) {
+                avail = (i + CTZ(m)) & mask;
+            }
+        }
 
-    i = tbl->hash_f(key) & (tbl->cap - 1);
-    k = 1;
+        if (dime_table_match(group, CTRL_FREE) != 0) {
+            break;
+        }
 
-    while (tbl->arr[i].use != ELEM_FREE) {
-        if (tbl->arr[i].use == ELEM_OCCUPIED) {
-            int cmp = tbl->cmp_f(key, tbl->arr[i].key);
+        i = (i + k) & mask;
+    }
 
-            if (cmp == 0) {
-                return tbl->arr[i].val;
+    /* Reusing a removed element takes no room */
+    if (tbl->ctrl[avail] == CTRL_FREE) {
+        if (tbl->growth_left == 0) {
+            if (tbl->len <= dime_table_maxload(tbl->cap) / 2) {
+                dime_table_rehash(tbl);
+            } else if (dime_table_grow(tbl) < 0) {
+                return -1;
             }
+
+            avail = dime_table_find_avail(tbl, hash);
         }
 
-        i = (i + k) & (tbl->cap - 1);
-        k++;
+        tbl->growth_left--;
     }
 
-    return NULL;
+    dime_table_setctrl(tbl, avail, h2);
+    tbl->arr[avail].hash = hash;
+    tbl->arr[avail].key = key;
+    tbl->arr[avail].val = val;
+
+    tbl->len++;
+
+    return 0;
 }
 
-void *dime_table_remove(dime_table_t *tbl, const void *key) {
-    size_t i, k;
+void *dime_table_search(dime_table_t *tbl, const void *key) {
+    return (void *)dime_table_search_r(tbl, key);
+}
 
-    i = tbl->hash_f(key) & (tbl->cap - 1);
-    k = 1;
+const void *dime_table_search_r(const dime_table_t *tbl, const void *key) {
+    size_t i = dime_table_find(tbl, key, tbl->hash_f(key));
 
-    while (tbl->arr[i].use != ELEM_FREE) {
-        if (tbl->arr[i].use == ELEM_OCCUPIED) {
-            int cmp = tbl->cmp_f(key, tbl->arr[i].key);
+    return (i != (size_t)-1) ? tbl->arr[i].val : NULL;
+}
 
-            if (cmp == 0) {
-                tbl->arr[i].use = ELEM_REMOVED;
-                tbl->len--;
+void *dime_table_remove(dime_table_t *tbl, const void *key) {
+    size_t i = dime_table_find(tbl, key, tbl->hash_f(key));
 
-                return tbl->arr[i].val;
-            }
-        }
+    if (i == (size_t)-1) {
+        return NULL;
+    }
 
-        i = (i + k) & (tbl->cap - 1);
-        k++;
+    size_t mask = tbl->cap - 1;
+    uint64_t after = dime_table_match(tbl->ctrl + i, CTRL_FREE);
+    uint64_t before = dime_table_match(tbl->ctrl + ((i - GROUPLEN) & mask), CTRL_FREE);
+
+    /*
+     * A probe only passes over an element if its whole group was in use,
+     * so the element may become free again if fewer than GROUPLEN
+     * consecutive elements around it are in use
+     */
+    int reusable = (after != 0 && before != 0 &&
+                    CTZ(after) + (GROUPLEN - 1 - ((63 - __builtin_clzll(before)) >> MASKSHIFT)) < GROUPLEN);
+
+    if (reusable) {
+        dime_table_setctrl(tbl, i, CTRL_FREE);
+        tbl->growth_left++;
+    } else {
+        dime_table_setctrl(tbl, i, CTRL_REMOVED);
     }
 
-    return NULL;
+    tbl->len--;
+
+    return tbl->arr[i].val;
 }
 
 size_t dime_table_len(const dime_table_t *tbl) {
     return tbl->len;
 }
 
+int dime_table_cmp_str(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+/*
+ * Note: FNV1a is currently used here to hash strings, but since this is a
+ * network-enabled program, we may want to use a randomized hashing algorithm
+ * like SipHash
+ */
+uint64_t dime_table_hash_str(const void *a) {
+    uint64_t y = 0xCBF29CE484222325;
+
+    for (const char *s = a; *s != '\0'; s++) {
+        y = (y ^ *s) * 1099511628211;
+    }
+
+    return y;
+}
+
 void dime_table_iter_init(dime_table_iter_t *it, dime_table_t *tbl) {
     it->tbl = tbl;
     it->i = (size_t)-1;
@@ -270,7 +392,7 @@ void dime_table_iter_init(dime_table_iter_t *it, dime_table_t *tbl) {
 int dime_table_iter_next(dime_table_iter_t *it) {
     do {
         it->i++;
-    } while (it->i < it->tbl->cap && it->tbl->arr[it->i].use != ELEM_OCCUPIED);
+    } while (it->i < it->tbl->cap && it->tbl->ctrl[it->i] < 0);
 
     if (it->i == it->tbl->cap) {
         return 0;
@@ -284,7 +406,7 @@ int dime_table_iter_next(dime_table_iter_t *it) {
 
 void dime_table_apply(dime_table_t *tbl, int(*f)(const void *, void *, void *), void *p) {
     for (size_t i = 0; i < tbl->cap; i++) {
-        if (tbl->arr[i].use == ELEM_OCCUPIED && !f(tbl->arr[i].key, tbl->arr[i].val, p)) {
+        if (tbl->ctrl[i] >= 0 && !f(tbl->arr[i].key, tbl->arr[i].val, p)) {
             break;
         }
     }
@@ -21,17 +21,23 @@
  * @author Nicholas West
  * @date 2020
  *
- * Implements an associative array via a hash table with quadratic
- * probing and lazy deletion. Allows for @f$\mathcal{O}(1)@f$ average
- * time on insertions, lookups, and removals. In particular, the
- * internal array size is always a power of two, and the probing
- * sequence is based on the triangular numbers (positive integers of the
- * form @f$ \sum_{i = 1}^{n} i @f$ or @f$ {n(n + 1)} \over 2 @f$).
- * Unlike most other quadratic probing methods, this assures that every
- * index is eventually visited when probing for a certain element. Even
- * so, the implementation maintains a maximum load factor of ½ and a
- * maximum ratio of bucket collisions to total elements of
- * @f$ \varphi \over 8 @f$ to ensure optimal performance.
+ * Implements an associative array via an open-addressing hash table in
+ * the style of Abseil's "Swiss tables". Allows for @f$\mathcal{O}(1)@f$
+ * average time on insertions, lookups, and removals. Each element has a
+ * control byte that tells whether it is free, removed, or occupied, and
+ * in the latter case holds 7 bits of the hash of its key. Probing looks
+ * at a group of 16 control bytes at a time, with SSE2 or NEON where
+ * available, so that keys are only compared for elements whose control
+ * byte and full memoized hash both match. The internal array size is
+ * always a power of two, and the sequence of groups probed is based on
+ * the triangular numbers (positive integers of the form
+ * @f$ \sum_{i = 1}^{n} i @f$ or @f$ {n(n + 1)} \over 2 @f$), which
+ * assures that every group is eventually visited.
+ *
+ * The maximum load factor, removed elements included, is ⅞. Removed
+ * elements leave a tombstone only if a probe may have passed over them.
+ * Once tombstones fill the table up, it is rehashed in place to clear
+ * them rather than grown, unless it is more than half full.
  */
 
 #include <stddef.h>
@@ -44,10 +50,11 @@
 extern "C" {
 #endif
 
+/* Number of control bytes probed at once */
+#define DIME_TABLE_GROUPLEN 16
+
 /* Actual element in the array of the hash table */
 typedef struct {
-    int use; /* Internal use of this element */
-
     uint64_t hash;   /* Memoized hash of the key */
     const void *key; /* Key */
     void *val;       /* Value */
@@ -75,9 +82,9 @@ typedef struct {
     uint64_t (*hash_f)(const void *);         /* Hashing function */
 
     dime_table_elem_t *arr; /* Array of elements */
+    int8_t *ctrl;           /* Control bytes of the elements, followed by a copy of the first DIME_TABLE_GROUPLEN */
     size_t cap;             /* Capacity of the array */
-    size_t ncollisions;     /* Number of collisions */
-    size_t nfree;           /* Number of free (not removed) elements */
+    size_t growth_left;     /* Number of free elements that can be used before a rehash */
 } dime_table_t;
 
 /**
@@ -139,11 +146,8 @@ void *dime_table_search(dime_table_t *tbl, const void *key);
  *
  * Similar to @link dime_table_search @endlink, but is guaranteed to not
  * mutate the underlying table. This allows for safe concurrent searches
- * of read-only tables, but because no element relocation is performed
- * for lazy deletions, subsequent searches for a table that has had many
- * insertions/removals may be slower. If your table is not exposed to
- * more than one thread, then @link dime_table_search @endlink should be
- * preferred.
+ * of read-only tables. Searches never move elements, so the two are
+ * equally fast.
  *
  * @param tbl Pointer to a @c dime_table_t struct
  * @param key Key
@@ -176,6 +180,33 @@ void *dime_table_remove(dime_table_t *tbl, const void *key);
  */
 size_t dime_table_len(const dime_table_t *tbl);
 
+/**
+ * @brief Comparison function for NUL-terminated string keys
+ *
+ * Suitable as the @em cmp_f of @link dime_table_init @endlink.
+ *
+ * @param a First key
+ * @param b Second key
+ *
+ * @return Zero if the strings are equal, or nonzero otherwise
+ *
+ * @see dime_table_hash_str
+ */
+int dime_table_cmp_str(const void *a, const void *b);
+
+/**
+ * @brief Hashing function for NUL-terminated string keys
+ *
+ * Suitable as the @em hash_f of @link dime_table_init @endlink.
+ *
+ * @param a Key
+ *
+ * @return 64-bit FNV-1a hash of the string
+ *
+ * @see dime_table_cmp_str
+ */
+uint64_t dime_table_hash_str(const void *a);
+
 /**
  * @brief Table iterator
  *
@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <time.h>
+
+#include <jansson.h>
+#include "trace.h"
+
+uint64_t dime_trace_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Bucket of a value: its leading bits, offset by its magnitude */
+static size_t dime_hist_index(uint64_t ns) {
+    if (ns < DIME_HIST_SUB) {
+        return ns;
+    }
+
+    unsigned int e = 63 - __builtin_clzll(ns);
+
+    if (e >= DIME_HIST_MAXBITS) {
+        return DIME_HIST_LEN - 1;
+    }
+
+    return DIME_HIST_SUB * (e - DIME_HIST_SUBBITS + 1) + (ns >> (e - DIME_HIST_SUBBITS)) - DIME_HIST_SUB;
+}
+
+/* Largest value that falls in a bucket */
+static uint64_t dime_hist_upper(size_t i) {
+    if (i < DIME_HIST_SUB) {
+        return i;
+    }
+
+    unsigned int k = i / DIME_HIST_SUB;
+    uint64_t lower = (uint64_t)(DIME_HIST_SUB + i % DIME_HIST_SUB) << (k - 1);
+
+    return lower + ((uint64_t)1 << (k - 1)) - 1;
+}
+
+void dime_hist_record(dime_hist_t *hist, uint64_t ns) {
+    __atomic_fetch_add(&hist->buckets[dime_hist_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t dime_hist_quantile(const dime_hist_t *hist, double q) {
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    /* Rank of the quantile, counting from 1 */
+    uint64_t rank = (uint64_t)(q * count);
+
+    if (rank < q * count || rank == 0) {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < DIME_HIST_LEN; i++) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+
+        if (seen >= rank) {
+            uint64_t upper = dime_hist_upper(i);
+
+            return (upper < max) ? upper : max;
+        }
+    }
+
+    /* Buckets were bumped before the count, so this is only a race */
+    return max;
+}
+
+void dime_trace_residence(dime_trace_t *trace, uint64_t ns) {
+    for (; trace != NULL; trace = trace->parent) {
+        dime_hist_record(&trace->residence, ns);
+    }
+}
+
+void dime_trace_drain(dime_trace_t *trace, uint64_t ns) {
+    for (; trace != NULL; trace = trace->parent) {
+        dime_hist_record(&trace->drain, ns);
+    }
+}
+
+json_t *dime_hist_json(const dime_hist_t *hist) {
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+
+    return json_pack("{sIsfsIsIsIsI}",
+                     "count", (json_int_t)count,
+                     "mean", (count > 0) ? (double)sum / count : 0.0,
+                     "p50", (json_int_t)dime_hist_quantile(hist, 0.5),
+                     "p99", (json_int_t)dime_hist_quantile(hist, 0.99),
+                     "p999", (json_int_t)dime_hist_quantile(hist, 0.999),
+                     "max", (json_int_t)__atomic_load_n(&hist->max, __ATOMIC_RELAXED));
+}
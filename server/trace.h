@@ -0,0 +1,142 @@
+/*
+ * trace.h - Latency histograms
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+/**
+ * @file trace.h
+ * @brief Latency histograms
+ * @author Nicholas West
+ * @date 2020
+ *
+ * Implements fixed-size histograms of durations in nanoseconds, in the
+ * manner of HdrHistogram: buckets are linear below 16 ns, and above that
+ * each power of two is split into 16 buckets, so every recorded value is
+ * known to within 1/16 of itself. Recording is a handful of relaxed
+ * atomic additions, so histograms may be shared between threads without
+ * locks.
+ *
+ * With @c DIME_USE_TRACE, the server records how long each relayed
+ * message spends in a recipient's queue, and then in its outbuffer, into
+ * a @link dime_trace_t @endlink per group and one for the whole server.
+ */
+
+#include <stdint.h>
+
+#include <jansson.h>
+
+#ifndef __DIME_trace_H
+#define __DIME_trace_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DIME_HIST_SUBBITS 4
+#define DIME_HIST_SUB (1 << DIME_HIST_SUBBITS)
+
+/* Values of 2^40 ns (about 18 minutes) or more land in the last bucket */
+#define DIME_HIST_MAXBITS 40
+
+#define DIME_HIST_LEN (DIME_HIST_SUB * (DIME_HIST_MAXBITS - DIME_HIST_SUBBITS + 1))
+
+/**
+ * @brief Histogram of durations
+ *
+ * Should be zeroed before use. Every field is modified atomically.
+ *
+ * @see dime_hist_record
+ * @see dime_hist_quantile
+ */
+typedef struct {
+    uint64_t count; /** Number of recorded values */
+    uint64_t sum;   /** Sum of recorded values */
+    uint64_t max;   /** Largest recorded value */
+    uint64_t buckets[DIME_HIST_LEN];
+} dime_hist_t;
+
+/**
+ * @brief Latencies of relayed messages
+ *
+ * Values recorded into a trace are also recorded into its parent, if
+ * any, so that a group's trace can feed the server-wide one.
+ */
+typedef struct __dime_trace {
+    dime_hist_t residence; /** Time from arrival to leaving a recipient's queue */
+    dime_hist_t drain;     /** Time from leaving the queue to being written to the socket */
+    struct __dime_trace *parent;
+} dime_trace_t;
+
+/**
+ * @brief Get the current time
+ *
+ * @return Nanoseconds on a monotonic clock
+ */
+uint64_t dime_trace_now(void);
+
+/**
+ * @brief Record a value into a histogram
+ *
+ * @param hist Pointer to a @link dime_hist_t @endlink struct
+ * @param ns Duration in nanoseconds
+ */
+void dime_hist_record(dime_hist_t *hist, uint64_t ns);
+
+/**
+ * @brief Estimate a quantile of a histogram
+ *
+ * Reports the upper end of the bucket the quantile falls in, but never
+ * more than the largest recorded value.
+ *
+ * @param hist Pointer to a @link dime_hist_t @endlink struct
+ * @param q Quantile, between 0 and 1
+ *
+ * @return The quantile in nanoseconds, or 0 if nothing was recorded
+ */
+uint64_t dime_hist_quantile(const dime_hist_t *hist, double q);
+
+/**
+ * @brief Record the queue residence of a message
+ *
+ * @param trace Pointer to a @link dime_trace_t @endlink struct
+ * @param ns Duration in nanoseconds
+ */
+void dime_trace_residence(dime_trace_t *trace, uint64_t ns);
+
+/**
+ * @brief Record the socket drain time of a message
+ *
+ * @param trace Pointer to a @link dime_trace_t @endlink struct
+ * @param ns Duration in nanoseconds
+ */
+void dime_trace_drain(dime_trace_t *trace, uint64_t ns);
+
+/**
+ * @brief Summarize a histogram as JSON
+ *
+ * The object has the fields @c count, @c mean, @c p50, @c p99, @c p999
+ * and @c max, in nanoseconds.
+ *
+ * @param hist Pointer to a @link dime_hist_t @endlink struct
+ *
+ * @return A new reference to the object, or @c NULL on failure
+ */
+json_t *dime_hist_json(const dime_hist_t *hist);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * uring.c - io_uring instance
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+#ifdef DIME_USE_IO_URING
+
+/* For syscall and MAP_ANONYMOUS */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include "uring.h"
+
+static int dime_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int dime_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int dime_uring_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+int dime_uring_init(dime_uring_t *ring, unsigned entries, unsigned nbufs, size_t buflen) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(struct io_uring_params));
+    memset(ring, 0, sizeof(dime_uring_t));
+
+    ring->fd = dime_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Newer kernels map both rings with a single mmap */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_len > ring->sq_len) {
+            ring->sq_len = cq_len;
+        }
+    } else {
+        ring->cq_len = cq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+
+        return -1;
+    }
+
+    if (ring->cq_len > 0) {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_len);
+            close(ring->fd);
+
+            return -1;
+        }
+    } else {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_len > 0) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(ring->fd);
+
+        return -1;
+    }
+
+    unsigned char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Set up the provided buffer ring used by multishot receives */
+    ring->nbufs = nbufs;
+    ring->buflen = buflen;
+    ring->br_len = nbufs * sizeof(struct io_uring_buf);
+
+    ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc(nbufs * buflen);
+
+    if (ring->br == MAP_FAILED || ring->bufs == NULL) {
+        if (ring->br != MAP_FAILED) {
+            munmap(ring->br, ring->br_len);
+        }
+
+        ring->br = NULL;
+        dime_uring_destroy(ring);
+
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (unsigned long)ring->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = 0;
+
+    if (dime_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+
+        dime_uring_destroy(ring);
+        errno = err;
+
+        return -1;
+    }
+
+    for (unsigned i = 0; i < nbufs; i++) {
+        struct io_uring_buf *buf = &ring->br->bufs[i];
+
+        buf->addr = (unsigned long)(ring->bufs + i * buflen);
+        buf->len = buflen;
+        buf->bid = i;
+    }
+
+    __atomic_store_n(&ring->br->tail, (unsigned short)nbufs, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void dime_uring_destroy(dime_uring_t *ring) {
+    if (ring->br != NULL) {
+        munmap(ring->br, ring->br_len);
+    }
+
+    free(ring->bufs);
+
+    munmap(ring->sqes, ring->sqes_len);
+
+    if (ring->cq_len > 0) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+struct io_uring_sqe *dime_uring_sqe(dime_uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - head > *ring->sq_mask) {
+        if (dime_uring_submit(ring, 0) < 0) {
+            return NULL;
+        }
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        if (tail - head > *ring->sq_mask) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[i];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    ring->sq_array[i] = i;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+int dime_uring_submit(dime_uring_t *ring, unsigned wait) {
+    while (1) {
+        int n = dime_uring_enter(ring->fd, ring->sq_pending, wait, (wait > 0) ? IORING_ENTER_GETEVENTS : 0);
+
+        if (n >= 0) {
+            ring->sq_pending -= n;
+
+            return 0;
+        }
+
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+struct io_uring_cqe *dime_uring_cqe(dime_uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void dime_uring_seen(dime_uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void *dime_uring_buf(const dime_uring_t *ring, const struct io_uring_cqe *cqe) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    return ring->bufs + bid * ring->buflen;
+}
+
+void dime_uring_putbuf(dime_uring_t *ring, const struct io_uring_cqe *cqe) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (ring->nbufs - 1)];
+
+    buf->addr = (unsigned long)(ring->bufs + bid * ring->buflen);
+    buf->len = ring->buflen;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#else
+
+/* ISO C forbids an empty translation unit */
+typedef int dime_uring_unused_t;
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * uring.h - io_uring instance
+ * Copyright (c) 2020 Nicholas West, Hantao Cui, CURENT, et. al.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided "as is" and the author disclaims all
+ * warranties with regard to this software including all implied warranties
+ * of merchantability and fitness. In no event shall the author be liable
+ * for any special, direct, indirect, or consequential damages or any
+ * damages whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action, arising
+ * out of or in connection with the use or performance of this software.
+ */
+
+/**
+ * @file uring.h
+ * @brief io_uring instance
+ * @author Nicholas West
+ * @date 2020
+ *
+ * A minimal wrapper around the Linux io_uring interface, talking to
+ * the kernel directly through the @c io_uring_setup, @c io_uring_enter
+ * and @c io_uring_register system calls so that liburing is not
+ * required. Besides the submission and completion queues, each instance
+ * registers a ring of receive buffers with the kernel (buffer group 0),
+ * from which multishot receives pick buffers as data arrives. Only
+ * available on Linux, when built with @c DIME_USE_IO_URING.
+ */
+
+#ifdef DIME_USE_IO_URING
+
+#include <stddef.h>
+
+#include <linux/io_uring.h>
+
+#ifndef __DIME_uring_H
+#define __DIME_uring_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief io_uring instance
+ *
+ * Should be treated as opaque; use relevant methods to submit and
+ * complete requests.
+ *
+ * @see dime_uring_init
+ * @see dime_uring_destroy
+ * @see dime_uring_sqe
+ * @see dime_uring_submit
+ * @see dime_uring_cqe
+ * @see dime_uring_seen
+ * @see dime_uring_buf
+ * @see dime_uring_putbuf
+ */
+typedef struct {
+    int fd; /* io_uring file descriptor */
+
+    void *sq_ptr;  /* Mapped submission queue ring */
+    size_t sq_len; /* Length of sq_ptr mapping */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_pending; /* SQEs queued but not yet submitted */
+
+    struct io_uring_sqe *sqes; /* Mapped submission queue entries */
+    size_t sqes_len;           /* Length of sqes mapping */
+
+    void *cq_ptr;  /* Mapped completion queue ring */
+    size_t cq_len; /* Length of cq_ptr mapping, or 0 if shared with sq_ptr */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br; /* Provided buffer ring */
+    size_t br_len;                /* Length of br mapping */
+    unsigned char *bufs;          /* Receive buffers */
+    unsigned nbufs;               /* Number of receive buffers */
+    size_t buflen;                /* Size of each receive buffer */
+} dime_uring_t;
+
+/**
+ * @brief Initialize a new io_uring instance
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ * @param entries Number of submission queue entries
+ * @param nbufs Number of receive buffers, a power of two
+ * @param buflen Size of each receive buffer
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_uring_destroy
+ */
+int dime_uring_init(dime_uring_t *ring, unsigned entries, unsigned nbufs, size_t buflen);
+
+/**
+ * @brief Free resources used by an io_uring instance
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ *
+ * @see dime_uring_init
+ */
+void dime_uring_destroy(dime_uring_t *ring);
+
+/**
+ * @brief Get a blank submission queue entry
+ *
+ * The entry is queued for the next call to
+ * @link dime_uring_submit @endlink. If the submission queue is full,
+ * the queued entries are submitted first.
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ *
+ * @return Zero-initialized entry, or NULL on failure
+ *
+ * @see dime_uring_submit
+ */
+struct io_uring_sqe *dime_uring_sqe(dime_uring_t *ring);
+
+/**
+ * @brief Submit queued entries, optionally waiting for completions
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ * @param wait Number of completions to wait for
+ *
+ * @return A nonnegative value on success, or a negative value on
+ * failure
+ *
+ * @see dime_uring_sqe
+ * @see dime_uring_cqe
+ */
+int dime_uring_submit(dime_uring_t *ring, unsigned wait);
+
+/**
+ * @brief Get the oldest unprocessed completion queue entry
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ *
+ * @return Completion queue entry, or NULL if there is none. It remains
+ * valid until @link dime_uring_seen @endlink is called.
+ *
+ * @see dime_uring_seen
+ */
+struct io_uring_cqe *dime_uring_cqe(dime_uring_t *ring);
+
+/**
+ * @brief Mark the oldest completion queue entry as processed
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ *
+ * @see dime_uring_cqe
+ */
+void dime_uring_seen(dime_uring_t *ring);
+
+/**
+ * @brief Get the receive buffer a completion was reported with
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ * @param cqe Completion with @c IORING_CQE_F_BUFFER set
+ *
+ * @return Pointer to the buffer
+ *
+ * @see dime_uring_putbuf
+ */
+void *dime_uring_buf(const dime_uring_t *ring, const struct io_uring_cqe *cqe);
+
+/**
+ * @brief Hand a receive buffer back to the kernel
+ *
+ * @param ring Pointer to a @c dime_uring_t struct
+ * @param cqe Completion the buffer was reported with
+ *
+ * @see dime_uring_buf
+ */
+void dime_uring_putbuf(dime_uring_t *ring, const struct io_uring_cqe *cqe);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
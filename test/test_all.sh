@@ -6,12 +6,23 @@ sh test_matlab_send.sh
 sh test_matlab_sync.sh
 sh test_matlab_tcp.sh
 sh test_matlab_wait.sh
+sh test_python_batch.sh
 sh test_python_broadcast.sh
+sh test_python_delta.sh
 sh test_python_devices.sh
+sh test_python_groups.sh
+sh test_python_peer.sh
+sh test_python_queue.sh
 sh test_python_send.sh
+sh test_python_shm.sh
+sh test_python_stats.sh
+sh test_python_subscribe.sh
 sh test_python_sync.sh
 sh test_python_tcp.sh
+sh test_python_threads.sh
+sh test_python_v2.sh
 sh test_python_wait.sh
+sh test_python_zlib.sh
 #sh test_javascript_broadcast.sh
 #sh test_javascript_devices.sh
 #sh test_javascript_send.sh
@@ -0,0 +1,44 @@
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[1])
+d3 = DimeClient("ipc", sys.argv[1])
+
+d2.join("d2", "both")
+d3.join("d3", "both")
+
+d1["a"] = 1
+d1["b"] = [2, 3]
+d1["c"] = "four"
+
+# Clients in several of the groups get the batch once
+d1.batch(["d2", "both"], "a", "b", "c")
+
+assert d2.wait() == 1
+assert d2.sync() == {"a", "b", "c"}
+assert d2["a"] == 1 and d2["b"] == [2, 3] and d2["c"] == "four"
+
+assert d3.sync() == {"a", "b", "c"}
+
+# Batches are queued and coalesced along with other messages
+d1["a"] = 5
+d1.send("d3", "a")
+d1.batch("d3", "b")
+d1.send("d3", "c")
+
+assert d3.sync(2) == {"a", "b"}
+assert d3.sync() == {"c"}
+
+try:
+    d1.batch(["d2", "d4"], "a")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("batch to a missing group succeeded")
+
+assert d2.sync() == set()
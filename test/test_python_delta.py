@@ -0,0 +1,76 @@
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1], delta = True)
+d2 = DimeClient("ipc", sys.argv[1])
+d3 = DimeClient("ipc", sys.argv[1], queue_policy = "drop_oldest", queue_max_len = 2)
+
+d2.join("g")
+d3.join("g")
+
+x = [float(i) for i in range(4096)]
+
+# The first send carries the full value...
+d1["x"] = list(x)
+d1.send("g", "x")
+
+assert d2.sync() == {"x"}
+assert d2["x"] == x
+
+bytes_in = d2.stats()["server"]["bytes_in"]
+
+# ...and later ones only what changed
+x[100] = -1.0
+d1["x"] = list(x)
+d1.send("g", "x")
+
+assert d2.sync() == {"x"}
+assert d2["x"] == x
+assert d2.stats()["server"]["bytes_in"] - bytes_in < 1024
+
+# Clients that may have dropped a message, and ones that joined since,
+# get the full value
+d4 = DimeClient("ipc", sys.argv[1])
+d4.join("g")
+
+x[200] = -2.0
+d1["x"] = list(x)
+d1.send("g", "x")
+
+assert d2.sync() == {"x"} and d2["x"] == x
+assert d3.sync() == {"x"} and d3["x"] == x
+assert d4.sync() == {"x"} and d4["x"] == x
+
+# Another client sending the variable invalidates the delta base...
+d5 = DimeClient("ipc", sys.argv[1], delta = True)
+
+x[300] = -3.0
+d5["x"] = list(x)
+d5.send("g", "x")
+
+assert d2.sync() == {"x"} and d2["x"] == x
+
+x[400] = -4.0
+d1["x"] = list(x)
+
+try:
+    d1.send("g", "x")
+except RuntimeError:
+    pass
+else:
+    assert False
+
+# ...until the full value is sent again
+d1.send("g", "x")
+
+assert d2.sync() == {"x"} and d2["x"] == x
+
+# Broadcasts always carry the full value
+d1.broadcast("x")
+
+assert d2.sync() == {"x"} and d2["x"] == x
+assert d3.sync() == {"x"} and d3["x"] == x
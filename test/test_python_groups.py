@@ -0,0 +1,42 @@
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[1])
+
+# Joining hands out a handle per group
+d2.join("d2a", "d2b")
+
+assert d2.groups["d2a"] != d2.groups["d2b"]
+
+# The first send by name learns the handle, later ones use it
+d1["a"] = 1
+d1.send("d2b", "a")
+
+assert d1.groups["d2b"] == d2.groups["d2b"]
+
+d1["a"] = 2
+d1.send("d2b", "a")
+d1.send("d2a", "a")
+
+assert d2.sync() == {"a"}
+assert d2["a"] == 2
+
+# Handles stay valid, but a group left empty cannot be sent to
+d2.leave("d2b")
+
+try:
+    d1.send("d2b", "a")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("send to an empty group succeeded")
+
+d2.join("d2b")
+d1.send("d2b", "a")
+
+assert d2.sync() == {"a"}
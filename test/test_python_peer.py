@@ -0,0 +1,89 @@
+import sys
+import time
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+# Membership reaches the other server a little after the join or leave
+def settle(d, group, present):
+    for _ in range(100):
+        if (group in d.devices()) == present:
+            return
+
+        time.sleep(0.05)
+
+    raise AssertionError("group membership did not reach the peer")
+
+# d1 and d4 are on the first server, d2 and d3 on the second
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[2])
+d3 = DimeClient("ipc", sys.argv[2])
+d4 = DimeClient("ipc", sys.argv[1])
+
+d2.join("both")
+d3.join("both")
+
+settle(d1, "both", True)
+
+d1["a"] = [2, 3]
+d1["b"] = "four"
+
+# Forwarded once, then fanned out to every member on the other server
+d1.send("both", "a")
+
+assert d2.wait() == 1
+assert d2.sync() == {"a"}
+assert d2["a"] == [2, 3]
+
+assert d3.wait() == 1
+assert d3.sync() == {"a"}
+
+# Members that leave get nothing more, while the rest still do
+d2.leave("both")
+
+d1.send("both", "b")
+
+assert d3.wait() == 1
+assert d3.sync() == {"b"}
+assert d3["b"] == "four"
+
+assert d2.sync() == set()
+
+# And the other way around
+d4.join("d4")
+
+settle(d3, "d4", True)
+
+d3["b"] = "five"
+d3.send("d4", "b")
+
+assert d4.wait() == 1
+assert d4.sync() == {"b"}
+assert d4["b"] == "five"
+
+# Once the last member on the other server leaves, the group is gone
+d3.leave("both")
+
+settle(d1, "both", False)
+
+try:
+    d1.send("both", "a")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("send to a group with no members left succeeded")
+
+# Broadcasts reach every other client once, on either server, and are not echoed back
+d1["a"] = "six"
+d1.broadcast("a")
+
+time.sleep(0.2)
+
+for d in (d2, d3, d4):
+    assert d.wait() == 1
+    assert d.sync() == {"a"}
+    assert d["a"] == "six"
+
+assert d1.sync() == set()
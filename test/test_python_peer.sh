@@ -0,0 +1,24 @@
+#!/bin/sh -e
+
+printf "Running test_python_peer... "
+
+DIME_SOCKET_1="`mktemp -u`"
+DIME_SOCKET_2="`mktemp -u`"
+
+../server/dime -l "unix:$DIME_SOCKET_1" &
+DIME_PID_1=$!
+
+# The second server peers with the first as it starts
+while [ ! -S "$DIME_SOCKET_1" ]; do
+    sleep 0.1
+done
+
+../server/dime -l "unix:$DIME_SOCKET_2" -p "unix:$DIME_SOCKET_1" &
+DIME_PID_2=$!
+
+env PYTHONPATH="../client/python" python3 test_python_peer.py "$DIME_SOCKET_1" "$DIME_SOCKET_2"
+
+kill $DIME_PID_2
+kill $DIME_PID_1
+
+printf "Done!\n"
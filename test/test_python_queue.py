@@ -0,0 +1,89 @@
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[1], queue_max_len = 2)
+d3 = DimeClient("ipc", sys.argv[1], queue_max_len = 2, queue_policy = "drop_oldest")
+d4 = DimeClient("ipc", sys.argv[1], queue_max_len = 2, queue_policy = "conflate")
+d5 = DimeClient("ipc", sys.argv[1])
+
+d1.join("d1")
+d2.join("d2")
+d3.join("d3")
+d4.join("d4")
+
+# Rejected once the queue is full
+d1["a"] = 1
+d1["b"] = 2
+d1["c"] = 3
+d1.send("d2", "a", "b")
+
+try:
+    d1.send("d2", "c")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("send to a full queue succeeded")
+
+assert d2.sync() == {"a", "b"}
+
+# A send of several variables raises if any is rejected, but the ones queued
+# before the queue filled up stay queued
+try:
+    d1.send("d2", "a", "b", "c")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("batched send to a full queue succeeded")
+
+assert d2.sync() == {"a", "b"}
+
+# A rejection by some recipients is told apart from one by all of them
+d2.join("both")
+d5.join("both")
+
+d1.send("d2", "a", "b")
+
+try:
+    d1.send("both", "c")
+except RuntimeError as e:
+    assert "1 of 2" in str(e)
+else:
+    raise AssertionError("send to a group with a full queue succeeded")
+
+assert d5.sync() == {"c"}
+assert d2.sync() == {"a", "b"}
+
+d2.leave("both")
+
+# The oldest message makes room for the newest
+d1.send("d3", "a", "b", "c")
+
+assert d3.sync() == {"b", "c"}
+assert d3["b"] == 2 and d3["c"] == 3
+
+# A newer value replaces the queued one for the same variable
+d1.send("d4", "a", "b")
+
+d1["a"] = 4
+d1.send("d4", "a")
+
+assert d4.sync() == {"a", "b"}
+assert d4["a"] == 4 and d4["b"] == 2
+
+# With nothing to replace, a full queue refuses rather than lose another variable
+d1.send("d4", "a", "b")
+
+try:
+    d1.send("d4", "c")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("send of a new variable to a full conflating queue succeeded")
+
+assert d4.sync() == {"a", "b"}
+assert d4["a"] == 4 and d4["b"] == 2
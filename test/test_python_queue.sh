@@ -0,0 +1,13 @@
+#!/bin/sh -e
+
+printf "Running test_python_queue... "
+
+DIME_SOCKET="`mktemp -u`"
+../server/dime -l "unix:$DIME_SOCKET" &
+DIME_PID=$!
+
+env PYTHONPATH="../client/python" python3 test_python_queue.py "$DIME_SOCKET"
+
+kill $DIME_PID
+
+printf "Done!\n"
@@ -0,0 +1,40 @@
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1], shm = True)
+d2 = DimeClient("ipc", sys.argv[1], shm = True)
+d3 = DimeClient("ipc", sys.argv[1])
+
+assert d1.shm and d2.shm and not d3.shm
+
+d1.join("d1")
+d2.join("d2")
+d3.join("d3")
+
+# Large enough to go through shared memory
+big = bytes(range(256)) * 4096
+
+# Shared memory on both ends
+d1["a"] = big
+d1["b"] = 1
+d1.send("d2", "a", "b")
+
+assert d2.sync() == {"a", "b"}
+assert d2["a"] == big and d2["b"] == 1
+
+# Copied into the stream for a client without shared memory...
+d1.broadcast("a")
+
+assert d3.sync() == {"a"}
+assert d3["a"] == big
+
+# ...and vice versa
+d3["c"] = big[::-1]
+d3.send("d2", "c")
+
+assert d2.sync() == {"a", "c"}
+assert d2["c"] == big[::-1]
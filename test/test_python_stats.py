@@ -0,0 +1,74 @@
+import sys
+import urllib.request
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[1])
+d3 = DimeClient("ipc", sys.argv[1], queue_max_len = 1, queue_policy = "drop_oldest")
+
+d2.join("g")
+d3.join("g", "h")
+
+d1["a"] = 1
+d1["b"] = 2
+d1.send("g", "a")
+d1.send("g", "b")
+
+stats = d1.stats()
+
+assert stats["server"]["clients"] == 3
+assert stats["server"]["connections"] == 3
+assert stats["server"]["relayed"] == 4
+assert stats["server"]["dropped"] == 1
+assert stats["server"]["bytes_in"] > 0 and stats["server"]["bytes_out"] > 0
+
+groups = {group["name"]: group for group in stats["groups"]}
+
+assert groups["g"]["members"] == 2
+assert groups["g"]["msgs"] == 2
+assert groups["g"]["fanout"] == 4
+assert groups["h"]["msgs"] == 0
+
+def client(stats, name):
+    return next(clnt for clnt in stats["clients"] if name in clnt["groups"])
+
+assert client(stats, "h")["queue_len"] == 1
+assert client(stats, "h")["msgs_queued"] == 2
+assert client(stats, "h")["msgs_dropped"] == 1
+
+d2.sync()
+
+stats = d1.stats()
+c2 = next(clnt for clnt in stats["clients"] if clnt["groups"] == ["g"])
+
+assert c2["queue_len"] == 0
+assert c2["queue_peak"] == 2
+assert c2["msgs_out"] == 2
+assert c2["bytes_out"] > 0
+
+# Unless the server was built without tracing
+if "latency" in stats["server"]:
+    groups = {group["name"]: group for group in stats["groups"]}
+
+    for kind in ("residence", "drain"):
+        latency = groups["g"]["latency"][kind]
+
+        assert latency["count"] == 2
+        assert 0 < latency["p50"] <= latency["p99"] <= latency["p999"] <= latency["max"]
+        assert stats["server"]["latency"][kind]["count"] == 2
+
+# The same counters, as Prometheus scrapes them
+with urllib.request.urlopen("http://localhost:%s/metrics" % sys.argv[2]) as response:
+    text = response.read().decode()
+
+assert response.headers["Content-Type"].startswith("text/plain")
+assert "dime_clients 3\n" in text
+assert 'dime_group_fanout_total{group="g"} 4\n' in text
+assert "# TYPE dime_client_dropped_total counter\n" in text
+
+if "latency" in stats["server"]:
+    assert 'dime_group_drain_seconds_count{group="g"} 2\n' in text
@@ -0,0 +1,43 @@
+import select
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[1])
+
+d2.join("d2")
+
+d1["a"] = 1
+d1["b"] = 2
+d1["c"] = 3
+
+# Variables queued before subscribing are pushed right away
+d1.send("d2", "a")
+d2.subscribe(2)
+
+assert d2.wait() == 1
+assert d2.sync() == {"a"}
+
+# No more than the credits are pushed before sync grants more
+d1.send("d2", "a", "b", "c")
+
+while d2.wait() < 2:
+    pass
+
+select.select([], [], [], 0.1)
+assert d2.wait() == 2
+
+assert d2.sync() == {"a", "b"}
+
+assert d2.wait() == 1
+assert d2.sync() == {"c"}
+
+d2.unsubscribe()
+
+d1.send("d2", "b")
+
+assert d2.sync() == {"b"}
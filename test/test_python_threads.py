@@ -0,0 +1,54 @@
+import sys
+import threading
+import time
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+# With four workers, eight clients land on every worker at least once
+ds = [DimeClient("ipc", sys.argv[1]) for _ in range(8)]
+
+for i, d in enumerate(ds):
+    d.join("d%d" % i)
+
+while len(ds[0].devices()) < len(ds):
+    time.sleep(0.05)
+
+# Each client sends to the next, which is usually on another worker
+for i, d in enumerate(ds):
+    d["a"] = i
+    d.send("d%d" % ((i + 1) % len(ds)), "a")
+
+for i, d in enumerate(ds):
+    assert d.wait() == 1
+    assert d.sync() == {"a"}
+    assert d["a"] == (i - 1) % len(ds)
+
+ds[0]["b"] = "all"
+ds[0].broadcast("b")
+
+for d in ds[1:]:
+    assert d.wait() == 1
+    assert d.sync() == {"b"}
+    assert d["b"] == "all"
+
+assert ds[0].sync() == set()
+
+# A wait blocked on one worker is woken by a send handled on another
+n = []
+t = threading.Thread(target = lambda: n.append(ds[1].wait()))
+t.start()
+
+time.sleep(0.2)
+
+ds[6]["c"] = [1, 2, 3]
+ds[6].send("d1", "c")
+
+t.join(10)
+
+assert not t.is_alive()
+assert n == [1]
+assert ds[1].sync() == {"c"}
+assert ds[1]["c"] == [1, 2, 3]
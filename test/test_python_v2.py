@@ -0,0 +1,54 @@
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1])
+d2 = DimeClient("ipc", sys.argv[1], queue_max_bytes = 4096)
+d3 = DimeClient("ipc", sys.argv[1])
+
+assert d1.version == 2 and d2.version == 2 and d3.version == 2
+
+d1.join("d1")
+d2.join("d2")
+
+# Only the last message of each batch is acknowledged
+d1["a"] = 1
+d1["b"] = [2, 3]
+d1["c"] = "four"
+
+d1.send("d2", "a", "b", "c")
+
+assert d2.sync(2) == {"a", "b"}
+assert d2.sync() == {"c"}
+assert d2["a"] == 1 and d2["b"] == [2, 3] and d2["c"] == "four"
+
+d1.broadcast("a", "b", "c")
+
+assert d2.sync() == {"a", "b", "c"}
+assert d3.sync() == {"a", "b", "c"}
+assert d3["a"] == 1 and d3["b"] == [2, 3] and d3["c"] == "four"
+
+# An error from an unacknowledged message arrives before the last reply
+d1["a"] = list(range(10000))
+d1["b"] = 5
+d1["c"] = "six"
+
+try:
+    d1.send("d2", "a", "b", "c")
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("send past the queue limit succeeded")
+
+assert d2.sync() == {"b", "c"}
+assert d2["a"] == 1 and d2["b"] == 5 and d2["c"] == "six"
+
+# The connection is still in step afterwards
+d1["a"] = 7
+d1.send("d2", "a")
+
+assert d2.sync() == {"a"}
+assert d2["a"] == 7
@@ -0,0 +1,51 @@
+import os
+import sys
+
+from dime import DimeClient
+
+if __name__ != "__main__":
+    raise RuntimeError()
+
+d1 = DimeClient("ipc", sys.argv[1], zlib = True)
+d2 = DimeClient("ipc", sys.argv[1], zlib = True)
+d3 = DimeClient("ipc", sys.argv[1])
+
+assert d1.zlib and d2.zlib and not d3.zlib
+assert d1.zlib_threshold == 65536
+
+d1.join("d1")
+d2.join("d2")
+d3.join("d3")
+
+# Large and compressible enough to be compressed
+big = bytes(range(256)) * 4096
+
+# Compressed on both ends
+d1["a"] = big
+d1["b"] = 1
+d1.send("d2", "a", "b")
+
+assert d2.sync() == {"a", "b"}
+assert d2["a"] == big and d2["b"] == 1
+
+# Decompressed for a client without compression...
+d1.broadcast("a")
+
+assert d3.sync() == {"a"}
+assert d3["a"] == big
+
+# ...and vice versa
+d3["c"] = big[::-1]
+d3.send("d2", "c")
+
+assert d2.sync() == {"a", "c"}
+assert d2["c"] == big[::-1]
+
+# Incompressible data is sent as is
+noise = os.urandom(1 << 18)
+
+d2["d"] = noise
+d2.send("d1", "d")
+
+assert d1.sync() == {"d"}
+assert d1["d"] == noise